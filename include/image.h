@@ -49,10 +49,21 @@ typedef enum
     ELR_NOT_SUPPORTED,
 
     /** \brief The image file contains garbage */
-    ELR_FILE_CORRUPTED
+    ELR_FILE_CORRUPTED,
+
+    /** \brief The image file does not contain an embedded thumbnail */
+    ELR_NO_THUMBNAIL
 }
 E_LOAD_RESULT;
 
+typedef enum
+{
+    EDM_NONE = 0,           /**< Map every pixel to the closest color */
+    EDM_ORDERED,            /**< Ordered dithering with a fixed color map */
+    EDM_FLOYD_STEINBERG     /**< Floyd-Steinberg error diffusion */
+}
+E_DITHER_MODE;
+
 
 
 typedef struct
@@ -116,6 +127,24 @@ E_LOAD_RESULT image_load( image_t* img, const char* filename,
 E_LOAD_RESULT image_load_custom( image_t* img, void* file,
                                  const image_io_t* io, E_IMAGE_FILE type );
 
+/**
+ * \brief Load an image from a file using custom I/O callbacks and a
+ *        reusable decoder context
+ *
+ * \param img     The image to load into
+ * \param file    An opaque file handle to read from
+ * \param io      The custom I/O callbacks
+ * \param type    The type of the image
+ * \param context A format specific decoder context (a jpeg_decoder_t for
+ *                EIF_JPG) or NULL. Ignored by formats that do not have
+ *                a decoder context.
+ *
+ * \return ELR_SUCESS(=0) on sucess, or a loading error otherwise.
+ */
+E_LOAD_RESULT image_load_custom_with( image_t* img, void* file,
+                                      const image_io_t* io, E_IMAGE_FILE type,
+                                      void* context );
+
 /**
  * \brief Store the contents of the image buffer to the given file
  *
@@ -138,6 +167,22 @@ void image_save(const image_t* img, const char* filename, E_IMAGE_FILE type);
 void image_save_custom( const image_t* img, void* file, const image_io_t* io,
                         E_IMAGE_FILE type );
 
+/**
+ * \brief Store the contents of the image buffer to the given file using a
+ *        reusable encoder context
+ *
+ * \param img     The image to save
+ * \param file    An opaque file handle
+ * \param io      The custom I/O callbacks
+ * \param type    What image file format to use for storing the image file
+ * \param context A format specific encoder context (a png_encoder_t for
+ *                EIF_PNG) or NULL. Ignored by formats that do not have
+ *                an encoder context.
+ */
+void image_save_custom_with( const image_t* img, void* file,
+                             const image_io_t* io, E_IMAGE_FILE type,
+                             void* context );
+
 /**
  * \brief Allocate an internal buffer for holding an image
  *
@@ -166,6 +211,31 @@ void image_flip_h( image_t* img );
  */
 void image_swap_channels( image_t* img, int c1, int c2 );
 
+/**
+ * \brief Reduce the number of colors of an image
+ *
+ * The pixels are replaced by the colors of a palette, so a PNG export
+ * writes an indexed image. For RGBA images, alpha is reduced to the five
+ * levels 0, 64, 128, 191 and 255. One palette entry is used for the fully
+ * transparent pixels, and the colors of each other level are quantized
+ * on their own, with a share of the palette by their number of pixels.
+ * Levels that would get fewer than 8 colors are merged into the nearest
+ * level. Requires the JPEG loader to be compiled in.
+ *
+ * \param img     A pointer to the image structure.
+ * \param ncolors The maximum number of colors, up to 256. Grayscale
+ *                images need at least 2, RGB images at least 8 with every
+ *                dithering method, and RGBA images with transparent
+ *                pixels at least 9, as the transparent entry is not
+ *                available to the quantizer. Fewer colors fail without
+ *                changing the image.
+ * \param dither  The dithering method to use. Ordered dithering uses a
+ *                fixed, evenly spaced color map instead of median cut.
+ *
+ * \return Non-zero on success, zero on failure.
+ */
+int image_quantize( image_t* img, int ncolors, E_DITHER_MODE dither );
+
 /**
  * \brief Set a hint for an image loader or exporter
  *
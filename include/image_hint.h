@@ -6,6 +6,72 @@ typedef enum
     /** \brief JPEG exporter quality. Value between 1 and 3. Default: 3 */
     EIH_JPEG_EXPORT_QUALITY = 0,
 
+    /**
+     * \brief Memory limit of the JPEG loader in KiB. Work buffers that do
+     *        not fit (e.g. the coefficients of a progressive JPEG) are kept
+     *        in a temporary file. 0 means no limit. Default: 0
+     */
+    EIH_JPEG_MAX_MEMORY,
+
+    /**
+     * \brief If not 0, only decode this many scans of a progressive JPEG,
+     *        resulting in a lower quality preview image. Default: 0
+     */
+    EIH_JPEG_PREVIEW_SCANS,
+
+    /**
+     * \brief If not 0, only read this many bytes of a JPEG file and decode
+     *        what is available, e.g. the first scans of a progressive JPEG.
+     *        Default: 0
+     */
+    EIH_JPEG_PREVIEW_BYTES,
+
+    /**
+     * \brief If not 0, do not verify the CRC checksums of PNG chunks, e.g.
+     *        for trusted files that are loaded often. Default: 0
+     */
+    EIH_PNG_IGNORE_CRC,
+
+    /**
+     * \brief If not ECT_NONE, the E_COLOR_TYPE to convert PNG images to.
+     *        Otherwise PNG images are loaded as ECT_GRAYSCALE8, ECT_RGB8 or
+     *        ECT_RGBA8, whichever is closest to the format of the file.
+     *        Default: ECT_NONE
+     */
+    EIH_PNG_COLOR_TYPE,
+
+    /**
+     * \brief If not 0, only decode this many Adam7 passes of an interlaced
+     *        PNG, resulting in a smaller preview image: 1 or 2 passes give
+     *        1/8, 3 or 4 give 1/4 and 5 or 6 give 1/2 of the width and
+     *        height. Only the start of the image data is read. Images that
+     *        are not interlaced and values above 6 load the whole image.
+     *        Default: 0
+     */
+    EIH_PNG_PREVIEW_PASSES,
+
+    /**
+     * \brief PNG exporter effort. Value between 0 and 10, from stored data
+     *        or runs only (fast, for scratch files) up to the largest window
+     *        and longest match search (slow, for assets). Files usually
+     *        get smaller with each level, but not always. 10 uses
+     *        optimal LZ77 parsing and tries many more filter choices, it is
+     *        very slow and meant for files that are encoded once and read
+     *        often. The output is the same on every run. Default: 5
+     */
+    EIH_PNG_EXPORT_EFFORT,
+
+    /**
+     * \brief The number of threads the PNG exporter filters and compresses
+     *        horizontal bands of an image on. The image is still written
+     *        as a single, standard PNG. 0 encodes the image row by row on
+     *        the calling thread. 1 or more encode the whole image in
+     *        memory, 1 without extra threads, so that 1 is the baseline
+     *        to compare more threads with. Without thread support, values
+     *        above 1 act like 1. Default: 0
+     */
+    EIH_PNG_EXPORT_THREADS,
+
     /** \brief Not a hint, but the number of possible hints. */
     EIH_NUM_HINTS
 }
@@ -0,0 +1,235 @@
+#ifndef IMAGE_JPEG_H
+#define IMAGE_JPEG_H
+
+#include "image.h"
+
+/**
+ * \brief A reusable JPEG decoder context
+ *
+ * Holds the libjpeg decompression object, its permanent memory pool and
+ * the row pointer and input buffers across multiple images. Pass it to
+ * image_load_custom_with( ) to avoid setting up libjpeg for every image,
+ * e.g. when decoding a large number of thumbnails.
+ *
+ * A decoder context must not be used by more than one thread at a time.
+ */
+typedef struct jpeg_decoder_t jpeg_decoder_t;
+
+typedef enum
+{
+    EJC_UNKNOWN = 0,
+
+    EJC_GRAYSCALE,   /**< One luminance component */
+    EJC_YCBCR,       /**< Luminance and two chrominance components */
+    EJC_RGB,         /**< Red, green and blue components */
+    EJC_CMYK,        /**< Cyan, magenta, yellow and black components */
+    EJC_YCCK         /**< YCbCr and a black component */
+}
+E_JPEG_COLOR;
+
+/**
+ * \brief The quantized DCT coefficients of a single JPEG image component
+ */
+typedef struct
+{
+    int id;                  /**< \brief Component identifier in the file */
+    int h_samp_factor;       /**< \brief Horizontal sampling factor (1-4) */
+    int v_samp_factor;       /**< \brief Vertical sampling factor (1-4) */
+
+    size_t width_in_blocks;  /**< \brief Number of 8x8 blocks per row */
+    size_t height_in_blocks; /**< \brief Number of rows of 8x8 blocks */
+
+    /** \brief The quantization table, in natural (row major) order */
+    unsigned short quant[ 64 ];
+
+    /**
+     * \brief width_in_blocks*height_in_blocks blocks of 64 coefficients
+     *
+     * Blocks are stored row by row, the coefficients of each block in
+     * natural (row major) order, i.e. the DC coefficient comes first.
+     */
+    short* blocks;
+}
+jpeg_component_t;
+
+/**
+ * \brief The quantized DCT coefficients of a JPEG image
+ */
+typedef struct
+{
+    size_t width;            /**< \brief Image width in pixels */
+    size_t height;           /**< \brief Image height in pixels */
+
+    E_JPEG_COLOR color;      /**< \brief Color space of the components */
+
+    int num_components;      /**< \brief Number of components (1-4) */
+
+    jpeg_component_t components[ 4 ];
+}
+jpeg_coefficients_t;
+
+typedef enum
+{
+    EJT_NONE = 0,       /**< No transformation, crop only */
+
+    EJT_FLIP_H,         /**< Mirror the image horizontally */
+    EJT_FLIP_V,         /**< Mirror the image vertically */
+    EJT_TRANSPOSE,      /**< Mirror along the upper-left to lower-right axis */
+    EJT_TRANSVERSE,     /**< Mirror along the upper-right to lower-left axis */
+    EJT_ROT_90,         /**< Rotate 90 degrees clockwise */
+    EJT_ROT_180,        /**< Rotate 180 degrees */
+    EJT_ROT_270         /**< Rotate 270 degrees clockwise */
+}
+E_JPEG_TRANSFORM;
+
+typedef enum
+{
+    EJO_PROGRESSIVE  = 0x01,    /**< Write a progressive JPEG file */
+    EJO_COPY_MARKERS = 0x02     /**< Keep comments and application markers */
+}
+E_JPEG_OPTIMIZE;
+
+/**
+ * \brief A crop region for lossless JPEG transformations
+ *
+ * The coordinates refer to the transformed image. The upper left corner is
+ * moved up and to the left to the nearest MCU boundary, the size is clipped
+ * to the image.
+ */
+typedef struct
+{
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+}
+jpeg_crop_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * \brief Create a reusable JPEG decoder context
+ *
+ * \return A pointer to a new decoder context, or NULL on failure or if
+ *         the JPEG loader has not been compiled in.
+ */
+jpeg_decoder_t* image_jpeg_decoder_create( void );
+
+/**
+ * \brief Destroy a JPEG decoder context and free all its resources
+ *
+ * \param dec A pointer to a decoder context. May be NULL.
+ */
+void image_jpeg_decoder_destroy( jpeg_decoder_t* dec );
+
+/**
+ * \brief Load the thumbnail image embedded in a JPEG file
+ *
+ * Only the markers in front of the image data are read. Thumbnails stored
+ * in an EXIF (APP1) block, in the JFIF header or in a JFIF extension
+ * (JFXX) block are supported and returned as RGB8 images.
+ *
+ * \param img  The image to load the thumbnail into
+ * \param file An opaque file handle to read from
+ * \param io   The custom I/O callbacks
+ *
+ * \return ELR_SUCESS(=0) on sucess, ELR_NO_THUMBNAIL if the file does not
+ *         have an embedded thumbnail, or another loading error otherwise.
+ */
+E_LOAD_RESULT image_load_embedded_thumbnail( image_t* img, void* file,
+                                             const image_io_t* io );
+
+/**
+ * \brief Initialise a coefficient structure
+ *
+ * Call this before doing anything with a coefficient structure.
+ */
+void image_jpeg_coefficients_init( jpeg_coefficients_t* coefs );
+
+/**
+ * \brief Uninitialise a coefficient structure
+ *
+ * Call this once you are done with a coefficient structure.
+ */
+void image_jpeg_coefficients_deinit( jpeg_coefficients_t* coefs );
+
+/**
+ * \brief Load the quantized DCT coefficients of a JPEG file
+ *
+ * Only the entropy coded data is decoded. No inverse DCT, upsampling or
+ * color conversion is performed.
+ *
+ * \param coefs The coefficient structure to load into
+ * \param file  An opaque file handle to read from
+ * \param io    The custom I/O callbacks
+ *
+ * \return ELR_SUCESS(=0) on sucess, or a loading error otherwise.
+ */
+E_LOAD_RESULT image_jpeg_load_coefficients( jpeg_coefficients_t* coefs,
+                                            void* file,
+                                            const image_io_t* io );
+
+/**
+ * \brief Store quantized DCT coefficients to a JPEG file
+ *
+ * The coefficients are only entropy coded, using Huffman tables optimized
+ * for the data. Loading and saving coefficients is lossless.
+ *
+ * \param coefs The coefficients to store
+ * \param file  An opaque file handle to write to
+ * \param io    The custom I/O callbacks
+ *
+ * \return Non-zero on success, zero on failure
+ */
+int image_jpeg_save_coefficients( const jpeg_coefficients_t* coefs,
+                                  void* file, const image_io_t* io );
+
+/**
+ * \brief Losslessly rotate, flip and/or crop a JPEG file
+ *
+ * The transformation is performed on the DCT coefficients, like jpegtran
+ * does it, so the image is never decoded to pixels and no generation loss
+ * occurs. Partial MCUs at the image edges that would have to be moved to
+ * the other side of the image are trimmed off.
+ *
+ * \param in        An opaque file handle to read the source image from
+ * \param in_io     The custom I/O callbacks for the source image
+ * \param out       An opaque file handle to write the result to
+ * \param out_io    The custom I/O callbacks for the result
+ * \param transform The transformation to apply
+ * \param crop      If not NULL, the region of the transformed image to keep
+ *
+ * \return Non-zero on success, zero on failure
+ */
+int image_jpeg_transform( void* in, const image_io_t* in_io,
+                          void* out, const image_io_t* out_io,
+                          E_JPEG_TRANSFORM transform,
+                          const jpeg_crop_t* crop );
+
+/**
+ * \brief Losslessly reduce the size of a JPEG file
+ *
+ * The quantized DCT coefficients are read and entropy coded again, using
+ * Huffman tables optimized for the image and, optionally, a progressive
+ * scan script. The decoded pixels are exactly the same as before.
+ *
+ * \param in     An opaque file handle to read the source image from
+ * \param in_io  The custom I/O callbacks for the source image
+ * \param out    An opaque file handle to write the result to
+ * \param out_io The custom I/O callbacks for the result
+ * \param flags  A combination of E_JPEG_OPTIMIZE flags
+ *
+ * \return Non-zero on success, zero on failure
+ */
+int image_jpeg_optimize( void* in, const image_io_t* in_io,
+                         void* out, const image_io_t* out_io, int flags );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IMAGE_JPEG_H */
+
@@ -0,0 +1,163 @@
+#ifndef IMAGE_PNG_H
+#define IMAGE_PNG_H
+
+#include "image.h"
+
+/**
+ * \brief A PNG reader that decodes an image a few rows at a time
+ *
+ * The compressed data is read from the file and inflated as the rows are
+ * requested, so only a few scanlines are kept in memory instead of the
+ * whole file and image. This allows processing images that are much larger
+ * than the available memory, e.g. map tiles or scans.
+ *
+ * Interlaced (Adam7) images can not be decoded row by row. For those, the
+ * whole image is decoded when the reader is created and the rows are
+ * returned from memory, unless the EIH_PNG_PREVIEW_PASSES hint asks for a
+ * preview, which is decoded from the first passes only.
+ */
+typedef struct png_reader_t png_reader_t;
+
+/**
+ * \brief A PNG writer that encodes an image a few rows at a time
+ *
+ * The rows are filtered and compressed as they are passed in, and the
+ * compressed data is written to the file in IDAT chunks of 64 KiB as soon
+ * as they are complete. The signature and header chunks are written when
+ * the writer is created, so the start of the file can be sent on, e.g.
+ * uploaded, while the rest of the image is still being encoded.
+ *
+ * The image is always written non-interlaced and with the color type of
+ * its rows, without choosing a smaller one for the image content.
+ */
+typedef struct png_writer_t png_writer_t;
+
+/**
+ * \brief A reusable PNG encoder context
+ *
+ * Holds the LZ77 hash tables, the filter and compression buffers and the
+ * buffer for palette indices across multiple images. Pass it to
+ * image_save_custom_with( ) to keep them allocated between images, e.g.
+ * when exporting a large number of small tiles. This saves allocations,
+ * but little time: filtering and compressing the pixels costs far more
+ * than setting up the buffers. Images compressed in memory (an
+ * EIH_PNG_EXPORT_THREADS of 1 or more, or an EIH_PNG_EXPORT_EFFORT of
+ * 10) reuse them as well, except for the trial compressions that choose
+ * the filters at effort 10.
+ *
+ * An encoder context must not be used by more than one thread at a time.
+ */
+typedef struct png_encoder_t png_encoder_t;
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * \brief Create a reader for a PNG file
+ *
+ * Reads the chunks in front of the image data. The width, height and color
+ * type of the image are stored in img, its buffer is freed and not used
+ * by the reader. The EIH_PNG_COLOR_TYPE, EIH_PNG_IGNORE_CRC and
+ * EIH_PNG_PREVIEW_PASSES hints of img are honoured. The file must stay open
+ * until the reader is destroyed.
+ *
+ * \param img  Receives the image properties
+ * \param file An opaque file handle to read from
+ * \param io   The custom I/O callbacks
+ *
+ * \return A pointer to a new reader, or NULL if the file can not be read
+ *         or the PNG loader has not been compiled in.
+ */
+png_reader_t* image_png_reader_create( image_t* img, void* file,
+                                       const image_io_t* io );
+
+/**
+ * \brief Decode the next rows of an image
+ *
+ * \param reader A pointer to a reader
+ * \param rows   Receives the rows, each of them width pixels of the color
+ *               type reported by image_png_reader_create, without padding
+ * \param count  The number of rows to decode
+ *
+ * \return The number of rows decoded. This is less than count at the end
+ *         of the image or if the file is corrupted.
+ */
+size_t image_png_reader_read( png_reader_t* reader, void* rows, size_t count );
+
+/**
+ * \brief Destroy a PNG reader and free all its resources
+ *
+ * \param reader A pointer to a reader. May be NULL.
+ */
+void image_png_reader_destroy( png_reader_t* reader );
+
+/**
+ * \brief Create a writer for a PNG file
+ *
+ * Writes the signature and the chunks in front of the image data. The
+ * width, height and color type of the image are taken from img, its
+ * buffer is not used. The EIH_PNG_EXPORT_EFFORT hint of img is honoured,
+ * the rows are always compressed on a single thread. At effort 10, the
+ * filters are only compared within the rows passed to one call of
+ * image_png_writer_write( ). The file must stay open until the writer is
+ * destroyed.
+ *
+ * \param img  The properties of the image to write
+ * \param file An opaque file handle to write to
+ * \param io   The custom I/O callbacks
+ *
+ * \return A pointer to a new writer, or NULL if the image can not be
+ *         written or the PNG exporter has not been compiled in.
+ */
+png_writer_t* image_png_writer_create( const image_t* img, void* file,
+                                       const image_io_t* io );
+
+/**
+ * \brief Encode the next rows of an image
+ *
+ * After the last row of the image, the rest of the file is written.
+ *
+ * \param writer A pointer to a writer
+ * \param rows   The rows, each of them width pixels of the color type of
+ *               the image passed to image_png_writer_create, without
+ *               padding
+ * \param count  The number of rows to encode
+ *
+ * \return The number of rows encoded. This is less than count at the end
+ *         of the image or if writing to the file failed.
+ */
+size_t image_png_writer_write( png_writer_t* writer, const void* rows,
+                               size_t count );
+
+/**
+ * \brief Destroy a PNG writer and free all its resources
+ *
+ * If not all rows of the image have been written, the file is incomplete.
+ *
+ * \param writer A pointer to a writer. May be NULL.
+ */
+void image_png_writer_destroy( png_writer_t* writer );
+
+/**
+ * \brief Create a reusable PNG encoder context
+ *
+ * \return A pointer to a new encoder context, or NULL on failure or if
+ *         the PNG exporter has not been compiled in.
+ */
+png_encoder_t* image_png_encoder_create( void );
+
+/**
+ * \brief Destroy a PNG encoder context and free all its resources
+ *
+ * \param enc A pointer to an encoder context. May be NULL.
+ */
+void image_png_encoder_destroy( png_encoder_t* enc );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IMAGE_PNG_H */
+
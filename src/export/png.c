@@ -1,4 +1,4 @@
-#include "image.h"
+#include "image_png.h"
 
 /*
    The PNG exporting facilities.
@@ -7,33 +7,597 @@
     - exporting ECT_GRAYSCALE8 images
     - exporting ECT_RGB8 images
     - exporting ECT_RGBA8 images
+    - exporting ECT_RGB8 and ECT_RGBA8 images with up to 256 colors as
+      1, 2, 4 or 8 bit palette images
+    - encoding images row by row, writing the IDAT chunks as they are
+      compressed instead of building the whole file in memory
+    - reusing the buffers and hash tables of the encoder across images
+    - an archival effort level with optimal LZ77 parsing and a search of
+      the filters that deflate smallest
 */
 
 #ifdef IMAGE_SAVE_PNG
 #include "lodepng.h"
 
 #include <stdlib.h>
+#include <string.h>
 
-void save_png( const image_t* img, void* file, const image_io_t* io )
+/*
+    Compressor settings for each EIH_PNG_EXPORT_EFFORT level. A window
+    size of 1 only encodes runs of the same byte. From level 2 on, each
+    block is also encoded with runs only and the smaller one is kept:
+    the filtered rows of some photos have nothing for LZ77 to find, and
+    its matches only make them larger. Higher levels search longer hash
+    chains, which usually gives smaller files, but with lazy matching a
+    longer search can also lose a few bytes. The brute force and minimum
+    sum filter strategies are left out, they win or lose by far
+    depending on the image. Level 10 refines an optimal parsing of the
+    LZ77 matches 15 times.
+ */
+static const struct
+{
+    unsigned btype, windowsize, minmatch, nicematch, lazymatching, maxchain;
+    unsigned optimal, tryrle;
+    LodePNGFilterStrategy filter_strategy;
+}
+efforts[] =
+{
+    { 0,     1, 3,   0, 0,    0,  0, 0, LFS_ZERO       },
+    { 2,     1, 4, 258, 0,    0,  0, 0, LFS_HEURISTIC  },
+    { 2,  8192, 4,  32, 0,    1,  0, 1, LFS_HEURISTIC  },
+    { 2, 16384, 4,  64, 0,    4,  0, 1, LFS_HEURISTIC  },
+    { 2, 32768, 4, 128, 1,    8,  0, 1, LFS_HEURISTIC  },
+    { 2, 32768, 4, 258, 1,   32,  0, 1, LFS_HEURISTIC  },
+    { 2, 32768, 4, 258, 1,  128,  0, 1, LFS_HEURISTIC  },
+    { 2, 32768, 4, 258, 1,  512,  0, 1, LFS_HEURISTIC  },
+    { 2, 32768, 4, 258, 1, 1024,  0, 1, LFS_HEURISTIC  },
+    { 2, 32768, 4, 258, 1, 1536,  0, 1, LFS_HEURISTIC  },
+    { 2, 32768, 3, 258, 1, 8192, 15, 0, LFS_EXHAUSTIVE }
+};
+
+/*
+    The row writer. A LodePNG row encoder writes the file through the I/O
+    callbacks as the rows are compressed.
+ */
+struct png_writer_t
+{
+    LodePNGState state;
+    LodePNGRowEncoder* encoder;
+
+    size_t height;
+    size_t row_size;
+    size_t y;                     /* the next row to encode */
+
+    void* file;
+    const image_io_t* io;
+};
+
+/*
+    The encoder context. The LodePNG row encoder with its buffers and hash
+    tables is restarted for every image instead of creating a new one, the
+    images compressed in memory reuse the buffers and hash tables of
+    LodePNG in the same way, and the buffer for the palette indices only
+    grows.
+ */
+struct png_encoder_t
 {
-    unsigned char* buffer;
-    size_t length;
+    LodePNGRowEncoder* encoder;   /* NULL until the first image */
+    LodePNGEncoderBuffers* whole; /* NULL until the first in memory image */
+
+    unsigned char* rows;          /* palette indices */
+    size_t rows_size;             /* size of the rows buffer in bytes */
+};
+
+static size_t write_callback( const unsigned char* buffer, size_t size,
+                              void* user )
+{
+    png_writer_t* writer = user;
+
+    return writer->io->write( buffer, 1, size, writer->file );
+}
+
+/*
+    Sets up the LodePNG state for the color type and hints of an image.
+    Returns zero if the color type can not be exported.
+ */
+static int init_state( LodePNGState* state, const image_t* img )
+{
+    LodePNGCompressSettings* zlib;
     LodePNGColorType colortype;
+    int effort, threads;
 
     switch( img->type )
     {
     case ECT_GRAYSCALE8: colortype = LCT_GREY; break;
     case ECT_RGB8:       colortype = LCT_RGB;  break;
     case ECT_RGBA8:      colortype = LCT_RGBA; break;
-    default:                                   return;
+    default:                                   return 0;
     };
 
-    lodepng_encode_memory( &buffer, &length, img->image_buffer,
-                           img->width, img->height, colortype, 8 );
+    effort = image_get_hint( img, EIH_PNG_EXPORT_EFFORT );
+    if( effort<0 || effort>10 )
+        effort = 5;
+
+    threads = image_get_hint( img, EIH_PNG_EXPORT_THREADS );
+    if( threads<1 )
+        threads = 1;
 
-    io->write( buffer, 1, length, file );
+    lodepng_state_init( state );
+    state->info_raw.colortype       = colortype;
+    state->info_raw.bitdepth        = 8;
+    state->info_png.color.colortype = colortype;
+    state->info_png.color.bitdepth  = 8;
 
-    free( buffer );
+    state->encoder.filter_strategy = efforts[ effort ].filter_strategy;
+
+    zlib = &state->encoder.zlibsettings;
+    zlib->btype        = efforts[ effort ].btype;
+    zlib->windowsize   = efforts[ effort ].windowsize;
+    zlib->minmatch     = efforts[ effort ].minmatch;
+    zlib->nicematch    = efforts[ effort ].nicematch;
+    zlib->lazymatching = efforts[ effort ].lazymatching;
+    zlib->maxchain     = efforts[ effort ].maxchain;
+    zlib->optimal      = efforts[ effort ].optimal;
+    zlib->tryrle       = efforts[ effort ].tryrle;
+    zlib->numthreads   = threads;
+    return 1;
 }
-#endif
 
+png_writer_t* image_png_writer_create( const image_t* img, void* file,
+                                       const image_io_t* io )
+{
+    png_writer_t* writer = calloc( 1, sizeof(png_writer_t) );
+
+    if( !writer )
+        return NULL;
+
+    if( !init_state( &writer->state, img ) )
+    {
+        free( writer );
+        return NULL;
+    }
+
+    writer->height   = img->height;
+    writer->row_size = lodepng_get_raw_size( img->width, 1,
+                                             &writer->state.info_raw );
+    writer->file     = file;
+    writer->io       = io;
+
+    if( lodepng_row_encoder_new( &writer->encoder, img->width, img->height,
+                                 &writer->state, write_callback, writer ) )
+    {
+        image_png_writer_destroy( writer );
+        return NULL;
+    }
+
+    return writer;
+}
+
+size_t image_png_writer_write( png_writer_t* writer, const void* rows,
+                               size_t count )
+{
+    const unsigned char* in = rows;
+    size_t i;
+
+    if( count > writer->height - writer->y )
+        count = writer->height - writer->y;
+
+    for( i=0; i<count; ++i, in+=writer->row_size )
+    {
+        if( lodepng_row_encoder_write( writer->encoder, in, 1 ) )
+            break;
+
+        ++writer->y;
+    }
+
+    return i;
+}
+
+void image_png_writer_destroy( png_writer_t* writer )
+{
+    if( writer )
+    {
+        lodepng_row_encoder_delete( writer->encoder );
+        lodepng_state_cleanup( &writer->state );
+        free( writer );
+    }
+}
+
+png_encoder_t* image_png_encoder_create( void )
+{
+    return calloc( 1, sizeof(png_encoder_t) );
+}
+
+void image_png_encoder_destroy( png_encoder_t* enc )
+{
+    if( enc )
+    {
+        lodepng_row_encoder_delete( enc->encoder );
+        lodepng_encoder_buffers_delete( enc->whole );
+        free( enc->rows );
+        free( enc );
+    }
+}
+
+/*
+    Starts the row encoder of a writer, reusing the one of the encoder
+    context if there is one. Returns a LodePNG error code.
+ */
+static unsigned start_encoder( png_writer_t* writer, png_encoder_t* enc,
+                               const image_t* img )
+{
+    unsigned error;
+
+    if( enc && enc->encoder )
+    {
+        writer->encoder = enc->encoder;
+
+        return lodepng_row_encoder_restart( writer->encoder, img->width,
+                                            img->height, &writer->state,
+                                            write_callback, writer );
+    }
+
+    error = lodepng_row_encoder_new( &writer->encoder, img->width,
+                                     img->height, &writer->state,
+                                     write_callback, writer );
+
+    if( enc )
+        enc->encoder = writer->encoder;
+
+    return error;
+}
+
+/*
+    Encodes a whole image in memory, with the buffers of the encoder
+    context if there is one. Returns a LodePNG error code. Without a
+    context, the caller must free the file.
+ */
+static unsigned encode_whole( unsigned char** out, size_t* outsize,
+                              png_encoder_t* enc, const unsigned char* in,
+                              const image_t* img, LodePNGState* state )
+{
+    if( !enc )
+    {
+        return lodepng_encode( out, outsize, in, img->width, img->height,
+                               state );
+    }
+
+    if( !enc->whole && lodepng_encoder_buffers_new( &enc->whole ) )
+        return 83;  /* LodePNG's out of memory error */
+
+    return lodepng_encode_buffers( out, outsize, enc->whole, in,
+                                   img->width, img->height, state );
+}
+
+/* Returns a buffer for the palette indices, the one of the context if any */
+static unsigned char* get_rows( png_encoder_t* enc, size_t size )
+{
+    unsigned char* rows;
+
+    if( !enc )
+        return malloc( size );
+
+    if( size > enc->rows_size )
+    {
+        rows = realloc( enc->rows, size );
+
+        if( !rows )
+            return NULL;
+
+        enc->rows = rows;
+        enc->rows_size = size;
+    }
+
+    return enc->rows;
+}
+
+/*
+    Images with at most 256 colors are written as palette images. The
+    colors are looked up in a small hash table of the colors packed into
+    integers, which is much faster than LodePNG's color tree, and the rows
+    are converted to palette indices of 1, 2, 4 or 8 bits right here, so
+    LodePNG neither has to choose the color type nor convert the image.
+ */
+#define PALETTE_HASH_SIZE 1024        /* a power of two, 4 times 256 */
+
+typedef struct
+{
+    unsigned long color[ PALETTE_HASH_SIZE ];
+    int index[ PALETTE_HASH_SIZE ];   /* -1 for free slots */
+    unsigned char rgba[ 256 * 4 ];    /* the palette */
+    int count;
+    int channels;
+    unsigned int bits;
+}
+palette_t;
+
+static unsigned long pack_color( const unsigned char* px, int channels )
+{
+    return ((unsigned long)px[0] << 24) | ((unsigned long)px[1] << 16) |
+           ((unsigned long)px[2] << 8) | (channels==4 ? px[3] : 255);
+}
+
+/*
+    Returns the palette index of a packed color. New colors are added, -1
+    is returned if the palette is full.
+ */
+static int palette_index( palette_t* pal, unsigned long color )
+{
+    size_t i = ((color * 2654435761UL) & 0xFFFFFFFFUL) >> 22;
+    unsigned char* rgba;
+
+    while( pal->index[ i ]>=0 )
+    {
+        if( pal->color[ i ]==color )
+            return pal->index[ i ];
+
+        i = (i + 1) & (PALETTE_HASH_SIZE - 1);
+    }
+
+    if( pal->count==256 )
+        return -1;
+
+    rgba = pal->rgba + 4 * pal->count;
+    rgba[0] = (color >> 24) & 0xFF;
+    rgba[1] = (color >> 16) & 0xFF;
+    rgba[2] = (color >>  8) & 0xFF;
+    rgba[3] =  color        & 0xFF;
+
+    pal->color[ i ] = color;
+    pal->index[ i ] = pal->count;
+    return pal->count++;
+}
+
+/*
+    Collects the colors of an RGB or RGBA image in one scan. Returns zero
+    if the image has more than 256 colors, if it is better stored as
+    grayscale or if it is too small for a palette to pay off. The
+    translucent colors are moved to the front, as the tRNS chunk ends
+    after the last of them.
+ */
+static int build_palette( palette_t* pal, const image_t* img )
+{
+    const unsigned char* px = img->image_buffer;
+    size_t i, count = img->width * img->height;
+    unsigned long color, last = 0;
+    unsigned char rgba[ 256 * 4 ];
+    int remap[ 256 ], grey = 1, n = 0;
+
+    if( img->type!=ECT_RGB8 && img->type!=ECT_RGBA8 )
+        return 0;
+
+    pal->count    = 0;
+    pal->channels = img->type==ECT_RGBA8 ? 4 : 3;
+
+    for( i=0; i<PALETTE_HASH_SIZE; ++i )
+        pal->index[ i ] = -1;
+
+    for( i=0; i<count; ++i, px+=pal->channels )
+    {
+        color = pack_color( px, pal->channels );
+
+        if( i>0 && color==last )
+            continue;
+
+        if( palette_index( pal, color )<0 )
+            return 0;
+
+        last = color;
+    }
+
+    for( i=0; i<(size_t)pal->count; ++i )
+    {
+        const unsigned char* c = pal->rgba + 4 * i;
+
+        grey = grey && c[0]==c[1] && c[1]==c[2] && c[3]==255;
+
+        if( c[3]!=255 )
+            remap[ i ] = n++;
+    }
+
+    /* like LodePNG, which may use fewer bits for grayscale images */
+    if( grey || (size_t)pal->count * 2 >= count )
+        return 0;
+
+    for( i=0; i<(size_t)pal->count; ++i )
+    {
+        if( pal->rgba[ 4 * i + 3 ]==255 )
+            remap[ i ] = n++;
+
+        memcpy( rgba + 4 * remap[ i ], pal->rgba + 4 * i, 4 );
+    }
+
+    memcpy( pal->rgba, rgba, 4 * pal->count );
+
+    for( i=0; i<PALETTE_HASH_SIZE; ++i )
+    {
+        if( pal->index[ i ]>=0 )
+            pal->index[ i ] = remap[ pal->index[ i ] ];
+    }
+
+    pal->bits = pal->count<=2 ? 1 : (pal->count<=4 ? 2 :
+                (pal->count<=16 ? 4 : 8));
+    return 1;
+}
+
+/* Stores the palette in the color modes of the image and the PNG */
+static int set_palette( LodePNGState* state, const palette_t* pal )
+{
+    const unsigned char* c;
+    int i;
+
+    state->info_raw.colortype       = LCT_PALETTE;
+    state->info_raw.bitdepth        = pal->bits;
+    state->info_png.color.colortype = LCT_PALETTE;
+    state->info_png.color.bitdepth  = pal->bits;
+    state->encoder.auto_convert     = LAC_NO;
+
+    for( i=0; i<pal->count; ++i )
+    {
+        c = pal->rgba + 4 * i;
+
+        if( lodepng_palette_add( &state->info_raw, c[0], c[1], c[2], c[3] ) ||
+            lodepng_palette_add( &state->info_png.color,
+                                 c[0], c[1], c[2], c[3] ) )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+    Converts pixels to palette indices, packed to pal->bits without any
+    padding, like LodePNG expects a whole image
+ */
+static void palette_pixels( palette_t* pal, unsigned char* out,
+                            const unsigned char* in, size_t count )
+{
+    unsigned int byte = 0, shift = 8, index = 0;
+    unsigned long color, last = 0;
+    size_t x;
+
+    for( x=0; x<count; ++x, in+=pal->channels )
+    {
+        color = pack_color( in, pal->channels );
+
+        if( x==0 || color!=last )
+        {
+            index = palette_index( pal, color );
+            last = color;
+        }
+
+        shift -= pal->bits;
+        byte |= index << shift;
+
+        if( shift==0 )
+        {
+            *(out++) = byte;
+            byte = 0;
+            shift = 8;
+        }
+    }
+
+    if( shift<8 )
+        *out = byte;
+}
+
+void save_png( const image_t* img, void* file, const image_io_t* io,
+               void* encoder )
+{
+    const unsigned char* in = img->image_buffer;
+    png_encoder_t* enc = encoder;
+    unsigned char *buffer = NULL, *rows = NULL;
+    size_t length = 0, in_size, y;
+    png_writer_t writer;
+    palette_t palette;
+    int indexed, whole;
+
+    if( !init_state( &writer.state, img ) )
+        return;
+
+    writer.encoder = NULL;
+    writer.file    = file;
+    writer.io      = io;
+
+    in_size  = lodepng_get_raw_size( img->width, 1, &writer.state.info_raw );
+    indexed  = build_palette( &palette, img ) &&
+               set_palette( &writer.state, &palette );
+
+    /* the image is filtered and compressed in bands on one or more
+       threads, or the filters are chosen by comparing whole images, which
+       needs all of it in memory */
+    whole = image_get_hint( img, EIH_PNG_EXPORT_THREADS ) > 0 ||
+            writer.state.encoder.filter_strategy == LFS_EXHAUSTIVE;
+
+    /* the indices are needed all at once then, one row at a time
+       otherwise */
+    if( indexed )
+    {
+        rows = get_rows( enc, lodepng_get_raw_size( img->width,
+                                                    whole ? img->height : 1,
+                                                    &writer.state.info_raw ) );
+    }
+
+    if( indexed && !rows )
+    {
+        /* out of memory, nothing is written */
+        lodepng_state_cleanup( &writer.state );
+        return;
+    }
+
+    if( whole )
+    {
+        if( indexed )
+        {
+            palette_pixels( &palette, rows, in, img->width * img->height );
+        }
+
+        if( !encode_whole( &buffer, &length, enc, indexed ? rows : in, img,
+                           &writer.state ) )
+        {
+            io->write( buffer, 1, length, file );
+        }
+    }
+    else if( (indexed ||
+              !lodepng_auto_choose_color( &writer.state.info_png.color,
+                                          in, img->width, img->height,
+                                          &writer.state.info_raw,
+                                          writer.state.encoder.auto_convert )) &&
+             !start_encoder( &writer, enc, img ) )
+    {
+        if( !indexed )
+            lodepng_row_encoder_write( writer.encoder, in, img->height );
+
+        for( y=0; indexed && y<img->height; ++y )
+        {
+            palette_pixels( &palette, rows, in + y*in_size, img->width );
+
+            if( lodepng_row_encoder_write( writer.encoder, rows, 1 ) )
+                break;
+        }
+    }
+
+    if( !enc )
+    {
+        lodepng_row_encoder_delete( writer.encoder );
+        free( rows );
+        free( buffer );
+    }
+
+    lodepng_state_cleanup( &writer.state );
+}
+
+#else
+
+png_writer_t* image_png_writer_create( const image_t* img, void* file,
+                                       const image_io_t* io )
+{
+    (void)img; (void)file; (void)io;
+    return NULL;
+}
+
+size_t image_png_writer_write( png_writer_t* writer, const void* rows,
+                               size_t count )
+{
+    (void)writer; (void)rows; (void)count;
+    return 0;
+}
+
+void image_png_writer_destroy( png_writer_t* writer )
+{
+    (void)writer;
+}
+
+png_encoder_t* image_png_encoder_create( void )
+{
+    return NULL;
+}
+
+void image_png_encoder_destroy( png_encoder_t* enc )
+{
+    (void)enc;
+}
+
+#endif
@@ -17,7 +17,7 @@ extern void save_tga( const image_t* img, void* file, const image_io_t* io );
 
 #ifdef IMAGE_LOAD_JPG
 extern E_LOAD_RESULT load_jpg( image_t* img, void* file,
-                               const image_io_t* io );
+                               const image_io_t* io, void* decoder );
 #endif
 
 #ifdef IMAGE_SAVE_JPG
@@ -41,7 +41,8 @@ extern E_LOAD_RESULT load_png( image_t* img, void* file,
 #endif
 
 #ifdef IMAGE_SAVE_PNG
-extern void save_png( const image_t* img, void* file, const image_io_t* io );
+extern void save_png( const image_t* img, void* file, const image_io_t* io,
+                      void* encoder );
 #endif
 
 
@@ -61,6 +62,7 @@ void image_init( image_t* img )
     memset( img, 0, sizeof(image_t) );
 
     img->hints[ EIH_JPEG_EXPORT_QUALITY ] = 3;
+    img->hints[ EIH_PNG_EXPORT_EFFORT ] = 5;
 }
 
 void image_deinit( image_t* img )
@@ -307,9 +309,20 @@ E_LOAD_RESULT image_load( image_t* img, const char* filename,
 
 E_LOAD_RESULT image_load_custom( image_t* img, void* file,
                                  const image_io_t* io, E_IMAGE_FILE type )
+{
+    return image_load_custom_with( img, file, io, type, NULL );
+}
+
+E_LOAD_RESULT image_load_custom_with( image_t* img, void* file,
+                                      const image_io_t* io, E_IMAGE_FILE type,
+                                      void* context )
 {
     E_LOAD_RESULT r = ELR_UNKNOWN_FILE_FORMAT;
 
+#ifndef IMAGE_LOAD_JPG
+    (void)context;
+#endif
+
     switch( type )
     {
 #ifdef IMAGE_LOAD_TGA
@@ -321,7 +334,7 @@ E_LOAD_RESULT image_load_custom( image_t* img, void* file,
 #endif
 
 #ifdef IMAGE_LOAD_JPG
-    case EIF_JPG: r = load_jpg( img, file, io ); break;
+    case EIF_JPG: r = load_jpg( img, file, io, context ); break;
 #endif
    
 #ifdef IMAGE_LOAD_PNG
@@ -372,6 +385,17 @@ void image_save( const image_t* img, const char* filename, E_IMAGE_FILE type )
 void image_save_custom( const image_t* img, void* file, const image_io_t* io,
                         E_IMAGE_FILE type )
 {
+    image_save_custom_with( img, file, io, type, NULL );
+}
+
+void image_save_custom_with( const image_t* img, void* file,
+                             const image_io_t* io, E_IMAGE_FILE type,
+                             void* context )
+{
+#ifndef IMAGE_SAVE_PNG
+    (void)context;
+#endif
+
     switch( type )
     {
 #ifdef IMAGE_SAVE_TGA
@@ -387,7 +411,7 @@ void image_save_custom( const image_t* img, void* file, const image_io_t* io,
 #endif
 
 #ifdef IMAGE_SAVE_PNG
-    case EIF_PNG: save_png( img, file, io ); break;
+    case EIF_PNG: save_png( img, file, io, context ); break;
 #endif
 
 #ifdef IMAGE_SAVE_PBM
@@ -1,161 +1,588 @@
-#include "image.h"
+#include "image_jpeg.h"
 
 /*
     The JPEG loading facilities.
 
     What should work:
       - Importing JPEG images using libjpeg and storing them as RGB8 images
+      - Reusing a decoder context across multiple images
+      - Decoding previews from the first scans or bytes of a progressive JPEG
+      - Loading EXIF, JFIF and JFXX thumbnails without decoding the image
 */
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <setjmp.h>
+#include <string.h>
+#include <limits.h>
 
 #ifdef IMAGE_LOAD_JPG
-#include "jpeglib.h"
+#include "jpg_util.h"
 
-/* struct for handling jpeg errors */
-typedef struct
-{
-    struct jpeg_error_mgr emgr;   /* jpeg error information */
-
-    jmp_buf setjmp_buffer;        /* for longjmp, to return to caller
-                                     on a fatal error */
-}
-m_jpeg_error_mgr;
 
 
-/* Override to get rid of exit behaviour */
-static void error_exit( j_common_ptr cinfo )
+/*
+    The decoder context. The decompression object, its permanent memory pool
+    and our own buffers are kept alive across images. After an image has
+    been decoded (or decoding failed), the object is reset using
+    jpeg_abort_decompress, which only releases the per-image pool.
+ */
+struct jpeg_decoder_t
 {
-    /* Retrieve custom jpeg error structure */
-    m_jpeg_error_mgr* m = (m_jpeg_error_mgr*)cinfo->err;
+    struct jpeg_decompress_struct cinfo;
+    m_jpeg_source_mgr jsrc;
+    m_jpeg_error_mgr jerr;
 
-    /* libjpeg expects us to not return from this function */
-    longjmp( m->setjmp_buffer, 1 );
-}
+    unsigned char** rowPtr;     /* row pointer array for jpeg_read_scanlines */
+    size_t rowPtr_size;         /* number of entries in rowPtr */
 
-static void output_message( j_common_ptr cinfo )
-{
-    (void)cinfo;
-}
+    unsigned char* input;       /* input buffer for byte limited previews */
+    size_t input_size;          /* size of the input buffer in bytes */
 
-static void skip_input_data( j_decompress_ptr cinfo, long count )
+    long max_memory;            /* default libjpeg memory limit */
+};
+
+static int decoder_init( jpeg_decoder_t* dec )
 {
-    struct jpeg_source_mgr* src = cinfo->src;
+    memset( dec, 0, sizeof(jpeg_decoder_t) );
+
+    /* Set up our jpeg info and jpeg error struct with our error routines */
+    dec->cinfo.err = jpg_error_init( &dec->jerr );
 
-    if( count > 0 )
+    /* jpeg_create_decompress can fail if it runs out of memory */
+    if( setjmp( dec->jerr.setjmp_buffer ) )
     {
-        src->bytes_in_buffer -= count;
-        src->next_input_byte += count;
+        jpeg_destroy_decompress( &dec->cinfo );
+        return 0;
     }
-}
 
-static void init_source( j_decompress_ptr cinfo )
-{
-    (void)cinfo;
+    jpeg_create_decompress( &dec->cinfo );
+
+    dec->max_memory = dec->cinfo.mem->max_memory_to_use;
+
+    return 1;
 }
 
-static void term_source( j_decompress_ptr cinfo )
+static void decoder_cleanup( jpeg_decoder_t* dec )
 {
-    (void)cinfo;
+    jpeg_destroy_decompress( &dec->cinfo );
+
+    free( dec->rowPtr );
+    free( dec->input  );
 }
 
-static boolean fill_input_buffer( j_decompress_ptr cinfo )
+/*
+    If a file has been cut off, make sure libjpeg does not see a partial
+    marker segment (which would be an error), but only complete headers
+    and partial entropy coded data. Returns the new length.
+ */
+static size_t trim_partial_segment( const unsigned char* data, size_t length )
 {
-    (void)cinfo;
-    return 1;
-}
+    size_t pos = 2, seglen;
+    unsigned char marker;
 
+    while( pos < length )
+    {
+        /* skip entropy coded data */
+        if( data[ pos ] != 0xFF || pos + 1 >= length )
+        {
+            ++pos;
+            continue;
+        }
 
+        marker = data[ pos + 1 ];
 
-E_LOAD_RESULT load_jpg( image_t* img, void* file, const image_io_t* io )
-{
-    size_t length;
-    unsigned char** rowPtr = NULL;
-    unsigned char* input;
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_source_mgr jsrc;
-    m_jpeg_error_mgr jerr;
-    size_t ystep, i, rows;
+        /* stuffed zero bytes, fill bytes and markers without a segment */
+        if( marker == 0xFF )
+        {
+            ++pos;
+            continue;
+        }
 
-    /* Read the file into a buffer */
-    io->seek( file, 0, SEEK_END );
-    length = io->tell( file );
-    io->seek( file, 0, SEEK_SET );
+        if( marker == 0x00 || marker == 0x01 ||
+            (marker >= JPEG_RST0 && marker <= JPEG_RST0 + 7) )
+        {
+            pos += 2;
+            continue;
+        }
 
-    input = malloc( length );
+        if( marker == JPEG_EOI )
+            break;
 
-    io->read( input, 1, length, file );
+        if( pos + 4 > length )
+            return pos;
 
-    /* Set up our jpeg info and jpeg error struct with our error routines */
-    cinfo.err                 = jpeg_std_error( &jerr.emgr );
-    cinfo.err->error_exit     = error_exit;
-    cinfo.err->output_message = output_message;
+        seglen = ((size_t)data[ pos + 2 ] << 8) | data[ pos + 3 ];
+
+        if( pos + 2 + seglen > length )
+            return pos;
+
+        pos += 2 + seglen;
+    }
+
+    return length;
+}
+
+/* decode a JPEG image, the source manager has to be set up already */
+static E_LOAD_RESULT decode_image( jpeg_decoder_t* dec, image_t* img )
+{
+    struct jpeg_decompress_struct* cinfo = &dec->cinfo;
+    size_t ystep, i, rows;
+    int max_mem, scans, bytes, ret;
+    void* ptr;
+
+    scans = image_get_hint( img, EIH_JPEG_PREVIEW_SCANS );
+    bytes = image_get_hint( img, EIH_JPEG_PREVIEW_BYTES );
 
     /*
         In case of a fatal error, libjpeg calls a custom callback and expects
         us not ot return(i.e. to exit). In order to continue normal program
-        flow, we use longjump to jump back here.
+        flow, we use longjump to jump back here. The decompression object
+        is reset, so it can be used for the next image.
      */
-    if( setjmp( jerr.setjmp_buffer ) )
+    if( setjmp( dec->jerr.setjmp_buffer ) )
     {
-        jpeg_destroy_decompress( &cinfo );
-
-        free( input  );
-        free( rowPtr );
-
+        jpeg_abort_decompress( cinfo );
         return ELR_FILE_CORRUPTED;
     }
 
     /* Initialise decompression */
-    jsrc.bytes_in_buffer   = length;                 /* the file buffer */
-    jsrc.next_input_byte   = (JOCTET*)input;
-    jsrc.init_source       = init_source;            /* our callbacks */
-    jsrc.fill_input_buffer = fill_input_buffer;
-    jsrc.skip_input_data   = skip_input_data;
-    jsrc.resync_to_restart = jpeg_resync_to_restart;
-    jsrc.term_source       = term_source;
+    jpeg_read_header( cinfo, TRUE );          /* Read the jif header */
 
-    jpeg_create_decompress( &cinfo );
+    cinfo->out_color_space = JCS_RGB;         /* convert to RGB on loading */
+    cinfo->out_color_components = 3;
+    cinfo->do_fancy_upsampling = FALSE;
 
-    cinfo.src = &jsrc;
+    /* Apply the memory limit, libjpeg uses temporary files beyond that */
+    max_mem = image_get_hint( img, EIH_JPEG_MAX_MEMORY );
 
-    jpeg_read_header( &cinfo, TRUE );          /* Read the jif header */
+    if( max_mem <= 0 )
+        cinfo->mem->max_memory_to_use = dec->max_memory;
+    else if( (unsigned long)max_mem > (unsigned long)LONG_MAX / 1024UL )
+        cinfo->mem->max_memory_to_use = LONG_MAX;
+    else
+        cinfo->mem->max_memory_to_use = (long)max_mem * 1024L;
 
-    cinfo.out_color_space = JCS_RGB;           /* convert to RGB on loading */
-    cinfo.out_color_components = 3;
-    cinfo.do_fancy_upsampling = FALSE;
+    /* For a preview, decode progressive JPEGs scan by scan */
+    cinfo->buffered_image = (scans > 0 || bytes > 0) &&
+                            jpeg_has_multiple_scans( cinfo );
 
-    jpeg_start_decompress( &cinfo );
+    jpeg_start_decompress( cinfo );
 
     /* allocate image buffer */
-    image_allocate_buffer( img, cinfo.image_width, cinfo.image_height,
-                           ECT_RGB8 );
+    if( !image_allocate_buffer( img, cinfo->image_width, cinfo->image_height,
+                                ECT_RGB8 ) )
+    {
+        jpeg_abort_decompress( cinfo );
+        return ELR_FILE_CORRUPTED;
+    }
 
     /* The libjpeg wants an array of row pointers, generate one. */
-    rowPtr = malloc( sizeof(unsigned char*) * img->height );
+    if( img->height > dec->rowPtr_size )
+    {
+        ptr = realloc( dec->rowPtr, sizeof(unsigned char*) * img->height );
+
+        if( !ptr )
+        {
+            jpeg_abort_decompress( cinfo );
+            return ELR_FILE_CORRUPTED;
+        }
+
+        dec->rowPtr      = ptr;
+        dec->rowPtr_size = img->height;
+    }
 
     ystep = img->width*3;
 
     for( i=0; i<img->height; ++i )
-        rowPtr[ i ] = (unsigned char*)img->image_buffer + i*ystep;
+        dec->rowPtr[ i ] = (unsigned char*)img->image_buffer + i*ystep;
+
+    if( cinfo->buffered_image )
+    {
+        /*
+            Gather scans up to the start of the first one not wanted or the
+            end of the available data and output what we have got so far.
+         */
+        do
+        {
+            ret = jpeg_consume_input( cinfo );
+        }
+        while( ret != JPEG_REACHED_EOI &&
+               (ret != JPEG_REACHED_SOS || scans <= 0 ||
+                cinfo->input_scan_number <= scans) );
+
+        /* The scan that just started has no data yet */
+        jpeg_start_output( cinfo, ret == JPEG_REACHED_EOI ?
+                                  cinfo->input_scan_number :
+                                  cinfo->input_scan_number - 1 );
+    }
 
     /* Read all scanlines from the file */
     rows = 0;
-    while( cinfo.output_scanline < cinfo.output_height )
-        rows += jpeg_read_scanlines( &cinfo, &rowPtr[ rows ],
-                                     cinfo.output_height - rows );
+    while( cinfo->output_scanline < cinfo->output_height )
+        rows += jpeg_read_scanlines( cinfo, &dec->rowPtr[ rows ],
+                                     cinfo->output_height - rows );
+
+    /* Releases the per-image memory, the object can be reused afterwards */
+    if( cinfo->buffered_image )
+    {
+        jpeg_finish_output( cinfo );
+        jpeg_abort_decompress( cinfo );
+    }
+    else
+    {
+        jpeg_finish_decompress( cinfo );
+    }
+
+    return ELR_SUCESS;
+}
+
+static E_LOAD_RESULT decode_jpg( jpeg_decoder_t* dec, image_t* img,
+                                 void* file, const image_io_t* io )
+{
+    int bytes = image_get_hint( img, EIH_JPEG_PREVIEW_BYTES );
+    size_t length;
+
+    if( bytes <= 0 )
+    {
+        /* stream the file through libjpeg in small chunks */
+        jpg_io_src( &dec->cinfo, &dec->jsrc, file, io );
+        return decode_image( dec, img );
+    }
+
+    /*
+        Read the allowed number of bytes into a buffer, reusing the one from
+        the last image, and make sure no partial marker segment is left.
+     */
+    if( !jpg_read_file( file, io, &dec->input, &dec->input_size, &length,
+                        (size_t)bytes ) )
+    {
+        return ELR_FILE_CORRUPTED;
+    }
+
+    if( length == (size_t)bytes )
+        length = trim_partial_segment( dec->input, length );
+
+    jpg_memory_src( &dec->cinfo, &dec->jsrc.pub, dec->input, length );
+    return decode_image( dec, img );
+}
+
+
+
+E_LOAD_RESULT load_jpg( image_t* img, void* file, const image_io_t* io,
+                        void* decoder )
+{
+    jpeg_decoder_t dec;
+    E_LOAD_RESULT r;
+
+    if( decoder )
+        return decode_jpg( decoder, img, file, io );
+
+    if( !decoder_init( &dec ) )
+        return ELR_FILE_CORRUPTED;
+
+    r = decode_jpg( &dec, img, file, io );
 
-    /* Cleanup */
-    free( rowPtr );
-    free( input  );
+    decoder_cleanup( &dec );
+    return r;
+}
 
-    jpeg_finish_decompress( &cinfo );
-    jpeg_destroy_decompress( &cinfo );
+jpeg_decoder_t* image_jpeg_decoder_create( void )
+{
+    jpeg_decoder_t* dec = malloc( sizeof(jpeg_decoder_t) );
+
+    if( dec && !decoder_init( dec ) )
+    {
+        free( dec );
+        dec = NULL;
+    }
+
+    return dec;
+}
+
+void image_jpeg_decoder_destroy( jpeg_decoder_t* dec )
+{
+    if( dec )
+    {
+        decoder_cleanup( dec );
+        free( dec );
+    }
+}
+
+/****************************************************************************/
+
+#define MARKER_SOI 0xD8
+#define MARKER_SOS 0xDA
+
+static unsigned int exif_u16( const unsigned char* p, int le )
+{
+    return le ? (p[0] | (p[1] << 8)) : ((p[0] << 8) | p[1]);
+}
+
+static unsigned long exif_u32( const unsigned char* p, int le )
+{
+    return le ? ((unsigned long)p[0]         | ((unsigned long)p[1] << 8) |
+                 ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24))
+              : (((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+                 ((unsigned long)p[2] << 8)  |  (unsigned long)p[3]);
+}
+
+/* decode a JPEG compressed thumbnail using a temporary decoder */
+static E_LOAD_RESULT thumbnail_jpg( image_t* img, const unsigned char* data,
+                                    size_t length )
+{
+    jpeg_decoder_t dec;
+    E_LOAD_RESULT r;
+
+    if( !decoder_init( &dec ) )
+        return ELR_FILE_CORRUPTED;
+
+    jpg_memory_src( &dec.cinfo, &dec.jsrc.pub, data, length );
+    r = decode_image( &dec, img );
+
+    decoder_cleanup( &dec );
+    return r;
+}
+
+/* uncompressed thumbnail, either RGB or indices into a 256 color palette */
+static E_LOAD_RESULT thumbnail_raw( image_t* img, const unsigned char* data,
+                                    size_t length, size_t width,
+                                    size_t height, const unsigned char* pal )
+{
+    unsigned char* dst;
+    size_t i, count = width * height;
+
+    if( !width || !height )
+        return ELR_NO_THUMBNAIL;
+
+    if( length < (pal ? count : count * 3) )
+        return ELR_FILE_CORRUPTED;
+
+    if( !image_allocate_buffer( img, width, height, ECT_RGB8 ) )
+        return ELR_FILE_CORRUPTED;
+
+    dst = img->image_buffer;
+
+    if( !pal )
+    {
+        memcpy( dst, data, count * 3 );
+        return ELR_SUCESS;
+    }
+
+    for( i=0; i<count; ++i, dst+=3 )
+    {
+        dst[0] = pal[ data[i]*3     ];
+        dst[1] = pal[ data[i]*3 + 1 ];
+        dst[2] = pal[ data[i]*3 + 2 ];
+    }
 
     return ELR_SUCESS;
 }
 
+/* thumbnail in a JFIF APP0 segment or a JFXX extension segment */
+static E_LOAD_RESULT thumbnail_jfif( image_t* img, const unsigned char* data,
+                                     size_t length )
+{
+    if( length >= 14 && !memcmp( data, "JFIF", 5 ) )
+        return thumbnail_raw( img, data + 14, length - 14,
+                              data[12], data[13], NULL );
+
+    if( length < 8 || memcmp( data, "JFXX", 5 ) )
+        return ELR_NO_THUMBNAIL;
+
+    switch( data[5] )
+    {
+    case 0x10:
+        return thumbnail_jpg( img, data + 6, length - 6 );
+    case 0x11:
+        if( length < 8 + 768 )
+            return ELR_FILE_CORRUPTED;
+
+        return thumbnail_raw( img, data + 8 + 768, length - 8 - 768,
+                              data[6], data[7], data + 8 );
+    case 0x13:
+        return thumbnail_raw( img, data + 8, length - 8,
+                              data[6], data[7], NULL );
+    }
+
+    return ELR_NO_THUMBNAIL;
+}
+
+/* JPEG compressed thumbnail in the second IFD of an EXIF APP1 segment */
+static E_LOAD_RESULT thumbnail_exif( image_t* img, const unsigned char* data,
+                                     size_t length )
+{
+    unsigned long ifd, offset = 0, size = 0, compression = 0, value;
+    const unsigned char *tiff, *entry;
+    unsigned int i, count, tag, type;
+    int le;
+
+    if( length < 6 + 8 || memcmp( data, "Exif\0\0", 6 ) )
+        return ELR_NO_THUMBNAIL;
+
+    tiff    = data + 6;
+    length -= 6;
+
+    if( tiff[0] == 'I' && tiff[1] == 'I' )
+        le = 1;
+    else if( tiff[0] == 'M' && tiff[1] == 'M' )
+        le = 0;
+    else
+        return ELR_FILE_CORRUPTED;
+
+    /* skip IFD0, the thumbnail is described by IFD1 */
+    ifd = exif_u32( tiff + 4, le );
+
+    if( ifd > length - 2 )
+        return ELR_FILE_CORRUPTED;
+
+    count = exif_u16( tiff + ifd, le );
+
+    if( ifd + 2 + count * 12 + 4 > length )
+        return ELR_FILE_CORRUPTED;
+
+    ifd = exif_u32( tiff + ifd + 2 + count * 12, le );
+
+    if( !ifd )
+        return ELR_NO_THUMBNAIL;
+
+    if( ifd > length - 2 )
+        return ELR_FILE_CORRUPTED;
+
+    count = exif_u16( tiff + ifd, le );
+
+    if( ifd + 2 + count * 12 > length )
+        return ELR_FILE_CORRUPTED;
+
+    for( i=0; i<count; ++i )
+    {
+        entry = tiff + ifd + 2 + i * 12;
+        tag   = exif_u16( entry, le );
+        type  = exif_u16( entry + 2, le );
+
+        /* SHORT values are stored in the first half of the value field */
+        value = type == 3 ? exif_u16( entry + 8, le ) :
+                            exif_u32( entry + 8, le );
+
+        switch( tag )
+        {
+        case 0x0103: compression = value; break;
+        case 0x0201: offset      = value; break;
+        case 0x0202: size        = value; break;
+        }
+    }
+
+    /* uncompressed TIFF thumbnails are not supported */
+    if( (compression && compression != 6) || !offset || !size )
+        return ELR_NO_THUMBNAIL;
+
+    if( offset > length || size > length - offset )
+        return ELR_FILE_CORRUPTED;
+
+    return thumbnail_jpg( img, tiff + offset, size );
+}
+
+E_LOAD_RESULT image_load_embedded_thumbnail( image_t* img, void* file,
+                                             const image_io_t* io )
+{
+    E_LOAD_RESULT r = ELR_NO_THUMBNAIL;
+    unsigned char buffer[ 4 ];
+    unsigned char* segment;
+    size_t length;
+    int marker;
+
+    if( io->read( buffer, 1, 2, file ) != 2 ||
+        buffer[0] != 0xFF || buffer[1] != MARKER_SOI )
+    {
+        return ELR_UNKNOWN_FILE_FORMAT;
+    }
+
+    segment = malloc( 0xFFFF );
+
+    if( !segment )
+        return ELR_FILE_CORRUPTED;
+
+    /* walk the marker segments up to the image data */
+    while( r == ELR_NO_THUMBNAIL )
+    {
+        if( io->read( buffer, 1, 2, file ) != 2 || buffer[0] != 0xFF )
+        {
+            r = ELR_FILE_CORRUPTED;
+            break;
+        }
+
+        /* skip fill bytes */
+        while( buffer[1] == 0xFF && io->read( buffer + 1, 1, 1, file ) == 1 )
+        {
+        }
+
+        marker = buffer[1];
+
+        /* thumbnails are stored in front of the first frame */
+        if( marker == MARKER_SOS || marker == JPEG_EOI ||
+            (marker >= 0xC0 && marker <= 0xCF &&
+             marker != 0xC4 && marker != 0xC8 && marker != 0xCC) )
+        {
+            break;
+        }
+
+        if( io->read( buffer + 2, 1, 2, file ) != 2 )
+        {
+            r = ELR_FILE_CORRUPTED;
+            break;
+        }
+
+        length = (buffer[2] << 8) | buffer[3];
+
+        if( length < 2 )
+        {
+            r = ELR_FILE_CORRUPTED;
+            break;
+        }
+
+        length -= 2;
+
+        if( marker != JPEG_APP0 && marker != JPEG_APP0 + 1 )
+        {
+            if( io->seek( file, (long)length, SEEK_CUR ) != 0 )
+                r = ELR_FILE_CORRUPTED;
+
+            continue;
+        }
+
+        if( io->read( segment, 1, length, file ) != length )
+        {
+            r = ELR_FILE_CORRUPTED;
+            break;
+        }
+
+        if( marker == JPEG_APP0 )
+            r = thumbnail_jfif( img, segment, length );
+        else
+            r = thumbnail_exif( img, segment, length );
+    }
+
+    free( segment );
+    return r;
+}
+
+#else
+
+jpeg_decoder_t* image_jpeg_decoder_create( void )
+{
+    return NULL;
+}
+
+void image_jpeg_decoder_destroy( jpeg_decoder_t* dec )
+{
+    (void)dec;
+}
+
+E_LOAD_RESULT image_load_embedded_thumbnail( image_t* img, void* file,
+                                             const image_io_t* io )
+{
+    (void)img; (void)file; (void)io;
+    return ELR_UNKNOWN_FILE_FORMAT;
+}
+
 #endif
 
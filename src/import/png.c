@@ -1,10 +1,16 @@
-#include "image.h"
+#include "image_png.h"
 
 /*
     The PNG loading facilities.
 
     What should work:
-      - Importing PNG images using LodePNG and storing them as RGBA8
+      - Importing PNG images using LodePNG and storing them as GRAYSCALE8,
+        RGB8 or RGBA8, depending on the file or the EIH_PNG_COLOR_TYPE hint
+      - Decoding non-interlaced images row by row, without holding the
+        whole file or image in memory
+      - Loading a 1/8, 1/4 or 1/2 scale preview of interlaced images from
+        their first Adam7 passes (EIH_PNG_PREVIEW_PASSES), without reading
+        the rest of the file
 */
 
 #ifdef IMAGE_LOAD_PNG
@@ -12,15 +18,71 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
-E_LOAD_RESULT load_png( image_t* img, void* file, const image_io_t* io )
+static void set_color_mode( LodePNGColorMode* mode, E_COLOR_TYPE type )
 {
-    unsigned int width, height, result;
-    unsigned char* input;
+    switch( type )
+    {
+    case ECT_GRAYSCALE8: mode->colortype = LCT_GREY; break;
+    case ECT_RGB8:       mode->colortype = LCT_RGB;  break;
+    default:             mode->colortype = LCT_RGBA; break;
+    }
+
+    mode->bitdepth = 8;
+}
+
+/* the smallest color type that can hold all pixels of a PNG file */
+static E_COLOR_TYPE native_color_type( const LodePNGColorMode* mode )
+{
+    if( lodepng_can_have_alpha( mode ) )
+        return ECT_RGBA8;
+
+    return lodepng_is_greyscale_type( mode ) ? ECT_GRAYSCALE8 : ECT_RGB8;
+}
+
+/* set up the decoder state according to the hints of an image */
+static E_COLOR_TYPE init_state( LodePNGState* state, const image_t* img )
+{
+    E_COLOR_TYPE type;
+    int passes;
+
+    lodepng_state_init( state );
+
+    state->decoder.ignore_crc = image_get_hint( img, EIH_PNG_IGNORE_CRC )!=0;
+
+    passes = image_get_hint( img, EIH_PNG_PREVIEW_PASSES );
+    state->decoder.adam7_passes = passes>0 ? (unsigned int)passes : 0;
+
+    type = (E_COLOR_TYPE)image_get_hint( img, EIH_PNG_COLOR_TYPE );
+
+    if( type==ECT_GRAYSCALE8 || type==ECT_RGB8 || type==ECT_RGBA8 )
+    {
+        set_color_mode( &state->info_raw, type );
+        return type;
+    }
+
+    /* decode as stored, the color type is known after decoding */
+    state->decoder.color_convert = 0;
+    return ECT_NONE;
+}
+
+/*
+    Decode a whole PNG file. If *type is ECT_NONE, the image is converted
+    to the closest supported color type, which is stored in *type.
+    Returns a LodePNG error code.
+ */
+static unsigned int decode_png( LodePNGState* state, E_COLOR_TYPE* type,
+                                void* file, const image_io_t* io,
+                                unsigned char** data, unsigned int* width,
+                                unsigned int* height )
+{
+    unsigned char *input, *converted;
+    LodePNGColorMode mode;
+    unsigned int result;
     size_t length;
 
-    if( img->image_buffer )
-        free( img->image_buffer );
+    *data = NULL;
 
     /* read the file into a buffer */
     io->seek( file, 0, SEEK_END );
@@ -32,28 +94,282 @@ E_LOAD_RESULT load_png( image_t* img, void* file, const image_io_t* io )
     io->read( input, 1, length, file );
 
     /* decode the image */
-    result = lodepng_decode32( (unsigned char**)&img->image_buffer,
-                               &width, &height, input, length );
+    result = lodepng_decode( data, width, height, state, input, length );
 
     free( input );
 
+    /* convert to the closest supported color type, if necessary */
+    if( result==0 && *type==ECT_NONE )
+    {
+        *type = native_color_type( &state->info_png.color );
+
+        lodepng_color_mode_init( &mode );
+        set_color_mode( &mode, *type );
+
+        if( state->info_png.color.colortype!=mode.colortype ||
+            state->info_png.color.bitdepth!=mode.bitdepth )
+        {
+            /* 83 is the LodePNG out of memory error */
+            converted = malloc( lodepng_get_raw_size( *width, *height,
+                                                      &mode ) );
+
+            result = converted ? lodepng_convert( converted, *data, &mode,
+                                                  &state->info_png.color,
+                                                  *width, *height ) : 83;
+
+            free( *data );
+            *data = converted;
+        }
+
+        lodepng_color_mode_cleanup( &mode );
+    }
+
     if( result != 0 )
     {
-        free( img->image_buffer );
+        free( *data );
+        *data = NULL;
+    }
+
+    return result;
+}
+
+/*
+    Load an image through a row reader. For interlaced images with the
+    EIH_PNG_PREVIEW_PASSES hint set, it only reads the passes it needs.
+ */
+static E_LOAD_RESULT load_png_rows( image_t* img, void* file,
+                                    const image_io_t* io )
+{
+    png_reader_t* reader;
+    size_t height;
 
-        img->image_buffer = NULL;
-        img->width        = 0;
-        img->height       = 0;
+    reader = image_png_reader_create( img, file, io );
 
+    if( !reader )
+        return ELR_FILE_CORRUPTED;
+
+    height = img->height;
+
+    if( !image_allocate_buffer( img, img->width, height, img->type ) ||
+        image_png_reader_read( reader, img->image_buffer, height )!=height )
+    {
+        image_png_reader_destroy( reader );
+        image_allocate_buffer( img, 0, 0, ECT_NONE );
         return ELR_FILE_CORRUPTED;
     }
 
+    image_png_reader_destroy( reader );
+    return ELR_SUCESS;
+}
+
+E_LOAD_RESULT load_png( image_t* img, void* file, const image_io_t* io )
+{
+    unsigned int width, height, result;
+    unsigned char* data;
+    LodePNGState state;
+    E_COLOR_TYPE type;
+
+    if( image_get_hint( img, EIH_PNG_PREVIEW_PASSES ) > 0 )
+        return load_png_rows( img, file, io );
+
+    if( img->image_buffer )
+        free( img->image_buffer );
+
+    img->image_buffer = NULL;
+    img->width        = 0;
+    img->height       = 0;
+
+    type = init_state( &state, img );
+
+    result = decode_png( &state, &type, file, io, &data, &width, &height );
+
+    lodepng_state_cleanup( &state );
+
+    if( result != 0 )
+        return ELR_FILE_CORRUPTED;
+
     /* store the image properties */
+    img->image_buffer = data;
+    img->width        = width;
+    img->height       = height;
+    img->type         = type;
+
+    return ELR_SUCESS;
+}
+
+/****************************************************************************/
+
+/*
+    The row reader. Non-interlaced images are decoded by a LodePNG row
+    decoder that reads the file through the I/O callbacks as it goes, as
+    are the first passes of interlaced images if a preview is requested.
+    Other interlaced images are decoded as a whole when the reader is
+    created.
+ */
+struct png_reader_t
+{
+    LodePNGState state;
+    LodePNGRowDecoder* decoder;   /* NULL for images decoded as a whole */
+
+    LodePNGColorMode mode;        /* the color mode of the returned rows */
+    unsigned char* line;          /* a row as stored, if it must be converted */
+    unsigned char* data;          /* the whole image, for interlaced images */
+
+    size_t width;
+    size_t height;
+    size_t row_size;
+    size_t y;                     /* the next row to return */
+
+    void* file;
+    const image_io_t* io;
+};
+
+static size_t read_callback( unsigned char* buffer, size_t size, void* user )
+{
+    png_reader_t* reader = user;
+
+    return reader->io->read( buffer, 1, size, reader->file );
+}
+
+png_reader_t* image_png_reader_create( image_t* img, void* file,
+                                       const image_io_t* io )
+{
+    unsigned int width = 0, height = 0, result;
+    png_reader_t* reader;
+    E_COLOR_TYPE type;
+
+    if( img->image_buffer )
+        free( img->image_buffer );
+
+    img->image_buffer = NULL;
+    img->width        = 0;
+    img->height       = 0;
+
+    reader = calloc( 1, sizeof(png_reader_t) );
+
+    if( !reader )
+        return NULL;
+
+    reader->file = file;
+    reader->io   = io;
+
+    lodepng_color_mode_init( &reader->mode );
+
+    type = init_state( &reader->state, img );
+
+    result = lodepng_row_decoder_new( &reader->decoder, &width, &height,
+                                      &reader->state, read_callback, reader );
+
+    if( result==92 )
+    {
+        /* 92 is the LodePNG error for interlaced images */
+        result = decode_png( &reader->state, &type, file, io, &reader->data,
+                             &width, &height );
+    }
+    else if( result==0 && type==ECT_NONE )
+    {
+        /* the rows are converted from the stored to the closest supported
+           color type one at a time */
+        type = native_color_type( &reader->state.info_png.color );
+        set_color_mode( &reader->mode, type );
+
+        if( reader->state.info_raw.colortype!=reader->mode.colortype ||
+            reader->state.info_raw.bitdepth!=reader->mode.bitdepth )
+        {
+            reader->line = malloc( lodepng_get_raw_size( width, 1,
+                                                     &reader->state.info_raw ) );
+            result = reader->line ? 0 : 83;
+        }
+    }
+
+    if( result != 0 )
+    {
+        image_png_reader_destroy( reader );
+        return NULL;
+    }
+
+    set_color_mode( &reader->mode, type );
+
+    reader->width    = width;
+    reader->height   = height;
+    reader->row_size = lodepng_get_raw_size( width, 1, &reader->mode );
+
     img->width  = width;
     img->height = height;
-    img->type   = ECT_RGBA8;
+    img->type   = type;
 
-    return ELR_SUCESS;
+    return reader;
+}
+
+size_t image_png_reader_read( png_reader_t* reader, void* rows, size_t count )
+{
+    unsigned char* out = rows;
+    size_t i;
+
+    if( count > reader->height - reader->y )
+        count = reader->height - reader->y;
+
+    if( reader->data )
+    {
+        memcpy( out, reader->data + reader->y * reader->row_size,
+                count * reader->row_size );
+        reader->y += count;
+        return count;
+    }
+
+    for( i=0; i<count; ++i, out+=reader->row_size )
+    {
+        if( reader->line )
+        {
+            if( lodepng_row_decoder_read( reader->decoder, reader->line, 1 ) ||
+                lodepng_convert( out, reader->line, &reader->mode,
+                                 &reader->state.info_raw, reader->width, 1 ) )
+            {
+                break;
+            }
+        }
+        else if( lodepng_row_decoder_read( reader->decoder, out, 1 ) )
+        {
+            break;
+        }
+
+        ++reader->y;
+    }
+
+    return i;
+}
+
+void image_png_reader_destroy( png_reader_t* reader )
+{
+    if( reader )
+    {
+        lodepng_row_decoder_delete( reader->decoder );
+        lodepng_state_cleanup( &reader->state );
+        lodepng_color_mode_cleanup( &reader->mode );
+        free( reader->line );
+        free( reader->data );
+        free( reader );
+    }
+}
+
+#else
+
+png_reader_t* image_png_reader_create( image_t* img, void* file,
+                                       const image_io_t* io )
+{
+    (void)img; (void)file; (void)io;
+    return NULL;
+}
+
+size_t image_png_reader_read( png_reader_t* reader, void* rows, size_t count )
+{
+    (void)reader; (void)rows; (void)count;
+    return 0;
+}
+
+void image_png_reader_destroy( png_reader_t* reader )
+{
+    (void)reader;
 }
 
 #endif
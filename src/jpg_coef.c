@@ -0,0 +1,392 @@
+#include "image_jpeg.h"
+
+/*
+    Access to the quantized DCT coefficients of JPEG files.
+
+    What should work:
+      - Loading the coefficients of any JPEG file libjpeg can read
+      - Storing coefficients to a baseline JPEG file with optimized
+        Huffman tables
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef IMAGE_LOAD_JPG
+#include "jpg_util.h"
+
+/* round a up to the next multiple of b */
+#define ROUND_UP( a, b ) ((JDIMENSION)((((a) + (b) - 1) / (b)) * (b)))
+
+
+static E_JPEG_COLOR color_from_jpeg( J_COLOR_SPACE jcs )
+{
+    switch( jcs )
+    {
+    case JCS_GRAYSCALE: return EJC_GRAYSCALE;
+    case JCS_YCbCr:     return EJC_YCBCR;
+    case JCS_RGB:       return EJC_RGB;
+    case JCS_CMYK:      return EJC_CMYK;
+    case JCS_YCCK:      return EJC_YCCK;
+    default:            break;
+    }
+
+    return EJC_UNKNOWN;
+}
+
+static J_COLOR_SPACE color_to_jpeg( E_JPEG_COLOR color )
+{
+    switch( color )
+    {
+    case EJC_GRAYSCALE: return JCS_GRAYSCALE;
+    case EJC_YCBCR:     return JCS_YCbCr;
+    case EJC_RGB:       return JCS_RGB;
+    case EJC_CMYK:      return JCS_CMYK;
+    case EJC_YCCK:      return JCS_YCCK;
+    default:            break;
+    }
+
+    return JCS_UNKNOWN;
+}
+
+/* copy the coefficients of all components out of libjpeg's virtual arrays */
+static int copy_from_arrays( jpeg_coefficients_t* coefs,
+                             j_decompress_ptr cinfo, jvirt_barray_ptr* arrays )
+{
+    jpeg_component_info* compptr;
+    jpeg_component_t* comp;
+    JQUANT_TBL* qtbl;
+    JBLOCKARRAY buffer;
+    size_t row, rowsize;
+    short* dst;
+    int ci, i;
+
+    coefs->width          = cinfo->image_width;
+    coefs->height         = cinfo->image_height;
+    coefs->color          = color_from_jpeg( cinfo->jpeg_color_space );
+    coefs->num_components = cinfo->num_components;
+
+    for( ci=0; ci<cinfo->num_components; ++ci )
+    {
+        compptr = cinfo->comp_info + ci;
+        comp    = coefs->components + ci;
+
+        comp->id               = compptr->component_id;
+        comp->h_samp_factor    = compptr->h_samp_factor;
+        comp->v_samp_factor    = compptr->v_samp_factor;
+        comp->width_in_blocks  = compptr->width_in_blocks;
+        comp->height_in_blocks = compptr->height_in_blocks;
+
+        qtbl = compptr->quant_table;
+
+        if( !qtbl )
+            qtbl = cinfo->quant_tbl_ptrs[ compptr->quant_tbl_no ];
+
+        if( qtbl )
+        {
+            for( i=0; i<DCTSIZE2; ++i )
+                comp->quant[ i ] = qtbl->quantval[ i ];
+        }
+
+        rowsize = comp->width_in_blocks * DCTSIZE2;
+
+        comp->blocks = malloc( rowsize * comp->height_in_blocks *
+                               sizeof(short) );
+
+        if( !comp->blocks )
+            return 0;
+
+        dst = comp->blocks;
+
+        for( row=0; row<comp->height_in_blocks; ++row, dst+=rowsize )
+        {
+            buffer = (*cinfo->mem->access_virt_barray)( (j_common_ptr)cinfo,
+                                                        arrays[ ci ],
+                                                        row, 1, FALSE );
+
+            memcpy( dst, buffer[0], rowsize * sizeof(short) );
+        }
+    }
+
+    return 1;
+}
+
+/* set up the compression parameters for storing coefficients */
+static void setup_compress( j_compress_ptr cinfo,
+                            const jpeg_coefficients_t* coefs )
+{
+    const jpeg_component_t* slots[ NUM_QUANT_TBLS ];
+    const jpeg_component_t* comp;
+    jpeg_component_info* compptr;
+    int ci, i, tbl, numtbl = 0;
+
+    cinfo->image_width           = coefs->width;
+    cinfo->image_height          = coefs->height;
+    cinfo->jpeg_width            = coefs->width;
+    cinfo->jpeg_height           = coefs->height;
+    cinfo->input_components      = coefs->num_components;
+    cinfo->in_color_space        = color_to_jpeg( coefs->color );
+    cinfo->min_DCT_h_scaled_size = DCTSIZE;
+    cinfo->min_DCT_v_scaled_size = DCTSIZE;
+
+    jpeg_set_defaults( cinfo );
+    jpeg_set_colorspace( cinfo, cinfo->in_color_space );
+
+    /* JCS_UNKNOWN leaves the number of components to us */
+    cinfo->num_components = coefs->num_components;
+
+    for( ci=0; ci<coefs->num_components; ++ci )
+    {
+        comp    = coefs->components + ci;
+        compptr = cinfo->comp_info + ci;
+
+        compptr->component_id  = comp->id;
+        compptr->h_samp_factor = comp->h_samp_factor;
+        compptr->v_samp_factor = comp->v_samp_factor;
+
+        /* share quantization table slots between identical tables */
+        for( tbl=0; tbl<numtbl; ++tbl )
+        {
+            if( !memcmp( slots[ tbl ]->quant, comp->quant,
+                         sizeof(comp->quant) ) )
+            {
+                break;
+            }
+        }
+
+        if( tbl == numtbl )
+        {
+            if( !cinfo->quant_tbl_ptrs[ tbl ] )
+            {
+                cinfo->quant_tbl_ptrs[ tbl ] =
+                    jpeg_alloc_quant_table( (j_common_ptr)cinfo );
+            }
+
+            for( i=0; i<DCTSIZE2; ++i )
+                cinfo->quant_tbl_ptrs[ tbl ]->quantval[ i ] = comp->quant[i];
+
+            cinfo->quant_tbl_ptrs[ tbl ]->sent_table = FALSE;
+            slots[ numtbl++ ] = comp;
+        }
+
+        compptr->quant_tbl_no = tbl;
+    }
+
+    /* the default tables do not necessarily cover arbitrary coefficients */
+    cinfo->optimize_coding = TRUE;
+}
+
+/* request virtual arrays for storing coefficients */
+static void request_arrays( j_compress_ptr cinfo,
+                            const jpeg_coefficients_t* coefs,
+                            jvirt_barray_ptr* arrays )
+{
+    const jpeg_component_t* comp;
+    int ci;
+
+    for( ci=0; ci<coefs->num_components; ++ci )
+    {
+        comp = coefs->components + ci;
+
+        arrays[ ci ] = (*cinfo->mem->request_virt_barray)(
+                            (j_common_ptr)cinfo, JPOOL_IMAGE, FALSE,
+                            ROUND_UP( comp->width_in_blocks,
+                                      comp->h_samp_factor ),
+                            ROUND_UP( comp->height_in_blocks,
+                                      comp->v_samp_factor ),
+                            (JDIMENSION)comp->v_samp_factor );
+    }
+}
+
+/* copy the coefficients into the realized virtual arrays */
+static void copy_to_arrays( j_compress_ptr cinfo,
+                            const jpeg_coefficients_t* coefs,
+                            jvirt_barray_ptr* arrays )
+{
+    const jpeg_component_t* comp;
+    JBLOCKARRAY buffer;
+    size_t row, rowsize;
+    const short* src;
+    int ci;
+
+    for( ci=0; ci<coefs->num_components; ++ci )
+    {
+        comp    = coefs->components + ci;
+        rowsize = comp->width_in_blocks * DCTSIZE2;
+        src     = comp->blocks;
+
+        for( row=0; row<comp->height_in_blocks; ++row, src+=rowsize )
+        {
+            buffer = (*cinfo->mem->access_virt_barray)( (j_common_ptr)cinfo,
+                                                        arrays[ ci ],
+                                                        row, 1, TRUE );
+
+            memcpy( buffer[0], src, rowsize * sizeof(short) );
+        }
+    }
+}
+
+static int check_coefficients( const jpeg_coefficients_t* coefs )
+{
+    const jpeg_component_t* comp;
+    size_t max_h = 1, max_v = 1, w, h;
+    int ci;
+
+    if( !coefs->width || !coefs->height )
+        return 0;
+
+    if( coefs->num_components < 1 || coefs->num_components > 4 )
+        return 0;
+
+    for( ci=0; ci<coefs->num_components; ++ci )
+    {
+        comp = coefs->components + ci;
+
+        if( !comp->blocks ||
+            comp->h_samp_factor < 1 || comp->h_samp_factor > 4 ||
+            comp->v_samp_factor < 1 || comp->v_samp_factor > 4 )
+        {
+            return 0;
+        }
+
+        if( (size_t)comp->h_samp_factor > max_h )
+            max_h = comp->h_samp_factor;
+
+        if( (size_t)comp->v_samp_factor > max_v )
+            max_v = comp->v_samp_factor;
+    }
+
+    /* the block dimensions must match what libjpeg derives from the size */
+    for( ci=0; ci<coefs->num_components; ++ci )
+    {
+        comp = coefs->components + ci;
+
+        w = (coefs->width  * comp->h_samp_factor + max_h*DCTSIZE - 1) /
+            (max_h*DCTSIZE);
+        h = (coefs->height * comp->v_samp_factor + max_v*DCTSIZE - 1) /
+            (max_v*DCTSIZE);
+
+        if( comp->width_in_blocks != w || comp->height_in_blocks != h )
+            return 0;
+    }
+
+    return 1;
+}
+
+/****************************************************************************/
+
+E_LOAD_RESULT image_jpeg_load_coefficients( jpeg_coefficients_t* coefs,
+                                            void* file,
+                                            const image_io_t* io )
+{
+    struct jpeg_decompress_struct cinfo;
+    m_jpeg_source_mgr jsrc;
+    m_jpeg_error_mgr jerr;
+    jvirt_barray_ptr* arrays;
+    int ok;
+
+    image_jpeg_coefficients_deinit( coefs );
+
+    cinfo.err = jpg_error_init( &jerr );
+
+    if( setjmp( jerr.setjmp_buffer ) )
+    {
+        jpeg_destroy_decompress( &cinfo );
+        image_jpeg_coefficients_deinit( coefs );
+        return ELR_FILE_CORRUPTED;
+    }
+
+    jpeg_create_decompress( &cinfo );
+    jpg_io_src( &cinfo, &jsrc, file, io );
+
+    jpeg_read_header( &cinfo, TRUE );
+
+    /* our coefficient layout only covers plain 8x8 DCT blocks */
+    if( cinfo.block_size != DCTSIZE || cinfo.num_components > 4 )
+    {
+        jpeg_destroy_decompress( &cinfo );
+        return ELR_NOT_SUPPORTED;
+    }
+
+    arrays = jpeg_read_coefficients( &cinfo );
+    ok = copy_from_arrays( coefs, &cinfo, arrays );
+
+    jpeg_finish_decompress( &cinfo );
+    jpeg_destroy_decompress( &cinfo );
+
+    if( !ok )
+    {
+        image_jpeg_coefficients_deinit( coefs );
+        return ELR_FILE_CORRUPTED;
+    }
+
+    return ELR_SUCESS;
+}
+
+int image_jpeg_save_coefficients( const jpeg_coefficients_t* coefs,
+                                  void* file, const image_io_t* io )
+{
+    struct jpeg_compress_struct cinfo;
+    jvirt_barray_ptr arrays[ MAX_COMPONENTS ];
+    m_jpeg_dest_mgr dest;
+    m_jpeg_error_mgr jerr;
+
+    if( !check_coefficients( coefs ) )
+        return 0;
+
+    cinfo.err = jpg_error_init( &jerr );
+
+    if( setjmp( jerr.setjmp_buffer ) )
+    {
+        jpeg_destroy_compress( &cinfo );
+        return 0;
+    }
+
+    jpeg_create_compress( &cinfo );
+    jpg_io_dest( &cinfo, &dest, file, io );
+
+    setup_compress( &cinfo, coefs );
+    request_arrays( &cinfo, coefs, arrays );
+
+    /* realizes the virtual arrays, they are filled afterwards */
+    jpeg_write_coefficients( &cinfo, arrays );
+    copy_to_arrays( &cinfo, coefs, arrays );
+
+    jpeg_finish_compress( &cinfo );
+    jpeg_destroy_compress( &cinfo );
+    return 1;
+}
+
+#else
+
+E_LOAD_RESULT image_jpeg_load_coefficients( jpeg_coefficients_t* coefs,
+                                            void* file,
+                                            const image_io_t* io )
+{
+    (void)coefs; (void)file; (void)io;
+    return ELR_UNKNOWN_FILE_FORMAT;
+}
+
+int image_jpeg_save_coefficients( const jpeg_coefficients_t* coefs,
+                                  void* file, const image_io_t* io )
+{
+    (void)coefs; (void)file; (void)io;
+    return 0;
+}
+
+#endif
+
+void image_jpeg_coefficients_init( jpeg_coefficients_t* coefs )
+{
+    memset( coefs, 0, sizeof(jpeg_coefficients_t) );
+}
+
+void image_jpeg_coefficients_deinit( jpeg_coefficients_t* coefs )
+{
+    int ci;
+
+    for( ci=0; ci<4; ++ci )
+        free( coefs->components[ ci ].blocks );
+
+    image_jpeg_coefficients_init( coefs );
+}
@@ -0,0 +1,398 @@
+#include "image.h"
+
+/*
+    Color quantization using the quantizers of libjpeg.
+
+    RGB images are reduced with the two pass median cut quantizer of
+    jquant2.c (without dithering or with Floyd-Steinberg dithering), or
+    with the one pass quantizer of jquant1.c when ordered dithering is
+    requested. Grayscale images always use jquant1.c. The quantizers only
+    need a decompression object for the memory manager and a few output
+    parameters, so they are driven directly instead of through
+    jpeg_start_decompress.
+
+    What should work:
+      - Reducing grayscale images to 2 - 256 colors
+      - Reducing RGB images to 8 - 256 colors, the median cut needs 8 and
+        the one pass quantizer 2 levels for each of the 3 components
+      - Reducing RGBA images, where alpha is reduced to 5 evenly spaced
+        levels. Fully transparent pixels share one palette entry, and the
+        RGB values of every other level are quantized on their own with a
+        share of the remaining colors, at least 8. Levels that do not fit
+        are merged into the nearest one, so these need 9 colors if any
+        pixel is transparent
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef IMAGE_LOAD_JPG
+#define JPEG_INTERNALS
+#include "jpg_util.h"
+
+/* alpha is reduced to this many evenly spaced levels, the first one fully
+   transparent */
+#define ALPHA_LEVELS 5
+
+/* the alpha level of an alpha value, and the alpha value of a level */
+#define ALPHA_LEVEL( a ) (((a) * (ALPHA_LEVELS - 1) + 127) / 255)
+#define LEVEL_ALPHA( k ) (((k) * 255 + (ALPHA_LEVELS - 1) / 2) / (ALPHA_LEVELS - 1))
+
+/* jquant2.c needs 8 colors, jquant1.c 2 levels for each component */
+#define MIN_RGB_COLORS 8
+
+/* the "simple" part of the table jdmaster.c builds, enough for dithering */
+static void prepare_range_limit( j_decompress_ptr cinfo )
+{
+    JSAMPLE* table;
+    int i;
+
+    table = (JSAMPLE*)(*cinfo->mem->alloc_small)( (j_common_ptr)cinfo,
+                                                  JPOOL_IMAGE,
+                                                  3 * (MAXJSAMPLE+1) );
+    memset( table, 0, MAXJSAMPLE+1 );
+    table += MAXJSAMPLE+1;
+
+    for( i=0; i<=MAXJSAMPLE; ++i )
+        table[ i ] = (JSAMPLE)i;
+
+    for( ; i<2*(MAXJSAMPLE+1); ++i )
+        table[ i ] = MAXJSAMPLE;
+
+    cinfo->sample_range_limit = table;
+}
+
+/*
+    For RGBA images, alpha maps every alpha value to the one of its level
+    and only the pixels at the level value are quantized in a pass, it is
+    NULL otherwise.
+ */
+
+/* pack the RGB values of a row, pixels of other levels repeat their left
+   neighbour so that they do not spread a dithering error */
+static void pack_row( JSAMPROW out, const unsigned char* in, size_t width,
+                      const unsigned char* alpha, int value )
+{
+    JSAMPLE r = 0, g = 0, b = 0;
+    size_t x;
+
+    if( !alpha )
+    {
+        memcpy( out, in, width*3 );
+        return;
+    }
+
+    for( x=0; x<width; ++x, in+=4 )
+    {
+        if( alpha[ in[3] ]==value )
+        {
+            r = in[0];
+            g = in[1];
+            b = in[2];
+        }
+
+        *(out++) = r;
+        *(out++) = g;
+        *(out++) = b;
+    }
+}
+
+/* feed the RGB values of the pixels of the level to the histogram pass */
+static void prescan( j_decompress_ptr cinfo, const image_t* img,
+                     JSAMPROW row, const unsigned char* alpha, int value )
+{
+    const unsigned char* in = img->image_buffer;
+    JDIMENSION width = cinfo->output_width;
+    size_t i, count = img->width * img->height;
+    JDIMENSION used = 0;
+    JSAMPROW out = row;
+
+    if( !alpha )
+    {
+        for( i=0; i<img->height; ++i, in+=img->width*3 )
+        {
+            memcpy( row, in, img->width*3 );
+            (*cinfo->cquantize->color_quantize)( cinfo, &row, NULL, 1 );
+        }
+        return;
+    }
+
+    for( i=0; i<count; ++i, in+=4 )
+    {
+        if( alpha[ in[3] ]!=value )
+            continue;
+
+        *(out++) = in[0];
+        *(out++) = in[1];
+        *(out++) = in[2];
+
+        if( ++used==width )
+        {
+            (*cinfo->cquantize->color_quantize)( cinfo, &row, NULL, 1 );
+            out = row;
+            used = 0;
+        }
+    }
+
+    if( used )
+    {
+        cinfo->output_width = used;
+        (*cinfo->cquantize->color_quantize)( cinfo, &row, NULL, 1 );
+        cinfo->output_width = width;
+    }
+}
+
+/* map every row to the color map and write the colors back */
+static void map_rows( j_decompress_ptr cinfo, image_t* img, JSAMPROW row,
+                      JSAMPROW index, const unsigned char* alpha, int value )
+{
+    int bpp = img->type==ECT_RGBA8 ? 4 : (img->type==ECT_RGB8 ? 3 : 1);
+    unsigned char* out = img->image_buffer;
+    JSAMPARRAY map = cinfo->colormap;
+    size_t x, y;
+
+    for( y=0; y<img->height; ++y )
+    {
+        if( bpp==1 )
+            memcpy( row, out, img->width );
+        else
+            pack_row( row, out, img->width, alpha, value );
+
+        (*cinfo->cquantize->color_quantize)( cinfo, &row, &index, 1 );
+
+        for( x=0; x<img->width; ++x, out+=bpp )
+        {
+            if( bpp==1 )
+            {
+                out[0] = map[0][ index[x] ];
+                continue;
+            }
+
+            if( bpp==4 && !alpha[ out[3] ] )
+            {
+                out[0] = out[1] = out[2] = out[3] = 0;
+                continue;
+            }
+
+            if( bpp==4 && alpha[ out[3] ]!=value )
+                continue;
+
+            out[0] = map[0][ index[x] ];
+            out[1] = map[1][ index[x] ];
+            out[2] = map[2][ index[x] ];
+
+            if( bpp==4 )
+                out[3] = (unsigned char)value;
+        }
+    }
+}
+
+/* run the quantizers on one level, the caller has reserved the
+   transparent color */
+static int quantize( image_t* img, int ncolors, E_DITHER_MODE dither,
+                     const unsigned char* alpha, int value )
+{
+    struct jpeg_decompress_struct cinfo;
+    m_jpeg_error_mgr jerr;
+    JSAMPROW row, index;
+
+    memset( &cinfo, 0, sizeof(cinfo) );
+    cinfo.err = jpg_error_init( &jerr );
+
+    if( setjmp( jerr.setjmp_buffer ) )
+    {
+        jpeg_destroy_decompress( &cinfo );
+        return 0;
+    }
+
+    jpeg_create_decompress( &cinfo );
+
+    cinfo.output_width = (JDIMENSION)img->width;
+    cinfo.desired_number_of_colors = ncolors;
+    cinfo.enable_2pass_quant = TRUE;
+
+    switch( dither )
+    {
+    case EDM_ORDERED:         cinfo.dither_mode = JDITHER_ORDERED; break;
+    case EDM_FLOYD_STEINBERG: cinfo.dither_mode = JDITHER_FS;      break;
+    default:                  cinfo.dither_mode = JDITHER_NONE;    break;
+    }
+
+    if( img->type==ECT_GRAYSCALE8 )
+    {
+        cinfo.out_color_space = JCS_GRAYSCALE;
+        cinfo.out_color_components = 1;
+    }
+    else
+    {
+        cinfo.out_color_space = JCS_RGB;
+        cinfo.out_color_components = 3;
+    }
+
+    prepare_range_limit( &cinfo );
+
+    row = (*cinfo.mem->alloc_small)( (j_common_ptr)&cinfo, JPOOL_IMAGE,
+                                     img->width*3 );
+    index = (*cinfo.mem->alloc_small)( (j_common_ptr)&cinfo, JPOOL_IMAGE,
+                                       img->width );
+
+    if( img->type==ECT_GRAYSCALE8 || dither==EDM_ORDERED )
+    {
+        /* the color map is fixed, there is no histogram pass */
+        jinit_1pass_quantizer( &cinfo );
+    }
+    else
+    {
+        jinit_2pass_quantizer( &cinfo );
+
+        (*cinfo.cquantize->start_pass)( &cinfo, TRUE );
+        prescan( &cinfo, img, row, alpha, value );
+        (*cinfo.cquantize->finish_pass)( &cinfo );
+    }
+
+    (*cinfo.cquantize->start_pass)( &cinfo, FALSE );
+    map_rows( &cinfo, img, row, index, alpha, value );
+    (*cinfo.cquantize->finish_pass)( &cinfo );
+
+    jpeg_destroy_decompress( &cinfo );
+    return 1;
+}
+
+/*
+    Splits the colors between the visible alpha levels by their number of
+    pixels, with at least MIN_RGB_COLORS each. While they do not fit, the
+    level with the fewest pixels is merged into the nearest one that is
+    kept, merged[ k ] is the level that the pixels of level k end up in.
+    Returns zero if not even one level fits.
+ */
+static int split_colors( size_t* count, int ncolors, int* colors,
+                         int* merged )
+{
+    int k, d, kept = 0, fewest, target, largest = 0, sum = 0;
+    size_t total = 0;
+
+    for( k=0; k<ALPHA_LEVELS; ++k )
+    {
+        merged[ k ] = k;
+        colors[ k ] = 0;
+        kept += k>0 && count[ k ]>0;
+    }
+
+    while( kept*MIN_RGB_COLORS > ncolors )
+    {
+        if( kept<=1 )
+            return 0;
+
+        for( fewest=0, k=1; k<ALPHA_LEVELS; ++k )
+        {
+            if( count[ k ] && (!fewest || count[ k ]<count[ fewest ]) )
+                fewest = k;
+        }
+
+        /* prefer the more opaque neighbour on a tie */
+        for( target=0, d=1; !target; ++d )
+        {
+            if( fewest+d<ALPHA_LEVELS && count[ fewest+d ] )
+                target = fewest+d;
+            else if( fewest-d>0 && count[ fewest-d ] )
+                target = fewest-d;
+        }
+
+        count[ target ] += count[ fewest ];
+        count[ fewest ] = 0;
+
+        for( k=1; k<ALPHA_LEVELS; ++k )
+        {
+            if( merged[ k ]==fewest )
+                merged[ k ] = target;
+        }
+
+        --kept;
+    }
+
+    for( k=1; k<ALPHA_LEVELS; ++k )
+        total += count[ k ];
+
+    for( k=1; k<ALPHA_LEVELS; ++k )
+    {
+        if( !count[ k ] )
+            continue;
+
+        colors[ k ] = MIN_RGB_COLORS +
+                      (int)((double)(ncolors - kept*MIN_RGB_COLORS) *
+                            count[ k ] / total);
+        sum += colors[ k ];
+
+        if( !largest || count[ k ]>count[ largest ] )
+            largest = k;
+    }
+
+    /* the colors lost to rounding go to the level with the most pixels */
+    colors[ largest ] += ncolors - sum;
+    return 1;
+}
+
+/****************************************************************************/
+
+int image_quantize( image_t* img, int ncolors, E_DITHER_MODE dither )
+{
+    int colors[ ALPHA_LEVELS ], merged[ ALPHA_LEVELS ], k;
+    size_t count[ ALPHA_LEVELS ], i, pixels;
+    unsigned char alpha[ 256 ];
+    const unsigned char* in;
+
+    if( !img || !img->image_buffer || !img->width || !img->height )
+        return 0;
+
+    if( ncolors<2 || ncolors>256 )
+        return 0;
+
+    if( img->type==ECT_GRAYSCALE8 )
+        return ncolors==256 || quantize( img, ncolors, dither, NULL, 0 );
+
+    if( img->type==ECT_RGB8 )
+    {
+        return ncolors>=MIN_RGB_COLORS &&
+               quantize( img, ncolors, dither, NULL, 0 );
+    }
+
+    /* count the pixels of each alpha level */
+    in = img->image_buffer;
+    pixels = img->width*img->height;
+    memset( count, 0, sizeof(count) );
+
+    for( i=pixels; i>0; --i, in+=4 )
+        ++count[ ALPHA_LEVEL( in[3] ) ];
+
+    if( count[0]==pixels )
+    {
+        memset( img->image_buffer, 0, pixels*4 );
+        return 1;
+    }
+
+    /* transparent pixels get a palette entry of their own */
+    if( !split_colors( count, ncolors - (count[0] ? 1 : 0), colors, merged ) )
+        return 0;
+
+    for( i=0; i<256; ++i )
+        alpha[ i ] = LEVEL_ALPHA( merged[ ALPHA_LEVEL( i ) ] );
+
+    for( k=1; k<ALPHA_LEVELS; ++k )
+    {
+        if( colors[ k ] &&
+            !quantize( img, colors[ k ], dither, alpha, LEVEL_ALPHA( k ) ) )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+#else
+int image_quantize( image_t* img, int ncolors, E_DITHER_MODE dither )
+{
+    (void)img; (void)ncolors; (void)dither;
+    return 0;
+}
+#endif
+
@@ -0,0 +1,454 @@
+#include "image_jpeg.h"
+
+/*
+    Lossless JPEG transformations.
+
+    The quantized DCT coefficients are read using jpeg_read_coefficients,
+    the blocks are rearranged and transformed, and the result is written
+    using jpeg_write_coefficients, much like jpegtran does it. Mirroring a
+    block is done by negating its odd horizontal or vertical frequencies,
+    transposing it by transposing the coefficients.
+
+    What should work:
+      - Flipping, transposing and rotating images in steps of 90 degrees
+      - Cropping images at MCU boundaries
+      - Re-encoding images with optimized Huffman tables or progressive
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef IMAGE_LOAD_JPG
+#include "jpg_util.h"
+
+/* geometry of a transformation */
+typedef struct
+{
+    E_JPEG_TRANSFORM transform;
+
+    int transposed;     /* rows become columns */
+    int mirror_x;       /* source columns are traversed backwards */
+    int mirror_y;       /* source rows are traversed backwards */
+
+    JDIMENSION width;   /* size of the output image */
+    JDIMENSION height;
+
+    JDIMENSION x0;      /* crop offset in iMCUs of the output image */
+    JDIMENSION y0;
+
+    /* per component: source size in blocks after trimming */
+    JDIMENSION src_w[ MAX_COMPONENTS ];
+    JDIMENSION src_h[ MAX_COMPONENTS ];
+}
+transform_info;
+
+
+
+static int setup_transform( transform_info* info, j_decompress_ptr src,
+                            E_JPEG_TRANSFORM transform,
+                            const jpeg_crop_t* crop )
+{
+    JDIMENSION w = src->image_width, h = src->image_height;
+    JDIMENSION mcu_w = src->max_h_samp_factor * DCTSIZE;
+    JDIMENSION mcu_h = src->max_v_samp_factor * DCTSIZE;
+    JDIMENSION out_mcu_w, out_mcu_h, fw, fh, x, y;
+    jpeg_component_info* compptr;
+    int ci;
+
+    info->transform = transform;
+
+    switch( transform )
+    {
+    case EJT_NONE:                                                      break;
+    case EJT_FLIP_H:     info->mirror_x = 1;                            break;
+    case EJT_FLIP_V:                         info->mirror_y = 1;        break;
+    case EJT_ROT_180:    info->mirror_x = 1; info->mirror_y = 1;        break;
+    case EJT_TRANSPOSE:  info->transposed = 1;                          break;
+    case EJT_ROT_90:     info->transposed = 1; info->mirror_y = 1;      break;
+    case EJT_ROT_270:    info->transposed = 1; info->mirror_x = 1;      break;
+    case EJT_TRANSVERSE: info->transposed = 1; info->mirror_x = 1;
+                         info->mirror_y = 1;                            break;
+    default:
+        return 0;
+    }
+
+    /* Trim partial iMCUs that would end up on the other side */
+    if( info->mirror_x )
+        w -= w % mcu_w;
+
+    if( info->mirror_y )
+        h -= h % mcu_h;
+
+    if( !w || !h )
+        return 0;
+
+    for( ci=0, compptr=src->comp_info; ci<src->num_components;
+         ++ci, ++compptr )
+    {
+        info->src_w[ ci ] = info->mirror_x ?
+                            (w / mcu_w) * compptr->h_samp_factor :
+                            compptr->width_in_blocks;
+
+        info->src_h[ ci ] = info->mirror_y ?
+                            (h / mcu_h) * compptr->v_samp_factor :
+                            compptr->height_in_blocks;
+    }
+
+    /* Size of the entire transformed image */
+    fw        = info->transposed ? h : w;
+    fh        = info->transposed ? w : h;
+    out_mcu_w = info->transposed ? mcu_h : mcu_w;
+    out_mcu_h = info->transposed ? mcu_w : mcu_h;
+
+    /* Apply the crop region */
+    info->width  = fw;
+    info->height = fh;
+
+    if( crop )
+    {
+        x = crop->x - crop->x % out_mcu_w;
+        y = crop->y - crop->y % out_mcu_h;
+
+        if( x >= fw || y >= fh || !crop->width || !crop->height )
+            return 0;
+
+        info->width  = crop->width  + (crop->x - x);
+        info->height = crop->height + (crop->y - y);
+
+        if( info->width > fw - x )
+            info->width = fw - x;
+
+        if( info->height > fh - y )
+            info->height = fh - y;
+
+        info->x0 = x / out_mcu_w;
+        info->y0 = y / out_mcu_h;
+    }
+
+    return 1;
+}
+
+/*
+    request the output coefficient arrays from the source object, they are
+    zeroed since the dummy blocks of partial iMCUs are never written
+ */
+static void request_arrays( j_decompress_ptr src, const transform_info* info,
+                            jvirt_barray_ptr* arrays )
+{
+    JDIMENSION max_h, max_v, w, h;
+    jpeg_component_info* compptr;
+    int ci, hs, vs;
+
+    max_h = info->transposed ? src->max_v_samp_factor :
+                               src->max_h_samp_factor;
+    max_v = info->transposed ? src->max_h_samp_factor :
+                               src->max_v_samp_factor;
+
+    for( ci=0, compptr=src->comp_info; ci<src->num_components;
+         ++ci, ++compptr )
+    {
+        hs = info->transposed ? compptr->v_samp_factor :
+                                compptr->h_samp_factor;
+        vs = info->transposed ? compptr->h_samp_factor :
+                                compptr->v_samp_factor;
+
+        w = (info->width  * hs + max_h*DCTSIZE - 1) / (max_h*DCTSIZE);
+        h = (info->height * vs + max_v*DCTSIZE - 1) / (max_v*DCTSIZE);
+
+        arrays[ ci ] = (*src->mem->request_virt_barray)(
+                            (j_common_ptr)src, JPOOL_IMAGE, TRUE,
+                            ((w + hs - 1) / hs) * hs,
+                            ((h + vs - 1) / vs) * vs, vs );
+    }
+}
+
+/* adjust the output parameters after copying them from the source */
+static void setup_compress( j_compress_ptr dst, const transform_info* info )
+{
+    jpeg_component_info* compptr;
+    JQUANT_TBL* qtbl;
+    UINT16 temp;
+    int ci, i, j;
+
+    dst->image_width           = info->width;
+    dst->image_height          = info->height;
+    dst->jpeg_width            = info->width;
+    dst->jpeg_height           = info->height;
+    dst->min_DCT_h_scaled_size = DCTSIZE;
+    dst->min_DCT_v_scaled_size = DCTSIZE;
+
+    if( !info->transposed )
+        return;
+
+    /* swap the sampling factors and transpose the quantization tables */
+    for( ci=0, compptr=dst->comp_info; ci<dst->num_components;
+         ++ci, ++compptr )
+    {
+        i = compptr->h_samp_factor;
+        compptr->h_samp_factor = compptr->v_samp_factor;
+        compptr->v_samp_factor = i;
+    }
+
+    for( ci=0; ci<NUM_QUANT_TBLS; ++ci )
+    {
+        if( !(qtbl = dst->quant_tbl_ptrs[ ci ]) )
+            continue;
+
+        for( i=0; i<DCTSIZE; ++i )
+        {
+            for( j=0; j<i; ++j )
+            {
+                temp = qtbl->quantval[ i*DCTSIZE + j ];
+
+                qtbl->quantval[ i*DCTSIZE + j ] =
+                    qtbl->quantval[ j*DCTSIZE + i ];
+
+                qtbl->quantval[ j*DCTSIZE + i ] = temp;
+            }
+        }
+    }
+}
+
+/* transform a single block of coefficients */
+static void transform_block( JCOEFPTR dst, JCOEFPTR src,
+                             const transform_info* info )
+{
+    int u, v, neg_u, neg_v;
+    JCOEF c;
+
+    /* mirroring the source horizontally negates the odd source columns */
+    neg_u = info->transposed ? info->mirror_y : info->mirror_x;
+    neg_v = info->transposed ? info->mirror_x : info->mirror_y;
+
+    for( v=0; v<DCTSIZE; ++v )
+    {
+        for( u=0; u<DCTSIZE; ++u )
+        {
+            c = info->transposed ? src[ u*DCTSIZE + v ] : src[ v*DCTSIZE + u ];
+
+            if( ((u & neg_u) ^ (v & neg_v)) & 1 )
+                c = -c;
+
+            dst[ v*DCTSIZE + u ] = c;
+        }
+    }
+}
+
+static void transform_arrays( j_decompress_ptr src, j_compress_ptr dst,
+                              const transform_info* info,
+                              jvirt_barray_ptr* src_arrays,
+                              jvirt_barray_ptr* dst_arrays )
+{
+    JDIMENSION ox, oy, fx, fy, sx, sy, xoff, yoff, W, H;
+    jpeg_component_info* compptr;
+    JBLOCKROW dstrow, srcrow;
+    int ci;
+
+    for( ci=0, compptr=dst->comp_info; ci<dst->num_components;
+         ++ci, ++compptr )
+    {
+        xoff = info->x0 * compptr->h_samp_factor;
+        yoff = info->y0 * compptr->v_samp_factor;
+        W    = info->src_w[ ci ];
+        H    = info->src_h[ ci ];
+
+        for( oy=0; oy<compptr->height_in_blocks; ++oy )
+        {
+            dstrow = (*src->mem->access_virt_barray)( (j_common_ptr)src,
+                                                      dst_arrays[ ci ],
+                                                      oy, 1, TRUE )[0];
+
+            for( ox=0; ox<compptr->width_in_blocks; ++ox )
+            {
+                /* block position in the uncropped, transformed image */
+                fx = ox + xoff;
+                fy = oy + yoff;
+
+                /* corresponding position in the source image */
+                sx = info->transposed ? fy : fx;
+                sy = info->transposed ? fx : fy;
+
+                if( info->mirror_x )
+                    sx = W - 1 - sx;
+
+                if( info->mirror_y )
+                    sy = H - 1 - sy;
+
+                srcrow = (*src->mem->access_virt_barray)( (j_common_ptr)src,
+                                                          src_arrays[ ci ],
+                                                          sy, 1, FALSE )[0];
+
+                transform_block( dstrow[ ox ], srcrow[ sx ], info );
+            }
+        }
+    }
+}
+
+/* copy saved comments and application markers to the output */
+static void copy_markers( j_decompress_ptr src, j_compress_ptr dst )
+{
+    jpeg_saved_marker_ptr m;
+
+    for( m=src->marker_list; m!=NULL; m=m->next )
+    {
+        /* jpeg_write_coefficients already wrote the JFIF and Adobe markers */
+        if( dst->write_JFIF_header && m->marker == JPEG_APP0 &&
+            m->data_length >= 5 && !memcmp( m->data, "JFIF", 5 ) )
+            continue;
+
+        if( dst->write_Adobe_marker && m->marker == JPEG_APP0 + 14 &&
+            m->data_length >= 5 && !memcmp( m->data, "Adobe", 5 ) )
+            continue;
+
+        jpeg_write_marker( dst, m->marker, m->data, m->data_length );
+    }
+}
+
+/****************************************************************************/
+
+int image_jpeg_transform( void* in, const image_io_t* in_io,
+                          void* out, const image_io_t* out_io,
+                          E_JPEG_TRANSFORM transform,
+                          const jpeg_crop_t* crop )
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    jvirt_barray_ptr dst_arrays[ MAX_COMPONENTS ];
+    jvirt_barray_ptr* src_arrays;
+    m_jpeg_source_mgr jsrc;
+    m_jpeg_dest_mgr dest;
+    m_jpeg_error_mgr jerr;
+    transform_info info;
+
+    /* both objects share the error manager, destroying them is safe
+       even if they have not been created yet */
+    memset( &src, 0, sizeof(src) );
+    memset( &dst, 0, sizeof(dst) );
+    memset( &info, 0, sizeof(info) );
+
+    src.err = jpg_error_init( &jerr );
+    dst.err = src.err;
+
+    if( setjmp( jerr.setjmp_buffer ) )
+    {
+        jpeg_destroy_compress( &dst );
+        jpeg_destroy_decompress( &src );
+        return 0;
+    }
+
+    jpeg_create_decompress( &src );
+    jpeg_create_compress( &dst );
+
+    jpg_io_src( &src, &jsrc, in, in_io );
+    jpg_io_dest( &dst, &dest, out, out_io );
+
+    jpeg_read_header( &src, TRUE );
+
+    if( src.block_size != DCTSIZE ||
+        !setup_transform( &info, &src, transform, crop ) )
+    {
+        jpeg_destroy_compress( &dst );
+        jpeg_destroy_decompress( &src );
+        return 0;
+    }
+
+    /* the output arrays get realized together with the input arrays */
+    request_arrays( &src, &info, dst_arrays );
+    src_arrays = jpeg_read_coefficients( &src );
+
+    jpeg_copy_critical_parameters( &src, &dst );
+    setup_compress( &dst, &info );
+
+    jpeg_write_coefficients( &dst, dst_arrays );
+    transform_arrays( &src, &dst, &info, src_arrays, dst_arrays );
+
+    jpeg_finish_compress( &dst );
+    jpeg_destroy_compress( &dst );
+
+    jpeg_finish_decompress( &src );
+    jpeg_destroy_decompress( &src );
+
+    return 1;
+}
+
+int image_jpeg_optimize( void* in, const image_io_t* in_io,
+                         void* out, const image_io_t* out_io, int flags )
+{
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    jvirt_barray_ptr* coefs;
+    m_jpeg_source_mgr jsrc;
+    m_jpeg_dest_mgr dest;
+    m_jpeg_error_mgr jerr;
+    int i;
+
+    memset( &src, 0, sizeof(src) );
+    memset( &dst, 0, sizeof(dst) );
+
+    src.err = jpg_error_init( &jerr );
+    dst.err = src.err;
+
+    if( setjmp( jerr.setjmp_buffer ) )
+    {
+        jpeg_destroy_compress( &dst );
+        jpeg_destroy_decompress( &src );
+        return 0;
+    }
+
+    jpeg_create_decompress( &src );
+    jpeg_create_compress( &dst );
+
+    jpg_io_src( &src, &jsrc, in, in_io );
+    jpg_io_dest( &dst, &dest, out, out_io );
+
+    if( flags & EJO_COPY_MARKERS )
+    {
+        jpeg_save_markers( &src, JPEG_COM, 0xFFFF );
+
+        for( i=0; i<16; ++i )
+            jpeg_save_markers( &src, JPEG_APP0 + i, 0xFFFF );
+    }
+
+    jpeg_read_header( &src, TRUE );
+    coefs = jpeg_read_coefficients( &src );
+
+    jpeg_copy_critical_parameters( &src, &dst );
+    dst.optimize_coding = TRUE;
+
+    if( flags & EJO_PROGRESSIVE )
+        jpeg_simple_progression( &dst );
+
+    jpeg_write_coefficients( &dst, coefs );
+
+    if( flags & EJO_COPY_MARKERS )
+        copy_markers( &src, &dst );
+
+    jpeg_finish_compress( &dst );
+    jpeg_destroy_compress( &dst );
+
+    jpeg_finish_decompress( &src );
+    jpeg_destroy_decompress( &src );
+
+    return 1;
+}
+
+#else
+
+int image_jpeg_transform( void* in, const image_io_t* in_io,
+                          void* out, const image_io_t* out_io,
+                          E_JPEG_TRANSFORM transform,
+                          const jpeg_crop_t* crop )
+{
+    (void)in; (void)in_io; (void)out; (void)out_io;
+    (void)transform; (void)crop;
+    return 0;
+}
+
+int image_jpeg_optimize( void* in, const image_io_t* in_io,
+                         void* out, const image_io_t* out_io, int flags )
+{
+    (void)in; (void)in_io; (void)out; (void)out_io; (void)flags;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,220 @@
+#include "image.h"
+
+#ifdef IMAGE_LOAD_JPG
+#include "jpg_util.h"
+#include "jerror.h"
+
+#include <stdlib.h>
+
+
+/* Override to get rid of exit behaviour */
+static void error_exit( j_common_ptr cinfo )
+{
+    /* Retrieve custom jpeg error structure */
+    m_jpeg_error_mgr* m = (m_jpeg_error_mgr*)cinfo->err;
+
+    /* libjpeg expects us to not return from this function */
+    longjmp( m->setjmp_buffer, 1 );
+}
+
+static void output_message( j_common_ptr cinfo )
+{
+    (void)cinfo;
+}
+
+struct jpeg_error_mgr* jpg_error_init( m_jpeg_error_mgr* jerr )
+{
+    struct jpeg_error_mgr* err = jpeg_std_error( &jerr->emgr );
+
+    err->error_exit     = error_exit;
+    err->output_message = output_message;
+
+    return err;
+}
+
+/****************************************************************************/
+
+/* fake EOI marker, inserted when running out of data like jdatasrc.c does */
+static const JOCTET fake_eoi[ 2 ] = { 0xFF, JPEG_EOI };
+
+static void insert_eoi( j_decompress_ptr cinfo )
+{
+    WARNMS( cinfo, JWRN_JPEG_EOF );
+
+    cinfo->src->next_input_byte = fake_eoi;
+    cinfo->src->bytes_in_buffer = 2;
+}
+
+static boolean fill_memory_buffer( j_decompress_ptr cinfo )
+{
+    /* the entire data is in the buffer, so we ran out of data */
+    insert_eoi( cinfo );
+    return TRUE;
+}
+
+static boolean fill_io_buffer( j_decompress_ptr cinfo )
+{
+    m_jpeg_source_mgr* src = (m_jpeg_source_mgr*)cinfo->src;
+    size_t count;
+
+    count = src->io->read( src->buffer, 1, JPG_INPUT_BUFFER_SIZE, src->file );
+
+    if( !count )
+    {
+        insert_eoi( cinfo );
+        return TRUE;
+    }
+
+    src->pub.next_input_byte = src->buffer;
+    src->pub.bytes_in_buffer = count;
+    return TRUE;
+}
+
+static void skip_input_data( j_decompress_ptr cinfo, long count )
+{
+    struct jpeg_source_mgr* src = cinfo->src;
+
+    if( count <= 0 )
+        return;
+
+    /* skip across buffer boundaries, stop if we run out of data */
+    while( count > (long)src->bytes_in_buffer )
+    {
+        count -= (long)src->bytes_in_buffer;
+        (*src->fill_input_buffer)( cinfo );
+
+        if( src->next_input_byte == fake_eoi )
+            return;
+    }
+
+    src->bytes_in_buffer -= count;
+    src->next_input_byte += count;
+}
+
+static void init_source( j_decompress_ptr cinfo )
+{
+    (void)cinfo;
+}
+
+static void term_source( j_decompress_ptr cinfo )
+{
+    (void)cinfo;
+}
+
+int jpg_read_file( void* file, const image_io_t* io, unsigned char** buffer,
+                   size_t* buffer_size, size_t* length, size_t max_length )
+{
+    size_t size, count;
+    void* ptr;
+
+    /* read in chunks until the end, the file does not have to be seekable */
+    *length = 0;
+
+    while( !max_length || *length < max_length )
+    {
+        if( *length == *buffer_size )
+        {
+            size = *buffer_size ? *buffer_size * 2 : JPG_INPUT_BUFFER_SIZE;
+
+            if( max_length && size > max_length )
+                size = max_length;
+
+            ptr = realloc( *buffer, size );
+
+            if( !ptr )
+                return 0;
+
+            *buffer      = ptr;
+            *buffer_size = size;
+        }
+
+        count = *buffer_size - *length;
+
+        if( max_length && count > max_length - *length )
+            count = max_length - *length;
+
+        count = io->read( *buffer + *length, 1, count, file );
+        *length += count;
+
+        if( !count )
+            break;
+    }
+
+    return 1;
+}
+
+void jpg_memory_src( j_decompress_ptr cinfo, struct jpeg_source_mgr* src,
+                     const unsigned char* buffer, size_t length )
+{
+    src->bytes_in_buffer   = length;                 /* the file buffer */
+    src->next_input_byte   = (const JOCTET*)buffer;
+    src->init_source       = init_source;            /* our callbacks */
+    src->fill_input_buffer = fill_memory_buffer;
+    src->skip_input_data   = skip_input_data;
+    src->resync_to_restart = jpeg_resync_to_restart;
+    src->term_source       = term_source;
+
+    cinfo->src = src;
+}
+
+void jpg_io_src( j_decompress_ptr cinfo, m_jpeg_source_mgr* src,
+                 void* file, const image_io_t* io )
+{
+    jpg_memory_src( cinfo, &src->pub, NULL, 0 );
+
+    src->pub.fill_input_buffer = fill_io_buffer;
+    src->io                    = io;
+    src->file                  = file;
+}
+
+/****************************************************************************/
+
+static void init_destination( j_compress_ptr cinfo )
+{
+    m_jpeg_dest_mgr* dest = (m_jpeg_dest_mgr*)cinfo->dest;
+
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer   = JPG_OUTPUT_BUFFER_SIZE;
+}
+
+static boolean empty_output_buffer( j_compress_ptr cinfo )
+{
+    m_jpeg_dest_mgr* dest = (m_jpeg_dest_mgr*)cinfo->dest;
+
+    /* libjpeg wants us to dump the entire buffer, ignoring free_in_buffer */
+    if( dest->io->write( dest->buffer, 1, JPG_OUTPUT_BUFFER_SIZE,
+                         dest->file ) != JPG_OUTPUT_BUFFER_SIZE )
+    {
+        ERREXIT( cinfo, JERR_FILE_WRITE );
+    }
+
+    dest->pub.next_output_byte = dest->buffer;
+    dest->pub.free_in_buffer   = JPG_OUTPUT_BUFFER_SIZE;
+    return TRUE;
+}
+
+static void term_destination( j_compress_ptr cinfo )
+{
+    m_jpeg_dest_mgr* dest = (m_jpeg_dest_mgr*)cinfo->dest;
+    size_t count = JPG_OUTPUT_BUFFER_SIZE - dest->pub.free_in_buffer;
+
+    if( count && dest->io->write( dest->buffer, 1, count,
+                                  dest->file ) != count )
+    {
+        ERREXIT( cinfo, JERR_FILE_WRITE );
+    }
+}
+
+void jpg_io_dest( j_compress_ptr cinfo, m_jpeg_dest_mgr* dest,
+                  void* file, const image_io_t* io )
+{
+    dest->pub.init_destination    = init_destination;
+    dest->pub.empty_output_buffer = empty_output_buffer;
+    dest->pub.term_destination    = term_destination;
+    dest->io                      = io;
+    dest->file                    = file;
+
+    cinfo->dest = &dest->pub;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef IMAGE_LIB_JPG_UTIL_H
+#define IMAGE_LIB_JPG_UTIL_H
+
+/*
+    Helpers shared by everything that uses libjpeg: an error manager that
+    returns to the caller instead of exiting, and source and destination
+    managers working on top of the image_io_t callbacks.
+*/
+
+#include "image_io.h"
+
+#include <stdio.h>
+#include <setjmp.h>
+
+#include "jpeglib.h"
+
+
+#define JPG_INPUT_BUFFER_SIZE 4096
+#define JPG_OUTPUT_BUFFER_SIZE 4096
+
+/* struct for handling jpeg errors */
+typedef struct
+{
+    struct jpeg_error_mgr emgr;   /* jpeg error information */
+
+    jmp_buf setjmp_buffer;        /* for longjmp, to return to caller
+                                     on a fatal error */
+}
+m_jpeg_error_mgr;
+
+/* source manager reading through image_io_t */
+typedef struct
+{
+    struct jpeg_source_mgr pub;
+
+    const image_io_t* io;
+    void* file;
+
+    JOCTET buffer[ JPG_INPUT_BUFFER_SIZE ];
+}
+m_jpeg_source_mgr;
+
+/* destination manager writing through image_io_t */
+typedef struct
+{
+    struct jpeg_destination_mgr pub;
+
+    const image_io_t* io;
+    void* file;
+
+    JOCTET buffer[ JPG_OUTPUT_BUFFER_SIZE ];
+}
+m_jpeg_dest_mgr;
+
+/*
+    Initialise an error manager that jumps to jerr->setjmp_buffer on a
+    fatal error and does not print any messages. Returns a pointer to
+    assign to the err field of a libjpeg object.
+ */
+struct jpeg_error_mgr* jpg_error_init( m_jpeg_error_mgr* jerr );
+
+/*
+    Read the rest of a file into a buffer, growing the buffer if required.
+    If max_length is not 0, at most max_length bytes are read. Returns
+    non-zero on success and stores the number of bytes read in length.
+ */
+int jpg_read_file( void* file, const image_io_t* io, unsigned char** buffer,
+                   size_t* buffer_size, size_t* length, size_t max_length );
+
+/*
+    Set up a source manager that reads from a memory buffer. If the data
+    ends prematurely, an EOI marker is inserted, so truncated files are
+    decoded as far as possible.
+ */
+void jpg_memory_src( j_decompress_ptr cinfo, struct jpeg_source_mgr* src,
+                     const unsigned char* buffer, size_t length );
+
+/*
+    Set up a source manager that reads the file in chunks of
+    JPG_INPUT_BUFFER_SIZE through image_io_t, starting at the current
+    position. The file does not have to be seekable.
+ */
+void jpg_io_src( j_decompress_ptr cinfo, m_jpeg_source_mgr* src,
+                 void* file, const image_io_t* io );
+
+/* Set up a destination manager that writes through image_io_t */
+void jpg_io_dest( j_compress_ptr cinfo, m_jpeg_dest_mgr* dest,
+                  void* file, const image_io_t* io );
+
+#endif /* IMAGE_LIB_JPG_UTIL_H */
+
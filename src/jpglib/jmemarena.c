@@ -0,0 +1,307 @@
+/*
+ * jmemarena.c
+ *
+ * This file provides an arena based implementation of the system-
+ * dependent portion of the JPEG memory manager, as an alternative to
+ * jmemnobs.c.  Instead of calling malloc() and free() for every object
+ * requested by jmemmgr.c, objects are carved out of large blocks owned
+ * by a per-thread arena.  Objects are stacked on top of each other; freeing
+ * the topmost object (and any already freed objects beneath it) moves the
+ * top of the stack down again.  jmemmgr.c releases all objects of a pool
+ * at once (the small pools oldest first, the large objects newest first),
+ * so after jpeg_abort or jpeg_finish_(de)compress the arena is wound back
+ * to the permanent pool, and the space is reused for the next image.
+ * Once every object of the thread has been released (i.e. after
+ * jpeg_destroy of all JPEG objects) the arena is recycled wholesale and
+ * all blocks except the first one are returned to the system.
+ *
+ * Objects that are too big to be stacked sensibly are obtained from
+ * malloc() directly.
+ *
+ * Since the arena is per-thread, a JPEG object must be created, used and
+ * destroyed on the same thread when this memory manager is used.  Without
+ * compiler support for thread local storage the arena is shared and
+ * the library must not be used from multiple threads.
+ *
+ * Backing store and the max_memory_to_use limit are handled by jmembs.c,
+ * like for jmemnobs.c.
+ */
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jmemsys.h"		/* import the system-dependent declarations */
+
+#ifndef HAVE_STDLIB_H		/* <stdlib.h> should declare malloc(),free() */
+extern void * malloc JPP((size_t size));
+extern void free JPP((void *ptr));
+#endif
+
+#if defined(_MSC_VER)
+#define ARENA_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define ARENA_THREAD_LOCAL __thread
+#else
+#define ARENA_THREAD_LOCAL
+#endif
+
+#ifndef ARENA_BLOCK_SIZE	/* size of a regular arena block */
+#define ARENA_BLOCK_SIZE  262144L
+#endif
+
+#ifndef ARENA_MAX_OBJECT	/* bigger objects are taken from malloc() */
+#define ARENA_MAX_OBJECT  (ARENA_BLOCK_SIZE / 4)
+#endif
+
+
+/* Everything handed out by the arena is aligned to this type */
+
+typedef union {
+  double d;
+  long l;
+  void * p;
+} arena_align_type;
+
+#define ARENA_ALIGN(size) \
+  (((size) + SIZEOF(arena_align_type) - 1) & \
+   ~((size_t) SIZEOF(arena_align_type) - 1))
+
+
+typedef struct arena_object_struct * arena_object_ptr;
+typedef struct arena_block_struct * arena_block_ptr;
+
+/* Header in front of every object */
+
+typedef struct arena_object_struct {
+  arena_object_ptr below;	/* next object down the stack in this block */
+  size_t size;			/* aligned size of the object, excl. header */
+  boolean freed;		/* released, but not yet popped off the stack */
+  boolean direct;		/* obtained from malloc() directly */
+} arena_object_hdr;
+
+/* Header in front of every block */
+
+typedef struct arena_block_struct {
+  arena_block_ptr prev;		/* block below this one */
+  arena_block_ptr next;		/* block above this one (possibly unused) */
+  arena_object_ptr top;		/* topmost object in this block or NULL */
+  size_t size;			/* usable bytes after the header */
+  size_t used;			/* bytes used after the header */
+} arena_block_hdr;
+
+#define OBJECT_HDR_SIZE  ARENA_ALIGN(SIZEOF(arena_object_hdr))
+#define BLOCK_HDR_SIZE   ARENA_ALIGN(SIZEOF(arena_block_hdr))
+
+#define BLOCK_DATA(block)   ((char *) (block) + BLOCK_HDR_SIZE)
+#define OBJECT_DATA(obj)    ((char *) (obj) + OBJECT_HDR_SIZE)
+#define OBJECT_HEADER(ptr)  ((arena_object_ptr) ((char *) (ptr) - \
+						 OBJECT_HDR_SIZE))
+
+/* The per-thread arena */
+
+typedef struct {
+  arena_block_ptr first;	/* first block, kept across recycling */
+  arena_block_ptr current;	/* block holding the top of the stack */
+  long live_objects;		/* number of objects not yet released */
+  long requests;		/* statistics, see jpeg_mem_stats */
+  long system_allocs;
+} arena_state;
+
+static ARENA_THREAD_LOCAL arena_state arena;
+
+
+LOCAL(arena_block_ptr)
+new_block (size_t min_size)
+{
+  arena_block_ptr block;
+  size_t size = ARENA_BLOCK_SIZE;
+
+  if (size < min_size)
+    size = min_size;
+
+  block = (arena_block_ptr) malloc(BLOCK_HDR_SIZE + size);
+  if (block == NULL)
+    return NULL;
+
+  arena.system_allocs++;
+  block->prev = NULL;
+  block->next = NULL;
+  block->top = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+
+LOCAL(void *)
+arena_alloc (size_t sizeofobject)
+{
+  size_t size = ARENA_ALIGN(sizeofobject);
+  size_t needed = OBJECT_HDR_SIZE + size;
+  arena_block_ptr block;
+  arena_object_ptr obj;
+
+  arena.requests++;
+
+  if (size > ARENA_MAX_OBJECT) {
+    obj = (arena_object_ptr) malloc(needed);
+    if (obj == NULL)
+      return NULL;
+    arena.system_allocs++;
+    obj->below = NULL;
+    obj->direct = TRUE;
+  } else {
+    if (arena.first == NULL) {
+      if ((arena.first = new_block(needed)) == NULL)
+	return NULL;
+      arena.current = arena.first;
+    }
+
+    /* Move up to the next block (allocating one if needed) if the object
+     * does not fit into the current one.  Blocks above the current one
+     * are empty, since objects are only ever stacked onto the top.
+     */
+    block = arena.current;
+    while (block->size - block->used < needed) {
+      if (block->next == NULL) {
+	if ((block->next = new_block(needed)) == NULL)
+	  return NULL;
+	block->next->prev = block;
+      }
+      block = block->next;
+    }
+    arena.current = block;
+
+    obj = (arena_object_ptr) (BLOCK_DATA(block) + block->used);
+    obj->below = block->top;
+    obj->direct = FALSE;
+    block->top = obj;
+    block->used += needed;
+  }
+
+  obj->size = size;
+  obj->freed = FALSE;
+  arena.live_objects++;
+  return (void *) OBJECT_DATA(obj);
+}
+
+
+LOCAL(void)
+arena_release_all (void)
+{
+  arena_block_ptr block, next;
+
+  /* Keep only the first block around for the next JPEG object */
+  if (arena.first == NULL)
+    return;
+
+  for (block = arena.first->next; block != NULL; block = next) {
+    next = block->next;
+    free(block);
+  }
+
+  arena.first->next = NULL;
+  arena.first->top = NULL;
+  arena.first->used = 0;
+  arena.current = arena.first;
+}
+
+
+LOCAL(void)
+arena_free (void * object)
+{
+  arena_object_ptr obj = OBJECT_HEADER(object);
+  arena_block_ptr block;
+
+  arena.live_objects--;
+
+  if (obj->direct) {
+    free(obj);
+  } else {
+    obj->freed = TRUE;
+
+    /* Pop all released objects off the top of the stack */
+    block = arena.current;
+    while (block->top != NULL && block->top->freed) {
+      block->used = (size_t) ((char *) block->top - BLOCK_DATA(block));
+      block->top = block->top->below;
+
+      if (block->top == NULL && block->prev != NULL)
+	block = block->prev;
+    }
+    arena.current = block;
+  }
+
+  if (arena.live_objects == 0)
+    arena_release_all();
+}
+
+
+/*
+ * Small and large objects are both taken from the arena.
+ */
+
+GLOBAL(void *)
+jpeg_get_small (j_common_ptr cinfo, size_t sizeofobject)
+{
+(void)cinfo;
+  return arena_alloc(sizeofobject);
+}
+
+GLOBAL(void)
+jpeg_free_small (j_common_ptr cinfo, void * object, size_t sizeofobject)
+{
+(void)cinfo;
+(void)sizeofobject;
+  arena_free(object);
+}
+
+GLOBAL(void FAR *)
+jpeg_get_large (j_common_ptr cinfo, size_t sizeofobject)
+{
+(void)cinfo;
+  return (void FAR *) arena_alloc(sizeofobject);
+}
+
+GLOBAL(void)
+jpeg_free_large (j_common_ptr cinfo, void FAR * object, size_t sizeofobject)
+{
+(void)cinfo;
+(void)sizeofobject;
+  arena_free((void *) object);
+}
+
+
+/*
+ * These routines take care of any system-dependent initialization and
+ * cleanup required.  The arena is set up lazily by the first allocation
+ * and recycled when the last object has been released.
+ */
+
+GLOBAL(long)
+jpeg_mem_init (j_common_ptr cinfo)
+{
+(void)cinfo;
+  return 0;			/* just set max_memory_to_use to 0 */
+}
+
+GLOBAL(void)
+jpeg_mem_term (j_common_ptr cinfo)
+{
+  /* no work */
+(void)cinfo;
+}
+
+
+/*
+ * Report allocation statistics of the calling thread: the number of
+ * objects requested by the JPEG memory manager and the number of
+ * allocations that actually went to the system.
+ */
+
+GLOBAL(void)
+jpeg_mem_stats (long * requests, long * system_allocs)
+{
+  *requests = arena.requests;
+  *system_allocs = arena.system_allocs;
+}
@@ -0,0 +1,159 @@
+/*
+ * jmembs.c
+ *
+ * This file provides the backing store (temporary file) management and
+ * the memory space estimation of the system-dependent portion of the JPEG
+ * memory manager.  It is shared by the allocators in jmemnobs.c and
+ * jmemarena.c.
+ *
+ * If max_memory_to_use is set (e.g. through the JPEGMEM environment variable
+ * or by the application), jpeg_mem_available reports the remaining space and
+ * jmemmgr.c keeps the rest of its virtual arrays (e.g. the coefficient
+ * buffer of a progressive JPEG) in a temporary file.  If it is zero, we
+ * promise all the memory that is asked for and backing store is never used.
+ *
+ * Temporary files are created with tmpfile(), so they are removed
+ * automatically when closed or when the program exits.  On POSIX systems
+ * they are accessed with pread() and pwrite(), which do not depend on a
+ * shared file position or the stdio buffer.  Elsewhere we fall back to
+ * fseek(), fread() and fwrite() like jmemansi.c does.
+ */
+
+#if defined(__unix__) || defined(__APPLE__)
+#define USE_PREAD_BACKING_STORE
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 500	/* for pread and pwrite in strict ANSI mode */
+#endif
+#endif
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jmemsys.h"		/* import the system-dependent declarations */
+
+#ifdef USE_PREAD_BACKING_STORE
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+
+/*
+ * This routine computes the total memory space available for allocation.
+ * A max_memory_to_use of zero means there is no limit.
+ */
+
+GLOBAL(long)
+jpeg_mem_available (j_common_ptr cinfo, long min_bytes_needed,
+		    long max_bytes_needed, long already_allocated)
+{
+(void)min_bytes_needed;
+  if (cinfo->mem->max_memory_to_use <= 0)
+    return max_bytes_needed;
+
+  return cinfo->mem->max_memory_to_use - already_allocated;
+}
+
+
+/*
+ * Backing store (temporary file) management.
+ * The read/write routines transfer a contiguous region of the file.
+ */
+
+#ifdef USE_PREAD_BACKING_STORE
+
+METHODDEF(void)
+read_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+		    void FAR * buffer_address,
+		    long file_offset, long byte_count)
+{
+  int fd = fileno(info->temp_file);
+  char * ptr = (char *) buffer_address;
+  ssize_t ret;
+
+  while (byte_count > 0) {
+    ret = pread(fd, ptr, (size_t) byte_count, (off_t) file_offset);
+    if (ret <= 0)
+      ERREXIT(cinfo, JERR_TFILE_READ);
+    ptr += ret;
+    file_offset += (long) ret;
+    byte_count -= (long) ret;
+  }
+}
+
+
+METHODDEF(void)
+write_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+		     void FAR * buffer_address,
+		     long file_offset, long byte_count)
+{
+  int fd = fileno(info->temp_file);
+  const char * ptr = (const char *) buffer_address;
+  ssize_t ret;
+
+  while (byte_count > 0) {
+    ret = pwrite(fd, ptr, (size_t) byte_count, (off_t) file_offset);
+    if (ret <= 0)
+      ERREXIT(cinfo, JERR_TFILE_WRITE);
+    ptr += ret;
+    file_offset += (long) ret;
+    byte_count -= (long) ret;
+  }
+}
+
+#else /* !USE_PREAD_BACKING_STORE */
+
+METHODDEF(void)
+read_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+		    void FAR * buffer_address,
+		    long file_offset, long byte_count)
+{
+  if (fseek(info->temp_file, file_offset, SEEK_SET))
+    ERREXIT(cinfo, JERR_TFILE_SEEK);
+  if (JFREAD(info->temp_file, buffer_address, byte_count)
+      != (size_t) byte_count)
+    ERREXIT(cinfo, JERR_TFILE_READ);
+}
+
+
+METHODDEF(void)
+write_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+		     void FAR * buffer_address,
+		     long file_offset, long byte_count)
+{
+  if (fseek(info->temp_file, file_offset, SEEK_SET))
+    ERREXIT(cinfo, JERR_TFILE_SEEK);
+  if (JFWRITE(info->temp_file, buffer_address, byte_count)
+      != (size_t) byte_count)
+    ERREXIT(cinfo, JERR_TFILE_WRITE);
+}
+
+#endif /* USE_PREAD_BACKING_STORE */
+
+
+METHODDEF(void)
+close_backing_store (j_common_ptr cinfo, backing_store_ptr info)
+{
+(void)cinfo;
+  fclose(info->temp_file);
+  /* Since this implementation uses tmpfile() to create the file,
+   * no explicit file deletion is needed.
+   */
+}
+
+
+/*
+ * Initial opening of a backing-store object.
+ */
+
+GLOBAL(void)
+jpeg_open_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+			 long total_bytes_needed)
+{
+(void)total_bytes_needed;
+  if ((info->temp_file = tmpfile()) == NULL)
+    ERREXITS(cinfo, JERR_TFILE_CREATE, "");
+  info->temp_name[0] = '\0';
+  info->read_backing_store = read_backing_store;
+  info->write_backing_store = write_backing_store;
+  info->close_backing_store = close_backing_store;
+}
@@ -6,13 +6,12 @@
  * For conditions of distribution and use, see the accompanying README file.
  *
  * This file provides a really simple implementation of the system-
- * dependent portion of the JPEG memory manager.  This implementation
- * assumes that no backing-store files are needed: all required space
- * can be obtained from malloc().
- * This is very portable in the sense that it'll compile on almost anything,
- * but you'd better have lots of main memory (or virtual memory) if you want
- * to process big images.
- * Note that the max_memory_to_use option is ignored by this implementation.
+ * dependent portion of the JPEG memory manager.  All required space
+ * is obtained from malloc().
+ * This is very portable in the sense that it'll compile on almost anything.
+ * Backing store is handled by jmembs.c, which is only used if
+ * max_memory_to_use is set; otherwise you'd better have lots of main memory
+ * (or virtual memory) if you want to process big images.
  */
 
 #define JPEG_INTERNALS
@@ -70,39 +69,6 @@ jpeg_free_large (j_common_ptr cinfo, void FAR * object, size_t sizeofobject)
 }
 
 
-/*
- * This routine computes the total memory space available for allocation.
- * Here we always say, "we got all you want bud!"
- */
-
-GLOBAL(long)
-jpeg_mem_available (j_common_ptr cinfo, long min_bytes_needed,
-		    long max_bytes_needed, long already_allocated)
-{
-(void)cinfo;
-(void)min_bytes_needed;
-(void)max_bytes_needed;
-(void)already_allocated;
-  return max_bytes_needed;
-}
-
-
-/*
- * Backing store (temporary file) management.
- * Since jpeg_mem_available always promised the moon,
- * this should never be called and we can just error out.
- */
-
-GLOBAL(void)
-jpeg_open_backing_store (j_common_ptr cinfo, backing_store_ptr info,
-			 long total_bytes_needed)
-{
-(void)info;
-(void)total_bytes_needed;
-  ERREXIT(cinfo, JERR_NO_BACKING_STORE);
-}
-
-
 /*
  * These routines take care of any system-dependent initialization and
  * cleanup required.  Here, there isn't any.
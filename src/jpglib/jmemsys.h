@@ -196,3 +196,13 @@ EXTERN(void) jpeg_open_backing_store JPP((j_common_ptr cinfo,
 
 EXTERN(long) jpeg_mem_init JPP((j_common_ptr cinfo));
 EXTERN(void) jpeg_mem_term JPP((j_common_ptr cinfo));
+
+#ifdef USE_ARENA_MEMMGR
+/*
+ * The arena memory manager (jmemarena.c) keeps allocation statistics for
+ * the calling thread: the number of objects requested through the routines
+ * above and the number of allocations actually passed on to the system.
+ */
+
+EXTERN(void) jpeg_mem_stats JPP((long * requests, long * system_allocs));
+#endif /* USE_ARENA_MEMMGR */
@@ -40,6 +40,18 @@ freely, subject to the following restrictions:
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/*the SSE2 code paths are only used if the target always has SSE2*/
+#if defined(LODEPNG_COMPILE_SSE2) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LODEPNG_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(LODEPNG_COMPILE_THREADS) && defined(LODEPNG_COMPILE_ENCODER)
+#include <pthread.h>
+#endif
 
 #define VERSION_STRING "20120623"
 
@@ -202,24 +214,6 @@ static unsigned uivector_push_back(uivector* p, unsigned c)
   p->data[p->size - 1] = c;
   return 1;
 }
-
-/*copy q to p, returns 1 if success, 0 if failure ==> nothing done*/
-static unsigned uivector_copy(uivector* p, const uivector* q)
-{
-  size_t i;
-  if(!uivector_resize(p, q->size)) return 0;
-  for(i = 0; i < q->size; i++) p->data[i] = q->data[i];
-  return 1;
-}
-
-static void uivector_swap(uivector* p, uivector* q)
-{
-  size_t tmp;
-  unsigned* tmpp;
-  tmp = p->size; p->size = q->size; q->size = tmp;
-  tmp = p->allocsize; p->allocsize = q->allocsize; q->allocsize = tmp;
-  tmpp = p->data; p->data = q->data; q->data = tmpp;
-}
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -340,38 +334,119 @@ static void addBitToStream(size_t* bitpointer, ucvector* bitstream, unsigned cha
   (*bitpointer)++;
 }
 
+/*adds the nbits lowest bits of value, filling up a byte at a time*/
 static void addBitsToStream(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
 {
-  size_t i;
-  for(i = 0; i < nbits; i++) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> i) & 1));
+  while(nbits > 0)
+  {
+    size_t used = (*bitpointer) & 0x7;
+    size_t amount = 8 - used < nbits ? 8 - used : nbits;
+    /*add a new byte at the end*/
+    if(used == 0) ucvector_push_back(bitstream, (unsigned char)0);
+    (bitstream->data[bitstream->size - 1]) |= (unsigned char)((value & ((1u << amount) - 1u)) << used);
+    value >>= amount;
+    nbits -= amount;
+    (*bitpointer) += amount;
+  }
 }
 
 static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, unsigned value, size_t nbits)
 {
+  unsigned reversed = 0;
   size_t i;
-  for(i = 0; i < nbits; i++) addBitToStream(bitpointer, bitstream, (unsigned char)((value >> (nbits - 1 - i)) & 1));
+  for(i = 0; i < nbits; i++) reversed |= ((value >> (nbits - 1 - i)) & 1u) << i;
+  addBitsToStream(bitpointer, bitstream, reversed, nbits);
 }
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+Bit reader of the inflator. The next bits of the stream are kept in a buffer as
+wide as a size_t (64 bits on 64-bit platforms), the lsb being the next bit. The
+buffer is refilled a byte at a time, after a refill it holds at least
+BITBUFFER_BITS - 7 bits, enough for a length code, a distance code and their
+extra bits (48 bits) on 64-bit platforms. Past the end of the input, zero bytes
+are fed in, the decoder notices that by the bit pointer going past bitsize.
+
+When the input arrives in pieces, the more callback is called once fewer than
+sizeof(size_t) bytes are left. It may replace data by a buffer holding the bytes
+from pos on and the next input, but must keep the bytes of the buffered bits
+in front of them, so that the bit pointer stays valid. It sets more to 0 at the
+end of the input.
+*/
+typedef struct BitReader
+{
+  const unsigned char* data;
+  size_t size; /*size of data in bytes*/
+  size_t bitsize; /*size of data in bits*/
+  size_t pos; /*next byte of data to put into the buffer*/
+  size_t buffer; /*bits not consumed yet*/
+  unsigned avail; /*number of valid bits in buffer*/
+  void (*more)(struct BitReader* reader); /*gets more input, 0 if all input is in data*/
+  void* user; /*for use by the more callback*/
+} BitReader;
+
+#define BITBUFFER_BITS (sizeof(size_t) * 8)
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+static void BitReader_init(BitReader* reader, const unsigned char* data, size_t size)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  (*bitpointer)++;
-  return result;
+  reader->data = data;
+  reader->size = size;
+  reader->bitsize = size * 8;
+  reader->pos = 0;
+  reader->buffer = 0;
+  reader->avail = 0;
+  reader->more = 0;
+  reader->user = 0;
+}
+
+/*position of the next bit in the stream*/
+static size_t BitReader_bp(const BitReader* reader)
+{
+  return reader->pos * 8 - reader->avail;
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+/*continue reading at the given byte position, dropping the buffered bits*/
+static void BitReader_seek(BitReader* reader, size_t pos)
 {
-  unsigned result = 0, i;
-  for(i = 0; i < nbits; i++)
+  reader->pos = pos;
+  reader->buffer = 0;
+  reader->avail = 0;
+}
+
+static void BitReader_refill(BitReader* reader)
+{
+  if(reader->pos + sizeof(size_t) > reader->size && reader->more) reader->more(reader);
+  if(reader->pos + sizeof(size_t) <= reader->size)
+  {
+    /*fast path: enough input left for a full buffer, no bounds checks needed*/
+    const unsigned char* in = &reader->data[reader->pos];
+    while(reader->avail <= BITBUFFER_BITS - 8)
+    {
+      reader->buffer |= (size_t)(*in++) << reader->avail;
+      reader->avail += 8;
+    }
+    reader->pos = (size_t)(in - reader->data);
+    return;
+  }
+  while(reader->avail <= BITBUFFER_BITS - 8)
   {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    (*bitpointer)++;
+    size_t byte = reader->pos < reader->size ? reader->data[reader->pos] : 0;
+    reader->buffer |= byte << reader->avail;
+    reader->avail += 8;
+    reader->pos++;
   }
+}
+
+/*read up to 16 bits*/
+static unsigned readBits(BitReader* reader, unsigned nbits)
+{
+  unsigned result;
+  if(reader->avail < nbits) BitReader_refill(reader);
+  result = (unsigned)(reader->buffer & (((size_t)1 << nbits) - 1));
+  reader->buffer >>= nbits;
+  reader->avail -= nbits;
   return result;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -421,7 +496,8 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
+  unsigned char* table_len; /*lookup table of the decoder: code lengths*/
+  unsigned short* table_value; /*lookup table of the decoder: symbols or offsets of second level tables*/
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
@@ -443,73 +519,151 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  myfree(tree->tree2d);
+  myfree(tree->table_len);
+  myfree(tree->table_value);
   myfree(tree->tree1d);
   myfree(tree->lengths);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+/*number of bits looked up at once by the decoder, longer codes use a second table*/
+#define FIRSTBITS 9u
+/*symbol value of table entries that no code maps to*/
+#define INVALIDSYMBOL 65535u
+
+static unsigned reverseBits(unsigned bits, unsigned num)
+{
+  unsigned i, result = 0;
+  for(i = 0; i < num; i++) result |= ((bits >> (num - i - 1u)) & 1u) << i;
+  return result;
+}
+
+/*
+the lookup table representation used by the decoder. return value is error.
+
+The first table is indexed by the next FIRSTBITS bits of the stream. For codes
+of up to FIRSTBITS bits, the entry holds the symbol and its code length. For
+longer codes it holds the offset of a second level table and the length of the
+longest code sharing these first bits, the remaining bits index the second
+level table. Since deflate stores huffman codes msb first but the bit reader
+delivers the lsb first, the codes are bit-reversed to form the indices.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  static const unsigned headsize = 1u << FIRSTBITS;
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  size_t i, numpresent, pointer, size;
+  unsigned* maxlens = (unsigned*)mymalloc(headsize * sizeof(unsigned));
+  if(!maxlens) return 83; /*alloc fail*/
 
-  tree->tree2d = (unsigned*)mymalloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+  /*longest code for each first table entry, decides the size of the second level tables*/
+  for(i = 0; i < headsize; i++) maxlens[i] = 0;
+  for(i = 0; i < tree->numcodes; i++)
+  {
+    unsigned l = tree->lengths[i];
+    unsigned index;
+    if(l <= FIRSTBITS) continue;
+    index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(l > maxlens[index]) maxlens[index] = l;
+  }
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; n++)
+  size = headsize;
+  for(i = 0; i < headsize; i++)
+  {
+    if(maxlens[i] > FIRSTBITS) size += 1u << (maxlens[i] - FIRSTBITS);
+  }
+
+  tree->table_len = (unsigned char*)mymalloc(size * sizeof(unsigned char));
+  tree->table_value = (unsigned short*)mymalloc(size * sizeof(unsigned short));
+  if(!tree->table_len || !tree->table_value)
+  {
+    myfree(maxlens);
+    return 83; /*alloc fail*/
+  }
+
+  /*16 marks unused entries, it is not a valid code length*/
+  for(i = 0; i < size; i++) tree->table_len[i] = 16;
+
+  /*first table entries pointing to second level tables*/
+  pointer = headsize;
+  for(i = 0; i < headsize; i++)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    unsigned l = maxlens[i];
+    if(l <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)l;
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += 1u << (l - FIRSTBITS);
   }
+  myfree(maxlens);
 
-  for(n = 0; n < tree->numcodes; n++) /*the codes*/
+  numpresent = 0;
+  for(i = 0; i < tree->numcodes; i++)
   {
-    for(i = 0; i < tree->lengths[n]; i++) /*the bits for this code*/
+    unsigned l = tree->lengths[i];
+    unsigned reverse, j, num;
+    if(l == 0) continue;
+    reverse = reverseBits(tree->tree1d[i], l);
+    numpresent++;
+
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      if(treepos > tree->numcodes - 2) return 55; /*oversubscribed, see comment in lodepng_error_text*/
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      /*short code, repeated for all values of the bits following it*/
+      num = 1u << (FIRSTBITS - l);
+      for(j = 0; j < num; j++)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          nodefilled++;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        unsigned index = reverse | (j << l);
+        if(tree->table_len[index] != 16) return 55; /*oversubscribed, see comment in lodepng_error_text*/
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      /*long code, goes into the second level table of its first bits*/
+      unsigned index = reverse & mask;
+      unsigned maxlen = tree->table_len[index];
+      unsigned start = tree->table_value[index];
+      if(maxlen < l) return 55; /*a short code has the same first bits*/
+      num = 1u << (maxlen - l);
+      for(j = 0; j < num; j++)
+      {
+        unsigned index2 = start + ((reverse >> FIRSTBITS) | (j << (l - FIRSTBITS)));
+        tree->table_len[index2] = (unsigned char)l;
+        tree->table_value[index2] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
   }
 
-  for(n = 0;  n < tree->numcodes * 2; n++)
+  if(numpresent < 2)
   {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
+    /*
+    With a single code (deflate uses 1 bit for it) or none at all (e.g. no
+    distance codes are used), not all entries are filled. Make them decode to an
+    invalid symbol. The lengths keep the decoder within the tables.
+    */
+    for(i = 0; i < size; i++)
+    {
+      if(tree->table_len[i] == 16)
+      {
+        tree->table_len[i] = (unsigned char)(i < headsize ? 1 : FIRSTBITS + 1);
+        tree->table_value[i] = INVALIDSYMBOL;
+      }
+    }
+  }
+  else
+  {
+    /*a complete huffman code fills every entry, otherwise the tree is invalid*/
+    for(i = 0; i < size; i++)
+    {
+      if(tree->table_len[i] == 16) return 55;
+    }
   }
 
   return 0;
@@ -555,7 +709,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
+  if(!error) return HuffmanTree_makeTable(tree);
   else return error;
 }
 
@@ -581,55 +735,23 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
 /*
 A coin, this is the terminology used for the package-merge algorithm and the
 coin collector's problem. This is used to generate the huffman tree.
-A coin can be multiple coins (when they're merged)
+A coin can be multiple coins (when they're merged). Instead of listing all their
+symbols, a merged coin refers to the two coins of the previous row it was made of,
+so that all coins can live in one pool without allocating anything per coin.
 */
 typedef struct Coin
 {
-  uivector symbols;
+  int symbol; /*the symbol of a coin that is not merged, -1 for merged coins*/
+  unsigned left, right; /*the indices in the pool of the two coins a merged coin is made of*/
   float weight; /*the sum of all weights in this coin*/
 } Coin;
 
-static void coin_init(Coin* c)
-{
-  uivector_init(&c->symbols);
-}
-
-/*argument c is void* so that this dtor can be given as function pointer to the vector resize function*/
-static void coin_cleanup(void* c)
-{
-  uivector_cleanup(&((Coin*)c)->symbols);
-}
-
-static void coin_copy(Coin* c1, const Coin* c2)
-{
-  c1->weight = c2->weight;
-  uivector_copy(&c1->symbols, &c2->symbols);
-}
-
-static void add_coins(Coin* c1, const Coin* c2)
-{
-  size_t i;
-  for(i = 0; i < c2->symbols.size; i++) uivector_push_back(&c1->symbols, c2->symbols.data[i]);
-  c1->weight += c2->weight;
-}
-
-static void init_coins(Coin* coins, size_t num)
-{
-  size_t i;
-  for(i = 0; i < num; i++) coin_init(&coins[i]);
-}
-
-static void cleanup_coins(Coin* coins, size_t num)
-{
-  size_t i;
-  for(i = 0; i < num; i++) coin_cleanup(&coins[i]);
-}
-
 /*
-This uses a simple combsort to sort the data. This function is not critical for
-overall encoding speed and the data amount isn't that large.
+This uses a simple combsort to sort the indices of the coins in the pool by weight.
+This function is not critical for overall encoding speed and the data amount isn't
+that large.
 */
-static void sort_coins(Coin* data, size_t amount)
+static void sort_coins(const Coin* pool, unsigned* data, size_t amount)
 {
   size_t gap = amount;
   unsigned char swapped = 0;
@@ -643,30 +765,42 @@ static void sort_coins(Coin* data, size_t amount)
     for(i = 0; i < amount - gap; i++)
     {
       size_t j = i + gap;
-      if(data[j].weight < data[i].weight)
+      if(pool[data[j]].weight < pool[data[i]].weight)
       {
-        float temp = data[j].weight; data[j].weight = data[i].weight; data[i].weight = temp;
-        uivector_swap(&data[i].symbols, &data[j].symbols);
+        unsigned temp = data[j]; data[j] = data[i]; data[i] = temp;
         swapped = 1;
       }
     }
   }
 }
 
-static unsigned append_symbol_coins(Coin* coins, const unsigned* frequencies, unsigned numcodes, size_t sum)
+/*adds a coin for every present symbol to the pool, and their indices to row*/
+static void append_symbol_coins(Coin* pool, unsigned* poolsize, unsigned* row,
+                                const unsigned* frequencies, unsigned numcodes, size_t sum)
 {
   unsigned i;
-  unsigned j = 0; /*index of present symbols*/
   for(i = 0; i < numcodes; i++)
   {
     if(frequencies[i] != 0) /*only include symbols that are present*/
     {
-      coins[j].weight = frequencies[i] / (float)sum;
-      uivector_push_back(&coins[j].symbols, i);
-      j++;
+      Coin* coin = &pool[*poolsize];
+      coin->symbol = (int)i;
+      coin->weight = frequencies[i] / (float)sum;
+      *(row++) = (*poolsize)++;
     }
   }
-  return 0;
+}
+
+/*counts every symbol a coin is made of once in lengths*/
+static void count_coin_symbols(unsigned* lengths, const Coin* pool, unsigned index)
+{
+  /*the recursion depth is at most maxbitlen*/
+  while(pool[index].symbol < 0)
+  {
+    count_coin_symbols(lengths, pool, pool[index].left);
+    index = pool[index].right;
+  }
+  lengths[pool[index].symbol]++;
 }
 
 unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequencies,
@@ -674,9 +808,11 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
 {
   unsigned i, j;
   size_t sum = 0, numpresent = 0;
-  unsigned error = 0;
-  Coin* coins; /*the coins of the currently calculated row*/
-  Coin* prev_row; /*the previous row of coins*/
+  Coin* pool; /*all coins of all rows*/
+  unsigned poolsize = 0;
+  unsigned* rows; /*memory for the two rows below*/
+  unsigned* coins; /*indices in the pool of the coins of the currently calculated row*/
+  unsigned* prev_row; /*indices in the pool of the coins of the previous row*/
   unsigned numcoins;
   unsigned coinmem;
 
@@ -710,29 +846,30 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
     For every symbol, maxbitlen coins will be created*/
 
     coinmem = numpresent * 2; /*max amount of coins needed with the current algo*/
-    coins = (Coin*)mymalloc(sizeof(Coin) * coinmem);
-    prev_row = (Coin*)mymalloc(sizeof(Coin) * coinmem);
-    if(!coins || !prev_row) return 83; /*alloc fail*/
-    init_coins(coins, coinmem);
-    init_coins(prev_row, coinmem);
+    /*every row adds at most coinmem coins to the pool*/
+    pool = (Coin*)mymalloc(sizeof(Coin) * coinmem * (maxbitlen + 1));
+    rows = (unsigned*)mymalloc(sizeof(unsigned) * coinmem * 2);
+    if(!pool || !rows)
+    {
+      myfree(pool);
+      myfree(rows);
+      return 83; /*alloc fail*/
+    }
+    coins = rows;
+    prev_row = rows + coinmem;
 
     /*first row, lowest denominator*/
-    error = append_symbol_coins(coins, frequencies, numcodes, sum);
+    append_symbol_coins(pool, &poolsize, coins, frequencies, numcodes, sum);
     numcoins = numpresent;
-    sort_coins(coins, numcoins);
-    if(!error)
+    sort_coins(pool, coins, numcoins);
     {
       unsigned numprev = 0;
-      for(j = 1; j <= maxbitlen && !error; j++) /*each of the remaining rows*/
+      for(j = 1; j <= maxbitlen; j++) /*each of the remaining rows*/
       {
-        unsigned tempnum;
-        Coin* tempcoins;
+        unsigned* temprow;
         /*swap prev_row and coins, and their amounts*/
-        tempcoins = prev_row; prev_row = coins; coins = tempcoins;
-        tempnum = numprev; numprev = numcoins; numcoins = tempnum;
-
-        cleanup_coins(coins, numcoins);
-        init_coins(coins, numcoins);
+        temprow = prev_row; prev_row = coins; coins = temprow;
+        numprev = numcoins;
 
         numcoins = 0;
 
@@ -740,37 +877,32 @@ unsigned lodepng_huffman_code_lengths(unsigned* lengths, const unsigned* frequen
         for(i = 0; i + 1 < numprev; i += 2)
         {
           /*merge prev_row[i] and prev_row[i + 1] into new coin*/
-          Coin* coin = &coins[numcoins++];
-          coin_copy(coin, &prev_row[i]);
-          add_coins(coin, &prev_row[i + 1]);
+          Coin* coin = &pool[poolsize];
+          coin->symbol = -1;
+          coin->left = prev_row[i];
+          coin->right = prev_row[i + 1];
+          coin->weight = pool[prev_row[i]].weight;
+          coin->weight += pool[prev_row[i + 1]].weight;
+          coins[numcoins++] = poolsize++;
         }
         /*fill in all the original symbols again*/
         if(j < maxbitlen)
         {
-          error = append_symbol_coins(coins + numcoins, frequencies, numcodes, sum);
+          append_symbol_coins(pool, &poolsize, coins + numcoins, frequencies, numcodes, sum);
           numcoins += numpresent;
         }
-        sort_coins(coins, numcoins);
+        sort_coins(pool, coins, numcoins);
       }
     }
 
-    if(!error)
-    {
-      /*calculate the lenghts of each symbol, as the amount of times a coin of each symbol is used*/
-      for(i = 0; i < numpresent - 1; i++)
-      {
-        Coin* coin = &coins[i];
-        for(j = 0; j < coin->symbols.size; j++) lengths[coin->symbols.data[j]]++;
-      }
-    }
+    /*calculate the lenghts of each symbol, as the amount of times a coin of each symbol is used*/
+    for(i = 0; i < numpresent - 1; i++) count_coin_symbols(lengths, pool, coins[i]);
 
-    cleanup_coins(coins, coinmem);
-    myfree(coins);
-    cleanup_coins(prev_row, coinmem);
-    myfree(prev_row);
+    myfree(pool);
+    myfree(rows);
   }
 
-  return error;
+  return 0;
 }
 
 /*Create the Huffman tree given the symbol frequencies*/
@@ -838,27 +970,29 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 #ifdef LODEPNG_COMPILE_DECODER
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the code, or INVALIDSYMBOL if the bits do not form a code of the tree.
+Reading past the end of the input is detected by the caller using the bit pointer.
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(BitReader* reader, const HuffmanTree* codetree)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
-  {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    (*bp)++;
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
+  unsigned code, l, value;
+  if(reader->avail < 15) BitReader_refill(reader);
 
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+  code = (unsigned)reader->buffer & ((1u << FIRSTBITS) - 1u);
+  l = codetree->table_len[code];
+  value = codetree->table_value[code];
+
+  if(l > FIRSTBITS)
+  {
+    /*long code, look up the remaining bits in the second level table*/
+    value += ((unsigned)reader->buffer >> FIRSTBITS) & ((1u << (l - FIRSTBITS)) - 1u);
+    l = codetree->table_len[value];
+    value = codetree->table_value[value];
   }
+
+  reader->buffer >>= l;
+  reader->avail -= l;
+  return value;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -877,13 +1011,11 @@ static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d, BitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
   unsigned* bitlen_ll = 0; /*lit,len code lengths*/
@@ -892,14 +1024,15 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) >> 3 >= inlength - 2) return 49; /*error: the bit pointer is or will go past the memory*/
+  BitReader_refill(reader);
+  if(BitReader_bp(reader) >> 3 >= reader->size - 2) return 49; /*error: the bit pointer is or will go past the memory*/
 
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  readBits(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = readBits(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
+  HCLEN = readBits(reader, 4) + 4;
 
   HuffmanTree_init(&tree_cl);
 
@@ -912,7 +1045,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
     for(i = 0; i < NUM_CODE_LENGTH_CODES; i++)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
 
@@ -930,7 +1063,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code = huffmanDecodeSymbol(reader, &tree_cl);
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -942,10 +1075,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
         unsigned replength = 3; /*read in the 2 bits that indicate repeat length (3-6)*/
         unsigned value; /*set value to the previous code*/
 
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        if(BitReader_bp(reader) >= reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
         if (i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        replength += readBitsFromStream(bp, in, 2);
+        replength += readBits(reader, 2);
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -961,9 +1094,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        if(BitReader_bp(reader) >= reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
-        replength += readBitsFromStream(bp, in, 3);
+        replength += readBits(reader, 3);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; n++)
@@ -978,9 +1111,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+        if(BitReader_bp(reader) >= reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
-        replength += readBitsFromStream(bp, in, 7);
+        replength += readBits(reader, 7);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; n++)
@@ -992,17 +1125,19 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
           i++;
         }
       }
-      else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+      else /*if(code == INVALIDSYMBOL)*/ /*huffmanDecodeSymbol returns INVALIDSYMBOL in case of error*/
       {
-        if(code == (unsigned)(-1))
+        if(code == INVALIDSYMBOL)
         {
           /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
           (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
+          error = BitReader_bp(reader) > reader->bitsize ? 10 : 11;
         }
         else error = 16; /*unexisting code, this can never happen*/
         break;
       }
+
+      if(BitReader_bp(reader) > reader->bitsize) ERROR_BREAK(10); /*error: end of input memory reached*/
     }
     if(error) break;
 
@@ -1024,117 +1159,130 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   return error;
 }
 
-/*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+/*
+decode the symbols of a Huffman block until the end code, setting *end, or until
+*pos reaches limit. A match may write up to 258 bytes past limit.
+*/
+static unsigned inflateHuffmanSymbols(ucvector* out, BitReader* reader, size_t* pos, size_t limit,
+                                      const HuffmanTree* tree_ll, const HuffmanTree* tree_d, unsigned* end)
 {
   unsigned error = 0;
-  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
-  HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
-
-  HuffmanTree_init(&tree_ll);
-  HuffmanTree_init(&tree_d);
+  unsigned char* data;
 
-  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2)
+  while(!error && (*pos) < limit) /*decode all symbols until end reached, breaks at end code*/
   {
-    error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
-  }
+    unsigned code_ll;
+
+    /*reserve room for the longest possible match, so the copies below need no checks*/
+    if((*pos) + 258 >= out->size)
+    {
+      if(!ucvector_resize(out, ((*pos) + 258) * 2)) ERROR_BREAK(83 /*alloc fail*/);
+    }
+    data = out->data;
+
+    if(BitReader_bp(reader) > reader->bitsize) ERROR_BREAK(10); /*error: end of input memory reached without endcode*/
 
-  while(!error) /*decode all symbols until end reached, breaks at end code*/
-  {
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    BitReader_refill(reader);
+    code_ll = huffmanDecodeSymbol(reader, tree_ll);
     if(code_ll <= 255) /*literal symbol*/
     {
-      if((*pos) >= out->size)
-      {
-        /*reserve more room at once*/
-        if(!ucvector_resize(out, ((*pos) + 1) * 2)) ERROR_BREAK(83 /*alloc fail*/);
-      }
-      out->data[(*pos)] = (unsigned char)(code_ll);
-      (*pos)++;
+      data[(*pos)++] = (unsigned char)(code_ll);
     }
     else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
     {
-      unsigned code_d, distance;
-      unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
-      size_t start, forward, backward, length;
+      unsigned code_d;
+      size_t distance, length, span;
+      unsigned char* dst;
+      const unsigned char* src;
 
-      /*part 1: get length base*/
+      /*get length base, and add the value of the extra bits to it*/
       length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
+      length += readBits(reader, LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX]);
 
-      /*part 2: get extra bits and add the value of that to length*/
-      numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      /*get distance code*/
+      code_d = huffmanDecodeSymbol(reader, tree_d);
+      if(code_d > 29) ERROR_BREAK(18); /*error: invalid distance code (30-31 are never used)*/
 
-      /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
-      if(code_d > 29)
-      {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
-        }
-        else error = 18; /*error: invalid distance code (30-31 are never used)*/
-        break;
-      }
+      /*get distance base, and add the value of the extra bits to it*/
       distance = DISTANCEBASE[code_d];
+      distance += readBits(reader, DISTANCEEXTRA[code_d]);
 
-      /*part 4: get extra bits from distance*/
-      numextrabits_d = DISTANCEEXTRA[code_d];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
+      if(BitReader_bp(reader) > reader->bitsize) ERROR_BREAK(51); /*error, bit pointer jumped past memory*/
+      if(distance > (*pos)) ERROR_BREAK(52); /*too long backward distance*/
 
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      /*
+      copy the match. If it overlaps itself, the bytes written so far repeat with
+      a period of distance, so the source can stay in place while the span that
+      can be copied without overlap doubles
+      */
+      dst = data + (*pos);
+      src = dst - distance;
+      (*pos) += length;
 
-      /*part 5: fill in all the out[n] values based on the length and dist*/
-      start = (*pos);
-      if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
-      backward = start - distance;
-      if((*pos) + length >= out->size)
+      if(distance == 1)
       {
-        /*reserve more room at once*/
-        if(!ucvector_resize(out, ((*pos) + length) * 2)) ERROR_BREAK(83 /*alloc fail*/);
+        memset(dst, *src, length);
       }
-
-      for(forward = 0; forward < length; forward++)
+      else
       {
-        out->data[(*pos)] = out->data[backward];
-        (*pos)++;
-        backward++;
-        if(backward >= start) backward = start - distance;
+        for(span = distance; length > span; span *= 2)
+        {
+          memcpy(dst, src, span);
+          dst += span;
+          length -= span;
+        }
+        memcpy(dst, src, length);
       }
     }
     else if(code_ll == 256)
     {
+      *end = 1;
       break; /*end code, break the loop*/
     }
-    else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+    else /*if(code == INVALIDSYMBOL)*/ /*huffmanDecodeSymbol returns INVALIDSYMBOL in case of error*/
     {
       /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
       (10=no endcode, 11=wrong jump outside of tree)*/
-      error = (*bp) > inlength * 8 ? 10 : 11;
+      error = BitReader_bp(reader) > reader->bitsize ? 10 : 11;
       break;
     }
   }
 
+  return error;
+}
+
+/*inflate a block with dynamic of fixed Huffman tree*/
+static unsigned inflateHuffmanBlock(ucvector* out, BitReader* reader, size_t* pos, unsigned btype)
+{
+  unsigned error = 0, end = 0;
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes*/
+
+  HuffmanTree_init(&tree_ll);
+  HuffmanTree_init(&tree_d);
+
+  if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
+  else if(btype == 2)
+  {
+    error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
+  }
+
+  if(!error) error = inflateHuffmanSymbols(out, reader, pos, (size_t)(-1), &tree_ll, &tree_d, &end);
+
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
 
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, BitReader* reader, size_t* pos)
 {
   /*go to first boundary of byte*/
-  size_t p;
-  unsigned LEN, NLEN, n, error = 0;
-  while(((*bp) & 0x7) != 0) (*bp)++;
-  p = (*bp) / 8; /*byte position*/
+  size_t p = (BitReader_bp(reader) + 7) / 8; /*byte position*/
+  const unsigned char* in = reader->data;
+  size_t inlength = reader->size;
+  unsigned LEN, NLEN, error = 0;
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
   if(p >= inlength - 4) return 52; /*error, bit pointer will jump past memory*/
@@ -1151,9 +1299,11 @@ static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, siz
 
   /*read the literal data: LEN bytes are now stored in the out buffer*/
   if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
-  for(n = 0; n < LEN; n++) out->data[(*pos)++] = in[p++];
+  memcpy(out->data + (*pos), in + p, LEN);
+  (*pos) += LEN;
+  p += LEN;
 
-  (*bp) = p * 8;
+  BitReader_seek(reader, p);
 
   return error;
 }
@@ -1162,8 +1312,7 @@ static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
                                  const LodePNGDecompressSettings* settings)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
+  BitReader reader;
   unsigned BFINAL = 0;
   size_t pos = 0; /*byte position in the out buffer*/
 
@@ -1171,17 +1320,18 @@ static unsigned lodepng_inflatev(ucvector* out,
 
   (void)settings;
 
+  BitReader_init(&reader, in, insize);
+
   while(!BFINAL)
   {
     unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1 * readBitFromStream(&bp, in);
-    BTYPE += 2 * readBitFromStream(&bp, in);
+    if(BitReader_bp(&reader) + 2 >= reader.bitsize) return 52; /*error, bit pointer will jump past memory*/
+    BFINAL = readBits(&reader, 1);
+    BTYPE = readBits(&reader, 2);
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else if(BTYPE == 0) error = inflateNoCompression(out, &reader, &pos); /*no compression*/
+    else error = inflateHuffmanBlock(out, &reader, &pos, BTYPE); /*compression, BTYPE 01 or 10*/
 
     if(error) return error;
   }
@@ -1272,46 +1422,40 @@ static void addLengthDistance(uivector* values, size_t length, size_t distance)
   uivector_push_back(values, extra_distance);
 }
 
+static const unsigned HASH_BIT_COUNT = 16;
 static const unsigned HASH_NUM_VALUES = 65536;
-static const unsigned HASH_NUM_CHARACTERS = 3;
-static const unsigned HASH_SHIFT = 2;
 /*
-The HASH_NUM_CHARACTERS value is used to make encoding faster by using longer
-sequences to generate a hash value from the stream bytes. Setting it to 3
-gives exactly the same compression as the brute force method, since deflate's
-run length encoding starts with lengths of 3. Setting it to higher values,
-like 6, can make the encoding faster (not always though!), but will cause the
-encoding to miss any length between 3 and this value, so that the compression
-may be worse (but this can vary too depending on the image, sometimes it is
-even a bit better instead).
+Positions are hashed by their first 4 bytes with a multiplicative hash. A match of
+length 3 is then only found on a hash collision, but those rarely pay off in PNG
+data, and hashing 4 bytes gives much shorter hash chains in areas of similar
+pixels, which is where most of the encoding time went.
 The HASH_NUM_VALUES is the amount of unique possible hash values that
 combinations of bytes can give, the higher it is the more memory is needed, but
 if it's too low the advantage of hashing is gone.
 */
 
+/*positions are stored as int relative to Hash::base, which moves up before they reach this*/
+static const size_t HASH_MAX_OFFSET = 1073741824u;
+
 typedef struct Hash
 {
-  int* head; /*hash value to head circular pos*/
-  int* val; /*circular pos to hash value*/
-  /*circular pos to prev circular pos*/
-  unsigned short* chain;
-  unsigned short* zeros;
+  int* head; /*hash value to the last position with that hash value, or -1*/
+  int* chain; /*position modulo windowsize to the previous position with the same hash value, or -1*/
+  size_t next; /*the first position that is not in the hash chains yet*/
+  size_t base; /*the position that the positions in head and chain are stored relative to*/
 } Hash;
 
 static unsigned hash_init(Hash* hash, unsigned windowsize)
 {
   unsigned i;
   hash->head = (int*)mymalloc(sizeof(int) * HASH_NUM_VALUES);
-  hash->val = (int*)mymalloc(sizeof(int) * windowsize);
-  hash->chain = (unsigned short*)mymalloc(sizeof(unsigned short) * windowsize);
-  hash->zeros = (unsigned short*)mymalloc(sizeof(unsigned short) * windowsize);
+  hash->chain = (int*)mymalloc(sizeof(int) * windowsize);
+  hash->next = hash->base = 0;
 
-  if(!hash->head || !hash->val || !hash->chain || !hash->zeros) return 83; /*alloc fail*/
+  if(!hash->head || !hash->chain) return 83; /*alloc fail*/
 
-  /*initialize hash table*/
+  /*initialize hash table. The chain only gets read for positions that were added*/
   for(i = 0; i < HASH_NUM_VALUES; i++) hash->head[i] = -1;
-  for(i = 0; i < windowsize; i++) hash->val[i] = -1;
-  for(i = 0; i < windowsize; i++) hash->chain[i] = i; /*same value as index indicates uninitialized*/
 
   return 0;
 }
@@ -1319,233 +1463,329 @@ static unsigned hash_init(Hash* hash, unsigned windowsize)
 static void hash_cleanup(Hash* hash)
 {
   myfree(hash->head);
-  myfree(hash->val);
   myfree(hash->chain);
-  myfree(hash->zeros);
 }
 
-static unsigned getHash(const unsigned char* data, size_t size, size_t pos)
+/*there must be 4 bytes of data at pos*/
+static unsigned getHash(const unsigned char* data, size_t pos)
 {
-  unsigned result = 0;
-  size_t amount, i;
-  if(pos >= size) return 0;
-  amount = HASH_NUM_CHARACTERS;
-  if(pos + amount >= size) amount = size - pos;
-  for(i = 0; i < amount; i++) result ^= (data[pos + i] << (i * HASH_SHIFT));
-  return result % HASH_NUM_VALUES;
+  unsigned value = (unsigned)data[pos] | ((unsigned)data[pos + 1] << 8)
+                 | ((unsigned)data[pos + 2] << 16) | ((unsigned)data[pos + 3] << 24);
+  return ((value * 2654435761u) & 0xffffffffu) >> (32 - HASH_BIT_COUNT);
 }
 
-static unsigned countZeros(const unsigned char* data, size_t size, size_t pos)
+/*
+Moves the base of the stored positions up to a window before hash->next, like the
+sliding of the hash table in zlib. Positions before the new base can't be matched
+anymore and become -1.
+*/
+static void hash_slide(Hash* hash, unsigned windowsize)
 {
-  const unsigned char* start = data + pos;
-  const unsigned char* end = start + MAX_SUPPORTED_DEFLATE_LENGTH;
-  if(end > data + size) end = data + size;
-  data = start;
-  while (data != end && *data == 0) data++;
-  return data - start;
+  int delta = (int)(hash->next - windowsize - hash->base);
+  size_t i;
+  for(i = 0; i < HASH_NUM_VALUES; i++) hash->head[i] = hash->head[i] >= delta ? hash->head[i] - delta : -1;
+  for(i = 0; i < windowsize; i++) hash->chain[i] = hash->chain[i] >= delta ? hash->chain[i] - delta : -1;
+  hash->base += (size_t)delta;
 }
 
-static void updateHashChain(Hash* hash,
-                            size_t pos, int hashval, unsigned windowsize)
+/*add all positions up to and including pos to the hash chains. windowsize must be a power of two*/
+static void updateHashChain(Hash* hash, const unsigned char* in, size_t insize,
+                            size_t pos, unsigned windowsize)
 {
-  unsigned wpos = pos % windowsize;
-  hash->val[wpos] = hashval;
-  if(hash->head[hashval] != -1)
+  for(; hash->next <= pos && hash->next + 4 <= insize; hash->next++)
   {
-    hash->chain[wpos] = hash->head[hashval];
+    unsigned hashval = getHash(in, hash->next);
+    if(hash->next - hash->base >= HASH_MAX_OFFSET) hash_slide(hash, windowsize);
+    hash->chain[hash->next & (windowsize - 1)] = hash->head[hashval];
+    hash->head[hashval] = (int)(hash->next - hash->base);
   }
-  hash->head[hashval] = wpos;
 }
 
-/*Enable to use lazy instead of greedy matching. It looks one byte further
-to see if that one gives a longer distance. This gives slightly better compression, at the cost
-of a speed loss.*/
-#define LAZY_MATCHING
-
 /*
-LZ77-encode the data. Return value is error code. The input are raw bytes, the output
-is in the form of unsigned integers with codes representing for example literal bytes, or
-length/distance pairs.
-It uses a hash table technique to let it encode faster. When doing LZ77 encoding, a
-sliding window (of windowsize) is used, and all past bytes in that window can be used as
-the "dictionary". A brute force search through all possible distances would be slow, and
-this hash technique is one out of several ways to speed this up.
+Empties the hash table again after the positions from start on have been added, so that
+it can be used for other data. Only the heads of those positions are cleared if there
+are few of them, the chains are only read for positions that were added.
 */
-static unsigned encodeLZ77(uivector* out, Hash* hash,
-                           const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize)
+static void hash_reset(Hash* hash, const unsigned char* in, size_t start)
 {
-  unsigned short numzeros = 0;
-  int usezeros = windowsize >= 8192; /*for small window size, the 'max chain length' optimization does a better job*/
-  unsigned pos, i, error = 0;
-
-  if(!error)
+  size_t i;
+  if(hash->next > start && hash->next - start < HASH_NUM_VALUES / 4)
   {
-    unsigned offset; /*the offset represents the distance in LZ77 terminology*/
-    unsigned length;
-#ifdef LAZY_MATCHING
-    unsigned lazy = 0;
-    unsigned lazylength = 0, lazyoffset = 0;
-#endif /*LAZY_MATCHING*/
-    unsigned hashval;
-    unsigned current_offset, current_length;
-    const unsigned char *lastptr, *foreptr, *backptr;
-    unsigned short hashpos, prevpos;
-
-    for(pos = inpos; pos < insize; pos++)
-    {
-      size_t wpos = pos % windowsize; /*position for in 'circular' hash buffers*/
+    for(i = start; i < hash->next; i++) hash->head[getHash(in, i)] = -1;
+  }
+  else if(hash->next > start)
+  {
+    for(i = 0; i < HASH_NUM_VALUES; i++) hash->head[i] = -1;
+  }
+  hash->next = 0;
+}
 
-      hashval = getHash(in, insize, pos);
-      updateHashChain(hash, pos, hashval, windowsize);
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LODEPNG_MATCH_WORDS
+#endif
+#endif
 
-      if(usezeros && hashval == 0)
-      {
-        numzeros = countZeros(in, insize, pos);
-        hash->zeros[wpos] = numzeros;
-      }
+/*returns how many bytes starting at a and b are equal, comparing up to end of a*/
+static unsigned countMatch(const unsigned char* a, const unsigned char* b, const unsigned char* end)
+{
+  const unsigned char* start = a;
+#ifdef LODEPNG_MATCH_WORDS
+  /*a word at a time, the lowest differing bit of the words is in the first differing byte*/
+  while((size_t)(end - a) >= sizeof(unsigned long))
+  {
+    unsigned long x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    if(x != y) return (unsigned)(a - start) + (unsigned)__builtin_ctzl(x ^ y) / 8;
+    a += sizeof(unsigned long);
+    b += sizeof(unsigned long);
+  }
+#endif /*LODEPNG_MATCH_WORDS*/
+  while(a != end && *a == *b)
+  {
+    ++a;
+    ++b;
+  }
+  return (unsigned)(a - start);
+}
 
-      /*the length and offset found for the current position*/
-      length = 0;
-      offset = 0;
+/*
+Returns the length of the longest match for the data at pos, and its distance in offset.
+Follows the hash chain from pos, which must have been added to it already, over at most
+maxchain earlier positions (0 for no limit), and stops at a match of nicematch bytes.
+*/
+static unsigned findMatch(const Hash* hash, const unsigned char* in, size_t pos, size_t insize,
+                          unsigned windowsize, unsigned nicematch, unsigned maxchain, unsigned* offset)
+{
+  const unsigned char* end;
+  unsigned length = 0, maxlength, chainlength = 0;
+  int candidate;
 
-      prevpos = hash->head[hashval];
-      hashpos = hash->chain[prevpos];
+  if(pos + 4 > insize) return 0;
+  maxlength = insize - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? (unsigned)(insize - pos) : MAX_SUPPORTED_DEFLATE_LENGTH;
+  if(nicematch > maxlength) nicematch = maxlength;
+  end = &in[pos + maxlength];
 
-      lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+  candidate = hash->chain[pos & (windowsize - 1)];
+  while(candidate >= 0)
+  {
+    size_t previous = hash->base + (size_t)candidate;
+    size_t distance = pos - previous;
+    /*the chain of positions a full window back has been overwritten already*/
+    if(distance >= windowsize) break;
 
-      /*search for the longest string*/
-      if(hash->val[wpos] == (int)hashval)
+    /*a longer match has to continue past the length of the best one*/
+    if(in[previous + length] == in[pos + length])
+    {
+      unsigned current = countMatch(&in[pos], &in[previous], end);
+      if(current > length)
       {
-        /*for large window lengths, assume the user wants no compression loss. Otherwise, max hash chain length speedup.*/
-        unsigned maxchainlength = windowsize >= 8192 ? windowsize : windowsize / 8;
-        for(;;)
-        {
-          /*stop when went completely around the circular buffer*/
-          if(prevpos < wpos && hashpos > prevpos && hashpos <= wpos) break;
-          if(prevpos > wpos && (hashpos <= wpos || hashpos > prevpos)) break;
-          if(maxchainlength-- == 0) break;
-
-          current_offset = hashpos <= wpos ? wpos - hashpos : wpos - hashpos + windowsize;
-          if(current_offset > 0) {
-            /*test the next characters*/
-            foreptr = &in[pos];
-            backptr = &in[pos - current_offset];
-
-            /*common case in PNGs is lots of zeros. Quickly skip over them as a speedup*/
-            if(usezeros && hashval == 0 && hash->val[hashpos] == 0 /*hashval[hashpos] may be out of date*/)
-            {
-              unsigned short skip = hash->zeros[hashpos];
-              if(skip > numzeros) skip = numzeros;
-              backptr += skip;
-              foreptr += skip;
-            }
-
-            /* multiple checks at once per array bounds check */
-            while(foreptr != lastptr && *backptr == *foreptr) /*maximum supported length by deflate is max length*/
-            {
-              ++backptr;
-              ++foreptr;
-            }
-            current_length = (unsigned)(foreptr - &in[pos]);
-
-            if(current_length > length)
-            {
-              length = current_length; /*the longest length*/
-              offset = current_offset; /*the offset that is related to this longest length*/
-              /*jump out once a length of max length is found (speed gain)*/
-              if(current_length == MAX_SUPPORTED_DEFLATE_LENGTH) break;
-            }
-          }
+        length = current;
+        *offset = (unsigned)distance;
+        /*jump out once a long enough match is found (speed gain)*/
+        if(length >= nicematch) break;
+      }
+    }
 
-          if(hashpos == hash->chain[hashpos]) break;
+    if(++chainlength == maxchain) break;
+    candidate = hash->chain[previous & (windowsize - 1)];
+  }
 
-          prevpos = hashpos;
-          hashpos = hash->chain[hashpos];
-        }
-      }
+  return length;
+}
 
-#ifdef LAZY_MATCHING
-      if(!lazy && length >= 3 && length < MAX_SUPPORTED_DEFLATE_LENGTH)
-      {
-        lazy = 1;
-        lazylength = length;
-        lazyoffset = offset;
-        continue;
-      }
-      if(lazy)
-      {
-        lazy = 0;
-        if(pos == 0) ERROR_BREAK(81);
-        if(length > lazylength + 1)
-        {
-          /*push the previous character as literal*/
-          if(!uivector_push_back(out, in[pos - 1])) ERROR_BREAK(83 /*alloc fail*/);
-        }
-        else
-        {
-          length = lazylength;
-          offset = lazyoffset;
-          hash->head[hashval] = -1; /*the same hashchain update will be done, this ensures no wrong alteration*/
-          pos--;
-        }
-      }
-#endif /*LAZY_MATCHING*/
+/*
+Append the matches for the data at pos to matches, as pairs of length and distance. A match is only
+added if it is longer than those at smaller distances, and all lengths from 3 up to its length can
+use its distance. Follows the hash chain like findMatch, but does not stop before the longest match.
+*/
+static unsigned findAllMatches(uivector* matches, const Hash* hash, const unsigned char* in, size_t pos,
+                               size_t insize, unsigned windowsize, unsigned maxchain)
+{
+  const unsigned char* end;
+  unsigned length = 2, maxlength, chainlength = 0;
+  int candidate;
 
-      if(length >= 3 && offset > windowsize) ERROR_BREAK(86 /*too big (or overflown negative) offset*/);
+  if(pos + 4 > insize) return 0;
+  maxlength = insize - pos < MAX_SUPPORTED_DEFLATE_LENGTH ? (unsigned)(insize - pos) : MAX_SUPPORTED_DEFLATE_LENGTH;
+  end = &in[pos + maxlength];
 
+  candidate = hash->chain[pos & (windowsize - 1)];
+  while(candidate >= 0)
+  {
+    size_t previous = hash->base + (size_t)candidate;
+    size_t distance = pos - previous;
+    if(distance >= windowsize) break;
 
-      /**encode it as length/distance pair or literal value**/
-      if(length < 3) /*only lengths of 3 or higher are supported as length/distance pair*/
-      {
-        if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
-      }
-      else
+    if(in[previous + length] == in[pos + length])
+    {
+      unsigned current = countMatch(&in[pos], &in[previous], end);
+      if(current > length)
       {
-        if(length == 3 && offset > 2048)
-        {
-          /*compensate for the fact that longer offsets have more extra bits, a
-          length of only 3 may be not worth it then*/
-          if(!uivector_push_back(out, in[pos + 0])) ERROR_BREAK(83 /*alloc fail*/);
-          if(!uivector_push_back(out, in[pos + 1])) ERROR_BREAK(83 /*alloc fail*/);
-          if(!uivector_push_back(out, in[pos + 2])) ERROR_BREAK(83 /*alloc fail*/);
-        }
-        else
-        {
-          addLengthDistance(out, length, offset);
-        }
-        for(i = 1; i < length; i++)
-        {
-          pos++;
-          hashval = getHash(in, insize, pos);
-          updateHashChain(hash, pos, hashval, windowsize);
-          if(usezeros && hashval == 0)
-          {
-            hash->zeros[pos % windowsize] = countZeros(in, insize, pos);
-          }
-        }
+        length = current;
+        if(!uivector_push_back(matches, length)) return 83; /*alloc fail*/
+        if(!uivector_push_back(matches, (unsigned)distance)) return 83; /*alloc fail*/
+        if(length == maxlength) break;
       }
+    }
 
-    } /*end of the loop through each character of input*/
-  } /*end of "if(!error)"*/
+    if(++chainlength == maxchain) break;
+    candidate = hash->chain[previous & (windowsize - 1)];
+  }
 
-  return error;
+  return 0;
 }
 
-/* /////////////////////////////////////////////////////////////////////////// */
-
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize)
+/*
+LZ77-encode the data with matches of distance 1 only, that is runs of the same byte.
+Used for a window size of 1, this is much faster than the hash chains and still
+compresses images with large areas of a single color well.
+*/
+static unsigned encodeRLE(uivector* out, const unsigned char* in, size_t inpos, size_t insize,
+                          unsigned minmatch)
 {
-  /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
-  2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
-
-  size_t i, j, numdeflateblocks = (datasize + 65534) / 65535;
-  unsigned datapos = 0;
-  for(i = 0; i < numdeflateblocks; i++)
+  size_t pos = inpos;
+  while(pos < insize)
+  {
+    size_t length = 0;
+    if(pos > 0)
+    {
+      const unsigned char* foreptr = &in[pos];
+      const unsigned char* lastptr = &in[insize < pos + MAX_SUPPORTED_DEFLATE_LENGTH
+                                         ? insize : pos + MAX_SUPPORTED_DEFLATE_LENGTH];
+      while(foreptr != lastptr && *foreptr == in[pos - 1]) foreptr++;
+      length = (size_t)(foreptr - &in[pos]);
+    }
+
+    if(length >= minmatch)
+    {
+      addLengthDistance(out, length, 1);
+      pos += length;
+    }
+    else
+    {
+      if(!uivector_push_back(out, in[pos])) return 83; /*alloc fail*/
+      pos++;
+    }
+  }
+  return 0;
+}
+
+/*
+Matches of up to 4 bytes further back than this are not used, as in zlib: their distance
+codes and extra bits cost about as much as the literals, and the literals they take away
+make the other literals more expensive.
+*/
+static const unsigned LZ77_TOO_FAR = 4096;
+
+/*
+LZ77-encode the data. Return value is error code. The input are raw bytes, the output
+is in the form of unsigned integers with codes representing for example literal bytes, or
+length/distance pairs.
+It uses a hash table technique to let it encode faster. When doing LZ77 encoding, a
+sliding window (of windowsize) is used, and all past bytes in that window can be used as
+the "dictionary". A brute force search through all possible distances would be slow, and
+this hash technique is one out of several ways to speed this up.
+Matches shorter than minmatch are not used, the search stops at a match of nicematch
+bytes or after maxchain earlier positions. With lazymatching, a match is only taken if
+the next byte does not start a longer one. With lazymatching off and a maxchain of 1,
+only the last position with the same hash is tried, which is the fastest.
+*/
+static unsigned encodeLZ77(uivector* out, Hash* hash,
+                           const unsigned char* in, size_t inpos, size_t insize, unsigned windowsize,
+                           unsigned minmatch, unsigned nicematch, unsigned lazymatching, unsigned maxchain)
+{
+  size_t pos;
+  unsigned i, error = 0;
+  unsigned offset = 0; /*the offset represents the distance in LZ77 terminology*/
+  unsigned length;
+  unsigned lazy = 0;
+  unsigned lazylength = 0, lazyoffset = 0;
+
+  if(minmatch < 3) minmatch = 3;
+  if(nicematch > MAX_SUPPORTED_DEFLATE_LENGTH) nicematch = MAX_SUPPORTED_DEFLATE_LENGTH;
+
+  if(windowsize == 1) return encodeRLE(out, in, inpos, insize, minmatch);
+
+  for(pos = inpos; pos < insize; pos++)
+  {
+    updateHashChain(hash, in, insize, pos, windowsize);
+    length = findMatch(hash, in, pos, insize, windowsize, nicematch, maxchain, &offset);
+    if(length <= 4 && offset > LZ77_TOO_FAR) length = 0;
+
+    if(lazymatching && !lazy && length >= minmatch && length < nicematch)
+    {
+      lazy = 1;
+      lazylength = length;
+      lazyoffset = offset;
+      continue;
+    }
+    if(lazy)
+    {
+      lazy = 0;
+      if(pos == 0) ERROR_BREAK(81);
+      if(length > lazylength + 1)
+      {
+        /*push the previous character as literal*/
+        if(!uivector_push_back(out, in[pos - 1])) ERROR_BREAK(83 /*alloc fail*/);
+      }
+      else
+      {
+        length = lazylength;
+        offset = lazyoffset;
+        pos--;
+      }
+    }
+
+    if(length >= minmatch && offset > windowsize) ERROR_BREAK(86 /*too big (or overflown negative) offset*/);
+
+    /**encode it as length/distance pair or literal value**/
+    if(length < minmatch) /*only lengths of 3 or higher are supported as length/distance pair*/
+    {
+      if(!uivector_push_back(out, in[pos])) ERROR_BREAK(83 /*alloc fail*/);
+    }
+    else
+    {
+      if(length == 3 && offset > 2048)
+      {
+        /*compensate for the fact that longer offsets have more extra bits, a
+        length of only 3 may be not worth it then*/
+        for(i = 0; i < 3; i++)
+        {
+          if(!uivector_push_back(out, in[pos + i])) { error = 83; /*alloc fail*/ break; }
+        }
+        if(error) break;
+      }
+      else
+      {
+        addLengthDistance(out, length, offset);
+      }
+      /*the positions inside the match are added to the hash chains by the next search*/
+      pos += length - 1;
+    }
+  } /*end of the loop through each character of input*/
+
+  return error;
+}
+
+/* /////////////////////////////////////////////////////////////////////////// */
+
+/*the last block is marked as final if final is set*/
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize, unsigned final)
+{
+  /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
+  2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
+
+  size_t i, j, numdeflateblocks = (datasize + 65534) / 65535;
+  unsigned datapos = 0;
+  if(numdeflateblocks == 0 && final) numdeflateblocks = 1;
+  for(i = 0; i < numdeflateblocks; i++)
   {
     unsigned BFINAL, BTYPE, LEN, NLEN;
     unsigned char firstbyte;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = final && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     firstbyte = (unsigned char)(BFINAL + ((BTYPE & 1) << 1) + ((BTYPE & 2) << 1));
@@ -1603,10 +1843,90 @@ static void writeLZ77data(size_t* bp, ucvector* out, const uivector* lz77_encode
   }
 }
 
-/*Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees*/
-static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
-                               const unsigned char* data, size_t datapos, size_t dataend,
-                               const LodePNGCompressSettings* settings, int final)
+/*
+Run-length encode the code lengths of the huffman trees with the repeat codes 16 (copy the previous
+length 3-6 times), 17 (3-10 zeroes) and 18 (11-138 zeroes). Repeat codes can be left out with the
+options 1 (no 16), 2 (no 17) and 4 (no 18), sometimes the tree of the code lengths is smaller then.
+*/
+static void encodeCodeLengths(uivector* out, const unsigned* bitlen, size_t numcodes, unsigned options)
+{
+  size_t i;
+  for(i = 0; i < numcodes; i++)
+  {
+    size_t j = 0; /*amount of repititions*/
+    while(i + j + 1 < numcodes && bitlen[i + j + 1] == bitlen[i]) j++;
+
+    if(bitlen[i] == 0 && j >= 10 && !(options & 4)) /*repeat code 18 supports max 138 zeroes*/
+    {
+      j++; /*include the first zero*/
+      if(j > 138) j = 138;
+      uivector_push_back(out, 18);
+      uivector_push_back(out, (unsigned)(j - 11));
+      i += (j - 1);
+    }
+    else if(bitlen[i] == 0 && j >= 2 && !(options & 2)) /*repeat code 17 supports max 10 zeroes*/
+    {
+      j++; /*include the first zero*/
+      if(j > 10) j = 10;
+      uivector_push_back(out, 17);
+      uivector_push_back(out, (unsigned)(j - 3));
+      i += (j - 1);
+    }
+    else if(j >= 3 && !(options & 1)) /*repeat code for value other than zero*/
+    {
+      size_t k;
+      size_t num = j / 6, rest = j % 6;
+      uivector_push_back(out, bitlen[i]);
+      for(k = 0; k < num; k++)
+      {
+        uivector_push_back(out, 16);
+        uivector_push_back(out, 6 - 3);
+      }
+      if(rest >= 3)
+      {
+        uivector_push_back(out, 16);
+        uivector_push_back(out, (unsigned)(rest - 3));
+      }
+      else j -= rest;
+      i += j;
+    }
+    else /*too short to benefit from repeat code*/
+    {
+      uivector_push_back(out, bitlen[i]);
+    }
+  }
+}
+
+/*counts the lit, len (286) and dist (30) codes of lz77 encoded data, including one end code*/
+static void lz77Frequencies(unsigned* frequencies_ll, unsigned* frequencies_d, const uivector* lz77_encoded)
+{
+  size_t i;
+  for(i = 0; i < 286; i++) frequencies_ll[i] = 0;
+  for(i = 0; i < 30; i++) frequencies_d[i] = 0;
+
+  for(i = 0; i < lz77_encoded->size; i++)
+  {
+    unsigned symbol = lz77_encoded->data[i];
+    frequencies_ll[symbol]++;
+    if(symbol > 256)
+    {
+      unsigned dist = lz77_encoded->data[i + 2];
+      frequencies_d[dist]++;
+      i += 3;
+    }
+  }
+  frequencies_ll[256] = 1; /*there will be exactly 1 end code, at the end of the block*/
+}
+
+/*
+Write a block of type "dynamic", that is, with freely, optimally, created huffman trees, with the
+lz77 encoded data. The trees are made from the frequencies of the 286 lit/len and 30 dist codes, which
+must count the end code. options are those of encodeCodeLengths, and 8 to leave out the unused codes
+at the end of both alphabets.
+*/
+static unsigned writeDynamicBlock(size_t* bp, ucvector* out, const uivector* lz77_encoded,
+                                  const unsigned* frequencies_ll, const unsigned* frequencies_d,
+                                  unsigned options, int final)
 {
   unsigned error = 0;
 
@@ -1621,13 +1941,9 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   the code length code lengths ("clcl").
   */
 
-  /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
-  uivector lz77_encoded;
   HuffmanTree tree_ll; /*tree for lit,len values*/
   HuffmanTree tree_d; /*tree for distance codes*/
   HuffmanTree tree_cl; /*tree for encoding the code lengths representing tree_ll and tree_d*/
-  uivector frequencies_ll; /*frequency of lit,len codes*/
-  uivector frequencies_d; /*frequency of dist codes*/
   uivector frequencies_cl; /*frequency of code length codes*/
   uivector bitlen_lld; /*lit,len,dist code lenghts (int bits), literally (without repeat codes).*/
   uivector bitlen_lld_e; /*bitlen_lld encoded with repeat codes (this is a rudemtary run length compression)*/
@@ -1635,7 +1951,6 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   (these are written as is in the file, it would be crazy to compress these using yet another huffman
   tree that needs to be represented by yet another set of code lengths)*/
   uivector bitlen_cl;
-  size_t datasize = dataend - datapos;
 
   /*
   Due to the huffman compression of huffman tree representations ("two levels"), there are some anologies:
@@ -1648,12 +1963,9 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   size_t numcodes_ll, numcodes_d, i;
   unsigned HLIT, HDIST, HCLEN;
 
-  uivector_init(&lz77_encoded);
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
   HuffmanTree_init(&tree_cl);
-  uivector_init(&frequencies_ll);
-  uivector_init(&frequencies_d);
   uivector_init(&frequencies_cl);
   uivector_init(&bitlen_lld);
   uivector_init(&bitlen_lld_e);
@@ -1663,92 +1975,25 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   allow breaking out of it to the cleanup phase on error conditions.*/
   while(!error)
   {
-    if(settings->use_lz77)
-    {
-      error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize); /*LZ77 encoded*/
-      if(error) break;
-    }
-    else
-    {
-      if(!uivector_resize(&lz77_encoded, datasize)) ERROR_BREAK(83 /*alloc fail*/);
-      for(i = datapos; i < dataend; i++) lz77_encoded.data[i] = data[i]; /*no LZ77, but still will be Huffman compressed*/
-    }
-
-    if(!uivector_resizev(&frequencies_ll, 286, 0)) ERROR_BREAK(83 /*alloc fail*/);
-    if(!uivector_resizev(&frequencies_d, 30, 0)) ERROR_BREAK(83 /*alloc fail*/);
-
-    /*Count the frequencies of lit, len and dist codes*/
-    for(i = 0; i < lz77_encoded.size; i++)
-    {
-      unsigned symbol = lz77_encoded.data[i];
-      frequencies_ll.data[symbol]++;
-      if(symbol > 256)
-      {
-        unsigned dist = lz77_encoded.data[i + 2];
-        frequencies_d.data[dist]++;
-        i += 3;
-      }
-    }
-    frequencies_ll.data[256] = 1; /*there will be exactly 1 end code, at the end of the block*/
-
     /*Make both huffman trees, one for the lit and len codes, one for the dist codes*/
-    error = HuffmanTree_makeFromFrequencies(&tree_ll, frequencies_ll.data, frequencies_ll.size, 15);
+    error = HuffmanTree_makeFromFrequencies(&tree_ll, frequencies_ll, 286, 15);
     if(error) break;
-    error = HuffmanTree_makeFromFrequencies(&tree_d, frequencies_d.data, frequencies_d.size, 15);
+    error = HuffmanTree_makeFromFrequencies(&tree_d, frequencies_d, 30, 15);
     if(error) break;
 
     numcodes_ll = tree_ll.numcodes; if(numcodes_ll > 286) numcodes_ll = 286;
     numcodes_d = tree_d.numcodes; if(numcodes_d > 30) numcodes_d = 30;
+    if(options & 8)
+    {
+      while(numcodes_ll > 257 && HuffmanTree_getLength(&tree_ll, (unsigned)numcodes_ll - 1) == 0) numcodes_ll--;
+      while(numcodes_d > 1 && HuffmanTree_getLength(&tree_d, (unsigned)numcodes_d - 1) == 0) numcodes_d--;
+    }
     /*store the code lengths of both generated trees in bitlen_lld*/
     for(i = 0; i < numcodes_ll; i++) uivector_push_back(&bitlen_lld, HuffmanTree_getLength(&tree_ll, (unsigned)i));
     for(i = 0; i < numcodes_d; i++) uivector_push_back(&bitlen_lld, HuffmanTree_getLength(&tree_d, (unsigned)i));
 
-    /*run-length compress bitlen_ldd into bitlen_lld_e by using repeat codes 16 (copy length 3-6 times),
-    17 (3-10 zeroes), 18 (11-138 zeroes)*/
-    for(i = 0; i < (unsigned)bitlen_lld.size; i++)
-    {
-      unsigned j = 0; /*amount of repititions*/
-      while(i + j + 1 < (unsigned)bitlen_lld.size && bitlen_lld.data[i + j + 1] == bitlen_lld.data[i]) j++;
-
-      if(bitlen_lld.data[i] == 0 && j >= 2) /*repeat code for zeroes*/
-      {
-        j++; /*include the first zero*/
-        if(j <= 10) /*repeat code 17 supports max 10 zeroes*/
-        {
-          uivector_push_back(&bitlen_lld_e, 17);
-          uivector_push_back(&bitlen_lld_e, j - 3);
-        }
-        else /*repeat code 18 supports max 138 zeroes*/
-        {
-          if(j > 138) j = 138;
-          uivector_push_back(&bitlen_lld_e, 18);
-          uivector_push_back(&bitlen_lld_e, j - 11);
-        }
-        i += (j - 1);
-      }
-      else if(j >= 3) /*repeat code for value other than zero*/
-      {
-        size_t k;
-        unsigned num = j / 6, rest = j % 6;
-        uivector_push_back(&bitlen_lld_e, bitlen_lld.data[i]);
-        for(k = 0; k < num; k++)
-        {
-          uivector_push_back(&bitlen_lld_e, 16);
-          uivector_push_back(&bitlen_lld_e, 6 - 3);
-        }
-        if(rest >= 3)
-        {
-          uivector_push_back(&bitlen_lld_e, 16);
-          uivector_push_back(&bitlen_lld_e, rest - 3);
-        }
-        else j -= rest;
-        i += j;
-      }
-      else /*too short to benefit from repeat code*/
-      {
-        uivector_push_back(&bitlen_lld_e, bitlen_lld.data[i]);
-      }
-    }
+    /*run-length compress bitlen_ldd into bitlen_lld_e*/
+    encodeCodeLengths(&bitlen_lld_e, bitlen_lld.data, bitlen_lld.size, options);
 
     /*generate tree_cl, the huffmantree of huffmantrees*/
 
@@ -1819,7 +2064,7 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
     }
 
     /*write the compressed data symbols*/
-    writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
+    writeLZ77data(bp, out, lz77_encoded, &tree_ll, &tree_d);
     /*error: the length of the end code 256 must be larger than 0*/
     if(HuffmanTree_getLength(&tree_ll, 256) == 0) ERROR_BREAK(64);
 
@@ -1830,12 +2075,9 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   }
 
   /*cleanup*/
-  uivector_cleanup(&lz77_encoded);
   HuffmanTree_cleanup(&tree_ll);
   HuffmanTree_cleanup(&tree_d);
   HuffmanTree_cleanup(&tree_cl);
-  uivector_cleanup(&frequencies_ll);
-  uivector_cleanup(&frequencies_d);
   uivector_cleanup(&frequencies_cl);
   uivector_cleanup(&bitlen_lld_e);
   uivector_cleanup(&bitlen_lld);
@@ -1844,45 +2086,32 @@ static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
-                             const unsigned char* data,
-                             size_t datapos, size_t dataend,
-                             const LodePNGCompressSettings* settings, int final)
+/*write a block with the fixed huffman trees of deflate and the lz77 encoded data*/
+static unsigned writeFixedBlock(size_t* bp, ucvector* out, const uivector* lz77_encoded, int final)
 {
   HuffmanTree tree_ll; /*tree for literal values and length codes*/
   HuffmanTree tree_d; /*tree for distance codes*/
 
   unsigned BFINAL = final;
   unsigned error = 0;
-  size_t i;
 
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
 
-  generateFixedLitLenTree(&tree_ll);
-  generateFixedDistanceTree(&tree_d);
-
-  addBitToStream(bp, out, BFINAL);
-  addBitToStream(bp, out, 1); /*first bit of BTYPE*/
-  addBitToStream(bp, out, 0); /*second bit of BTYPE*/
+  error = generateFixedLitLenTree(&tree_ll);
+  if(!error) error = generateFixedDistanceTree(&tree_d);
 
-  if(settings->use_lz77) /*LZ77 encoded*/
-  {
-    uivector lz77_encoded;
-    uivector_init(&lz77_encoded);
-    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize);
-    if(!error) writeLZ77data(bp, out, &lz77_encoded, &tree_ll, &tree_d);
-    uivector_cleanup(&lz77_encoded);
-  }
-  else /*no LZ77, but still will be Huffman compressed*/
+  if(!error)
   {
-    for(i = datapos; i < dataend; i++)
-    {
-      addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, data[i]), HuffmanTree_getLength(&tree_ll, data[i]));
-    }
+    addBitToStream(bp, out, BFINAL);
+    addBitToStream(bp, out, 1); /*first bit of BTYPE*/
+    addBitToStream(bp, out, 0); /*second bit of BTYPE*/
+
+    writeLZ77data(bp, out, lz77_encoded, &tree_ll, &tree_d);
+
+    /*add END code*/
+    addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
   }
-  /*add END code*/
-  if(!error) addHuffmanSymbol(bp, out, HuffmanTree_getCode(&tree_ll, 256), HuffmanTree_getLength(&tree_ll, 256));
 
   /*cleanup*/
   HuffmanTree_cleanup(&tree_ll);
@@ -1891,157 +2120,717 @@ static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
   return error;
 }
 
-static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings)
+/*
+Change the frequencies so that the code lengths made from them run-length encode better, like
+zopfli does: stretches of frequencies close to each other are all set to their average, unless
+they are in a long run of the same frequency already. Unused codes at the end stay unused, and
+used codes keep a frequency of at least 1. numcodes must be at most 286.
+*/
+static void optimizeHuffmanForRLE(unsigned* frequencies, size_t numcodes)
 {
-#if LODEPNG_CUSTOM_ZLIB_ENCODER == 2
-  if(settings->custom_encoder)
-  {
-    unsigned char** out2 = &out->data;
-    size_t* outsize = &out->size;
+  unsigned char good[286]; /*whether the frequency is in a run that is encoded well already*/
+  size_t i, k, stride, sum, limit;
+  unsigned symbol;
 
-    unsigned error = lodepng_custom_deflate(out2, outsize, in, insize, settings);
+  while(numcodes > 0 && frequencies[numcodes - 1] == 0) numcodes--;
+  if(numcodes == 0) return;
 
-    if(!error) ucvector_init_buffer(out, *out2, *outsize);
-    return error;
-  }
-  else
+  /*runs of at least 5 zeroes or 7 times another frequency are kept*/
+  for(i = 0; i < numcodes; i++) good[i] = 0;
+  symbol = frequencies[0];
+  stride = 0;
+  for(i = 0; i <= numcodes; i++)
   {
-#endif /*LODEPNG_CUSTOM_ZLIB_ENCODER == 2*/
-    unsigned error = 0;
-    size_t i, blocksize, numdeflateblocks;
-    size_t bp = 0; /*the bit pointer*/
-    Hash hash;
-
-    if(settings->btype > 2) return 61;
-
-    if(settings->btype == 0) return deflateNoCompression(out, in, insize);
-
-    if(settings->btype == 1) blocksize = insize;
-    else /*if(settings->btype == 2)*/
+    if(i == numcodes || frequencies[i] != symbol)
     {
-      blocksize = insize / 8 + 8;
-      if(blocksize < 65535) blocksize = 65535;
+      if((symbol == 0 && stride >= 5) || (symbol != 0 && stride >= 7))
+      {
+        for(k = 0; k < stride; k++) good[i - k - 1] = 1;
+      }
+      stride = 1;
+      if(i != numcodes) symbol = frequencies[i];
     }
+    else stride++;
+  }
 
-    numdeflateblocks = (insize + blocksize - 1) / blocksize;
-    if(numdeflateblocks == 0) numdeflateblocks = 1;
-
-    error = hash_init(&hash, settings->windowsize);
-    if(error) return error;
-
-    for(i = 0; i < numdeflateblocks && !error; i++)
+  /*a stretch ends at a kept run or at a frequency that differs 4 or more from its average*/
+  stride = 0;
+  sum = 0;
+  limit = frequencies[0];
+  for(i = 0; i <= numcodes; i++)
+  {
+    if(i == numcodes || good[i]
+       || (frequencies[i] > limit ? frequencies[i] - limit : limit - frequencies[i]) >= 4)
     {
-      int final = i == numdeflateblocks - 1;
-      size_t start = i * blocksize;
-      size_t end = start + blocksize;
-      if(end > insize) end = insize;
-
-      if(settings->btype == 1) error = deflateFixed(out, &bp, &hash, in, start, end, settings, final);
-      else if(settings->btype == 2) error = deflateDynamic(out, &bp, &hash, in, start, end, settings, final);
+      if(stride >= 4 || (stride >= 3 && sum == 0))
+      {
+        /*a stretch of zeroes stays zero*/
+        unsigned count = sum == 0 ? 0 : (unsigned)((sum + stride / 2) / stride);
+        if(sum != 0 && count < 1) count = 1;
+        for(k = 0; k < stride; k++) frequencies[i - k - 1] = count;
+      }
+      stride = 0;
+      sum = 0;
+      if(i + 3 < numcodes)
+      {
+        limit = ((size_t)frequencies[i] + frequencies[i + 1] + frequencies[i + 2] + frequencies[i + 3] + 2) / 4;
+      }
+      else if(i < numcodes) limit = frequencies[i];
+      else limit = 0;
     }
-
-    hash_cleanup(&hash);
-
-    return error;
-#if LODEPNG_CUSTOM_ZLIB_ENCODER == 2
+    stride++;
+    if(i != numcodes) sum += frequencies[i];
   }
-#endif /*LODEPNG_CUSTOM_ZLIB_ENCODER == 2*/
 }
 
-unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
-                         const unsigned char* in, size_t insize,
-                         const LodePNGCompressSettings* settings)
+/*
+Write the lz77 encoded data in the smallest block out of a block with the fixed trees, and dynamic
+blocks with trees made from the frequencies as counted and as changed by optimizeHuffmanForRLE, each
+with all ways to run-length encode their code lengths. For settings->optimal.
+*/
+static unsigned writeSmallestBlock(size_t* bp, ucvector* out, const uivector* lz77_encoded, int final)
 {
+  unsigned frequencies_ll[286], frequencies_d[30]; /*as counted*/
+  unsigned rle_ll[286], rle_d[30]; /*changed to run-length encode better*/
+  unsigned variant, best = 16; /*16 is the fixed block*/
+  size_t bits = 0, smallest;
   unsigned error;
-  ucvector v;
-  ucvector_init_buffer(&v, *out, *outsize);
-  error = lodepng_deflatev(&v, in, insize, settings);
-  *out = v.data;
-  *outsize = v.size;
-  return error;
-}
-
-#endif /*LODEPNG_COMPILE_DECODER*/
+  ucvector scratch;
 
-/* ////////////////////////////////////////////////////////////////////////// */
-/* / Adler32                                                                  */
-/* ////////////////////////////////////////////////////////////////////////// */
+  lz77Frequencies(frequencies_ll, frequencies_d, lz77_encoded);
+  memcpy(rle_ll, frequencies_ll, sizeof(rle_ll));
+  memcpy(rle_d, frequencies_d, sizeof(rle_d));
+  optimizeHuffmanForRLE(rle_ll, 286);
+  optimizeHuffmanForRLE(rle_d, 30);
 
-static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
-{
-   unsigned s1 = adler & 0xffff;
-   unsigned s2 = (adler >> 16) & 0xffff;
+  ucvector_init(&scratch);
+  error = writeFixedBlock(&bits, &scratch, lz77_encoded, final);
+  smallest = bits;
 
-  while(len > 0)
+  for(variant = 0; variant < 16 && !error; variant++)
   {
-    /*at least 5550 sums can be done before the sums overflow, saving a lot of module divisions*/
-    unsigned amount = len > 5550 ? 5550 : len;
-    len -= amount;
-    while(amount > 0)
+    bits = 0;
+    if(!ucvector_resize(&scratch, 0)) error = 83; /*alloc fail*/
+    else error = writeDynamicBlock(&bits, &scratch, lz77_encoded, variant & 8 ? rle_ll : frequencies_ll,
+                                   variant & 8 ? rle_d : frequencies_d, (variant & 7) | 8, final);
+    if(bits < smallest)
     {
-      s1 = (s1 + *data++);
-      s2 = (s2 + s1);
-      amount--;
+      smallest = bits;
+      best = variant;
     }
-    s1 %= 65521;
-    s2 %= 65521;
   }
+  ucvector_cleanup(&scratch);
+  if(error) return error;
 
-  return (s2 << 16) | s1;
+  if(best == 16) return writeFixedBlock(bp, out, lz77_encoded, final);
+  return writeDynamicBlock(bp, out, lz77_encoded, best & 8 ? rle_ll : frequencies_ll,
+                           best & 8 ? rle_d : frequencies_d, (best & 7) | 8, final);
 }
 
-/*Return the adler32 of the bytes data[0..len-1]*/
-static unsigned adler32(const unsigned char* data, unsigned len)
+/*
+The size in bits of the dynamic block writeDynamicBlock writes with these frequencies and options 0,
+without writing the symbols: the trees and end code as written for no symbols, plus the code lengths
+and extra bits of each counted symbol.
+*/
+static unsigned dynamicBlockBits(size_t* bits, const unsigned* frequencies_ll, const unsigned* frequencies_d,
+                                 int final)
 {
-  return update_adler32(1L, data, len);
-}
-
-/* ////////////////////////////////////////////////////////////////////////// */
-/* / Zlib                                                                   / */
-/* ////////////////////////////////////////////////////////////////////////// */
-
-#ifdef LODEPNG_COMPILE_DECODER
+  unsigned lengths_ll[286], lengths_d[30];
+  unsigned i, error;
+  uivector none;
+  ucvector header;
 
-unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
-                                 size_t insize, const LodePNGDecompressSettings* settings)
-{
-#if LODEPNG_CUSTOM_ZLIB_DECODER == 1
-  if(settings->custom_decoder)
+  uivector_init(&none);
+  ucvector_init(&header);
+  memset(lengths_ll, 0, sizeof(lengths_ll));
+  memset(lengths_d, 0, sizeof(lengths_d));
+
+  *bits = 0;
+  error = writeDynamicBlock(bits, &header, &none, frequencies_ll, frequencies_d, 0, final);
+  if(!error) error = lodepng_huffman_code_lengths(lengths_ll, frequencies_ll, 286, 15);
+  if(!error) error = lodepng_huffman_code_lengths(lengths_d, frequencies_d, 30, 15);
+  for(i = 0; i < 286; i++)
   {
-    return lodepng_custom_zlib_decompress(out, outsize, in, insize, settings);
+    if(i == 256) continue; /*already counted*/
+    *bits += (size_t)frequencies_ll[i] * (lengths_ll[i] + (i > 256 ? LENGTHEXTRA[i - 257] : 0));
   }
-  else
-  {
-#endif /*LODEPNG_CUSTOM_ZLIB_DECODER == 1*/
-    unsigned error = 0;
-    unsigned CM, CINFO, FDICT;
-
-    if(insize < 2) return 53; /*error, size of zlib data too small*/
-    /*read information from zlib header*/
-    if((in[0] * 256 + in[1]) % 31 != 0)
-    {
-      /*error: 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way*/
-      return 24;
-    }
+  for(i = 0; i < 30; i++) *bits += (size_t)frequencies_d[i] * (lengths_d[i] + DISTANCEEXTRA[i]);
 
-    CM = in[0] & 15;
-    CINFO = (in[0] >> 4) & 15;
-    /*FCHECK = in[1] & 31;*/ /*FCHECK is already tested above*/
-    FDICT = (in[1] >> 5) & 1;
-    /*FLEVEL = (in[1] >> 6) & 3;*/ /*FLEVEL is not used here*/
+  uivector_cleanup(&none);
+  ucvector_cleanup(&header);
+  return error;
+}
 
-    if(CM != 8 || CINFO > 7)
-    {
-      /*error: only compression method 8: inflate with sliding window of 32k is supported by the PNG spec*/
-      return 25;
-    }
-    if(FDICT != 0)
+/*
+Write the lz77 encoded data of data[datapos..dataend) in a dynamic block, or the same data encoded
+with runs only if that block is smaller. Short matches far back can cost more bits than the literals
+they replace, e.g. in photos, while runs rarely do. For settings->tryrle.
+*/
+static unsigned writeSmallerThanRLE(size_t* bp, ucvector* out, const uivector* lz77_encoded,
+                                    const unsigned char* data, size_t datapos, size_t dataend,
+                                    unsigned minmatch, int final)
+{
+  unsigned frequencies_ll[286], frequencies_d[30]; /*of lz77_encoded*/
+  unsigned rle_ll[286], rle_d[30]; /*of the runs only encoding*/
+  size_t lz77bits = 0, rlebits = 0;
+  unsigned error;
+  uivector rle_encoded;
+
+  uivector_init(&rle_encoded);
+
+  error = encodeRLE(&rle_encoded, data, datapos, dataend, minmatch < 3 ? 3 : minmatch);
+  lz77Frequencies(frequencies_ll, frequencies_d, lz77_encoded);
+  if(!error) lz77Frequencies(rle_ll, rle_d, &rle_encoded);
+  if(!error) error = dynamicBlockBits(&lz77bits, frequencies_ll, frequencies_d, final);
+  if(!error) error = dynamicBlockBits(&rlebits, rle_ll, rle_d, final);
+
+  if(!error && rlebits < lz77bits) error = writeDynamicBlock(bp, out, &rle_encoded, rle_ll, rle_d, 0, final);
+  else if(!error) error = writeDynamicBlock(bp, out, lz77_encoded, frequencies_ll, frequencies_d, 0, final);
+
+  uivector_cleanup(&rle_encoded);
+  return error;
+}
+
+/*
+The costs of the symbols for optimal parsing: the lengths of their huffman codes for the frequencies,
+and the maximum length for unused codes.
+*/
+static unsigned symbolCosts(unsigned* costs_ll, unsigned* costs_d,
+                            const unsigned* frequencies_ll, const unsigned* frequencies_d)
+{
+  unsigned i, error = lodepng_huffman_code_lengths(costs_ll, frequencies_ll, 286, 15);
+  if(!error) error = lodepng_huffman_code_lengths(costs_d, frequencies_d, 30, 15);
+  for(i = 0; i < 286; i++) if(costs_ll[i] == 0) costs_ll[i] = 15;
+  for(i = 0; i < 30; i++) if(costs_d[i] == 0) costs_d[i] = 15;
+  return error;
+}
+
+/*
+Append the symbols of the path of literals and matches through in[inpos..insize) with the lowest
+total cost to out. The matches of position i are the pairs of length and distance matches[first[i]]
+up to matches[first[i + 1]], see findAllMatches. costs, lengths and dists have room for the number
+of positions plus one.
+*/
+static unsigned encodeCheapestPath(uivector* out, const unsigned char* in, size_t inpos, size_t insize,
+                                   const uivector* matches, const uivector* first,
+                                   const unsigned* costs_ll, const unsigned* costs_d,
+                                   size_t* costs, unsigned short* lengths, unsigned short* dists)
+{
+  unsigned lengthcosts[259]; /*cost of the length code and its extra bits*/
+  unsigned length, k, error = 0;
+  size_t n = insize - inpos, i, runstart = 0, runend = 0;
+  uivector path; /*the positions the steps of the path end at, from the last*/
+
+  for(length = 3; length <= 258; length++)
+  {
+    unsigned code = (unsigned)searchCodeIndex(LENGTHBASE, 29, length);
+    lengthcosts[length] = costs_ll[FIRST_LENGTH_CODE_INDEX + code] + LENGTHEXTRA[code];
+  }
+
+  costs[0] = 0;
+  for(i = 1; i <= n; i++) costs[i] = (size_t)(-1);
+
+  for(i = 0; i < n; i++)
+  {
+    size_t cost = costs[i];
+    unsigned char value = in[inpos + i];
+
+    if(i >= runend)
+    {
+      runstart = i;
+      runend = i + 1;
+      while(runend < n && in[inpos + runend] == value) runend++;
+    }
+
+    /*deep inside a long run of the same byte, only the longest match at distance 1 is tried*/
+    if(i > runstart + 258 && runend - i > 2 * 258)
+    {
+      size_t total = cost + lengthcosts[258] + costs_d[0];
+      if(total < costs[i + 258])
+      {
+        costs[i + 258] = total;
+        lengths[i + 258] = 258;
+        dists[i + 258] = 1;
+      }
+      continue;
+    }
+
+    if(cost + costs_ll[value] < costs[i + 1])
+    {
+      costs[i + 1] = cost + costs_ll[value];
+      lengths[i + 1] = 1;
+      dists[i + 1] = 0;
+    }
+
+    /*all lengths up to the length of a pair can use its distance*/
+    length = 3;
+    for(k = first->data[i]; k < first->data[i + 1]; k += 2)
+    {
+      unsigned code = (unsigned)searchCodeIndex(DISTANCEBASE, 30, matches->data[k + 1]);
+      size_t distcost = cost + costs_d[code] + DISTANCEEXTRA[code];
+      for(; length <= matches->data[k]; length++)
+      {
+        size_t total = distcost + lengthcosts[length];
+        if(total < costs[i + length])
+        {
+          costs[i + length] = total;
+          lengths[i + length] = (unsigned short)length;
+          dists[i + length] = (unsigned short)matches->data[k + 1];
+        }
+      }
+    }
+  }
+
+  /*follow the path back from the end, and encode it from the start*/
+  uivector_init(&path);
+  for(i = n; i > 0 && !error; i -= lengths[i])
+  {
+    if(!uivector_push_back(&path, (unsigned)i)) error = 83; /*alloc fail*/
+  }
+  for(i = path.size; i > 0 && !error; i--)
+  {
+    size_t end = path.data[i - 1];
+    if(lengths[end] == 1)
+    {
+      if(!uivector_push_back(out, in[inpos + end - 1])) error = 83; /*alloc fail*/
+    }
+    else addLengthDistance(out, lengths[end], dists[end]);
+  }
+  uivector_cleanup(&path);
+
+  return error;
+}
+
+/*
+LZ77-encode the data with optimal parsing, the way zopfli does. All matches at every position are
+searched once. Then the path of literals and matches with the lowest cost is found for the costs of
+the fixed tree, and again settings->optimal - 1 times for the costs of the huffman codes of the
+previous path, or until the symbols of the path no longer change. out, which must be empty, gets
+the path that gives the smallest dynamic block. Costs are in whole bits, so that the result does
+not depend on floating point rounding.
+*/
+static unsigned encodeOptimal(uivector* out, Hash* hash, const unsigned char* in, size_t inpos, size_t insize,
+                              const LodePNGCompressSettings* settings)
+{
+  unsigned costs_ll[286], costs_d[30];
+  unsigned frequencies_ll[286], frequencies_d[30];
+  unsigned previous_ll[286], previous_d[30];
+  size_t n = insize - inpos, i, smallest = 0;
+  unsigned start, iteration, error = 0;
+  uivector matches; /*pairs of length and distance, see findAllMatches*/
+  uivector first; /*index in matches of the first pair of each position*/
+  uivector path;
+  ucvector scratch;
+  size_t* costs;
+  unsigned short* lengths;
+  unsigned short* dists;
+
+  uivector_init(&matches);
+  uivector_init(&first);
+  uivector_init(&path);
+  ucvector_init(&scratch);
+  costs = (size_t*)mymalloc((n + 1) * sizeof(size_t));
+  lengths = (unsigned short*)mymalloc((n + 1) * sizeof(unsigned short));
+  dists = (unsigned short*)mymalloc((n + 1) * sizeof(unsigned short));
+  if(!costs || !lengths || !dists || !uivector_resize(&first, n + 1)) error = 83; /*alloc fail*/
+
+  for(i = 0; i < n && !error; i++)
+  {
+    first.data[i] = (unsigned)matches.size;
+    updateHashChain(hash, in, insize, inpos + i, settings->windowsize);
+    error = findAllMatches(&matches, hash, in, inpos + i, insize, settings->windowsize, settings->maxchain);
+  }
+  if(!error) first.data[n] = (unsigned)matches.size;
+
+  for(start = 0; start < 2 && !error; start++)
+  {
+    if(start == 0)
+    {
+      /*the code lengths of the fixed tree, which make matches cheap*/
+      for(i = 0; i < 286; i++) costs_ll[i] = i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8));
+      for(i = 0; i < 30; i++) costs_d[i] = 5;
+    }
+    else
+    {
+      /*the code lengths for the data as literals, which make matches expensive*/
+      for(i = 0; i < 286; i++) frequencies_ll[i] = 0;
+      for(i = 0; i < 30; i++) frequencies_d[i] = 0;
+      for(i = inpos; i < insize; i++) frequencies_ll[in[i]]++;
+      frequencies_ll[256] = 1;
+      error = symbolCosts(costs_ll, costs_d, frequencies_ll, frequencies_d);
+    }
+
+    for(iteration = 0; iteration < settings->optimal && !error; iteration++)
+    {
+      size_t bits = 0;
+      if(!uivector_resize(&path, 0) || !ucvector_resize(&scratch, 0)) ERROR_BREAK(83 /*alloc fail*/);
+      error = encodeCheapestPath(&path, in, inpos, insize, &matches, &first, costs_ll, costs_d,
+                                 costs, lengths, dists);
+      if(error) break;
+
+      lz77Frequencies(frequencies_ll, frequencies_d, &path);
+      error = writeDynamicBlock(&bits, &scratch, &path, frequencies_ll, frequencies_d, 8, 0);
+      if(error) break;
+
+      if((start == 0 && iteration == 0) || bits < smallest)
+      {
+        /*keep the path, out gets the previous one to be overwritten*/
+        uivector temp = *out;
+        *out = path;
+        path = temp;
+        smallest = bits;
+      }
+
+      /*the same costs give the same path again*/
+      if(iteration > 0 && memcmp(frequencies_ll, previous_ll, sizeof(previous_ll)) == 0
+         && memcmp(frequencies_d, previous_d, sizeof(previous_d)) == 0) break;
+      memcpy(previous_ll, frequencies_ll, sizeof(previous_ll));
+      memcpy(previous_d, frequencies_d, sizeof(previous_d));
+
+      error = symbolCosts(costs_ll, costs_d, frequencies_ll, frequencies_d);
+    }
+  }
+
+  myfree(costs);
+  myfree(lengths);
+  myfree(dists);
+  uivector_cleanup(&matches);
+  uivector_cleanup(&first);
+  uivector_cleanup(&path);
+  ucvector_cleanup(&scratch);
+
+  return error;
+}
+
+/*
+Deflate for a block of type "dynamic", that is, with freely, optimally, created huffman trees.
+With settings->optimal, the lz77 encoding is done by encodeOptimal and the smallest way to write
+it is searched, which may also be a block with the fixed trees.
+*/
+static unsigned deflateDynamic(ucvector* out, size_t* bp, Hash* hash,
+                               const unsigned char* data, size_t datapos, size_t dataend,
+                               const LodePNGCompressSettings* settings, int final)
+{
+  unsigned error = 0;
+  /*The lz77 encoded data, represented with integers since there will also be length and distance codes in it*/
+  uivector lz77_encoded;
+  unsigned frequencies_ll[286]; /*frequency of lit,len codes*/
+  unsigned frequencies_d[30]; /*frequency of dist codes*/
+  size_t i;
+
+  uivector_init(&lz77_encoded);
+
+  if(settings->use_lz77 && settings->optimal && settings->windowsize > 1)
+  {
+    error = encodeOptimal(&lz77_encoded, hash, data, datapos, dataend, settings);
+  }
+  else if(settings->use_lz77)
+  {
+    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                       settings->minmatch, settings->nicematch, settings->lazymatching, settings->maxchain); /*LZ77 encoded*/
+  }
+  else
+  {
+    if(!uivector_resize(&lz77_encoded, dataend - datapos)) error = 83; /*alloc fail*/
+    /*no LZ77, but still will be Huffman compressed*/
+    else for(i = datapos; i < dataend; i++) lz77_encoded.data[i - datapos] = data[i];
+  }
+
+  if(!error && settings->optimal) error = writeSmallestBlock(bp, out, &lz77_encoded, final);
+  else if(!error && settings->tryrle && settings->use_lz77 && settings->windowsize > 1)
+  {
+    error = writeSmallerThanRLE(bp, out, &lz77_encoded, data, datapos, dataend, settings->minmatch, final);
+  }
+  else if(!error)
+  {
+    lz77Frequencies(frequencies_ll, frequencies_d, &lz77_encoded);
+    error = writeDynamicBlock(bp, out, &lz77_encoded, frequencies_ll, frequencies_d, 0, final);
+  }
+
+  uivector_cleanup(&lz77_encoded);
+
+  return error;
+}
+
+static unsigned deflateFixed(ucvector* out, size_t* bp, Hash* hash,
+                             const unsigned char* data,
+                             size_t datapos, size_t dataend,
+                             const LodePNGCompressSettings* settings, int final)
+{
+  uivector lz77_encoded;
+  unsigned error = 0;
+  size_t i;
+
+  uivector_init(&lz77_encoded);
+
+  if(settings->use_lz77) /*LZ77 encoded*/
+  {
+    error = encodeLZ77(&lz77_encoded, hash, data, datapos, dataend, settings->windowsize,
+                       settings->minmatch, settings->nicematch, settings->lazymatching, settings->maxchain);
+  }
+  else /*no LZ77, but still will be Huffman compressed*/
+  {
+    for(i = datapos; i < dataend && !error; i++)
     {
-      /*error: the specification of PNG says about the zlib stream:
-        "The additional flags shall not specify a preset dictionary."*/
-      return 26;
+      if(!uivector_push_back(&lz77_encoded, data[i])) error = 83; /*alloc fail*/
     }
+  }
+
+  if(!error) error = writeFixedBlock(bp, out, &lz77_encoded, final);
+
+  uivector_cleanup(&lz77_encoded);
+
+  return error;
+}
+
+/*
+Deflates in[start..end) with btype 1 or 2, the data of the window before start serves as
+dictionary. The last block is marked as final if final is set. bp is the bit pointer in out.
+With a blocksize of 0, the size of the dynamic blocks is chosen from the size of the data.
+If hash is not 0, it is an empty hash table with chains for a window of 32768 bytes that
+is used instead of allocating one, and left empty again.
+*/
+static unsigned deflateRange(ucvector* out, size_t* bp, Hash* hash, const unsigned char* in,
+                             size_t start, size_t end, size_t blocksize, unsigned final,
+                             const LodePNGCompressSettings* settings)
+{
+  unsigned error = 0;
+  size_t i, numdeflateblocks, first;
+  Hash local;
+
+  if(settings->windowsize == 0 || settings->windowsize > 32768) return 60;
+  if((settings->windowsize & (settings->windowsize - 1)) != 0) return 90; /*not a power of two*/
+
+  if(settings->btype == 1) blocksize = end - start;
+  else if(blocksize == 0) /*btype 2*/
+  {
+    blocksize = (end - start) / 8 + 8;
+    if(blocksize < 65535) blocksize = 65535;
+  }
+
+  numdeflateblocks = (end - start + blocksize - 1) / blocksize;
+  if(numdeflateblocks == 0) numdeflateblocks = 1;
+
+  if(!hash)
+  {
+    hash = &local;
+    error = hash_init(hash, settings->windowsize);
+    if(error)
+    {
+      hash_cleanup(hash);
+      return error;
+    }
+  }
+  hash->next = hash->base = first = start > settings->windowsize ? start - settings->windowsize : 0;
+
+  for(i = 0; i < numdeflateblocks && !error; i++)
+  {
+    int blockfinal = final && i == numdeflateblocks - 1;
+    size_t blockstart = start + i * blocksize;
+    size_t blockend = blockstart + blocksize;
+    if(blockend > end) blockend = end;
+
+    if(settings->btype == 1) error = deflateFixed(out, bp, hash, in, blockstart, blockend, settings, blockfinal);
+    else if(settings->btype == 2) error = deflateDynamic(out, bp, hash, in, blockstart, blockend, settings, blockfinal);
+  }
+
+  if(hash == &local) hash_cleanup(hash);
+  else hash_reset(hash, in, first);
+
+  return error;
+}
+
+/*hash is an empty hash table for a window of 32768 bytes, or 0 to allocate one*/
+static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
+                                 const LodePNGCompressSettings* settings, Hash* hash)
+{
+#if LODEPNG_CUSTOM_ZLIB_ENCODER == 2
+  if(settings->custom_encoder)
+  {
+    unsigned char** out2 = &out->data;
+    size_t* outsize = &out->size;
+
+    unsigned error = lodepng_custom_deflate(out2, outsize, in, insize, settings);
+
+    if(!error) ucvector_init_buffer(out, *out2, *outsize);
+    return error;
+  }
+  else
+  {
+#endif /*LODEPNG_CUSTOM_ZLIB_ENCODER == 2*/
+    size_t bp = 0; /*the bit pointer*/
+
+    if(settings->btype > 2) return 61;
+
+    if(settings->btype == 0) return deflateNoCompression(out, in, insize, 1);
+
+    return deflateRange(out, &bp, hash, in, 0, insize, 0, 1, settings);
+#if LODEPNG_CUSTOM_ZLIB_ENCODER == 2
+  }
+#endif /*LODEPNG_CUSTOM_ZLIB_ENCODER == 2*/
+}
+
+unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
+                         const unsigned char* in, size_t insize,
+                         const LodePNGCompressSettings* settings)
+{
+  unsigned error;
+  ucvector v;
+  ucvector_init_buffer(&v, *out, *outsize);
+  error = lodepng_deflatev(&v, in, insize, settings, 0);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Adler32                                                                  */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+#ifdef LODEPNG_SSE2
+/*sum of the four 32-bit elements*/
+static unsigned hsum32SSE2(__m128i v)
+{
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (unsigned)_mm_cvtsi128_si32(v);
+}
+#endif /*LODEPNG_SSE2*/
+
+static unsigned update_adler32(unsigned adler, const unsigned char* data, unsigned len)
+{
+  unsigned s1 = adler & 0xffff;
+  unsigned s2 = (adler >> 16) & 0xffff;
+
+  while(len > 0)
+  {
+    /*at most 5552 sums can be done before s2 overflows, saving a lot of module divisions*/
+    unsigned amount = len > 5552 ? 5552 : len;
+    len -= amount;
+
+#ifdef LODEPNG_SSE2
+    if(amount >= 16)
+    {
+      /*
+      For 16 bytes d[0..15], s1 grows by the sum of d[k] and s2 grows by 16 times
+      the old s1 plus the sum of (16 - k) * d[k]. The sums are kept in vectors and
+      the old values of s1 are collected in ps, s1 and s2 are only updated at the end.
+      */
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i weights_lo = _mm_set_epi16(9, 10, 11, 12, 13, 14, 15, 16);
+      const __m128i weights_hi = _mm_set_epi16(1, 2, 3, 4, 5, 6, 7, 8);
+      __m128i vs1 = zero, vs2 = zero, vps = zero;
+      unsigned blocks = amount / 16, n;
+
+      for(n = 0; n < blocks; n++)
+      {
+        __m128i d = _mm_loadu_si128((const __m128i*)data);
+        vps = _mm_add_epi32(vps, vs1);
+        vs1 = _mm_add_epi32(vs1, _mm_sad_epu8(d, zero));
+        vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpacklo_epi8(d, zero), weights_lo));
+        vs2 = _mm_add_epi32(vs2, _mm_madd_epi16(_mm_unpackhi_epi8(d, zero), weights_hi));
+        data += 16;
+      }
+
+      s2 += s1 * blocks * 16 + hsum32SSE2(_mm_add_epi32(vs2, _mm_slli_epi32(vps, 4)));
+      s1 += hsum32SSE2(vs1);
+      amount -= blocks * 16;
+    }
+#endif /*LODEPNG_SSE2*/
+
+    while(amount > 0)
+    {
+      s1 = (s1 + *data++);
+      s2 = (s2 + s1);
+      amount--;
+    }
+    s1 %= 65521;
+    s2 %= 65521;
+  }
+
+  return (s2 << 16) | s1;
+}
+
+/*Return the adler32 of the bytes data[0..len-1]*/
+static unsigned adler32(const unsigned char* data, unsigned len)
+{
+  return update_adler32(1L, data, len);
+}
+
+#if defined(LODEPNG_COMPILE_THREADS) && defined(LODEPNG_COMPILE_ENCODER)
+/*Return the adler32 of two blocks of data after each other, from their adler32 and the size of the second*/
+static unsigned adler32_combine(unsigned adler1, unsigned adler2, size_t len2)
+{
+  unsigned rem = (unsigned)(len2 % 65521);
+  unsigned s1 = adler1 & 0xffff;
+  unsigned s2 = (rem * s1) % 65521;
+  s1 += (adler2 & 0xffff) + 65521 - 1;
+  s2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + 65521 - rem;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s1 >= 65521) s1 -= 65521;
+  if(s2 >= 65521 * 2) s2 -= 65521 * 2;
+  if(s2 >= 65521) s2 -= 65521;
+  return (s2 << 16) | s1;
+}
+#endif /*LODEPNG_COMPILE_THREADS && LODEPNG_COMPILE_ENCODER*/
+
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Zlib                                                                   / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+#ifdef LODEPNG_COMPILE_DECODER
+
+/*check the 2 bytes of the zlib header, return value is error*/
+static unsigned checkZlibHeader(const unsigned char* in)
+{
+  unsigned CM, CINFO, FDICT;
+
+  /*read information from zlib header*/
+  if((in[0] * 256 + in[1]) % 31 != 0)
+  {
+    /*error: 256 * in[0] + in[1] must be a multiple of 31, the FCHECK value is supposed to be made that way*/
+    return 24;
+  }
+
+  CM = in[0] & 15;
+  CINFO = (in[0] >> 4) & 15;
+  /*FCHECK = in[1] & 31;*/ /*FCHECK is already tested above*/
+  FDICT = (in[1] >> 5) & 1;
+  /*FLEVEL = (in[1] >> 6) & 3;*/ /*FLEVEL is not used here*/
+
+  if(CM != 8 || CINFO > 7)
+  {
+    /*error: only compression method 8: inflate with sliding window of 32k is supported by the PNG spec*/
+    return 25;
+  }
+  if(FDICT != 0)
+  {
+    /*error: the specification of PNG says about the zlib stream:
+      "The additional flags shall not specify a preset dictionary."*/
+    return 26;
+  }
+
+  return 0;
+}
+
+unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
+                                 size_t insize, const LodePNGDecompressSettings* settings)
+{
+#if LODEPNG_CUSTOM_ZLIB_DECODER == 1
+  if(settings->custom_decoder)
+  {
+    return lodepng_custom_zlib_decompress(out, outsize, in, insize, settings);
+  }
+  else
+  {
+#endif /*LODEPNG_CUSTOM_ZLIB_DECODER == 1*/
+    unsigned error = 0;
+
+    if(insize < 2) return 53; /*error, size of zlib data too small*/
+    error = checkZlibHeader(in);
+    if(error) return error;
 
     error = lodepng_inflate(out, outsize, in + 2, insize - 2, settings);
     if(error) return error;
@@ -2063,6 +2852,179 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
+#ifdef LODEPNG_COMPILE_THREADS
+/*
+Calls func for each of the count tasks, which are tasksize bytes apart, on count - 1 new threads
+and the calling one, and waits until all are done. Tasks that no thread can be started for run
+on the calling thread.
+*/
+static void runThreads(void* (*func)(void*), void* tasks, size_t tasksize, unsigned count)
+{
+  pthread_t* threads = (pthread_t*)mymalloc(sizeof(pthread_t) * count);
+  unsigned char* started = (unsigned char*)mymalloc(count);
+  unsigned i;
+
+  for(i = 0; i < count; i++)
+  {
+    void* task = (unsigned char*)tasks + i * tasksize;
+    if(i > 0 && threads && started && pthread_create(&threads[i], 0, func, task) == 0) started[i] = 1;
+    else
+    {
+      if(started) started[i] = 0;
+      func(task);
+    }
+  }
+  for(i = 1; i < count && threads && started; i++)
+  {
+    if(started[i]) pthread_join(threads[i], 0);
+  }
+
+  myfree(threads);
+  myfree(started);
+}
+
+/*the smallest amount of data that is deflated on its own thread*/
+static const size_t DEFLATE_BAND_MIN_SIZE = 131072;
+
+typedef struct DeflateBand
+{
+  const unsigned char* in;
+  size_t start, end;
+  unsigned final;
+  const LodePNGCompressSettings* settings;
+  Hash* hash; /*an empty hash table, or 0 to allocate one*/
+  ucvector out;
+  unsigned adler; /*of in[start..end)*/
+  unsigned error;
+} DeflateBand;
+
+static void* deflateBandThread(void* arg)
+{
+  DeflateBand* band = (DeflateBand*)arg;
+  size_t bp = 0; /*the bit pointer*/
+
+  band->error = deflateRange(&band->out, &bp, band->hash, band->in, band->start, band->end, 0, band->final, band->settings);
+  if(!band->error && !band->final)
+  {
+    /*a sync flush: an empty stored block, which ends the band on a byte boundary*/
+    addBitsToStream(&bp, &band->out, 0, 3);
+    if(!ucvector_resize(&band->out, band->out.size + 4)) band->error = 83; /*alloc fail*/
+    else
+    {
+      /*LEN 0 and NLEN*/
+      band->out.data[band->out.size - 4] = 0;
+      band->out.data[band->out.size - 3] = 0;
+      band->out.data[band->out.size - 2] = 255;
+      band->out.data[band->out.size - 1] = 255;
+    }
+  }
+  band->adler = adler32(&band->in[band->start], (unsigned)(band->end - band->start));
+  return 0;
+}
+
+/*
+Deflates the data in settings->numthreads bands on their own threads, pigz style. Every band
+uses the window before it as dictionary, and all but the last end with a sync flush, so that
+they form one deflate stream when put after each other. Also returns the adler32 of the data.
+hashes is 0, or holds an empty hash table for a window of 32768 bytes for each thread.
+*/
+static unsigned deflateBands(ucvector* out, unsigned* adler, const unsigned char* in, size_t insize,
+                             const LodePNGCompressSettings* settings, Hash* hashes)
+{
+  unsigned error = 0;
+  unsigned i, numbands = settings->numthreads;
+  size_t bandsize;
+  DeflateBand* bands;
+
+  if(numbands > insize / DEFLATE_BAND_MIN_SIZE) numbands = (unsigned)(insize / DEFLATE_BAND_MIN_SIZE);
+  if(numbands == 0) numbands = 1;
+  bandsize = (insize + numbands - 1) / numbands;
+
+  bands = (DeflateBand*)mymalloc(sizeof(DeflateBand) * numbands);
+  if(!bands) return 83; /*alloc fail*/
+
+  for(i = 0; i < numbands; i++)
+  {
+    bands[i].in = in;
+    bands[i].start = i * bandsize;
+    bands[i].end = i == numbands - 1 ? insize : (i + 1) * bandsize;
+    bands[i].final = i == numbands - 1;
+    bands[i].settings = settings;
+    bands[i].hash = hashes ? &hashes[i] : 0;
+    ucvector_init(&bands[i].out);
+  }
+
+  runThreads(deflateBandThread, bands, sizeof(DeflateBand), numbands);
+
+  *adler = 1;
+  for(i = 0; i < numbands; i++)
+  {
+    if(!error) error = bands[i].error;
+    if(!error)
+    {
+      size_t size = out->size;
+      if(!ucvector_resize(out, size + bands[i].out.size)) error = 83; /*alloc fail*/
+      else memcpy(&out->data[size], bands[i].out.data, bands[i].out.size);
+      *adler = adler32_combine(*adler, bands[i].adler, bands[i].end - bands[i].start);
+    }
+    ucvector_cleanup(&bands[i].out);
+  }
+
+  myfree(bands);
+  return error;
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*
+Appends the zlib stream of in to out, using deflatedata for the deflate stream. hashes is 0,
+or holds an empty hash table for a window of 32768 bytes for each thread (at least one), which
+are used instead of allocating them.
+*/
+static unsigned zlibCompress(ucvector* out, ucvector* deflatedata, const unsigned char* in, size_t insize,
+                             const LodePNGCompressSettings* settings, Hash* hashes)
+{
+  unsigned error;
+
+  unsigned ADLER32;
+  /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
+  unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
+  unsigned FLEVEL = 0;
+  unsigned FDICT = 0;
+  unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
+  unsigned FCHECK = 31 - CMFFLG % 31;
+  CMFFLG += FCHECK;
+
+  ucvector_push_back(out, (unsigned char)(CMFFLG / 256));
+  ucvector_push_back(out, (unsigned char)(CMFFLG % 256));
+
+  deflatedata->size = 0;
+#ifdef LODEPNG_COMPILE_THREADS
+  if(settings->numthreads > 1 && (settings->btype == 1 || settings->btype == 2)
+     && !settings->custom_encoder && insize >= 2 * DEFLATE_BAND_MIN_SIZE)
+  {
+    error = deflateBands(deflatedata, &ADLER32, in, insize, settings, hashes);
+  }
+  else
+#endif /*LODEPNG_COMPILE_THREADS*/
+  {
+    error = lodepng_deflatev(deflatedata, in, insize, settings, hashes);
+    if(!error) ADLER32 = adler32(in, (unsigned)insize);
+  }
+
+  if(!error)
+  {
+    size_t size = out->size;
+    if(!ucvector_resize(out, size + deflatedata->size)) error = 83; /*alloc fail*/
+    else
+    {
+      memcpy(&out->data[size], deflatedata->data, deflatedata->size);
+      lodepng_add32bitInt(out, ADLER32);
+    }
+  }
+
+  return error;
+}
+
 unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsigned char* in,
                                size_t insize, const LodePNGCompressSettings* settings)
 {
@@ -2077,34 +3039,13 @@ unsigned lodepng_zlib_compress(unsigned char** out, size_t* outsize, const unsig
     /*initially, *out must be NULL and outsize 0, if you just give some random *out
     that's pointing to a non allocated buffer, this'll crash*/
     ucvector deflatedata, outv;
-    size_t i;
     unsigned error;
 
-    unsigned ADLER32;
-    /*zlib data: 1 byte CMF (CM+CINFO), 1 byte FLG, deflate data, 4 byte ADLER32 checksum of the Decompressed data*/
-    unsigned CMF = 120; /*0b01111000: CM 8, CINFO 7. With CINFO 7, any window size up to 32768 can be used.*/
-    unsigned FLEVEL = 0;
-    unsigned FDICT = 0;
-    unsigned CMFFLG = 256 * CMF + FDICT * 32 + FLEVEL * 64;
-    unsigned FCHECK = 31 - CMFFLG % 31;
-    CMFFLG += FCHECK;
-
     /*ucvector-controlled version of the output buffer, for dynamic array*/
     ucvector_init_buffer(&outv, *out, *outsize);
-
-    ucvector_push_back(&outv, (unsigned char)(CMFFLG / 256));
-    ucvector_push_back(&outv, (unsigned char)(CMFFLG % 256));
-
     ucvector_init(&deflatedata);
-    error = lodepng_deflatev(&deflatedata, in, insize, settings);
-
-    if(!error)
-    {
-      ADLER32 = adler32(in, (unsigned)insize);
-      for(i = 0; i < deflatedata.size; i++) ucvector_push_back(&outv, deflatedata.data[i]);
-      ucvector_cleanup(&deflatedata);
-      lodepng_add32bitInt(&outv, ADLER32);
-    }
+    error = zlibCompress(&outv, &deflatedata, in, insize, settings, 0);
+    ucvector_cleanup(&deflatedata);
 
     *out = outv.data;
     *outsize = outv.size;
@@ -2149,6 +3090,13 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->btype = 2;
   settings->use_lz77 = 1;
   settings->windowsize = DEFAULT_WINDOWSIZE;
+  settings->minmatch = 3;
+  settings->nicematch = 258;
+  settings->lazymatching = 1;
+  settings->maxchain = 128;
+  settings->optimal = 0;
+  settings->tryrle = 0;
+  settings->numthreads = 1;
 #if LODEPNG_CUSTOM_ZLIB_ENCODER == 0
   settings->custom_encoder = 0;
 #else
@@ -2157,9 +3105,9 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
 }
 
 #if LODEPNG_CUSTOM_ZLIB_ENCODER == 0
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 0};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 258, 1, 128, 0, 0, 1, 0};
 #else
-const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 1};
+const LodePNGCompressSettings lodepng_default_compress_settings = {2, 1, DEFAULT_WINDOWSIZE, 3, 258, 1, 128, 0, 0, 1, 1};
 #endif
 
 
@@ -2197,38 +3145,400 @@ const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 1};
 /* / CRC32                                                                  / */
 /* ////////////////////////////////////////////////////////////////////////// */
 
-static unsigned Crc32_crc_table_computed = 0;
-static unsigned Crc32_crc_table[256];
-
-/*Make the table for a fast CRC.*/
-static void Crc32_make_crc_table(void)
+/*
+The CRC table for slicing-by-8. Crc32_crc_table[0] is the usual table for the
+polynomial 0xedb88320, Crc32_crc_table[k][n] gives the CRC of n followed by k zero
+bytes. The table is constant, so it needs no initialization and can be shared
+between threads.
+*/
+static const unsigned Crc32_crc_table[8][256] =
 {
-  unsigned c, k, n;
-  for(n = 0; n < 256; n++)
   {
-    c = n;
-    for(k = 0; k < 8; k++)
-    {
-      if(c & 1) c = 0xedb88320L ^ (c >> 1);
-      else c = c >> 1;
-    }
-    Crc32_crc_table[n] = c;
+    0x00000000u, 0x77073096u, 0xee0e612cu, 0x990951bau, 0x076dc419u, 0x706af48fu,
+    0xe963a535u, 0x9e6495a3u, 0x0edb8832u, 0x79dcb8a4u, 0xe0d5e91eu, 0x97d2d988u,
+    0x09b64c2bu, 0x7eb17cbdu, 0xe7b82d07u, 0x90bf1d91u, 0x1db71064u, 0x6ab020f2u,
+    0xf3b97148u, 0x84be41deu, 0x1adad47du, 0x6ddde4ebu, 0xf4d4b551u, 0x83d385c7u,
+    0x136c9856u, 0x646ba8c0u, 0xfd62f97au, 0x8a65c9ecu, 0x14015c4fu, 0x63066cd9u,
+    0xfa0f3d63u, 0x8d080df5u, 0x3b6e20c8u, 0x4c69105eu, 0xd56041e4u, 0xa2677172u,
+    0x3c03e4d1u, 0x4b04d447u, 0xd20d85fdu, 0xa50ab56bu, 0x35b5a8fau, 0x42b2986cu,
+    0xdbbbc9d6u, 0xacbcf940u, 0x32d86ce3u, 0x45df5c75u, 0xdcd60dcfu, 0xabd13d59u,
+    0x26d930acu, 0x51de003au, 0xc8d75180u, 0xbfd06116u, 0x21b4f4b5u, 0x56b3c423u,
+    0xcfba9599u, 0xb8bda50fu, 0x2802b89eu, 0x5f058808u, 0xc60cd9b2u, 0xb10be924u,
+    0x2f6f7c87u, 0x58684c11u, 0xc1611dabu, 0xb6662d3du, 0x76dc4190u, 0x01db7106u,
+    0x98d220bcu, 0xefd5102au, 0x71b18589u, 0x06b6b51fu, 0x9fbfe4a5u, 0xe8b8d433u,
+    0x7807c9a2u, 0x0f00f934u, 0x9609a88eu, 0xe10e9818u, 0x7f6a0dbbu, 0x086d3d2du,
+    0x91646c97u, 0xe6635c01u, 0x6b6b51f4u, 0x1c6c6162u, 0x856530d8u, 0xf262004eu,
+    0x6c0695edu, 0x1b01a57bu, 0x8208f4c1u, 0xf50fc457u, 0x65b0d9c6u, 0x12b7e950u,
+    0x8bbeb8eau, 0xfcb9887cu, 0x62dd1ddfu, 0x15da2d49u, 0x8cd37cf3u, 0xfbd44c65u,
+    0x4db26158u, 0x3ab551ceu, 0xa3bc0074u, 0xd4bb30e2u, 0x4adfa541u, 0x3dd895d7u,
+    0xa4d1c46du, 0xd3d6f4fbu, 0x4369e96au, 0x346ed9fcu, 0xad678846u, 0xda60b8d0u,
+    0x44042d73u, 0x33031de5u, 0xaa0a4c5fu, 0xdd0d7cc9u, 0x5005713cu, 0x270241aau,
+    0xbe0b1010u, 0xc90c2086u, 0x5768b525u, 0x206f85b3u, 0xb966d409u, 0xce61e49fu,
+    0x5edef90eu, 0x29d9c998u, 0xb0d09822u, 0xc7d7a8b4u, 0x59b33d17u, 0x2eb40d81u,
+    0xb7bd5c3bu, 0xc0ba6cadu, 0xedb88320u, 0x9abfb3b6u, 0x03b6e20cu, 0x74b1d29au,
+    0xead54739u, 0x9dd277afu, 0x04db2615u, 0x73dc1683u, 0xe3630b12u, 0x94643b84u,
+    0x0d6d6a3eu, 0x7a6a5aa8u, 0xe40ecf0bu, 0x9309ff9du, 0x0a00ae27u, 0x7d079eb1u,
+    0xf00f9344u, 0x8708a3d2u, 0x1e01f268u, 0x6906c2feu, 0xf762575du, 0x806567cbu,
+    0x196c3671u, 0x6e6b06e7u, 0xfed41b76u, 0x89d32be0u, 0x10da7a5au, 0x67dd4accu,
+    0xf9b9df6fu, 0x8ebeeff9u, 0x17b7be43u, 0x60b08ed5u, 0xd6d6a3e8u, 0xa1d1937eu,
+    0x38d8c2c4u, 0x4fdff252u, 0xd1bb67f1u, 0xa6bc5767u, 0x3fb506ddu, 0x48b2364bu,
+    0xd80d2bdau, 0xaf0a1b4cu, 0x36034af6u, 0x41047a60u, 0xdf60efc3u, 0xa867df55u,
+    0x316e8eefu, 0x4669be79u, 0xcb61b38cu, 0xbc66831au, 0x256fd2a0u, 0x5268e236u,
+    0xcc0c7795u, 0xbb0b4703u, 0x220216b9u, 0x5505262fu, 0xc5ba3bbeu, 0xb2bd0b28u,
+    0x2bb45a92u, 0x5cb36a04u, 0xc2d7ffa7u, 0xb5d0cf31u, 0x2cd99e8bu, 0x5bdeae1du,
+    0x9b64c2b0u, 0xec63f226u, 0x756aa39cu, 0x026d930au, 0x9c0906a9u, 0xeb0e363fu,
+    0x72076785u, 0x05005713u, 0x95bf4a82u, 0xe2b87a14u, 0x7bb12baeu, 0x0cb61b38u,
+    0x92d28e9bu, 0xe5d5be0du, 0x7cdcefb7u, 0x0bdbdf21u, 0x86d3d2d4u, 0xf1d4e242u,
+    0x68ddb3f8u, 0x1fda836eu, 0x81be16cdu, 0xf6b9265bu, 0x6fb077e1u, 0x18b74777u,
+    0x88085ae6u, 0xff0f6a70u, 0x66063bcau, 0x11010b5cu, 0x8f659effu, 0xf862ae69u,
+    0x616bffd3u, 0x166ccf45u, 0xa00ae278u, 0xd70dd2eeu, 0x4e048354u, 0x3903b3c2u,
+    0xa7672661u, 0xd06016f7u, 0x4969474du, 0x3e6e77dbu, 0xaed16a4au, 0xd9d65adcu,
+    0x40df0b66u, 0x37d83bf0u, 0xa9bcae53u, 0xdebb9ec5u, 0x47b2cf7fu, 0x30b5ffe9u,
+    0xbdbdf21cu, 0xcabac28au, 0x53b39330u, 0x24b4a3a6u, 0xbad03605u, 0xcdd70693u,
+    0x54de5729u, 0x23d967bfu, 0xb3667a2eu, 0xc4614ab8u, 0x5d681b02u, 0x2a6f2b94u,
+    0xb40bbe37u, 0xc30c8ea1u, 0x5a05df1bu, 0x2d02ef8du
+  },
+  {
+    0x00000000u, 0x191b3141u, 0x32366282u, 0x2b2d53c3u, 0x646cc504u, 0x7d77f445u,
+    0x565aa786u, 0x4f4196c7u, 0xc8d98a08u, 0xd1c2bb49u, 0xfaefe88au, 0xe3f4d9cbu,
+    0xacb54f0cu, 0xb5ae7e4du, 0x9e832d8eu, 0x87981ccfu, 0x4ac21251u, 0x53d92310u,
+    0x78f470d3u, 0x61ef4192u, 0x2eaed755u, 0x37b5e614u, 0x1c98b5d7u, 0x05838496u,
+    0x821b9859u, 0x9b00a918u, 0xb02dfadbu, 0xa936cb9au, 0xe6775d5du, 0xff6c6c1cu,
+    0xd4413fdfu, 0xcd5a0e9eu, 0x958424a2u, 0x8c9f15e3u, 0xa7b24620u, 0xbea97761u,
+    0xf1e8e1a6u, 0xe8f3d0e7u, 0xc3de8324u, 0xdac5b265u, 0x5d5daeaau, 0x44469febu,
+    0x6f6bcc28u, 0x7670fd69u, 0x39316baeu, 0x202a5aefu, 0x0b07092cu, 0x121c386du,
+    0xdf4636f3u, 0xc65d07b2u, 0xed705471u, 0xf46b6530u, 0xbb2af3f7u, 0xa231c2b6u,
+    0x891c9175u, 0x9007a034u, 0x179fbcfbu, 0x0e848dbau, 0x25a9de79u, 0x3cb2ef38u,
+    0x73f379ffu, 0x6ae848beu, 0x41c51b7du, 0x58de2a3cu, 0xf0794f05u, 0xe9627e44u,
+    0xc24f2d87u, 0xdb541cc6u, 0x94158a01u, 0x8d0ebb40u, 0xa623e883u, 0xbf38d9c2u,
+    0x38a0c50du, 0x21bbf44cu, 0x0a96a78fu, 0x138d96ceu, 0x5ccc0009u, 0x45d73148u,
+    0x6efa628bu, 0x77e153cau, 0xbabb5d54u, 0xa3a06c15u, 0x888d3fd6u, 0x91960e97u,
+    0xded79850u, 0xc7cca911u, 0xece1fad2u, 0xf5facb93u, 0x7262d75cu, 0x6b79e61du,
+    0x4054b5deu, 0x594f849fu, 0x160e1258u, 0x0f152319u, 0x243870dau, 0x3d23419bu,
+    0x65fd6ba7u, 0x7ce65ae6u, 0x57cb0925u, 0x4ed03864u, 0x0191aea3u, 0x188a9fe2u,
+    0x33a7cc21u, 0x2abcfd60u, 0xad24e1afu, 0xb43fd0eeu, 0x9f12832du, 0x8609b26cu,
+    0xc94824abu, 0xd05315eau, 0xfb7e4629u, 0xe2657768u, 0x2f3f79f6u, 0x362448b7u,
+    0x1d091b74u, 0x04122a35u, 0x4b53bcf2u, 0x52488db3u, 0x7965de70u, 0x607eef31u,
+    0xe7e6f3feu, 0xfefdc2bfu, 0xd5d0917cu, 0xcccba03du, 0x838a36fau, 0x9a9107bbu,
+    0xb1bc5478u, 0xa8a76539u, 0x3b83984bu, 0x2298a90au, 0x09b5fac9u, 0x10aecb88u,
+    0x5fef5d4fu, 0x46f46c0eu, 0x6dd93fcdu, 0x74c20e8cu, 0xf35a1243u, 0xea412302u,
+    0xc16c70c1u, 0xd8774180u, 0x9736d747u, 0x8e2de606u, 0xa500b5c5u, 0xbc1b8484u,
+    0x71418a1au, 0x685abb5bu, 0x4377e898u, 0x5a6cd9d9u, 0x152d4f1eu, 0x0c367e5fu,
+    0x271b2d9cu, 0x3e001cddu, 0xb9980012u, 0xa0833153u, 0x8bae6290u, 0x92b553d1u,
+    0xddf4c516u, 0xc4eff457u, 0xefc2a794u, 0xf6d996d5u, 0xae07bce9u, 0xb71c8da8u,
+    0x9c31de6bu, 0x852aef2au, 0xca6b79edu, 0xd37048acu, 0xf85d1b6fu, 0xe1462a2eu,
+    0x66de36e1u, 0x7fc507a0u, 0x54e85463u, 0x4df36522u, 0x02b2f3e5u, 0x1ba9c2a4u,
+    0x30849167u, 0x299fa026u, 0xe4c5aeb8u, 0xfdde9ff9u, 0xd6f3cc3au, 0xcfe8fd7bu,
+    0x80a96bbcu, 0x99b25afdu, 0xb29f093eu, 0xab84387fu, 0x2c1c24b0u, 0x350715f1u,
+    0x1e2a4632u, 0x07317773u, 0x4870e1b4u, 0x516bd0f5u, 0x7a468336u, 0x635db277u,
+    0xcbfad74eu, 0xd2e1e60fu, 0xf9ccb5ccu, 0xe0d7848du, 0xaf96124au, 0xb68d230bu,
+    0x9da070c8u, 0x84bb4189u, 0x03235d46u, 0x1a386c07u, 0x31153fc4u, 0x280e0e85u,
+    0x674f9842u, 0x7e54a903u, 0x5579fac0u, 0x4c62cb81u, 0x8138c51fu, 0x9823f45eu,
+    0xb30ea79du, 0xaa1596dcu, 0xe554001bu, 0xfc4f315au, 0xd7626299u, 0xce7953d8u,
+    0x49e14f17u, 0x50fa7e56u, 0x7bd72d95u, 0x62cc1cd4u, 0x2d8d8a13u, 0x3496bb52u,
+    0x1fbbe891u, 0x06a0d9d0u, 0x5e7ef3ecu, 0x4765c2adu, 0x6c48916eu, 0x7553a02fu,
+    0x3a1236e8u, 0x230907a9u, 0x0824546au, 0x113f652bu, 0x96a779e4u, 0x8fbc48a5u,
+    0xa4911b66u, 0xbd8a2a27u, 0xf2cbbce0u, 0xebd08da1u, 0xc0fdde62u, 0xd9e6ef23u,
+    0x14bce1bdu, 0x0da7d0fcu, 0x268a833fu, 0x3f91b27eu, 0x70d024b9u, 0x69cb15f8u,
+    0x42e6463bu, 0x5bfd777au, 0xdc656bb5u, 0xc57e5af4u, 0xee530937u, 0xf7483876u,
+    0xb809aeb1u, 0xa1129ff0u, 0x8a3fcc33u, 0x9324fd72u
+  },
+  {
+    0x00000000u, 0x01c26a37u, 0x0384d46eu, 0x0246be59u, 0x0709a8dcu, 0x06cbc2ebu,
+    0x048d7cb2u, 0x054f1685u, 0x0e1351b8u, 0x0fd13b8fu, 0x0d9785d6u, 0x0c55efe1u,
+    0x091af964u, 0x08d89353u, 0x0a9e2d0au, 0x0b5c473du, 0x1c26a370u, 0x1de4c947u,
+    0x1fa2771eu, 0x1e601d29u, 0x1b2f0bacu, 0x1aed619bu, 0x18abdfc2u, 0x1969b5f5u,
+    0x1235f2c8u, 0x13f798ffu, 0x11b126a6u, 0x10734c91u, 0x153c5a14u, 0x14fe3023u,
+    0x16b88e7au, 0x177ae44du, 0x384d46e0u, 0x398f2cd7u, 0x3bc9928eu, 0x3a0bf8b9u,
+    0x3f44ee3cu, 0x3e86840bu, 0x3cc03a52u, 0x3d025065u, 0x365e1758u, 0x379c7d6fu,
+    0x35dac336u, 0x3418a901u, 0x3157bf84u, 0x3095d5b3u, 0x32d36beau, 0x331101ddu,
+    0x246be590u, 0x25a98fa7u, 0x27ef31feu, 0x262d5bc9u, 0x23624d4cu, 0x22a0277bu,
+    0x20e69922u, 0x2124f315u, 0x2a78b428u, 0x2bbade1fu, 0x29fc6046u, 0x283e0a71u,
+    0x2d711cf4u, 0x2cb376c3u, 0x2ef5c89au, 0x2f37a2adu, 0x709a8dc0u, 0x7158e7f7u,
+    0x731e59aeu, 0x72dc3399u, 0x7793251cu, 0x76514f2bu, 0x7417f172u, 0x75d59b45u,
+    0x7e89dc78u, 0x7f4bb64fu, 0x7d0d0816u, 0x7ccf6221u, 0x798074a4u, 0x78421e93u,
+    0x7a04a0cau, 0x7bc6cafdu, 0x6cbc2eb0u, 0x6d7e4487u, 0x6f38fadeu, 0x6efa90e9u,
+    0x6bb5866cu, 0x6a77ec5bu, 0x68315202u, 0x69f33835u, 0x62af7f08u, 0x636d153fu,
+    0x612bab66u, 0x60e9c151u, 0x65a6d7d4u, 0x6464bde3u, 0x662203bau, 0x67e0698du,
+    0x48d7cb20u, 0x4915a117u, 0x4b531f4eu, 0x4a917579u, 0x4fde63fcu, 0x4e1c09cbu,
+    0x4c5ab792u, 0x4d98dda5u, 0x46c49a98u, 0x4706f0afu, 0x45404ef6u, 0x448224c1u,
+    0x41cd3244u, 0x400f5873u, 0x4249e62au, 0x438b8c1du, 0x54f16850u, 0x55330267u,
+    0x5775bc3eu, 0x56b7d609u, 0x53f8c08cu, 0x523aaabbu, 0x507c14e2u, 0x51be7ed5u,
+    0x5ae239e8u, 0x5b2053dfu, 0x5966ed86u, 0x58a487b1u, 0x5deb9134u, 0x5c29fb03u,
+    0x5e6f455au, 0x5fad2f6du, 0xe1351b80u, 0xe0f771b7u, 0xe2b1cfeeu, 0xe373a5d9u,
+    0xe63cb35cu, 0xe7fed96bu, 0xe5b86732u, 0xe47a0d05u, 0xef264a38u, 0xeee4200fu,
+    0xeca29e56u, 0xed60f461u, 0xe82fe2e4u, 0xe9ed88d3u, 0xebab368au, 0xea695cbdu,
+    0xfd13b8f0u, 0xfcd1d2c7u, 0xfe976c9eu, 0xff5506a9u, 0xfa1a102cu, 0xfbd87a1bu,
+    0xf99ec442u, 0xf85cae75u, 0xf300e948u, 0xf2c2837fu, 0xf0843d26u, 0xf1465711u,
+    0xf4094194u, 0xf5cb2ba3u, 0xf78d95fau, 0xf64fffcdu, 0xd9785d60u, 0xd8ba3757u,
+    0xdafc890eu, 0xdb3ee339u, 0xde71f5bcu, 0xdfb39f8bu, 0xddf521d2u, 0xdc374be5u,
+    0xd76b0cd8u, 0xd6a966efu, 0xd4efd8b6u, 0xd52db281u, 0xd062a404u, 0xd1a0ce33u,
+    0xd3e6706au, 0xd2241a5du, 0xc55efe10u, 0xc49c9427u, 0xc6da2a7eu, 0xc7184049u,
+    0xc25756ccu, 0xc3953cfbu, 0xc1d382a2u, 0xc011e895u, 0xcb4dafa8u, 0xca8fc59fu,
+    0xc8c97bc6u, 0xc90b11f1u, 0xcc440774u, 0xcd866d43u, 0xcfc0d31au, 0xce02b92du,
+    0x91af9640u, 0x906dfc77u, 0x922b422eu, 0x93e92819u, 0x96a63e9cu, 0x976454abu,
+    0x9522eaf2u, 0x94e080c5u, 0x9fbcc7f8u, 0x9e7eadcfu, 0x9c381396u, 0x9dfa79a1u,
+    0x98b56f24u, 0x99770513u, 0x9b31bb4au, 0x9af3d17du, 0x8d893530u, 0x8c4b5f07u,
+    0x8e0de15eu, 0x8fcf8b69u, 0x8a809decu, 0x8b42f7dbu, 0x89044982u, 0x88c623b5u,
+    0x839a6488u, 0x82580ebfu, 0x801eb0e6u, 0x81dcdad1u, 0x8493cc54u, 0x8551a663u,
+    0x8717183au, 0x86d5720du, 0xa9e2d0a0u, 0xa820ba97u, 0xaa6604ceu, 0xaba46ef9u,
+    0xaeeb787cu, 0xaf29124bu, 0xad6fac12u, 0xacadc625u, 0xa7f18118u, 0xa633eb2fu,
+    0xa4755576u, 0xa5b73f41u, 0xa0f829c4u, 0xa13a43f3u, 0xa37cfdaau, 0xa2be979du,
+    0xb5c473d0u, 0xb40619e7u, 0xb640a7beu, 0xb782cd89u, 0xb2cddb0cu, 0xb30fb13bu,
+    0xb1490f62u, 0xb08b6555u, 0xbbd72268u, 0xba15485fu, 0xb853f606u, 0xb9919c31u,
+    0xbcde8ab4u, 0xbd1ce083u, 0xbf5a5edau, 0xbe9834edu
+  },
+  {
+    0x00000000u, 0xb8bc6765u, 0xaa09c88bu, 0x12b5afeeu, 0x8f629757u, 0x37def032u,
+    0x256b5fdcu, 0x9dd738b9u, 0xc5b428efu, 0x7d084f8au, 0x6fbde064u, 0xd7018701u,
+    0x4ad6bfb8u, 0xf26ad8ddu, 0xe0df7733u, 0x58631056u, 0x5019579fu, 0xe8a530fau,
+    0xfa109f14u, 0x42acf871u, 0xdf7bc0c8u, 0x67c7a7adu, 0x75720843u, 0xcdce6f26u,
+    0x95ad7f70u, 0x2d111815u, 0x3fa4b7fbu, 0x8718d09eu, 0x1acfe827u, 0xa2738f42u,
+    0xb0c620acu, 0x087a47c9u, 0xa032af3eu, 0x188ec85bu, 0x0a3b67b5u, 0xb28700d0u,
+    0x2f503869u, 0x97ec5f0cu, 0x8559f0e2u, 0x3de59787u, 0x658687d1u, 0xdd3ae0b4u,
+    0xcf8f4f5au, 0x7733283fu, 0xeae41086u, 0x525877e3u, 0x40edd80du, 0xf851bf68u,
+    0xf02bf8a1u, 0x48979fc4u, 0x5a22302au, 0xe29e574fu, 0x7f496ff6u, 0xc7f50893u,
+    0xd540a77du, 0x6dfcc018u, 0x359fd04eu, 0x8d23b72bu, 0x9f9618c5u, 0x272a7fa0u,
+    0xbafd4719u, 0x0241207cu, 0x10f48f92u, 0xa848e8f7u, 0x9b14583du, 0x23a83f58u,
+    0x311d90b6u, 0x89a1f7d3u, 0x1476cf6au, 0xaccaa80fu, 0xbe7f07e1u, 0x06c36084u,
+    0x5ea070d2u, 0xe61c17b7u, 0xf4a9b859u, 0x4c15df3cu, 0xd1c2e785u, 0x697e80e0u,
+    0x7bcb2f0eu, 0xc377486bu, 0xcb0d0fa2u, 0x73b168c7u, 0x6104c729u, 0xd9b8a04cu,
+    0x446f98f5u, 0xfcd3ff90u, 0xee66507eu, 0x56da371bu, 0x0eb9274du, 0xb6054028u,
+    0xa4b0efc6u, 0x1c0c88a3u, 0x81dbb01au, 0x3967d77fu, 0x2bd27891u, 0x936e1ff4u,
+    0x3b26f703u, 0x839a9066u, 0x912f3f88u, 0x299358edu, 0xb4446054u, 0x0cf80731u,
+    0x1e4da8dfu, 0xa6f1cfbau, 0xfe92dfecu, 0x462eb889u, 0x549b1767u, 0xec277002u,
+    0x71f048bbu, 0xc94c2fdeu, 0xdbf98030u, 0x6345e755u, 0x6b3fa09cu, 0xd383c7f9u,
+    0xc1366817u, 0x798a0f72u, 0xe45d37cbu, 0x5ce150aeu, 0x4e54ff40u, 0xf6e89825u,
+    0xae8b8873u, 0x1637ef16u, 0x048240f8u, 0xbc3e279du, 0x21e91f24u, 0x99557841u,
+    0x8be0d7afu, 0x335cb0cau, 0xed59b63bu, 0x55e5d15eu, 0x47507eb0u, 0xffec19d5u,
+    0x623b216cu, 0xda874609u, 0xc832e9e7u, 0x708e8e82u, 0x28ed9ed4u, 0x9051f9b1u,
+    0x82e4565fu, 0x3a58313au, 0xa78f0983u, 0x1f336ee6u, 0x0d86c108u, 0xb53aa66du,
+    0xbd40e1a4u, 0x05fc86c1u, 0x1749292fu, 0xaff54e4au, 0x322276f3u, 0x8a9e1196u,
+    0x982bbe78u, 0x2097d91du, 0x78f4c94bu, 0xc048ae2eu, 0xd2fd01c0u, 0x6a4166a5u,
+    0xf7965e1cu, 0x4f2a3979u, 0x5d9f9697u, 0xe523f1f2u, 0x4d6b1905u, 0xf5d77e60u,
+    0xe762d18eu, 0x5fdeb6ebu, 0xc2098e52u, 0x7ab5e937u, 0x680046d9u, 0xd0bc21bcu,
+    0x88df31eau, 0x3063568fu, 0x22d6f961u, 0x9a6a9e04u, 0x07bda6bdu, 0xbf01c1d8u,
+    0xadb46e36u, 0x15080953u, 0x1d724e9au, 0xa5ce29ffu, 0xb77b8611u, 0x0fc7e174u,
+    0x9210d9cdu, 0x2aacbea8u, 0x38191146u, 0x80a57623u, 0xd8c66675u, 0x607a0110u,
+    0x72cfaefeu, 0xca73c99bu, 0x57a4f122u, 0xef189647u, 0xfdad39a9u, 0x45115eccu,
+    0x764dee06u, 0xcef18963u, 0xdc44268du, 0x64f841e8u, 0xf92f7951u, 0x41931e34u,
+    0x5326b1dau, 0xeb9ad6bfu, 0xb3f9c6e9u, 0x0b45a18cu, 0x19f00e62u, 0xa14c6907u,
+    0x3c9b51beu, 0x842736dbu, 0x96929935u, 0x2e2efe50u, 0x2654b999u, 0x9ee8defcu,
+    0x8c5d7112u, 0x34e11677u, 0xa9362eceu, 0x118a49abu, 0x033fe645u, 0xbb838120u,
+    0xe3e09176u, 0x5b5cf613u, 0x49e959fdu, 0xf1553e98u, 0x6c820621u, 0xd43e6144u,
+    0xc68bceaau, 0x7e37a9cfu, 0xd67f4138u, 0x6ec3265du, 0x7c7689b3u, 0xc4caeed6u,
+    0x591dd66fu, 0xe1a1b10au, 0xf3141ee4u, 0x4ba87981u, 0x13cb69d7u, 0xab770eb2u,
+    0xb9c2a15cu, 0x017ec639u, 0x9ca9fe80u, 0x241599e5u, 0x36a0360bu, 0x8e1c516eu,
+    0x866616a7u, 0x3eda71c2u, 0x2c6fde2cu, 0x94d3b949u, 0x090481f0u, 0xb1b8e695u,
+    0xa30d497bu, 0x1bb12e1eu, 0x43d23e48u, 0xfb6e592du, 0xe9dbf6c3u, 0x516791a6u,
+    0xccb0a91fu, 0x740cce7au, 0x66b96194u, 0xde0506f1u
+  },
+  {
+    0x00000000u, 0x3d6029b0u, 0x7ac05360u, 0x47a07ad0u, 0xf580a6c0u, 0xc8e08f70u,
+    0x8f40f5a0u, 0xb220dc10u, 0x30704bc1u, 0x0d106271u, 0x4ab018a1u, 0x77d03111u,
+    0xc5f0ed01u, 0xf890c4b1u, 0xbf30be61u, 0x825097d1u, 0x60e09782u, 0x5d80be32u,
+    0x1a20c4e2u, 0x2740ed52u, 0x95603142u, 0xa80018f2u, 0xefa06222u, 0xd2c04b92u,
+    0x5090dc43u, 0x6df0f5f3u, 0x2a508f23u, 0x1730a693u, 0xa5107a83u, 0x98705333u,
+    0xdfd029e3u, 0xe2b00053u, 0xc1c12f04u, 0xfca106b4u, 0xbb017c64u, 0x866155d4u,
+    0x344189c4u, 0x0921a074u, 0x4e81daa4u, 0x73e1f314u, 0xf1b164c5u, 0xccd14d75u,
+    0x8b7137a5u, 0xb6111e15u, 0x0431c205u, 0x3951ebb5u, 0x7ef19165u, 0x4391b8d5u,
+    0xa121b886u, 0x9c419136u, 0xdbe1ebe6u, 0xe681c256u, 0x54a11e46u, 0x69c137f6u,
+    0x2e614d26u, 0x13016496u, 0x9151f347u, 0xac31daf7u, 0xeb91a027u, 0xd6f18997u,
+    0x64d15587u, 0x59b17c37u, 0x1e1106e7u, 0x23712f57u, 0x58f35849u, 0x659371f9u,
+    0x22330b29u, 0x1f532299u, 0xad73fe89u, 0x9013d739u, 0xd7b3ade9u, 0xead38459u,
+    0x68831388u, 0x55e33a38u, 0x124340e8u, 0x2f236958u, 0x9d03b548u, 0xa0639cf8u,
+    0xe7c3e628u, 0xdaa3cf98u, 0x3813cfcbu, 0x0573e67bu, 0x42d39cabu, 0x7fb3b51bu,
+    0xcd93690bu, 0xf0f340bbu, 0xb7533a6bu, 0x8a3313dbu, 0x0863840au, 0x3503adbau,
+    0x72a3d76au, 0x4fc3fedau, 0xfde322cau, 0xc0830b7au, 0x872371aau, 0xba43581au,
+    0x9932774du, 0xa4525efdu, 0xe3f2242du, 0xde920d9du, 0x6cb2d18du, 0x51d2f83du,
+    0x167282edu, 0x2b12ab5du, 0xa9423c8cu, 0x9422153cu, 0xd3826fecu, 0xeee2465cu,
+    0x5cc29a4cu, 0x61a2b3fcu, 0x2602c92cu, 0x1b62e09cu, 0xf9d2e0cfu, 0xc4b2c97fu,
+    0x8312b3afu, 0xbe729a1fu, 0x0c52460fu, 0x31326fbfu, 0x7692156fu, 0x4bf23cdfu,
+    0xc9a2ab0eu, 0xf4c282beu, 0xb362f86eu, 0x8e02d1deu, 0x3c220dceu, 0x0142247eu,
+    0x46e25eaeu, 0x7b82771eu, 0xb1e6b092u, 0x8c869922u, 0xcb26e3f2u, 0xf646ca42u,
+    0x44661652u, 0x79063fe2u, 0x3ea64532u, 0x03c66c82u, 0x8196fb53u, 0xbcf6d2e3u,
+    0xfb56a833u, 0xc6368183u, 0x74165d93u, 0x49767423u, 0x0ed60ef3u, 0x33b62743u,
+    0xd1062710u, 0xec660ea0u, 0xabc67470u, 0x96a65dc0u, 0x248681d0u, 0x19e6a860u,
+    0x5e46d2b0u, 0x6326fb00u, 0xe1766cd1u, 0xdc164561u, 0x9bb63fb1u, 0xa6d61601u,
+    0x14f6ca11u, 0x2996e3a1u, 0x6e369971u, 0x5356b0c1u, 0x70279f96u, 0x4d47b626u,
+    0x0ae7ccf6u, 0x3787e546u, 0x85a73956u, 0xb8c710e6u, 0xff676a36u, 0xc2074386u,
+    0x4057d457u, 0x7d37fde7u, 0x3a978737u, 0x07f7ae87u, 0xb5d77297u, 0x88b75b27u,
+    0xcf1721f7u, 0xf2770847u, 0x10c70814u, 0x2da721a4u, 0x6a075b74u, 0x576772c4u,
+    0xe547aed4u, 0xd8278764u, 0x9f87fdb4u, 0xa2e7d404u, 0x20b743d5u, 0x1dd76a65u,
+    0x5a7710b5u, 0x67173905u, 0xd537e515u, 0xe857cca5u, 0xaff7b675u, 0x92979fc5u,
+    0xe915e8dbu, 0xd475c16bu, 0x93d5bbbbu, 0xaeb5920bu, 0x1c954e1bu, 0x21f567abu,
+    0x66551d7bu, 0x5b3534cbu, 0xd965a31au, 0xe4058aaau, 0xa3a5f07au, 0x9ec5d9cau,
+    0x2ce505dau, 0x11852c6au, 0x562556bau, 0x6b457f0au, 0x89f57f59u, 0xb49556e9u,
+    0xf3352c39u, 0xce550589u, 0x7c75d999u, 0x4115f029u, 0x06b58af9u, 0x3bd5a349u,
+    0xb9853498u, 0x84e51d28u, 0xc34567f8u, 0xfe254e48u, 0x4c059258u, 0x7165bbe8u,
+    0x36c5c138u, 0x0ba5e888u, 0x28d4c7dfu, 0x15b4ee6fu, 0x521494bfu, 0x6f74bd0fu,
+    0xdd54611fu, 0xe03448afu, 0xa794327fu, 0x9af41bcfu, 0x18a48c1eu, 0x25c4a5aeu,
+    0x6264df7eu, 0x5f04f6ceu, 0xed242adeu, 0xd044036eu, 0x97e479beu, 0xaa84500eu,
+    0x4834505du, 0x755479edu, 0x32f4033du, 0x0f942a8du, 0xbdb4f69du, 0x80d4df2du,
+    0xc774a5fdu, 0xfa148c4du, 0x78441b9cu, 0x4524322cu, 0x028448fcu, 0x3fe4614cu,
+    0x8dc4bd5cu, 0xb0a494ecu, 0xf704ee3cu, 0xca64c78cu
+  },
+  {
+    0x00000000u, 0xcb5cd3a5u, 0x4dc8a10bu, 0x869472aeu, 0x9b914216u, 0x50cd91b3u,
+    0xd659e31du, 0x1d0530b8u, 0xec53826du, 0x270f51c8u, 0xa19b2366u, 0x6ac7f0c3u,
+    0x77c2c07bu, 0xbc9e13deu, 0x3a0a6170u, 0xf156b2d5u, 0x03d6029bu, 0xc88ad13eu,
+    0x4e1ea390u, 0x85427035u, 0x9847408du, 0x531b9328u, 0xd58fe186u, 0x1ed33223u,
+    0xef8580f6u, 0x24d95353u, 0xa24d21fdu, 0x6911f258u, 0x7414c2e0u, 0xbf481145u,
+    0x39dc63ebu, 0xf280b04eu, 0x07ac0536u, 0xccf0d693u, 0x4a64a43du, 0x81387798u,
+    0x9c3d4720u, 0x57619485u, 0xd1f5e62bu, 0x1aa9358eu, 0xebff875bu, 0x20a354feu,
+    0xa6372650u, 0x6d6bf5f5u, 0x706ec54du, 0xbb3216e8u, 0x3da66446u, 0xf6fab7e3u,
+    0x047a07adu, 0xcf26d408u, 0x49b2a6a6u, 0x82ee7503u, 0x9feb45bbu, 0x54b7961eu,
+    0xd223e4b0u, 0x197f3715u, 0xe82985c0u, 0x23755665u, 0xa5e124cbu, 0x6ebdf76eu,
+    0x73b8c7d6u, 0xb8e41473u, 0x3e7066ddu, 0xf52cb578u, 0x0f580a6cu, 0xc404d9c9u,
+    0x4290ab67u, 0x89cc78c2u, 0x94c9487au, 0x5f959bdfu, 0xd901e971u, 0x125d3ad4u,
+    0xe30b8801u, 0x28575ba4u, 0xaec3290au, 0x659ffaafu, 0x789aca17u, 0xb3c619b2u,
+    0x35526b1cu, 0xfe0eb8b9u, 0x0c8e08f7u, 0xc7d2db52u, 0x4146a9fcu, 0x8a1a7a59u,
+    0x971f4ae1u, 0x5c439944u, 0xdad7ebeau, 0x118b384fu, 0xe0dd8a9au, 0x2b81593fu,
+    0xad152b91u, 0x6649f834u, 0x7b4cc88cu, 0xb0101b29u, 0x36846987u, 0xfdd8ba22u,
+    0x08f40f5au, 0xc3a8dcffu, 0x453cae51u, 0x8e607df4u, 0x93654d4cu, 0x58399ee9u,
+    0xdeadec47u, 0x15f13fe2u, 0xe4a78d37u, 0x2ffb5e92u, 0xa96f2c3cu, 0x6233ff99u,
+    0x7f36cf21u, 0xb46a1c84u, 0x32fe6e2au, 0xf9a2bd8fu, 0x0b220dc1u, 0xc07ede64u,
+    0x46eaaccau, 0x8db67f6fu, 0x90b34fd7u, 0x5bef9c72u, 0xdd7beedcu, 0x16273d79u,
+    0xe7718facu, 0x2c2d5c09u, 0xaab92ea7u, 0x61e5fd02u, 0x7ce0cdbau, 0xb7bc1e1fu,
+    0x31286cb1u, 0xfa74bf14u, 0x1eb014d8u, 0xd5ecc77du, 0x5378b5d3u, 0x98246676u,
+    0x852156ceu, 0x4e7d856bu, 0xc8e9f7c5u, 0x03b52460u, 0xf2e396b5u, 0x39bf4510u,
+    0xbf2b37beu, 0x7477e41bu, 0x6972d4a3u, 0xa22e0706u, 0x24ba75a8u, 0xefe6a60du,
+    0x1d661643u, 0xd63ac5e6u, 0x50aeb748u, 0x9bf264edu, 0x86f75455u, 0x4dab87f0u,
+    0xcb3ff55eu, 0x006326fbu, 0xf135942eu, 0x3a69478bu, 0xbcfd3525u, 0x77a1e680u,
+    0x6aa4d638u, 0xa1f8059du, 0x276c7733u, 0xec30a496u, 0x191c11eeu, 0xd240c24bu,
+    0x54d4b0e5u, 0x9f886340u, 0x828d53f8u, 0x49d1805du, 0xcf45f2f3u, 0x04192156u,
+    0xf54f9383u, 0x3e134026u, 0xb8873288u, 0x73dbe12du, 0x6eded195u, 0xa5820230u,
+    0x2316709eu, 0xe84aa33bu, 0x1aca1375u, 0xd196c0d0u, 0x5702b27eu, 0x9c5e61dbu,
+    0x815b5163u, 0x4a0782c6u, 0xcc93f068u, 0x07cf23cdu, 0xf6999118u, 0x3dc542bdu,
+    0xbb513013u, 0x700de3b6u, 0x6d08d30eu, 0xa65400abu, 0x20c07205u, 0xeb9ca1a0u,
+    0x11e81eb4u, 0xdab4cd11u, 0x5c20bfbfu, 0x977c6c1au, 0x8a795ca2u, 0x41258f07u,
+    0xc7b1fda9u, 0x0ced2e0cu, 0xfdbb9cd9u, 0x36e74f7cu, 0xb0733dd2u, 0x7b2fee77u,
+    0x662adecfu, 0xad760d6au, 0x2be27fc4u, 0xe0beac61u, 0x123e1c2fu, 0xd962cf8au,
+    0x5ff6bd24u, 0x94aa6e81u, 0x89af5e39u, 0x42f38d9cu, 0xc467ff32u, 0x0f3b2c97u,
+    0xfe6d9e42u, 0x35314de7u, 0xb3a53f49u, 0x78f9ececu, 0x65fcdc54u, 0xaea00ff1u,
+    0x28347d5fu, 0xe368aefau, 0x16441b82u, 0xdd18c827u, 0x5b8cba89u, 0x90d0692cu,
+    0x8dd55994u, 0x46898a31u, 0xc01df89fu, 0x0b412b3au, 0xfa1799efu, 0x314b4a4au,
+    0xb7df38e4u, 0x7c83eb41u, 0x6186dbf9u, 0xaada085cu, 0x2c4e7af2u, 0xe712a957u,
+    0x15921919u, 0xdececabcu, 0x585ab812u, 0x93066bb7u, 0x8e035b0fu, 0x455f88aau,
+    0xc3cbfa04u, 0x089729a1u, 0xf9c19b74u, 0x329d48d1u, 0xb4093a7fu, 0x7f55e9dau,
+    0x6250d962u, 0xa90c0ac7u, 0x2f987869u, 0xe4c4abccu
+  },
+  {
+    0x00000000u, 0xa6770bb4u, 0x979f1129u, 0x31e81a9du, 0xf44f2413u, 0x52382fa7u,
+    0x63d0353au, 0xc5a73e8eu, 0x33ef4e67u, 0x959845d3u, 0xa4705f4eu, 0x020754fau,
+    0xc7a06a74u, 0x61d761c0u, 0x503f7b5du, 0xf64870e9u, 0x67de9cceu, 0xc1a9977au,
+    0xf0418de7u, 0x56368653u, 0x9391b8ddu, 0x35e6b369u, 0x040ea9f4u, 0xa279a240u,
+    0x5431d2a9u, 0xf246d91du, 0xc3aec380u, 0x65d9c834u, 0xa07ef6bau, 0x0609fd0eu,
+    0x37e1e793u, 0x9196ec27u, 0xcfbd399cu, 0x69ca3228u, 0x582228b5u, 0xfe552301u,
+    0x3bf21d8fu, 0x9d85163bu, 0xac6d0ca6u, 0x0a1a0712u, 0xfc5277fbu, 0x5a257c4fu,
+    0x6bcd66d2u, 0xcdba6d66u, 0x081d53e8u, 0xae6a585cu, 0x9f8242c1u, 0x39f54975u,
+    0xa863a552u, 0x0e14aee6u, 0x3ffcb47bu, 0x998bbfcfu, 0x5c2c8141u, 0xfa5b8af5u,
+    0xcbb39068u, 0x6dc49bdcu, 0x9b8ceb35u, 0x3dfbe081u, 0x0c13fa1cu, 0xaa64f1a8u,
+    0x6fc3cf26u, 0xc9b4c492u, 0xf85cde0fu, 0x5e2bd5bbu, 0x440b7579u, 0xe27c7ecdu,
+    0xd3946450u, 0x75e36fe4u, 0xb044516au, 0x16335adeu, 0x27db4043u, 0x81ac4bf7u,
+    0x77e43b1eu, 0xd19330aau, 0xe07b2a37u, 0x460c2183u, 0x83ab1f0du, 0x25dc14b9u,
+    0x14340e24u, 0xb2430590u, 0x23d5e9b7u, 0x85a2e203u, 0xb44af89eu, 0x123df32au,
+    0xd79acda4u, 0x71edc610u, 0x4005dc8du, 0xe672d739u, 0x103aa7d0u, 0xb64dac64u,
+    0x87a5b6f9u, 0x21d2bd4du, 0xe47583c3u, 0x42028877u, 0x73ea92eau, 0xd59d995eu,
+    0x8bb64ce5u, 0x2dc14751u, 0x1c295dccu, 0xba5e5678u, 0x7ff968f6u, 0xd98e6342u,
+    0xe86679dfu, 0x4e11726bu, 0xb8590282u, 0x1e2e0936u, 0x2fc613abu, 0x89b1181fu,
+    0x4c162691u, 0xea612d25u, 0xdb8937b8u, 0x7dfe3c0cu, 0xec68d02bu, 0x4a1fdb9fu,
+    0x7bf7c102u, 0xdd80cab6u, 0x1827f438u, 0xbe50ff8cu, 0x8fb8e511u, 0x29cfeea5u,
+    0xdf879e4cu, 0x79f095f8u, 0x48188f65u, 0xee6f84d1u, 0x2bc8ba5fu, 0x8dbfb1ebu,
+    0xbc57ab76u, 0x1a20a0c2u, 0x8816eaf2u, 0x2e61e146u, 0x1f89fbdbu, 0xb9fef06fu,
+    0x7c59cee1u, 0xda2ec555u, 0xebc6dfc8u, 0x4db1d47cu, 0xbbf9a495u, 0x1d8eaf21u,
+    0x2c66b5bcu, 0x8a11be08u, 0x4fb68086u, 0xe9c18b32u, 0xd82991afu, 0x7e5e9a1bu,
+    0xefc8763cu, 0x49bf7d88u, 0x78576715u, 0xde206ca1u, 0x1b87522fu, 0xbdf0599bu,
+    0x8c184306u, 0x2a6f48b2u, 0xdc27385bu, 0x7a5033efu, 0x4bb82972u, 0xedcf22c6u,
+    0x28681c48u, 0x8e1f17fcu, 0xbff70d61u, 0x198006d5u, 0x47abd36eu, 0xe1dcd8dau,
+    0xd034c247u, 0x7643c9f3u, 0xb3e4f77du, 0x1593fcc9u, 0x247be654u, 0x820cede0u,
+    0x74449d09u, 0xd23396bdu, 0xe3db8c20u, 0x45ac8794u, 0x800bb91au, 0x267cb2aeu,
+    0x1794a833u, 0xb1e3a387u, 0x20754fa0u, 0x86024414u, 0xb7ea5e89u, 0x119d553du,
+    0xd43a6bb3u, 0x724d6007u, 0x43a57a9au, 0xe5d2712eu, 0x139a01c7u, 0xb5ed0a73u,
+    0x840510eeu, 0x22721b5au, 0xe7d525d4u, 0x41a22e60u, 0x704a34fdu, 0xd63d3f49u,
+    0xcc1d9f8bu, 0x6a6a943fu, 0x5b828ea2u, 0xfdf58516u, 0x3852bb98u, 0x9e25b02cu,
+    0xafcdaab1u, 0x09baa105u, 0xfff2d1ecu, 0x5985da58u, 0x686dc0c5u, 0xce1acb71u,
+    0x0bbdf5ffu, 0xadcafe4bu, 0x9c22e4d6u, 0x3a55ef62u, 0xabc30345u, 0x0db408f1u,
+    0x3c5c126cu, 0x9a2b19d8u, 0x5f8c2756u, 0xf9fb2ce2u, 0xc813367fu, 0x6e643dcbu,
+    0x982c4d22u, 0x3e5b4696u, 0x0fb35c0bu, 0xa9c457bfu, 0x6c636931u, 0xca146285u,
+    0xfbfc7818u, 0x5d8b73acu, 0x03a0a617u, 0xa5d7ada3u, 0x943fb73eu, 0x3248bc8au,
+    0xf7ef8204u, 0x519889b0u, 0x6070932du, 0xc6079899u, 0x304fe870u, 0x9638e3c4u,
+    0xa7d0f959u, 0x01a7f2edu, 0xc400cc63u, 0x6277c7d7u, 0x539fdd4au, 0xf5e8d6feu,
+    0x647e3ad9u, 0xc209316du, 0xf3e12bf0u, 0x55962044u, 0x90311ecau, 0x3646157eu,
+    0x07ae0fe3u, 0xa1d90457u, 0x579174beu, 0xf1e67f0au, 0xc00e6597u, 0x66796e23u,
+    0xa3de50adu, 0x05a95b19u, 0x34414184u, 0x92364a30u
+  },
+  {
+    0x00000000u, 0xccaa009eu, 0x4225077du, 0x8e8f07e3u, 0x844a0efau, 0x48e00e64u,
+    0xc66f0987u, 0x0ac50919u, 0xd3e51bb5u, 0x1f4f1b2bu, 0x91c01cc8u, 0x5d6a1c56u,
+    0x57af154fu, 0x9b0515d1u, 0x158a1232u, 0xd92012acu, 0x7cbb312bu, 0xb01131b5u,
+    0x3e9e3656u, 0xf23436c8u, 0xf8f13fd1u, 0x345b3f4fu, 0xbad438acu, 0x767e3832u,
+    0xaf5e2a9eu, 0x63f42a00u, 0xed7b2de3u, 0x21d12d7du, 0x2b142464u, 0xe7be24fau,
+    0x69312319u, 0xa59b2387u, 0xf9766256u, 0x35dc62c8u, 0xbb53652bu, 0x77f965b5u,
+    0x7d3c6cacu, 0xb1966c32u, 0x3f196bd1u, 0xf3b36b4fu, 0x2a9379e3u, 0xe639797du,
+    0x68b67e9eu, 0xa41c7e00u, 0xaed97719u, 0x62737787u, 0xecfc7064u, 0x205670fau,
+    0x85cd537du, 0x496753e3u, 0xc7e85400u, 0x0b42549eu, 0x01875d87u, 0xcd2d5d19u,
+    0x43a25afau, 0x8f085a64u, 0x562848c8u, 0x9a824856u, 0x140d4fb5u, 0xd8a74f2bu,
+    0xd2624632u, 0x1ec846acu, 0x9047414fu, 0x5ced41d1u, 0x299dc2edu, 0xe537c273u,
+    0x6bb8c590u, 0xa712c50eu, 0xadd7cc17u, 0x617dcc89u, 0xeff2cb6au, 0x2358cbf4u,
+    0xfa78d958u, 0x36d2d9c6u, 0xb85dde25u, 0x74f7debbu, 0x7e32d7a2u, 0xb298d73cu,
+    0x3c17d0dfu, 0xf0bdd041u, 0x5526f3c6u, 0x998cf358u, 0x1703f4bbu, 0xdba9f425u,
+    0xd16cfd3cu, 0x1dc6fda2u, 0x9349fa41u, 0x5fe3fadfu, 0x86c3e873u, 0x4a69e8edu,
+    0xc4e6ef0eu, 0x084cef90u, 0x0289e689u, 0xce23e617u, 0x40ace1f4u, 0x8c06e16au,
+    0xd0eba0bbu, 0x1c41a025u, 0x92cea7c6u, 0x5e64a758u, 0x54a1ae41u, 0x980baedfu,
+    0x1684a93cu, 0xda2ea9a2u, 0x030ebb0eu, 0xcfa4bb90u, 0x412bbc73u, 0x8d81bcedu,
+    0x8744b5f4u, 0x4beeb56au, 0xc561b289u, 0x09cbb217u, 0xac509190u, 0x60fa910eu,
+    0xee7596edu, 0x22df9673u, 0x281a9f6au, 0xe4b09ff4u, 0x6a3f9817u, 0xa6959889u,
+    0x7fb58a25u, 0xb31f8abbu, 0x3d908d58u, 0xf13a8dc6u, 0xfbff84dfu, 0x37558441u,
+    0xb9da83a2u, 0x7570833cu, 0x533b85dau, 0x9f918544u, 0x111e82a7u, 0xddb48239u,
+    0xd7718b20u, 0x1bdb8bbeu, 0x95548c5du, 0x59fe8cc3u, 0x80de9e6fu, 0x4c749ef1u,
+    0xc2fb9912u, 0x0e51998cu, 0x04949095u, 0xc83e900bu, 0x46b197e8u, 0x8a1b9776u,
+    0x2f80b4f1u, 0xe32ab46fu, 0x6da5b38cu, 0xa10fb312u, 0xabcaba0bu, 0x6760ba95u,
+    0xe9efbd76u, 0x2545bde8u, 0xfc65af44u, 0x30cfafdau, 0xbe40a839u, 0x72eaa8a7u,
+    0x782fa1beu, 0xb485a120u, 0x3a0aa6c3u, 0xf6a0a65du, 0xaa4de78cu, 0x66e7e712u,
+    0xe868e0f1u, 0x24c2e06fu, 0x2e07e976u, 0xe2ade9e8u, 0x6c22ee0bu, 0xa088ee95u,
+    0x79a8fc39u, 0xb502fca7u, 0x3b8dfb44u, 0xf727fbdau, 0xfde2f2c3u, 0x3148f25du,
+    0xbfc7f5beu, 0x736df520u, 0xd6f6d6a7u, 0x1a5cd639u, 0x94d3d1dau, 0x5879d144u,
+    0x52bcd85du, 0x9e16d8c3u, 0x1099df20u, 0xdc33dfbeu, 0x0513cd12u, 0xc9b9cd8cu,
+    0x4736ca6fu, 0x8b9ccaf1u, 0x8159c3e8u, 0x4df3c376u, 0xc37cc495u, 0x0fd6c40bu,
+    0x7aa64737u, 0xb60c47a9u, 0x3883404au, 0xf42940d4u, 0xfeec49cdu, 0x32464953u,
+    0xbcc94eb0u, 0x70634e2eu, 0xa9435c82u, 0x65e95c1cu, 0xeb665bffu, 0x27cc5b61u,
+    0x2d095278u, 0xe1a352e6u, 0x6f2c5505u, 0xa386559bu, 0x061d761cu, 0xcab77682u,
+    0x44387161u, 0x889271ffu, 0x825778e6u, 0x4efd7878u, 0xc0727f9bu, 0x0cd87f05u,
+    0xd5f86da9u, 0x19526d37u, 0x97dd6ad4u, 0x5b776a4au, 0x51b26353u, 0x9d1863cdu,
+    0x1397642eu, 0xdf3d64b0u, 0x83d02561u, 0x4f7a25ffu, 0xc1f5221cu, 0x0d5f2282u,
+    0x079a2b9bu, 0xcb302b05u, 0x45bf2ce6u, 0x89152c78u, 0x50353ed4u, 0x9c9f3e4au,
+    0x121039a9u, 0xdeba3937u, 0xd47f302eu, 0x18d530b0u, 0x965a3753u, 0x5af037cdu,
+    0xff6b144au, 0x33c114d4u, 0xbd4e1337u, 0x71e413a9u, 0x7b211ab0u, 0xb78b1a2eu,
+    0x39041dcdu, 0xf5ae1d53u, 0x2c8e0fffu, 0xe0240f61u, 0x6eab0882u, 0xa201081cu,
+    0xa8c40105u, 0x646e019bu, 0xeae10678u, 0x264b06e6u
   }
-  Crc32_crc_table_computed = 1;
-}
+};
 
 /*Update a running CRC with the bytes buf[0..len-1]--the CRC should be
 initialized to all 1's, and the transmitted value is the 1's complement of the
 final running CRC (see the crc() routine below).*/
 static unsigned Crc32_update_crc(const unsigned char* buf, unsigned crc, size_t len)
 {
-  unsigned c = crc;
-  size_t n;
+  unsigned c = crc, d;
+
+  /*process 8 bytes at once, the bytes are combined in little endian order on any platform*/
+  while(len >= 8)
+  {
+    c ^= buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((unsigned)buf[3] << 24);
+    d = buf[4] | (buf[5] << 8) | (buf[6] << 16) | ((unsigned)buf[7] << 24);
+    c = Crc32_crc_table[7][c & 0xff] ^ Crc32_crc_table[6][(c >> 8) & 0xff]
+      ^ Crc32_crc_table[5][(c >> 16) & 0xff] ^ Crc32_crc_table[4][(c >> 24) & 0xff]
+      ^ Crc32_crc_table[3][d & 0xff] ^ Crc32_crc_table[2][(d >> 8) & 0xff]
+      ^ Crc32_crc_table[1][(d >> 16) & 0xff] ^ Crc32_crc_table[0][(d >> 24) & 0xff];
+    buf += 8;
+    len -= 8;
+  }
 
-  if(!Crc32_crc_table_computed) Crc32_make_crc_table();
-  for(n = 0; n < len; n++)
+  while(len > 0)
   {
-    c = Crc32_crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+    c = Crc32_crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+    len--;
   }
   return c;
 }
@@ -2676,13 +3986,6 @@ static int color_tree_get(ColorTree* tree, unsigned char r, unsigned char g, uns
   return tree->index;
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
-{
-  return color_tree_get(tree, r, g, b, a) >= 0;
-}
-#endif /*LODEPNG_COMPILE_ENCODER*/
-
 /*color is not allowed to already exist. Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
 static void color_tree_add(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a, int index)
 {
@@ -3012,6 +4315,9 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
 
 #ifdef LODEPNG_COMPILE_ENCODER
 
+/*the number of slots of the set of counted colors, a power of two of at least 4 times 257*/
+#define COLOR_PROFILE_HASH_SIZE 1024u
+
 typedef struct ColorProfile
 {
   unsigned char sixteenbit; /*needs more than 8 bits per channel*/
@@ -3029,8 +4335,10 @@ typedef struct ColorProfile
   unsigned char alpha_done;
 
   unsigned numcolors;
-  ColorTree tree; /*for listing the counted colors, up to 256*/
-  unsigned char* palette; /*size 1024. Remember up to the first 256 RGBA colors*/
+  /*for listing the counted colors, up to 257, as RGBA packed into integers in a hash set*/
+  unsigned colors[COLOR_PROFILE_HASH_SIZE];
+  unsigned char used[COLOR_PROFILE_HASH_SIZE]; /*whether the slot in colors holds a color*/
+  unsigned char palette[1024]; /*Remember up to the first 256 RGBA colors*/
   unsigned maxnumcolors; /*if more than that amount counted*/
   unsigned char numcolors_done;
 
@@ -3052,8 +4360,7 @@ static void color_profile_init(ColorProfile* profile, LodePNGColorMode* mode)
   profile->alpha_done = lodepng_can_have_alpha(mode) ? 0 : 1;
 
   profile->numcolors = 0;
-  color_tree_init(&profile->tree, 1);
-  profile->palette = (unsigned char*)mymalloc(1024);
+  memset(profile->used, 0, sizeof(profile->used));
   profile->maxnumcolors = 257;
   if(lodepng_get_bpp(mode) <= 8)
   {
@@ -3066,10 +4373,20 @@ static void color_profile_init(ColorProfile* profile, LodePNGColorMode* mode)
   profile->greybits_done = lodepng_get_bpp(mode) == 1 ? 1 : 0;
 }
 
-static void color_profile_cleanup(ColorProfile* profile)
+/*adds a color to the counted colors, returns 1 if it was not counted yet*/
+static unsigned color_profile_add(ColorProfile* profile,
+                                  unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
-  color_tree_cleanup(&profile->tree);
-  myfree(profile->palette);
+  unsigned color = ((unsigned)r << 24) | ((unsigned)g << 16) | ((unsigned)b << 8) | (unsigned)a;
+  unsigned i = ((color * 2654435761u) & 0xffffffffu) >> 22; /*the top 10 bits, for 1024 slots*/
+  while(profile->used[i])
+  {
+    if(profile->colors[i] == color) return 0;
+    i = (i + 1) & (COLOR_PROFILE_HASH_SIZE - 1);
+  }
+  profile->used[i] = 1;
+  profile->colors[i] = color;
+  return 1;
 }
 
 /*function used for debug purposes with C++*/
@@ -3169,9 +4486,8 @@ static unsigned get_color_profile(ColorProfile* profile,
       if(!profile->numcolors_done)
       {
         /*assuming 8-bit rgba, this test does not care about 16-bit*/
-        if(!color_tree_has(&profile->tree, r, g, b, a))
+        if(color_profile_add(profile, r, g, b, a))
         {
-          color_tree_add(&profile->tree, r, g, b, a, profile->numcolors);
           if(profile->numcolors < 256)
           {
             unsigned char* p = profile->palette;
@@ -3237,10 +4553,8 @@ static unsigned get_color_profile(ColorProfile* profile,
 
       if(!profile->numcolors_done)
       {
-        if(!color_tree_has(&profile->tree, r, g, b, a))
+        if(color_profile_add(profile, r, g, b, a))
         {
-
-          color_tree_add(&profile->tree, r, g, b, a, profile->numcolors);
           if(profile->numcolors < 256)
           {
             unsigned char* p = profile->palette;
@@ -3388,8 +4702,6 @@ static unsigned doAutoChooseColor(LodePNGColorMode* mode_out,
     }
   }
 
-  color_profile_cleanup(&profile);
-
   if(mode_in->colortype == LCT_PALETTE && mode_out->colortype == LCT_PALETTE
      && mode_in->palettesize == mode_out->palettesize) {
     /*In this case keep the palette order of the input, so that the user can choose an optimal one*/
@@ -3432,6 +4744,35 @@ static unsigned char paethPredictor(short a, short b, short c)
   else return (unsigned char)c;
 }
 
+#ifdef LODEPNG_SSE2
+/*if mask then x else y, for each element*/
+static __m128i selectSSE2(__m128i mask, __m128i x, __m128i y)
+{
+  return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+static __m128i abs16SSE2(__m128i x)
+{
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+/*paethPredictor for eight 16-bit values at once, a, b and c must be in the range 0-255*/
+static __m128i paethPredictorSSE2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = abs16SSE2(_mm_add_epi16(pa, pb));
+  __m128i smallest;
+  pa = abs16SSE2(pa);
+  pb = abs16SSE2(pb);
+
+  /*ties are resolved in favor of a, then b, like in paethPredictor*/
+  smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  return selectSSE2(_mm_cmpeq_epi16(smallest, pa), a,
+                    selectSSE2(_mm_cmpeq_epi16(smallest, pb), b, c));
+}
+#endif /*LODEPNG_SSE2*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -3531,6 +4872,94 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
+#ifdef LODEPNG_SSE2
+/*
+SSE2 versions of the filters. Sub, Average and Paeth process all channels of a pixel
+at once and only support 3 and 4 bytes per pixel, Up processes 16 bytes at once.
+The same rules as for unfilterScanline apply, precon must not be NULL.
+*/
+/*3 byte pixels are assembled in a register, going through memory stalls store forwarding*/
+static __m128i loadPixelSSE2(const unsigned char* p, size_t bytewidth)
+{
+  int value;
+  if(bytewidth == 4) memcpy(&value, p, 4);
+  else value = p[0] | (p[1] << 8) | (p[2] << 16);
+  return _mm_cvtsi32_si128(value);
+}
+
+static void storePixelSSE2(unsigned char* p, __m128i v, size_t bytewidth)
+{
+  int value = _mm_cvtsi128_si32(v);
+  if(bytewidth == 4) memcpy(p, &value, 4);
+  else
+  {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+    p[2] = (unsigned char)(value >> 16);
+  }
+}
+
+static void unfilterSubSSE2(unsigned char* recon, const unsigned char* scanline, size_t bytewidth, size_t length)
+{
+  __m128i a = _mm_setzero_si128();
+  size_t i;
+  for(i = 0; i + bytewidth <= length; i += bytewidth)
+  {
+    a = _mm_add_epi8(a, loadPixelSSE2(&scanline[i], bytewidth));
+    storePixelSSE2(&recon[i], a, bytewidth);
+  }
+}
+
+static void unfilterUpSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                           size_t length)
+{
+  size_t i;
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i d = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+    _mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(d, b));
+  }
+  for(; i < length; i++) recon[i] = scanline[i] + precon[i];
+}
+
+static void unfilterAverageSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                size_t bytewidth, size_t length)
+{
+  __m128i a = _mm_setzero_si128(), b, avg;
+  __m128i one = _mm_set1_epi8(1);
+  size_t i;
+  for(i = 0; i + bytewidth <= length; i += bytewidth)
+  {
+    b = loadPixelSSE2(&precon[i], bytewidth);
+    /*_mm_avg_epu8 rounds up, the filter rounds down*/
+    avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(loadPixelSSE2(&scanline[i], bytewidth), avg);
+    storePixelSSE2(&recon[i], a, bytewidth);
+  }
+}
+
+static void unfilterPaethSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                              size_t bytewidth, size_t length)
+{
+  /*a, b and c are widened to 16 bit, the same way paethPredictor uses shorts*/
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero, b, nearest, x;
+  size_t i;
+  for(i = 0; i + bytewidth <= length; i += bytewidth)
+  {
+    b = _mm_unpacklo_epi8(loadPixelSSE2(&precon[i], bytewidth), zero);
+    nearest = paethPredictorSSE2(a, b, c);
+
+    x = _mm_add_epi8(loadPixelSSE2(&scanline[i], bytewidth), _mm_packus_epi16(nearest, nearest));
+    storePixelSSE2(&recon[i], x, bytewidth);
+
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+#endif /*LODEPNG_SSE2*/
+
 static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
                                  size_t bytewidth, unsigned char filterType, size_t length)
 {
@@ -3544,6 +4973,33 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+
+#ifdef LODEPNG_SSE2
+  if(filterType == 2 && precon)
+  {
+    unfilterUpSSE2(recon, scanline, precon, length);
+    return 0;
+  }
+  if(bytewidth == 3 || bytewidth == 4)
+  {
+    if(filterType == 1)
+    {
+      unfilterSubSSE2(recon, scanline, bytewidth, length);
+      return 0;
+    }
+    if(filterType == 3 && precon)
+    {
+      unfilterAverageSSE2(recon, scanline, precon, bytewidth, length);
+      return 0;
+    }
+    if(filterType == 4 && precon)
+    {
+      unfilterPaethSSE2(recon, scanline, precon, bytewidth, length);
+      return 0;
+    }
+  }
+#endif /*LODEPNG_SSE2*/
+
   switch(filterType)
   {
     case 0:
@@ -3770,6 +5226,94 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
   return 0;
 }
 
+/*the total size of the data of all IDAT chunks from the given chunk up to IEND or the end of the buffer*/
+static size_t getIdatSize(const unsigned char* chunk, const unsigned char* end)
+{
+  size_t total = 0;
+  while((size_t)(end - chunk) >= 12 && (size_t)(end - chunk) - 12 >= lodepng_chunk_length(chunk))
+  {
+    if(lodepng_chunk_type_equals(chunk, "IEND")) break;
+    if(lodepng_chunk_type_equals(chunk, "IDAT")) total += lodepng_chunk_length(chunk);
+    chunk = lodepng_chunk_next_const(chunk);
+  }
+  return total;
+}
+
+/*the size of the filtered (and for Adam7, interlaced) scanlines, including the filter type bytes*/
+static size_t getScanlinesSize(unsigned w, unsigned h, const LodePNGInfo* info_png)
+{
+  unsigned bpp = lodepng_get_bpp(&info_png->color);
+  if(info_png->interlace_method == 0)
+  {
+    return (size_t)h * (1 + ((size_t)w * bpp + 7) / 8);
+  }
+  else
+  {
+    unsigned passw[7], passh[7]; size_t filter_passstart[8], padded_passstart[8], passstart[8];
+    Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+    return filter_passstart[7];
+  }
+}
+
+/*palette chunk (PLTE)*/
+static unsigned readChunk_PLTE(LodePNGColorMode* color, const unsigned char* data, size_t chunkLength)
+{
+  unsigned pos = 0, i;
+  if(color->palette) myfree(color->palette);
+  color->palettesize = chunkLength / 3;
+  color->palette = (unsigned char*)mymalloc(4 * color->palettesize);
+  if(!color->palette && color->palettesize)
+  {
+    color->palettesize = 0;
+    return 83; /*alloc fail*/
+  }
+  if(color->palettesize > 256) return 38; /*error: palette too big*/
+
+  for(i = 0; i < color->palettesize; i++)
+  {
+    color->palette[4 * i + 0] = data[pos++]; /*R*/
+    color->palette[4 * i + 1] = data[pos++]; /*G*/
+    color->palette[4 * i + 2] = data[pos++]; /*B*/
+    color->palette[4 * i + 3] = 255; /*alpha*/
+  }
+
+  return 0; /*OK*/
+}
+
+/*palette transparency chunk (tRNS)*/
+static unsigned readChunk_tRNS(LodePNGColorMode* color, const unsigned char* data, size_t chunkLength)
+{
+  unsigned i;
+  if(color->colortype == LCT_PALETTE)
+  {
+    /*error: more alpha values given than there are palette entries*/
+    if(chunkLength > color->palettesize) return 38;
+
+    for(i = 0; i < chunkLength; i++) color->palette[4 * i + 3] = data[i];
+  }
+  else if(color->colortype == LCT_GREY)
+  {
+    /*error: this chunk must be 2 bytes for greyscale image*/
+    if(chunkLength != 2) return 30;
+
+    color->key_defined = 1;
+    color->key_r = color->key_g = color->key_b = 256 * data[0] + data[1];
+  }
+  else if(color->colortype == LCT_RGB)
+  {
+    /*error: this chunk must be 6 bytes for RGB image*/
+    if(chunkLength != 6) return 41;
+
+    color->key_defined = 1;
+    color->key_r = 256 * data[0] + data[1];
+    color->key_g = 256 * data[2] + data[3];
+    color->key_b = 256 * data[4] + data[5];
+  }
+  else return 42; /*error: tRNS chunk not allowed for other color models*/
+
+  return 0; /*OK*/
+}
+
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
 static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
                           LodePNGState* state,
@@ -3777,8 +5321,9 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
 {
   unsigned char IEND = 0;
   const unsigned char* chunk;
-  size_t i;
-  ucvector idat; /*the data from idat chunks*/
+  ucvector idat; /*the data from idat chunks, if there are several of them*/
+  const unsigned char* idat_data = 0; /*the compressed image data, either in the in buffer or idat*/
+  size_t idat_size = 0;
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
@@ -3793,12 +5338,15 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   chunk = &in[33]; /*first byte of the first chunk after the header*/
 
   /*loop through the chunks, ignoring unknown chunks and stopping at IEND chunk.
-  IDAT data is put at the start of the in buffer*/
+  A single IDAT chunk is used where it is, the data of multiple IDAT chunks is
+  concatenated in a buffer of the exact total size*/
   while(!IEND && !state->error)
   {
     unsigned chunkLength;
     const unsigned char* data; /*the data in the chunk*/
 
+    unknown = 0;
+
     /*error: size of the in buffer too small to contain next chunk*/
     if((size_t)((chunk - in) + 12) > insize || chunk < in) CERROR_BREAK(state->error, 30);
 
@@ -3817,9 +5365,26 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     /*IDAT chunk, containing compressed image data*/
     if(lodepng_chunk_type_equals(chunk, "IDAT"))
     {
-      size_t oldsize = idat.size;
-      if(!ucvector_resize(&idat, oldsize + chunkLength)) CERROR_BREAK(state->error, 83 /*alloc fail*/);
-      for(i = 0; i < chunkLength; i++) idat.data[oldsize + i] = data[i];
+      if(!idat_data)
+      {
+        size_t total = getIdatSize(chunk, in + insize);
+        idat_data = data;
+        if(total > chunkLength)
+        {
+          unsigned char* buffer = (unsigned char*)mymalloc(total);
+          if(!buffer) CERROR_BREAK(state->error, 83 /*alloc fail*/);
+          ucvector_init_buffer(&idat, buffer, total);
+          idat_data = idat.data;
+        }
+      }
+
+      if(idat_data == idat.data)
+      {
+        /*error: the IDAT chunks are larger than counted in advance*/
+        if(idat_size + chunkLength > idat.size) CERROR_BREAK(state->error, 30);
+        memcpy(&idat.data[idat_size], data, chunkLength);
+      }
+      idat_size += chunkLength;
     }
     /*IEND chunk*/
     else if(lodepng_chunk_type_equals(chunk, "IEND"))
@@ -3829,55 +5394,14 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     /*palette chunk (PLTE)*/
     else if(lodepng_chunk_type_equals(chunk, "PLTE"))
     {
-      unsigned pos = 0;
-      if(state->info_png.color.palette) myfree(state->info_png.color.palette);
-      state->info_png.color.palettesize = chunkLength / 3;
-      state->info_png.color.palette = (unsigned char*)mymalloc(4 * state->info_png.color.palettesize);
-      if(!state->info_png.color.palette && state->info_png.color.palettesize)
-      {
-        state->info_png.color.palettesize = 0;
-        CERROR_BREAK(state->error, 83); /*alloc fail*/
-      }
-      if(state->info_png.color.palettesize > 256) CERROR_BREAK(state->error, 38); /*error: palette too big*/
-
-      for(i = 0; i < state->info_png.color.palettesize; i++)
-      {
-        state->info_png.color.palette[4 * i + 0] = data[pos++]; /*R*/
-        state->info_png.color.palette[4 * i + 1] = data[pos++]; /*G*/
-        state->info_png.color.palette[4 * i + 2] = data[pos++]; /*B*/
-        state->info_png.color.palette[4 * i + 3] = 255; /*alpha*/
-      }
+      state->error = readChunk_PLTE(&state->info_png.color, data, chunkLength);
+      if(state->error) break;
     }
     /*palette transparency chunk (tRNS)*/
     else if(lodepng_chunk_type_equals(chunk, "tRNS"))
     {
-      if(state->info_png.color.colortype == LCT_PALETTE)
-      {
-        /*error: more alpha values given than there are palette entries*/
-        if(chunkLength > state->info_png.color.palettesize) CERROR_BREAK(state->error, 38);
-
-        for(i = 0; i < chunkLength; i++) state->info_png.color.palette[4 * i + 3] = data[i];
-      }
-      else if(state->info_png.color.colortype == LCT_GREY)
-      {
-        /*error: this chunk must be 2 bytes for greyscale image*/
-        if(chunkLength != 2) CERROR_BREAK(state->error, 30);
-
-        state->info_png.color.key_defined = 1;
-        state->info_png.color.key_r = state->info_png.color.key_g
-                                     = state->info_png.color.key_b = 256 * data[0] + data[1];
-      }
-      else if(state->info_png.color.colortype == LCT_RGB)
-      {
-        /*error: this chunk must be 6 bytes for RGB image*/
-        if(chunkLength != 6) CERROR_BREAK(state->error, 41);
-
-        state->info_png.color.key_defined = 1;
-        state->info_png.color.key_r = 256 * data[0] + data[1];
-        state->info_png.color.key_g = 256 * data[2] + data[3];
-        state->info_png.color.key_b = 256 * data[4] + data[5];
-      }
-      else CERROR_BREAK(state->error, 42); /*error: tRNS chunk not allowed for other color models*/
+      state->error = readChunk_tRNS(&state->info_png.color, data, chunkLength);
+      if(state->error) break;
     }
     else /*it's not an implemented chunk type, so ignore it: skip over the data*/
     {
@@ -3898,26 +5422,40 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   if(!state->error)
   {
     ucvector scanlines;
+    size_t expected = getScanlinesSize(*w, *h, &state->info_png);
+    size_t rawsize = lodepng_get_raw_size(*w, *h, &state->info_png.color);
+
+    /*The decompressed size is known in advance, so the inflater gets a buffer of exactly that size,
+    plus the 258 bytes it wants to have available for every back reference, and never grows it*/
     ucvector_init(&scanlines);
+    if(expected + 259 > expected) scanlines.data = (unsigned char*)mymalloc(expected + 259);
+    if(!scanlines.data) state->error = 83; /*alloc fail*/
+    else scanlines.allocsize = scanlines.size = expected + 259;
 
-    /*maximum final image length is already reserved in the vector's length - this is not really necessary*/
-    if(!ucvector_resize(&scanlines, lodepng_get_raw_size(*w, *h, &state->info_png.color) + *h))
-    {
-      state->error = 83; /*alloc fail*/
-    }
     if(!state->error)
     {
       /*decompress with the Zlib decompressor*/
-      state->error = lodepng_zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
-                                             idat.size, &state->decoder.zlibsettings);
+      state->error = lodepng_zlib_decompress(&scanlines.data, &scanlines.size, idat_data,
+                                             idat_size, &state->decoder.zlibsettings);
     }
+    if(!state->error && scanlines.size < expected) state->error = 91; /*error: not enough image data*/
 
-    if(!state->error)
+    if(!state->error && state->info_png.interlace_method == 0)
+    {
+      /*without interlacing the scanlines can be unfiltered in place, the buffer becomes the output*/
+      state->error = postProcessScanlines(scanlines.data, scanlines.data, *w, *h, &state->info_png);
+      if(!state->error)
+      {
+        *out = (unsigned char*)myrealloc(scanlines.data, rawsize);
+        if(!*out) *out = scanlines.data; /*shrinking failed, keep the larger buffer*/
+        ucvector_init(&scanlines);
+      }
+    }
+    else if(!state->error)
     {
       ucvector outv;
       ucvector_init(&outv);
-      if(!ucvector_resizev(&outv,
-          lodepng_get_raw_size(*w, *h, &state->info_png.color), 0)) state->error = 83; /*alloc fail*/
+      if(!ucvector_resizev(&outv, rawsize, 0)) state->error = 83; /*alloc fail*/
       if(!state->error) state->error = postProcessScanlines(outv.data, scanlines.data, *w, *h, &state->info_png);
       *out = outv.data;
     }
@@ -3994,10 +5532,564 @@ unsigned lodepng_decode24(unsigned char** out, unsigned* w, unsigned* h, const u
   return lodepng_decode_memory(out, w, h, in, insize, LCT_RGB, 8);
 }
 
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / Row Decoder                                                            / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*
+State of an inflator that stops when its output reaches a limit, and continues
+where it left off when called again. The input comes from the more callback of
+the bit reader, so neither the compressed nor the decompressed data has to be in
+memory at once.
+*/
+typedef struct Inflater
+{
+  BitReader reader;
+  HuffmanTree tree_ll; /*the huffman tree for literal and length codes of the current block*/
+  HuffmanTree tree_d; /*the huffman tree for distance codes of the current block*/
+  unsigned final; /*BFINAL of the current block*/
+  unsigned mode; /*0: at a block header, 1: in a huffman block, 2: in a stored block, 3: done*/
+  unsigned stored; /*bytes left in the current stored block*/
+} Inflater;
+
+static void Inflater_init(Inflater* inf)
+{
+  BitReader_init(&inf->reader, 0, 0);
+  HuffmanTree_init(&inf->tree_ll);
+  HuffmanTree_init(&inf->tree_d);
+  inf->final = 0;
+  inf->mode = 0;
+  inf->stored = 0;
+}
+
+static void Inflater_cleanup(Inflater* inf)
+{
+  HuffmanTree_cleanup(&inf->tree_ll);
+  HuffmanTree_cleanup(&inf->tree_d);
+}
+
+/*
+inflate until *pos reaches limit or the last block ends. out must have room for
+258 bytes after limit, it is never resized. return value is error
+*/
+static unsigned Inflater_run(Inflater* inf, ucvector* out, size_t* pos, size_t limit)
+{
+  BitReader* reader = &inf->reader;
+  unsigned error = 0;
+
+  while(!error && (*pos) < limit && inf->mode != 3)
+  {
+    if(inf->mode == 0)
+    {
+      unsigned BTYPE;
+      BitReader_refill(reader);
+      if(BitReader_bp(reader) + 2 >= reader->bitsize) return 52; /*error, bit pointer will jump past memory*/
+      inf->final = readBits(reader, 1);
+      BTYPE = readBits(reader, 2);
+
+      if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
+      else if(BTYPE == 0) /*no compression*/
+      {
+        unsigned LEN, NLEN;
+        readBits(reader, reader->avail % 8); /*go to first boundary of byte*/
+        LEN = readBits(reader, 16);
+        NLEN = readBits(reader, 16);
+        if(BitReader_bp(reader) > reader->bitsize) return 52; /*error, bit pointer will jump past memory*/
+        if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
+        inf->stored = LEN;
+        inf->mode = 2;
+      }
+      else /*compression, BTYPE 01 or 10*/
+      {
+        HuffmanTree_cleanup(&inf->tree_ll);
+        HuffmanTree_cleanup(&inf->tree_d);
+        HuffmanTree_init(&inf->tree_ll);
+        HuffmanTree_init(&inf->tree_d);
+        if(BTYPE == 1) getTreeInflateFixed(&inf->tree_ll, &inf->tree_d);
+        else error = getTreeInflateDynamic(&inf->tree_ll, &inf->tree_d, reader);
+        inf->mode = 1;
+      }
+    }
+    else if(inf->mode == 1)
+    {
+      unsigned end = 0;
+      error = inflateHuffmanSymbols(out, reader, pos, limit, &inf->tree_ll, &inf->tree_d, &end);
+      if(end) inf->mode = inf->final ? 3 : 0;
+    }
+    else
+    {
+      /*stored blocks are rare in PNG files, they are simply read through the bit reader*/
+      while(inf->stored && (*pos) < limit)
+      {
+        out->data[(*pos)++] = (unsigned char)readBits(reader, 8);
+        inf->stored--;
+      }
+      if(BitReader_bp(reader) > reader->bitsize) return 23; /*error: reading outside of in buffer*/
+      if(!inf->stored) inf->mode = inf->final ? 3 : 0;
+    }
+  }
+
+  return error;
+}
+
+/*size of the input buffer of the row decoder*/
+#define ROWDECODER_INPUTSIZE 16384u
+/*size of the deflate window, inflated data that back references can reach*/
+#define ROWDECODER_WINDOWSIZE 32768u
+
+struct LodePNGRowDecoder
+{
+  LodePNGState* state;
+  LodePNGReadFunc read;
+  void* user;
+  unsigned w, h;
+  unsigned y; /*the next row to return*/
+  size_t linebytes; /*bytes of a scanline, without the filter type byte*/
+  size_t bytewidth; /*bytes per pixel for the filters, at least 1*/
+  unsigned char* line; /*the current unfiltered scanline*/
+  unsigned char* prevline; /*the previous unfiltered scanline*/
+  Inflater inflater;
+  ucvector window; /*the inflated data, of which the last ROWDECODER_WINDOWSIZE bytes are kept*/
+  size_t windowpos; /*end of the inflated data in window*/
+  size_t used; /*start of the inflated data that is not unfiltered yet*/
+  unsigned char* input; /*the input buffer of the bit reader*/
+  unsigned chunkleft; /*bytes of the current IDAT chunk that are not read yet*/
+  unsigned crc; /*running CRC of the current IDAT chunk*/
+  unsigned adler; /*running adler32 of the inflated data*/
+  unsigned error; /*once an error happened, it is returned by every call*/
+  unsigned char* preview; /*the pixels of the first Adam7 passes of an interlaced image, or 0*/
+};
+
+/*read exactly size bytes, returns 0 if the input ended before*/
+static unsigned readFully(LodePNGReadFunc read, void* user, unsigned char* buffer, size_t size)
+{
+  while(size > 0)
+  {
+    size_t amount = read(buffer, size, user);
+    if(amount == 0 || amount > size) return 0;
+    buffer += amount;
+    size -= amount;
+  }
+  return 1;
+}
+
+/*
+more callback of the bit reader: moves the unread input to the front of the input
+buffer and fills it up with the data of the IDAT chunks. The compressed data ends
+at the first chunk that is not an IDAT chunk. Errors are stored in dec->error.
+*/
+static void rowDecoderMore(BitReader* reader)
+{
+  LodePNGRowDecoder* dec = (LodePNGRowDecoder*)reader->user;
+  /*the bytes of the buffered bits are kept, the bit pointer counts from the start of data*/
+  size_t keep = reader->pos < sizeof(size_t) ? reader->pos : sizeof(size_t);
+  size_t size = reader->size - (reader->pos - keep);
+
+  if(size) memmove(dec->input, reader->data + (reader->pos - keep), size);
+  reader->data = dec->input;
+  reader->pos = keep;
+
+  while(size < ROWDECODER_INPUTSIZE && reader->more)
+  {
+    if(dec->chunkleft == 0)
+    {
+      /*end of an IDAT chunk: its CRC, and the length and type of the next chunk*/
+      unsigned char next[12];
+      if(!readFully(dec->read, dec->user, next, 12))
+      {
+        dec->error = 30; /*error: the input ends in the middle of a chunk*/
+        reader->more = 0;
+      }
+      else if(!dec->state->decoder.ignore_crc
+              && lodepng_read32bitInt(next) != (dec->crc ^ 0xffffffffu))
+      {
+        dec->error = 57; /*invalid CRC*/
+        reader->more = 0;
+      }
+      else if(!lodepng_chunk_type_equals(&next[4], "IDAT"))
+      {
+        reader->more = 0; /*end of the image data*/
+      }
+      else
+      {
+        dec->chunkleft = lodepng_read32bitInt(&next[4]);
+        dec->crc = Crc32_update_crc(&next[8], 0xffffffffu, 4);
+        if(dec->chunkleft > 2147483647)
+        {
+          dec->error = 63; /*error: chunk length larger than the max PNG chunk size*/
+          reader->more = 0;
+        }
+      }
+    }
+    else
+    {
+      size_t amount = ROWDECODER_INPUTSIZE - size;
+      if(amount > dec->chunkleft) amount = dec->chunkleft;
+      if(!readFully(dec->read, dec->user, &dec->input[size], amount))
+      {
+        dec->error = 30; /*error: the input ends in the middle of a chunk*/
+        reader->more = 0;
+        break;
+      }
+      dec->crc = Crc32_update_crc(&dec->input[size], dec->crc, amount);
+      dec->chunkleft -= (unsigned)amount;
+      size += amount;
+    }
+  }
+
+  reader->size = size;
+  reader->bitsize = size * 8;
+}
+
+/*
+inflate until at least needed bytes after dec->used are available or the zlib
+stream ends, then also the adler32 and the CRCs of the remaining IDAT chunks are
+checked. return value is error
+*/
+static unsigned rowDecoderInflate(LodePNGRowDecoder* dec, size_t needed)
+{
+  Inflater* inf = &dec->inflater;
+  size_t limit = dec->window.size - 259;
+  unsigned error = 0;
+
+  while(!error && inf->mode != 3 && dec->windowpos - dec->used < needed)
+  {
+    size_t start;
+    if(dec->windowpos >= limit)
+    {
+      /*slide the window, keeping what is not unfiltered yet and what back references can reach*/
+      size_t discard = dec->windowpos - ROWDECODER_WINDOWSIZE;
+      if(discard > dec->used) discard = dec->used;
+      memmove(dec->window.data, &dec->window.data[discard], dec->windowpos - discard);
+      dec->windowpos -= discard;
+      dec->used -= discard;
+    }
+
+    start = dec->windowpos;
+    error = Inflater_run(inf, &dec->window, &dec->windowpos, limit);
+    if(dec->error) return dec->error; /*input errors cause the inflate errors*/
+    if(error) return error;
+
+    if(!dec->state->decoder.zlibsettings.ignore_adler32)
+    {
+      dec->adler = update_adler32(dec->adler, &dec->window.data[start], (unsigned)(dec->windowpos - start));
+    }
+
+    if(inf->mode == 3)
+    {
+      BitReader* reader = &inf->reader;
+      unsigned ADLER32, i;
+
+      /*the adler32 follows the last block at the next byte boundary*/
+      readBits(reader, reader->avail % 8);
+      ADLER32 = 0;
+      for(i = 0; i < 4; i++) ADLER32 = (ADLER32 << 8) | readBits(reader, 8);
+      if(!dec->state->decoder.zlibsettings.ignore_adler32 && ADLER32 != dec->adler)
+      {
+        return 58; /*error, adler checksum not correct, data must be corrupted*/
+      }
+
+      /*read the rest of the IDAT chunks, which checks their CRCs*/
+      while(reader->more)
+      {
+        BitReader_seek(reader, reader->size);
+        reader->more(reader);
+      }
+      if(dec->error) return dec->error;
+    }
+  }
+
+  return error;
+}
+
+/*
+decodes the first Adam7 passes into dec->preview. Together, passes 1, 1-3 and 1-5 hold
+every 8th, 4th and 2nd pixel of every 8th, 4th and 2nd row, so an even number of passes
+is rounded down: the even passes are only decoded as part of the prefix that reaches the
+next odd pass. dec->w, dec->h and dec->linebytes are set to the size of the preview, the
+rest of the image data is not inflated. return value is error
+*/
+static unsigned rowDecoderPreview(LodePNGRowDecoder* dec, unsigned passes)
+{
+  unsigned passw[7], passh[7];
+  size_t filter_passstart[8], padded_passstart[8], passstart[8];
+  unsigned bpp = lodepng_get_bpp(&dec->state->info_png.color);
+  unsigned scale = passes < 3 ? 8 : (passes < 5 ? 4 : 2);
+  unsigned i, x, y;
+
+  passes = ((passes - 1) & ~1u) + 1;
+  Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, dec->w, dec->h, bpp);
+  dec->w = (dec->w + scale - 1) / scale;
+  dec->h = (dec->h + scale - 1) / scale;
+  dec->linebytes = ((size_t)dec->w * bpp + 7) / 8;
+  dec->preview = (unsigned char*)mymalloc(dec->linebytes * dec->h);
+  if(!dec->preview) return 83; /*alloc fail*/
+
+  for(i = 0; i < passes; i++)
+  {
+    size_t linebytes = ((size_t)passw[i] * bpp + 7) / 8;
+
+    for(y = 0; y < passh[i]; y++)
+    {
+      unsigned char* scanline;
+      unsigned char* temp;
+      size_t outstart = (ADAM7_IY[i] + y * ADAM7_DY[i]) / scale * dec->linebytes;
+      unsigned error = rowDecoderInflate(dec, linebytes + 1);
+      if(!error && dec->windowpos - dec->used < linebytes + 1) error = 91; /*error: not enough image data*/
+      if(error) return error;
+
+      scanline = &dec->window.data[dec->used];
+      dec->used += linebytes + 1;
+      error = unfilterScanline(dec->line, &scanline[1], y ? dec->prevline : 0,
+                               dec->bytewidth, scanline[0], linebytes);
+      if(error) return error;
+
+      /*every pixel of these passes is in the preview*/
+      if(bpp >= 8)
+      {
+        for(x = 0; x < passw[i]; x++)
+        {
+          size_t pixeloutstart = outstart + (ADAM7_IX[i] + x * ADAM7_DX[i]) / scale * dec->bytewidth;
+          memcpy(&dec->preview[pixeloutstart], &dec->line[x * dec->bytewidth], dec->bytewidth);
+        }
+      }
+      else
+      {
+        for(x = 0; x < passw[i]; x++)
+        {
+          size_t ibp = (size_t)x * bpp;
+          size_t obp = outstart * 8 + (ADAM7_IX[i] + x * ADAM7_DX[i]) / scale * bpp;
+          unsigned b;
+          for(b = 0; b < bpp; b++)
+          {
+            unsigned char bit = readBitFromReversedStream(&ibp, dec->line);
+            setBitOfReversedStream(&obp, dec->preview, bit);
+          }
+        }
+      }
+
+      temp = dec->prevline;
+      dec->prevline = dec->line;
+      dec->line = temp;
+    }
+  }
+
+  return 0;
+}
+
+/*reads the chunks up to the image data and sets up the buffers. return value is error*/
+static unsigned rowDecoderStart(LodePNGRowDecoder* dec)
+{
+  LodePNGState* state = dec->state;
+  unsigned char zlibheader[2];
+  unsigned bpp, error;
+
+  /*the chunks in front of the image data, only PLTE and tRNS are needed*/
+  for(;;)
+  {
+    unsigned char chunkhead[8];
+    unsigned chunkLength;
+
+    /*error: the input ends in the middle of a chunk*/
+    if(!readFully(dec->read, dec->user, chunkhead, 8)) return 30;
+    chunkLength = lodepng_read32bitInt(chunkhead);
+    /*error: chunk length larger than the max PNG chunk size*/
+    if(chunkLength > 2147483647) return 63;
+
+    if(lodepng_chunk_type_equals(chunkhead, "IDAT"))
+    {
+      dec->chunkleft = chunkLength;
+      dec->crc = Crc32_update_crc(&chunkhead[4], 0xffffffffu, 4);
+      break;
+    }
+    else if(lodepng_chunk_type_equals(chunkhead, "PLTE") || lodepng_chunk_type_equals(chunkhead, "tRNS"))
+    {
+      unsigned char* chunk = (unsigned char*)mymalloc((size_t)chunkLength + 12);
+      if(!chunk) return 83; /*alloc fail*/
+      memcpy(chunk, chunkhead, 8);
+      /*error: the input ends in the middle of a chunk*/
+      if(!readFully(dec->read, dec->user, &chunk[8], (size_t)chunkLength + 4)) error = 30;
+      else if(!state->decoder.ignore_crc && lodepng_chunk_check_crc(chunk)) error = 57; /*invalid CRC*/
+      else if(lodepng_chunk_type_equals(chunk, "PLTE"))
+      {
+        error = readChunk_PLTE(&state->info_png.color, &chunk[8], chunkLength);
+      }
+      else error = readChunk_tRNS(&state->info_png.color, &chunk[8], chunkLength);
+      myfree(chunk);
+      if(error) return error;
+    }
+    else
+    {
+      /*error: no image data before the IEND chunk*/
+      if(lodepng_chunk_type_equals(chunkhead, "IEND")) return 53;
+      /*error: unknown critical chunk (5th bit of first byte of chunk type is 0)*/
+      if(!lodepng_chunk_ancillary(chunkhead)) return 69;
+
+      /*skip the data and the CRC, the CRCs of unknown chunks are not checked*/
+      chunkLength += 4;
+      while(chunkLength > 0)
+      {
+        unsigned amount = chunkLength < ROWDECODER_INPUTSIZE ? chunkLength : ROWDECODER_INPUTSIZE;
+        /*error: the input ends in the middle of a chunk*/
+        if(!readFully(dec->read, dec->user, dec->input, amount)) return 30;
+        chunkLength -= amount;
+      }
+    }
+  }
+
+  if(!state->decoder.color_convert)
+  {
+    error = lodepng_color_mode_copy(&state->info_raw, &state->info_png.color);
+    if(error) return error;
+  }
+  else if(!lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)
+          && !(state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA)
+          && !(state->info_raw.bitdepth == 8))
+  {
+    return 56; /*unsupported color mode conversion*/
+  }
+
+  /*the window holds the deflate window, the data of the next rows and the 258 bytes the inflater may overshoot*/
+  bpp = lodepng_get_bpp(&state->info_png.color);
+  dec->linebytes = ((size_t)dec->w * bpp + 7) / 8;
+  dec->bytewidth = (bpp + 7) / 8;
+  dec->line = (unsigned char*)mymalloc(dec->linebytes + 1);
+  dec->prevline = (unsigned char*)mymalloc(dec->linebytes + 1);
+  if(!dec->line || !dec->prevline) return 83; /*alloc fail*/
+  if(!ucvector_resize(&dec->window, 2 * ROWDECODER_WINDOWSIZE + 2 * (dec->linebytes + 1) + 259)) return 83;
+
+  /*the zlib header, read through the bit reader which goes through the IDAT chunks*/
+  dec->inflater.reader.more = rowDecoderMore;
+  dec->inflater.reader.user = dec;
+  zlibheader[0] = (unsigned char)readBits(&dec->inflater.reader, 8);
+  zlibheader[1] = (unsigned char)readBits(&dec->inflater.reader, 8);
+  if(dec->error) return dec->error;
+  /*error, size of zlib data too small*/
+  if(BitReader_bp(&dec->inflater.reader) > dec->inflater.reader.bitsize) return 53;
+  error = checkZlibHeader(zlibheader);
+  if(!error && state->info_png.interlace_method != 0) error = rowDecoderPreview(dec, state->decoder.adam7_passes);
+  return error;
+}
+
+unsigned lodepng_row_decoder_new(LodePNGRowDecoder** decoder, unsigned* w, unsigned* h,
+                                 LodePNGState* state, LodePNGReadFunc read, void* user)
+{
+  unsigned char header[33];
+  LodePNGRowDecoder* dec;
+
+  *decoder = 0;
+
+  /*error: the data length is smaller than the length of a PNG header*/
+  if(!readFully(read, user, header, 33)) CERROR_RETURN_ERROR(state->error, 27);
+  state->error = lodepng_inspect(w, h, state, header, 33); /*reads header and resets other parameters in state->info_png*/
+  if(state->error) return state->error;
+  /*error: interlaced images can not be decoded row by row, only their first passes*/
+  if(state->info_png.interlace_method != 0
+     && (state->decoder.adam7_passes == 0 || state->decoder.adam7_passes > 6)) CERROR_RETURN_ERROR(state->error, 92);
+
+  dec = (LodePNGRowDecoder*)mymalloc(sizeof(LodePNGRowDecoder));
+  if(!dec) CERROR_RETURN_ERROR(state->error, 83); /*alloc fail*/
+  dec->state = state;
+  dec->read = read;
+  dec->user = user;
+  dec->w = *w;
+  dec->h = *h;
+  dec->y = 0;
+  dec->line = dec->prevline = 0;
+  Inflater_init(&dec->inflater);
+  ucvector_init(&dec->window);
+  dec->windowpos = dec->used = 0;
+  dec->chunkleft = 0;
+  dec->crc = 0;
+  dec->adler = 1;
+  dec->error = 0;
+  dec->preview = 0;
+  dec->input = (unsigned char*)mymalloc(ROWDECODER_INPUTSIZE);
+
+  state->error = dec->input ? rowDecoderStart(dec) : 83 /*alloc fail*/;
+  if(state->error) lodepng_row_decoder_delete(dec);
+  else
+  {
+    *w = dec->w;
+    *h = dec->h;
+    *decoder = dec;
+  }
+  return state->error;
+}
+
+unsigned lodepng_row_decoder_read(LodePNGRowDecoder* dec, unsigned char* out, unsigned numrows)
+{
+  LodePNGState* state = dec->state;
+  size_t rowsize = lodepng_get_raw_size(dec->w, 1, &state->info_raw);
+  unsigned convert = !lodepng_color_mode_equal(&state->info_raw, &state->info_png.color);
+  unsigned i;
+
+  for(i = 0; i < numrows && !dec->error; i++)
+  {
+    unsigned char* scanline;
+    unsigned char* temp;
+
+    if(dec->y >= dec->h) CERROR_BREAK(dec->error, 93); /*error: reading past the last row*/
+
+    if(dec->preview)
+    {
+      /*the passes were decoded when the decoder was created*/
+      scanline = &dec->preview[dec->y * dec->linebytes];
+      if(convert) dec->error = lodepng_convert(out, scanline, &state->info_raw, &state->info_png.color, dec->w, 1);
+      else memcpy(out, scanline, rowsize);
+      out += rowsize;
+      dec->y++;
+      continue;
+    }
+
+    dec->error = rowDecoderInflate(dec, dec->linebytes + 1);
+    if(!dec->error && dec->windowpos - dec->used < dec->linebytes + 1) dec->error = 91; /*error: not enough image data*/
+    if(dec->error) break;
+
+    scanline = &dec->window.data[dec->used];
+    dec->used += dec->linebytes + 1;
+    dec->error = unfilterScanline(dec->line, &scanline[1], dec->y ? dec->prevline : 0,
+                                  dec->bytewidth, scanline[0], dec->linebytes);
+    if(dec->error) break;
+
+    if(convert) dec->error = lodepng_convert(out, dec->line, &state->info_raw, &state->info_png.color, dec->w, 1);
+    else memcpy(out, dec->line, rowsize);
+    out += rowsize;
+
+    temp = dec->prevline;
+    dec->prevline = dec->line;
+    dec->line = temp;
+    dec->y++;
+
+    /*after the last row, go to the end of the zlib stream to check the checksums*/
+    while(dec->y == dec->h && !dec->error && dec->inflater.mode != 3)
+    {
+      dec->used = dec->windowpos; /*anything after the image data is skipped*/
+      dec->error = rowDecoderInflate(dec, 1);
+    }
+  }
+
+  state->error = dec->error;
+  return dec->error;
+}
+
+void lodepng_row_decoder_delete(LodePNGRowDecoder* dec)
+{
+  if(!dec) return;
+  Inflater_cleanup(&dec->inflater);
+  ucvector_cleanup(&dec->window);
+  myfree(dec->input);
+  myfree(dec->line);
+  myfree(dec->prevline);
+  myfree(dec->preview);
+  myfree(dec);
+}
+
 void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings)
 {
   settings->color_convert = 1;
   settings->ignore_crc = 0;
+  settings->adam7_passes = 0;
   lodepng_decompress_settings_init(&settings->zlibsettings);
 }
 
@@ -4146,28 +6238,172 @@ static unsigned addChunk_tRNS(ucvector* out, const LodePNGColorMode* info)
   return error;
 }
 
-static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
-                              LodePNGCompressSettings* zlibsettings)
+struct LodePNGEncoderBuffers
+{
+  Hash* hashes; /*LZ77 hash tables for a window of 32768 bytes, one for each thread, allocated on first use*/
+  unsigned numhashes;
+  ucvector data; /*the filtered scanlines*/
+  ucvector deflatedata; /*the deflate stream of data*/
+  ucvector zlibdata; /*the zlib stream of data*/
+  ucvector png; /*the PNG file*/
+};
+
+static void encoderBuffersInit(LodePNGEncoderBuffers* buffers)
+{
+  buffers->hashes = 0;
+  buffers->numhashes = 0;
+  ucvector_init(&buffers->data);
+  ucvector_init(&buffers->deflatedata);
+  ucvector_init(&buffers->zlibdata);
+  ucvector_init(&buffers->png);
+}
+
+static void encoderBuffersCleanup(LodePNGEncoderBuffers* buffers)
+{
+  unsigned i;
+  for(i = 0; i < buffers->numhashes; i++) hash_cleanup(&buffers->hashes[i]);
+  myfree(buffers->hashes);
+  ucvector_cleanup(&buffers->data);
+  ucvector_cleanup(&buffers->deflatedata);
+  ucvector_cleanup(&buffers->zlibdata);
+  ucvector_cleanup(&buffers->png);
+}
+
+/*makes sure there are at least count hash tables*/
+static unsigned encoderBuffersReserveHashes(LodePNGEncoderBuffers* buffers, unsigned count)
+{
+  Hash* hashes;
+  if(count <= buffers->numhashes) return 0;
+
+  hashes = (Hash*)myrealloc(buffers->hashes, sizeof(Hash) * count);
+  if(!hashes) return 83; /*alloc fail*/
+  buffers->hashes = hashes;
+
+  for(; buffers->numhashes < count; buffers->numhashes++)
+  {
+    unsigned error = hash_init(&hashes[buffers->numhashes], 32768);
+    if(error)
+    {
+      hash_cleanup(&hashes[buffers->numhashes]);
+      return error;
+    }
+  }
+  return 0;
+}
+
+/*the zlib stream is made in buffers, with its hash tables if it has any*/
+static unsigned addChunk_IDAT(ucvector* out, const unsigned char* data, size_t datasize,
+                              LodePNGCompressSettings* zlibsettings, LodePNGEncoderBuffers* buffers)
+{
+  unsigned error = 0;
+
+#if LODEPNG_CUSTOM_ZLIB_ENCODER == 1
+  if(zlibsettings->custom_encoder)
+  {
+    unsigned char* zlibdata = 0;
+    size_t zlibsize = 0;
+    error = lodepng_zlib_compress(&zlibdata, &zlibsize, data, datasize, zlibsettings);
+    if(!error) error = addChunk(out, "IDAT", zlibdata, zlibsize);
+    myfree(zlibdata);
+    return error;
+  }
+#endif /*LODEPNG_CUSTOM_ZLIB_ENCODER == 1*/
+
+  /*compress with the Zlib compressor*/
+  buffers->zlibdata.size = 0;
+  error = zlibCompress(&buffers->zlibdata, &buffers->deflatedata, data, datasize, zlibsettings,
+                       buffers->numhashes ? buffers->hashes : 0);
+  if(!error) error = addChunk(out, "IDAT", buffers->zlibdata.data, buffers->zlibdata.size);
+
+  return error;
+}
+
+static unsigned addChunk_IEND(ucvector* out)
+{
+  unsigned error = 0;
+  error = addChunk(out, "IEND", 0, 0);
+  return error;
+}
+
+#ifdef LODEPNG_SSE2
+/*
+SSE2 versions of the filters. Unlike when unfiltering, the predictions only depend on the
+unfiltered scanlines, so 16 bytes are filtered at once for any pixel size. They start at
+byte i and return where they stopped, the remaining bytes are left to the scalar code.
+*/
+#define LOAD_SSE2(p) _mm_loadu_si128((const __m128i*)(p))
+#define STORE_SSE2(p, v) _mm_storeu_si128((__m128i*)(p), v)
+
+static size_t filterSubSSE2(unsigned char* out, const unsigned char* scanline, size_t bytewidth,
+                            size_t i, size_t length)
+{
+  for(; i + 16 <= length; i += 16)
+  {
+    STORE_SSE2(&out[i], _mm_sub_epi8(LOAD_SSE2(&scanline[i]), LOAD_SSE2(&scanline[i - bytewidth])));
+  }
+  return i;
+}
+
+static size_t filterUpSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                           size_t i, size_t length)
+{
+  for(; i + 16 <= length; i += 16)
+  {
+    STORE_SSE2(&out[i], _mm_sub_epi8(LOAD_SSE2(&scanline[i]), LOAD_SSE2(&prevline[i])));
+  }
+  return i;
+}
+
+static size_t filterAverageSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                size_t bytewidth, size_t i, size_t length)
+{
+  __m128i one = _mm_set1_epi8(1);
+  for(; i + 16 <= length; i += 16)
+  {
+    __m128i a = LOAD_SSE2(&scanline[i - bytewidth]);
+    __m128i b = LOAD_SSE2(&prevline[i]);
+    /*_mm_avg_epu8 rounds up, the filter rounds down*/
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    STORE_SSE2(&out[i], _mm_sub_epi8(LOAD_SSE2(&scanline[i]), avg));
+  }
+  return i;
+}
+
+static size_t filterPaethSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                              size_t bytewidth, size_t i, size_t length)
 {
-  ucvector zlibdata;
-  unsigned error = 0;
-
-  /*compress with the Zlib compressor*/
-  ucvector_init(&zlibdata);
-  error = lodepng_zlib_compress(&zlibdata.data, &zlibdata.size, data, datasize, zlibsettings);
-  if(!error) error = addChunk(out, "IDAT", zlibdata.data, zlibdata.size);
-  ucvector_cleanup(&zlibdata);
-
-  return error;
+  __m128i zero = _mm_setzero_si128();
+  for(; i + 8 <= length; i += 8)
+  {
+    __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&scanline[i - bytewidth]), zero);
+    __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&prevline[i]), zero);
+    __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)&prevline[i - bytewidth]), zero);
+    __m128i nearest = paethPredictorSSE2(a, b, c);
+    __m128i x = _mm_sub_epi8(_mm_loadl_epi64((const __m128i*)&scanline[i]), _mm_packus_epi16(nearest, nearest));
+    _mm_storel_epi64((__m128i*)&out[i], x);
+  }
+  return i;
 }
 
-static unsigned addChunk_IEND(ucvector* out)
+/*sum of the bytes of data, as signed values if sign is set*/
+static size_t filterSumSSE2(const unsigned char* data, size_t length, int sign, size_t* i)
 {
-  unsigned error = 0;
-  error = addChunk(out, "IEND", 0, 0);
-  return error;
+  __m128i zero = _mm_setzero_si128();
+  __m128i sum = zero;
+  for(*i = 0; *i + 16 <= length; *i += 16)
+  {
+    __m128i x = LOAD_SSE2(&data[*i]);
+    /*the absolute value of a signed byte is the smaller of it and its negation, as unsigned*/
+    if(sign) x = _mm_min_epu8(x, _mm_sub_epi8(zero, x));
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(x, zero));
+  }
+  return (size_t)(unsigned)_mm_cvtsi128_si32(sum) + (size_t)(unsigned)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
 }
 
+#undef LOAD_SSE2
+#undef STORE_SSE2
+#endif /*LODEPNG_SSE2*/
+
 static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
                            size_t length, size_t bytewidth, unsigned char filterType)
 {
@@ -4175,35 +6411,37 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
   switch(filterType)
   {
     case 0: /*None*/
-      for(i = 0; i < length; i++) out[i] = scanline[i];
+      memcpy(out, scanline, length);
       break;
     case 1: /*Sub*/
-      if(prevline)
-      {
-        for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
-        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth];
-      }
-      else
-      {
-        for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
-        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth];
-      }
+      for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
+#ifdef LODEPNG_SSE2
+      i = filterSubSSE2(out, scanline, bytewidth, i, length);
+#endif /*LODEPNG_SSE2*/
+      for(; i < length; i++) out[i] = scanline[i] - scanline[i - bytewidth];
       break;
     case 2: /*Up*/
       if(prevline)
       {
-        for(i = 0; i < length; i++) out[i] = scanline[i] - prevline[i];
+        i = 0;
+#ifdef LODEPNG_SSE2
+        i = filterUpSSE2(out, scanline, prevline, i, length);
+#endif /*LODEPNG_SSE2*/
+        for(; i < length; i++) out[i] = scanline[i] - prevline[i];
       }
       else
       {
-        for(i = 0; i < length; i++) out[i] = scanline[i];
+        memcpy(out, scanline, length);
       }
       break;
     case 3: /*Average*/
       if(prevline)
       {
         for(i = 0; i < bytewidth; i++) out[i] = scanline[i] - prevline[i] / 2;
-        for(i = bytewidth; i < length; i++) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) / 2);
+#ifdef LODEPNG_SSE2
+        i = filterAverageSSE2(out, scanline, prevline, bytewidth, i, length);
+#endif /*LODEPNG_SSE2*/
+        for(; i < length; i++) out[i] = scanline[i] - ((scanline[i - bytewidth] + prevline[i]) / 2);
       }
       else
       {
@@ -4216,7 +6454,10 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       {
         /*paethPredictor(0, prevline[i], 0) is always prevline[i]*/
         for(i = 0; i < bytewidth; i++) out[i] = (scanline[i] - prevline[i]);
-        for(i = bytewidth; i < length; i++)
+#ifdef LODEPNG_SSE2
+        i = filterPaethSSE2(out, scanline, prevline, bytewidth, i, length);
+#endif /*LODEPNG_SSE2*/
+        for(; i < length; i++)
         {
           out[i] = (scanline[i] - paethPredictor(scanline[i - bytewidth], prevline[i], prevline[i - bytewidth]));
         }
@@ -4225,20 +6466,54 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
       {
         for(i = 0; i < bytewidth; i++) out[i] = scanline[i];
         /*paethPredictor(scanline[i - bytewidth], 0, 0) is always scanline[i - bytewidth]*/
-        for(i = bytewidth; i < length; i++) out[i] = (scanline[i] - scanline[i - bytewidth]);
+#ifdef LODEPNG_SSE2
+        i = filterSubSSE2(out, scanline, bytewidth, i, length);
+#endif /*LODEPNG_SSE2*/
+        for(; i < length; i++) out[i] = (scanline[i] - scanline[i - bytewidth]);
       }
       break;
     default: return; /*unexisting filter type given*/
   }
 }
 
-static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+/*
+The sum of the bytes of a filtered scanline, used by the minimum sum of absolute differences
+heuristic. For differences, each byte is treated as signed, values above 127 are negative.
+Filter type 0 isn't a difference though, so its bytes are summed as unsigned. This means filter
+type 0 is almost never chosen, but that is justified.
+*/
+static size_t filterSum(const unsigned char* data, size_t length, unsigned type)
+{
+  size_t i = 0, sum = 0;
+#ifdef LODEPNG_SSE2
+  sum = filterSumSSE2(data, length, type != 0, &i);
+#endif /*LODEPNG_SSE2*/
+  for(; i < length; i++)
+  {
+    if(type == 0) sum += data[i];
+    else
+    {
+      signed char s = (signed char)data[i];
+      sum += s < 0 ? -s : s;
+    }
+  }
+  return sum;
+}
+
+static unsigned filterExhaustive(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                                 unsigned w, unsigned h, const LodePNGColorMode* info,
+                                 const LodePNGEncoderSettings* settings, ucvector* attempt);
+
+static unsigned filterBuffers(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                              unsigned w, unsigned h, const LodePNGColorMode* info,
+                              const LodePNGEncoderSettings* settings, ucvector* attempt)
 {
   /*
   For PNG filter method 0
   out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
   the scanlines with 1 extra byte per scanline
+  attempt are five buffers for the filtering attempts, one for each filter type, that
+  are resized as needed
   */
 
   unsigned bpp = lodepng_get_bpp(info);
@@ -4246,7 +6521,6 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   size_t linebytes = (w * bpp + 7) / 8;
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
   unsigned x, y;
   unsigned error = 0;
   /*
@@ -4268,12 +6542,9 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
   {
     /*adaptive filtering*/
     size_t sum[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t smallest = 0;
     unsigned type, bestType = 0;
 
-    for(type = 0; type < 5; type++) ucvector_init(&attempt[type]);
-
     for(type = 0; type < 5; type++)
     {
       if(!ucvector_resize(&attempt[type], linebytes)) ERROR_BREAK(83 /*alloc fail*/);
@@ -4289,20 +6560,7 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
           filterScanline(attempt[type].data, &in[y * linebytes], prevline, linebytes, bytewidth, type);
 
           /*calculate the sum of the result*/
-          sum[type] = 0;
-          /*note that not all pixels are checked to speed this up while still having probably the best choice*/
-          for(x = 0; x < attempt[type].size; x+=3)
-          {
-            /*For differences, each byte should be treated as signed, values above 127 are negative
-            (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-            This means filtertype 0 is almost never chosen, but that is justified.*/
-            if(type == 0) sum[type] += (unsigned char)(attempt[type].data[x]);
-            else
-            {
-              signed char s = (signed char)(attempt[type].data[x]);
-              sum[type] += s < 0 ? -s : s;
-            }
-          }
+          sum[type] = filterSum(attempt[type].data, linebytes, type);
 
           /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
           if(type == 0 || sum[type] < smallest)
@@ -4316,11 +6574,9 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
 
         /*now fill the out values*/
         out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x < linebytes; x++) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
+        memcpy(&out[y * (linebytes + 1) + 1], attempt[bestType].data, linebytes);
       }
     }
-
-    for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
   }
   else if((heuristic_zero && settings->filter_strategy == LFS_HEURISTIC)||
       settings->filter_strategy == LFS_ZERO)
@@ -4335,6 +6591,10 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       prevline = &in[inindex];
     }
   }
+  else if(settings->filter_strategy == LFS_EXHAUSTIVE)
+  {
+    error = filterExhaustive(out, in, prevline, w, h, info, settings, attempt);
+  }
   else if(settings->filter_strategy == LFS_PREDEFINED)
   {
     for(y = 0; y < h; y++)
@@ -4353,7 +6613,6 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     deflate the scanline after every filter attempt to see which one deflates best.
     This is very slow and gives only slightly smaller, sometimes even larger, result*/
     size_t size[5];
-    ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
     size_t smallest = 0;
     unsigned type = 0, bestType = 0;
     unsigned char* dummy;
@@ -4366,9 +6625,9 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
     /*a custom encoder likely doesn't read the btype setting and is optimized for complete PNG
     images only, so disable it*/
     zlibsettings.custom_encoder = 0;
+    zlibsettings.numthreads = 1;
     for(type = 0; type < 5; type++)
     {
-      ucvector_init(&attempt[type]);
       ucvector_resize(&attempt[type], linebytes); /*todo: give error if resize failed*/
     }
     for(y = 0; y < h; y++) /*try the 5 filter types*/
@@ -4394,12 +6653,197 @@ static unsigned filter(unsigned char* out, const unsigned char* in, unsigned w,
       out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
       for(x = 0; x < linebytes; x++) out[y * (linebytes + 1) + 1 + x] = attempt[bestType].data[x];
     }
-    for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
   }
 
   return error;
 }
 
+/*
+LFS_EXHAUSTIVE: the filter of each scanline is the one with which the scanline deflates to the fewest
+bits after the scanlines before it. The result is compared with the images filtered with each single
+filter type and with LFS_MINSUM and LFS_BRUTE_FORCE, by deflating them as a whole, and the smallest is
+kept. The attempts are deflated without optimal parsing and with at most the default maxchain.
+*/
+static unsigned filterExhaustive(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                                 unsigned w, unsigned h, const LodePNGColorMode* info,
+                                 const LodePNGEncoderSettings* settings, ucvector* attempt)
+{
+  unsigned bpp = lodepng_get_bpp(info);
+  size_t linebytes = (w * bpp + 7) / 8;
+  size_t bytewidth = (bpp + 7) / 8;
+  size_t outsize = h * (linebytes + 1);
+  const unsigned char* firstprev = prevline;
+  LodePNGEncoderSettings trial = *settings;
+  LodePNGCompressSettings linesettings;
+  unsigned char* candidate = 0; /*the image filtered with another strategy*/
+  unsigned char* types = 0; /*predefined filters of a single type*/
+  unsigned char* dummy;
+  size_t size, smallest = 0;
+  unsigned y, type, strategy, error = 0;
+  ucvector scratch;
+  Hash hash;
+
+  trial.zlibsettings.optimal = 0;
+  if(trial.zlibsettings.maxchain == 0 || trial.zlibsettings.maxchain > 128) trial.zlibsettings.maxchain = 128;
+  trial.zlibsettings.custom_encoder = 0;
+  trial.zlibsettings.numthreads = 1;
+  /*a scanline is too short for a dynamic tree to pay off*/
+  linesettings = trial.zlibsettings;
+  linesettings.btype = 1;
+
+  ucvector_init(&scratch);
+  error = hash_init(&hash, 32768);
+
+  for(y = 0; y < h && !error; y++)
+  {
+    unsigned char* line = &out[y * (linebytes + 1)];
+    size_t fewest = 0;
+    unsigned bestType = 0;
+
+    for(type = 0; type < 5 && !error; type++)
+    {
+      size_t bp = 0;
+      line[0] = type;
+      filterScanline(&line[1], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+      if(!ucvector_resize(&scratch, 0)) ERROR_BREAK(83 /*alloc fail*/);
+      error = deflateRange(&scratch, &bp, &hash, out, y * (linebytes + 1), (y + 1) * (linebytes + 1),
+                           0, 1, &linesettings);
+      if(type == 0 || bp < fewest)
+      {
+        bestType = type;
+        fewest = bp;
+      }
+    }
+
+    line[0] = bestType;
+    filterScanline(&line[1], &in[y * linebytes], prevline, linebytes, bytewidth, bestType);
+    prevline = &in[y * linebytes];
+  }
+
+  hash_cleanup(&hash);
+  ucvector_cleanup(&scratch);
+
+  if(!error)
+  {
+    dummy = 0;
+    error = lodepng_zlib_compress(&dummy, &smallest, out, outsize, &trial.zlibsettings);
+    myfree(dummy);
+  }
+
+  if(!error)
+  {
+    candidate = (unsigned char*)mymalloc(outsize);
+    types = (unsigned char*)mymalloc(h);
+    if(!candidate || !types) error = 83; /*alloc fail*/
+  }
+
+  /*the five filter types, LFS_MINSUM and LFS_BRUTE_FORCE*/
+  for(strategy = 0; strategy < 7 && !error; strategy++)
+  {
+    if(strategy < 5)
+    {
+      memset(types, (int)strategy, h);
+      trial.filter_strategy = LFS_PREDEFINED;
+      trial.predefined_filters = types;
+    }
+    else trial.filter_strategy = strategy == 5 ? LFS_MINSUM : LFS_BRUTE_FORCE;
+
+    error = filterBuffers(candidate, in, firstprev, w, h, info, &trial, attempt);
+    if(error) break;
+
+    dummy = 0;
+    size = 0;
+    error = lodepng_zlib_compress(&dummy, &size, candidate, outsize, &trial.zlibsettings);
+    myfree(dummy);
+    if(!error && size < smallest)
+    {
+      smallest = size;
+      memcpy(out, candidate, outsize);
+    }
+  }
+
+  myfree(candidate);
+  myfree(types);
+
+  return error;
+}
+
+/*prevline is the unfiltered scanline before in, or NULL if in starts with the first scanline*/
+static unsigned filter(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                       unsigned w, unsigned h,
+                       const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+  ucvector attempt[5]; /*five filtering attempts, one for each filter type*/
+  unsigned type, error;
+
+  for(type = 0; type < 5; type++) ucvector_init(&attempt[type]);
+  error = filterBuffers(out, in, prevline, w, h, info, settings, attempt);
+  for(type = 0; type < 5; type++) ucvector_cleanup(&attempt[type]);
+
+  return error;
+}
+
+#ifdef LODEPNG_COMPILE_THREADS
+/*the smallest number of scanlines that is filtered on its own thread*/
+static const unsigned FILTER_BAND_MIN_LINES = 16;
+
+typedef struct FilterBand
+{
+  unsigned char* out;
+  const unsigned char* in;
+  const unsigned char* prevline;
+  unsigned w, h;
+  const LodePNGColorMode* info;
+  LodePNGEncoderSettings settings;
+  unsigned error;
+} FilterBand;
+
+static void* filterBandThread(void* arg)
+{
+  FilterBand* band = (FilterBand*)arg;
+  band->error = filter(band->out, band->in, band->prevline, band->w, band->h, band->info, &band->settings);
+  return 0;
+}
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+/*filters the scanlines in horizontal bands on settings->zlibsettings.numthreads threads*/
+static unsigned filterBands(unsigned char* out, const unsigned char* in, unsigned w, unsigned h,
+                            const LodePNGColorMode* info, const LodePNGEncoderSettings* settings)
+{
+#ifdef LODEPNG_COMPILE_THREADS
+  unsigned numbands = settings->zlibsettings.numthreads;
+  FilterBand* bands;
+
+  if(numbands > h / FILTER_BAND_MIN_LINES) numbands = h / FILTER_BAND_MIN_LINES;
+  bands = numbands > 1 ? (FilterBand*)mymalloc(sizeof(FilterBand) * numbands) : 0;
+  if(bands)
+  {
+    size_t linebytes = (w * lodepng_get_bpp(info) + 7) / 8;
+    unsigned i, y = 0, error = 0;
+
+    for(i = 0; i < numbands; i++)
+    {
+      bands[i].out = &out[y * (linebytes + 1)];
+      bands[i].in = &in[y * linebytes];
+      bands[i].prevline = y > 0 ? &in[(y - 1) * linebytes] : 0;
+      bands[i].w = w;
+      bands[i].h = h / numbands + (i < h % numbands ? 1 : 0);
+      bands[i].info = info;
+      bands[i].settings = *settings;
+      if(settings->predefined_filters) bands[i].settings.predefined_filters = &settings->predefined_filters[y];
+      y += bands[i].h;
+    }
+
+    runThreads(filterBandThread, bands, sizeof(FilterBand), numbands);
+
+    for(i = 0; i < numbands && !error; i++) error = bands[i].error;
+    myfree(bands);
+    return error;
+  }
+#endif /*LODEPNG_COMPILE_THREADS*/
+  return filter(out, in, 0, w, h, info, settings);
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h)
 {
@@ -4473,9 +6917,9 @@ static void Adam7_interlace(unsigned char* out, const unsigned char* in, unsigne
   }
 }
 
-/*out must be buffer big enough to contain uncompressed IDAT chunk data, and in must contain the full image.
+/*out is resized to the uncompressed IDAT chunk data, and in must contain the full image.
 return value is error**/
-static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const unsigned char* in,
+static unsigned preProcessScanlines(ucvector* out, const unsigned char* in,
                                     unsigned w, unsigned h,
                                     const LodePNGInfo* info_png, const LodePNGEncoderSettings* settings)
 {
@@ -4489,9 +6933,8 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
 
   if(info_png->interlace_method == 0)
   {
-    *outsize = h + (h * ((w * bpp + 7) / 8)); /*image size plus an extra byte per scanline + possible padding bits*/
-    *out = (unsigned char*)mymalloc(*outsize);
-    if(!(*out) && (*outsize)) error = 83; /*alloc fail*/
+    /*image size plus an extra byte per scanline + possible padding bits*/
+    if(!ucvector_resize(out, h + (h * ((w * bpp + 7) / 8)))) error = 83; /*alloc fail*/
 
     if(!error)
     {
@@ -4504,14 +6947,14 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         if(!error)
         {
           addPaddingBits(padded.data, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
-          error = filter(*out, padded.data, w, h, &info_png->color, settings);
+          error = filterBands(out->data, padded.data, w, h, &info_png->color, settings);
         }
         ucvector_cleanup(&padded);
       }
       else
       {
         /*we can immediatly filter into the out buffer, no other steps needed*/
-        error = filter(*out, in, w, h, &info_png->color, settings);
+        error = filterBands(out->data, in, w, h, &info_png->color, settings);
       }
     }
   }
@@ -4528,9 +6971,8 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
 
       Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
-      *outsize = filter_passstart[7]; /*image size plus an extra byte per scanline + possible padding bits*/
-      *out = (unsigned char*)mymalloc(*outsize);
-      if(!(*out) && (*outsize)) ERROR_BREAK(83 /*alloc fail*/);
+      /*image size plus an extra byte per scanline + possible padding bits*/
+      if(!ucvector_resize(out, filter_passstart[7])) ERROR_BREAK(83 /*alloc fail*/);
 
       Adam7_interlace(adam7, in, w, h, bpp);
 
@@ -4545,7 +6987,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
           {
             addPaddingBits(&padded.data[padded_passstart[i]], &adam7[passstart[i]],
                            ((passw[i] * bpp + 7) / 8) * 8, passw[i] * bpp, passh[i]);
-            error = filter(&(*out)[filter_passstart[i]], &padded.data[padded_passstart[i]],
+            error = filter(&out->data[filter_passstart[i]], &padded.data[padded_passstart[i]], 0,
                            passw[i], passh[i], &info_png->color, settings);
           }
 
@@ -4553,7 +6995,7 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, const
         }
         else
         {
-          error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
+          error = filter(&out->data[filter_passstart[i]], &adam7[padded_passstart[i]], 0,
                          passw[i], passh[i], &info_png->color, settings);
         }
       }
@@ -4592,18 +7034,60 @@ static unsigned getPaletteTranslucency(const unsigned char* palette, size_t pale
   return key;
 }
 
-unsigned lodepng_encode(unsigned char** out, size_t* outsize,
-                        const unsigned char* image, unsigned w, unsigned h,
-                        LodePNGState* state)
+/*checks the settings of the encoder in state, for a PNG with the given color mode*/
+static unsigned checkEncoderSettings(const LodePNGColorMode* color, const LodePNGState* state)
+{
+  unsigned error;
+
+  if(state->encoder.zlibsettings.windowsize > 32768) return 60; /*error: windowsize larger than allowed*/
+  if((state->encoder.zlibsettings.windowsize & (state->encoder.zlibsettings.windowsize - 1)) != 0)
+  {
+    return 90; /*error: windowsize not a power of two*/
+  }
+  if(state->encoder.zlibsettings.btype > 2) return 61; /*error: unexisting btype*/
+  if(state->info_png.interlace_method > 1) return 71; /*error: unexisting interlace mode*/
+  /*error: unexisting color type given*/
+  if((error = checkColorValidity(color->colortype, color->bitdepth))) return error;
+  /*error: unexisting color type given*/
+  return checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
+}
+
+/*writes the signature and the chunks in front of the image data*/
+static void addHeaderChunks(ucvector* out, unsigned w, unsigned h,
+                            const LodePNGInfo* info, const LodePNGEncoderSettings* settings)
+{
+  writeSignature(out);
+  /*IHDR*/
+  addChunk_IHDR(out, w, h, info->color.colortype, info->color.bitdepth, info->interlace_method);
+  /*PLTE*/
+  if(info->color.colortype == LCT_PALETTE)
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  if(settings->force_palette && (info->color.colortype == LCT_RGB || info->color.colortype == LCT_RGBA))
+  {
+    addChunk_PLTE(out, &info->color);
+  }
+  /*tRNS*/
+  if(info->color.colortype == LCT_PALETTE && getPaletteTranslucency(info->color.palette, info->color.palettesize) != 0)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+  if((info->color.colortype == LCT_GREY || info->color.colortype == LCT_RGB) && info->color.key_defined)
+  {
+    addChunk_tRNS(out, &info->color);
+  }
+}
+
+/*encodes the PNG into buffers->png*/
+static unsigned encodeWithBuffers(LodePNGEncoderBuffers* buffers,
+                                  const unsigned char* image, unsigned w, unsigned h,
+                                  LodePNGState* state)
 {
   LodePNGInfo info;
-  ucvector outv;
-  unsigned char* data = 0; /*uncompressed version of the IDAT chunk data*/
-  size_t datasize = 0;
+  ucvector* outv = &buffers->png;
 
-  /*provide some proper output values if error will happen*/
-  *out = 0;
-  *outsize = 0;
+  outv->size = 0;
   state->error = 0;
 
   lodepng_info_init(&info);
@@ -4613,34 +7097,17 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
       && (info.color.palettesize == 0 || info.color.palettesize > 256))
   {
     state->error = 68; /*invalid palette size, it is only allowed to be 1-256*/
-    return state->error;
   }
 
-  if(state->encoder.auto_convert != LAC_NO)
+  if(!state->error && state->encoder.auto_convert != LAC_NO)
   {
     state->error = doAutoChooseColor(&info.color, image, w, h, &state->info_raw,
                                      state->encoder.auto_convert);
   }
-  if(state->error) return state->error;
 
-  if(state->encoder.zlibsettings.windowsize > 32768)
-  {
-    CERROR_RETURN_ERROR(state->error, 60); /*error: windowsize larger than allowed*/
-  }
-  if(state->encoder.zlibsettings.btype > 2)
-  {
-    CERROR_RETURN_ERROR(state->error, 61); /*error: unexisting btype*/
-  }
-  if(state->info_png.interlace_method > 1)
-  {
-    CERROR_RETURN_ERROR(state->error, 71); /*error: unexisting interlace mode*/
-  }
-  /*error: unexisting color type given*/
-  if((state->error = checkColorValidity(info.color.colortype, info.color.bitdepth))) return state->error;
-  /*error: unexisting color type given*/
-  if((state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth))) return state->error;
+  if(!state->error) state->error = checkEncoderSettings(&info.color, state);
 
-  if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
+  if(!state->error && !lodepng_color_mode_equal(&state->info_raw, &info.color))
   {
     unsigned char* converted;
     size_t size = (w * h * lodepng_get_bpp(&info.color) + 7) / 8;
@@ -4651,54 +7118,347 @@ unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     {
       state->error = lodepng_convert(converted, image, &info.color, &state->info_raw, w, h);
     }
-    if(!state->error) preProcessScanlines(&data, &datasize, converted, w, h, &info, &state->encoder);
+    if(!state->error) state->error = preProcessScanlines(&buffers->data, converted, w, h, &info, &state->encoder);
     myfree(converted);
   }
-  else preProcessScanlines(&data, &datasize, image, w, h, &info, &state->encoder);
+  else if(!state->error) state->error = preProcessScanlines(&buffers->data, image, w, h, &info, &state->encoder);
 
-  ucvector_init(&outv);
   while(!state->error) /*while only executed once, to break on error*/
   {
     /*write signature and chunks*/
-    writeSignature(&outv);
-    /*IHDR*/
-    addChunk_IHDR(&outv, w, h, info.color.colortype, info.color.bitdepth, info.interlace_method);
-    /*PLTE*/
-    if(info.color.colortype == LCT_PALETTE)
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    if(state->encoder.force_palette && (info.color.colortype == LCT_RGB || info.color.colortype == LCT_RGBA))
-    {
-      addChunk_PLTE(&outv, &info.color);
-    }
-    /*tRNS*/
-    if(info.color.colortype == LCT_PALETTE && getPaletteTranslucency(info.color.palette, info.color.palettesize) != 0)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
-    if((info.color.colortype == LCT_GREY || info.color.colortype == LCT_RGB) && info.color.key_defined)
-    {
-      addChunk_tRNS(&outv, &info.color);
-    }
+    addHeaderChunks(outv, w, h, &info, &state->encoder);
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+    state->error = addChunk_IDAT(outv, buffers->data.data, buffers->data.size, &state->encoder.zlibsettings,
+                                 buffers);
     if(state->error) break;
     /*IEND*/
-    addChunk_IEND(&outv);
+    addChunk_IEND(outv);
 
     break; /*this isn't really a while loop; no error happened so break out now!*/
   }
 
   lodepng_info_cleanup(&info);
-  myfree(data);
-  /*instead of cleaning the vector up, give it to the output*/
-  *out = outv.data;
-  *outsize = outv.size;
+  return state->error;
+}
+
+unsigned lodepng_encode(unsigned char** out, size_t* outsize,
+                        const unsigned char* image, unsigned w, unsigned h,
+                        LodePNGState* state)
+{
+  LodePNGEncoderBuffers buffers;
+  encoderBuffersInit(&buffers);
+
+  encodeWithBuffers(&buffers, image, w, h, state);
+
+  /*instead of cleaning the file up, give it to the output*/
+  *out = buffers.png.data;
+  *outsize = buffers.png.size;
+  ucvector_init(&buffers.png);
+  encoderBuffersCleanup(&buffers);
+
+  return state->error;
+}
+
+unsigned lodepng_encoder_buffers_new(LodePNGEncoderBuffers** buffers)
+{
+  *buffers = (LodePNGEncoderBuffers*)mymalloc(sizeof(LodePNGEncoderBuffers));
+  if(!*buffers) return 83; /*alloc fail*/
+  encoderBuffersInit(*buffers);
+  return 0;
+}
+
+unsigned lodepng_encode_buffers(unsigned char** out, size_t* outsize, LodePNGEncoderBuffers* buffers,
+                                const unsigned char* image, unsigned w, unsigned h,
+                                LodePNGState* state)
+{
+  unsigned numhashes = 1;
+#ifdef LODEPNG_COMPILE_THREADS
+  if(state->encoder.zlibsettings.numthreads > 1) numhashes = state->encoder.zlibsettings.numthreads;
+#endif /*LODEPNG_COMPILE_THREADS*/
+
+  *out = 0;
+  *outsize = 0;
+  buffers->png.size = 0;
+
+  state->error = encoderBuffersReserveHashes(buffers, numhashes);
+  if(!state->error) encodeWithBuffers(buffers, image, w, h, state);
+  if(!state->error)
+  {
+    *out = buffers->png.data;
+    *outsize = buffers->png.size;
+  }
+  return state->error;
+}
+
+void lodepng_encoder_buffers_delete(LodePNGEncoderBuffers* buffers)
+{
+  if(!buffers) return;
+  encoderBuffersCleanup(buffers);
+  myfree(buffers);
+}
+
+unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
+                                   const unsigned char* image, unsigned w, unsigned h,
+                                   const LodePNGColorMode* mode_in, LodePNGAutoConvert auto_convert)
+{
+  LodePNGColorMode mode;
+  unsigned error;
+
+  lodepng_color_mode_init(&mode);
+  error = lodepng_color_mode_copy(&mode, mode_in);
+  if(!error && auto_convert != LAC_NO) error = doAutoChooseColor(mode_out, image, w, h, &mode, auto_convert);
+  lodepng_color_mode_cleanup(&mode);
+
+  return error;
+}
+
+/*filtered scanlines that are collected and deflated together, as one dynamic block*/
+#define ROWENCODER_BLOCKSIZE 262144u
+/*the size of the IDAT chunks, except the last one*/
+#define ROWENCODER_CHUNKSIZE 65536u
+
+struct LodePNGRowEncoder
+{
+  LodePNGState* state;
+  LodePNGWriteFunc write;
+  void* user;
+  unsigned w, h;
+  unsigned y; /*the next row to encode*/
+  size_t linebytes; /*bytes of a scanline, without the filter type byte*/
+  size_t linesize; /*allocated size of line and prevline*/
+  unsigned char* line; /*the current scanline in the color type of the PNG*/
+  unsigned char* prevline; /*the previous scanline in the color type of the PNG*/
+  ucvector attempt[5]; /*the filtering attempts of a scanline, one for each filter type*/
+  Hash hash; /*LZ77 hash table for a window of 32768 bytes, allocated on first use*/
+  ucvector data; /*filtered scanlines, after up to windowsize bytes of earlier ones as dictionary*/
+  size_t datapos; /*start of the filtered scanlines in data that are not deflated yet*/
+  ucvector zlibdata; /*compressed data that is not written yet*/
+  size_t bp; /*bit pointer in zlibdata*/
+  ucvector chunks; /*chunks that are not written yet*/
+  unsigned adler; /*running adler32 of the filtered scanlines*/
+  unsigned error; /*once an error happened, it is returned by every call*/
+};
+
+/*writes the chunks through the callback*/
+static unsigned rowEncoderFlush(LodePNGRowEncoder* enc)
+{
+  size_t size = enc->chunks.size;
+  enc->chunks.size = 0;
+  if(size > 0 && enc->write(enc->chunks.data, size, enc->user) != size) return 94; /*error: writing failed*/
+  return 0;
+}
+
+/*deflates the pending scanlines and writes the complete IDAT chunks, or all of them if final*/
+static unsigned rowEncoderDeflate(LodePNGRowEncoder* enc, unsigned final)
+{
+  const LodePNGCompressSettings* settings = &enc->state->encoder.zlibsettings;
+  size_t keep, pos = 0, end;
+  unsigned error = 0;
+
+  if(settings->btype == 0)
+  {
+    error = deflateNoCompression(&enc->zlibdata, &enc->data.data[enc->datapos], enc->data.size - enc->datapos, final);
+    enc->bp = enc->zlibdata.size * 8;
+  }
+  else
+  {
+    if(!enc->hash.head)
+    {
+      error = hash_init(&enc->hash, 32768);
+      if(error)
+      {
+        hash_cleanup(&enc->hash);
+        enc->hash.head = enc->hash.chain = 0;
+      }
+    }
+    if(!error) error = deflateRange(&enc->zlibdata, &enc->bp, &enc->hash, enc->data.data, enc->datapos,
+                                    enc->data.size, enc->data.size - enc->datapos, final, settings);
+  }
+  if(error) return error;
+
+  /*keep the end of the scanlines as dictionary for the next ones*/
+  keep = enc->data.size < settings->windowsize ? enc->data.size : settings->windowsize;
+  memmove(enc->data.data, &enc->data.data[enc->data.size - keep], keep);
+  enc->data.size = enc->datapos = keep;
+
+  if(final)
+  {
+    lodepng_add32bitInt(&enc->zlibdata, enc->adler);
+    enc->bp = enc->zlibdata.size * 8;
+  }
+
+  /*only complete bytes can be written, the last one may still get more bits*/
+  end = enc->bp / 8;
+  while(!error && (end - pos >= ROWENCODER_CHUNKSIZE || (final && pos < end)))
+  {
+    size_t size = end - pos < ROWENCODER_CHUNKSIZE ? end - pos : ROWENCODER_CHUNKSIZE;
+    error = addChunk(&enc->chunks, "IDAT", &enc->zlibdata.data[pos], size);
+    if(!error) error = rowEncoderFlush(enc);
+    pos += size;
+  }
+
+  memmove(enc->zlibdata.data, &enc->zlibdata.data[pos], enc->zlibdata.size - pos);
+  enc->zlibdata.size -= pos;
+  enc->bp -= pos * 8;
+
+  if(!error && final)
+  {
+    addChunk_IEND(&enc->chunks);
+    error = rowEncoderFlush(enc);
+  }
+
+  return error;
+}
+
+/*checks the settings for encoding an image row by row*/
+static unsigned rowEncoderCheck(const LodePNGState* state)
+{
+  const LodePNGColorMode* color = &state->info_png.color;
+  unsigned error;
 
+  if((color->colortype == LCT_PALETTE || state->encoder.force_palette)
+      && (color->palettesize == 0 || color->palettesize > 256))
+  {
+    return 68; /*invalid palette size, it is only allowed to be 1-256*/
+  }
+  error = checkEncoderSettings(color, state);
+  if(error) return error;
+  /*error: interlaced images can not be encoded row by row*/
+  if(state->info_png.interlace_method != 0) return 92;
+  return 0;
+}
+
+/*starts a new image, keeping the buffers of the encoder, and writes the chunks up to the image data*/
+static unsigned rowEncoderStart(LodePNGRowEncoder* enc, unsigned w, unsigned h,
+                                LodePNGState* state, LodePNGWriteFunc write, void* user)
+{
+  enc->state = state;
+  enc->write = write;
+  enc->user = user;
+  enc->w = w;
+  enc->h = h;
+  enc->y = 0;
+  enc->linebytes = ((size_t)w * lodepng_get_bpp(&state->info_png.color) + 7) / 8;
+  enc->data.size = enc->datapos = 0;
+  enc->zlibdata.size = 0;
+  enc->chunks.size = 0;
+  enc->adler = 1;
+
+  if(enc->linebytes + 1 > enc->linesize)
+  {
+    myfree(enc->line);
+    myfree(enc->prevline);
+    enc->line = (unsigned char*)mymalloc(enc->linebytes + 1);
+    enc->prevline = (unsigned char*)mymalloc(enc->linebytes + 1);
+    enc->linesize = enc->line && enc->prevline ? enc->linebytes + 1 : 0;
+    if(!enc->linesize) return 83; /*alloc fail*/
+  }
+
+  /*the zlib header, the same one as lodepng_zlib_compress writes*/
+  ucvector_push_back(&enc->zlibdata, 120);
+  ucvector_push_back(&enc->zlibdata, 1);
+  enc->bp = 16;
+  if(enc->zlibdata.size != 2) return 83; /*alloc fail*/
+
+  addHeaderChunks(&enc->chunks, w, h, &state->info_png, &state->encoder);
+  return rowEncoderFlush(enc);
+}
+
+unsigned lodepng_row_encoder_new(LodePNGRowEncoder** encoder, unsigned w, unsigned h,
+                                 LodePNGState* state, LodePNGWriteFunc write, void* user)
+{
+  LodePNGRowEncoder* enc;
+  unsigned type;
+
+  *encoder = 0;
+  state->error = rowEncoderCheck(state);
+  if(state->error) return state->error;
+
+  enc = (LodePNGRowEncoder*)mymalloc(sizeof(LodePNGRowEncoder));
+  if(!enc) CERROR_RETURN_ERROR(state->error, 83); /*alloc fail*/
+  enc->linesize = 0;
+  enc->line = 0;
+  enc->prevline = 0;
+  ucvector_init(&enc->data);
+  ucvector_init(&enc->zlibdata);
+  ucvector_init(&enc->chunks);
+  for(type = 0; type < 5; type++) ucvector_init(&enc->attempt[type]);
+  enc->hash.head = enc->hash.chain = 0;
+
+  state->error = enc->error = rowEncoderStart(enc, w, h, state, write, user);
+
+  if(state->error) lodepng_row_encoder_delete(enc);
+  else *encoder = enc;
+  return state->error;
+}
+
+unsigned lodepng_row_encoder_restart(LodePNGRowEncoder* enc, unsigned w, unsigned h,
+                                     LodePNGState* state, LodePNGWriteFunc write, void* user)
+{
+  enc->state = state;
+  state->error = rowEncoderCheck(state);
+  if(!state->error) state->error = rowEncoderStart(enc, w, h, state, write, user);
+  enc->error = state->error;
   return state->error;
 }
 
+unsigned lodepng_row_encoder_write(LodePNGRowEncoder* enc, const unsigned char* in, unsigned numrows)
+{
+  LodePNGState* state = enc->state;
+  size_t rowsize = lodepng_get_raw_size(enc->w, 1, &state->info_raw);
+  unsigned convert = !lodepng_color_mode_equal(&state->info_raw, &state->info_png.color);
+  unsigned i;
+
+  for(i = 0; i < numrows && !enc->error; i++)
+  {
+    LodePNGEncoderSettings settings = state->encoder;
+    size_t size = enc->data.size;
+    unsigned char* temp;
+
+    if(enc->y >= enc->h) CERROR_BREAK(enc->error, 95); /*error: writing past the last row*/
+    if(!ucvector_resize(&enc->data, size + enc->linebytes + 1)) CERROR_BREAK(enc->error, 83); /*alloc fail*/
+
+    /*the row is copied, the next one is filtered against it*/
+    if(convert) enc->error = lodepng_convert(enc->line, in, &state->info_png.color, &state->info_raw, enc->w, 1);
+    else memcpy(enc->line, in, rowsize);
+    if(enc->error) break;
+    in += rowsize;
+
+    /*the predefined filter types are indexed by row, filter sees only this one*/
+    if(settings.predefined_filters) settings.predefined_filters = &settings.predefined_filters[enc->y];
+    settings.zlibsettings.numthreads = 1;
+    enc->error = filterBuffers(&enc->data.data[size], enc->line, enc->y ? enc->prevline : 0,
+                               enc->w, 1, &state->info_png.color, &settings, enc->attempt);
+    if(enc->error) break;
+    enc->adler = update_adler32(enc->adler, &enc->data.data[size], (unsigned)(enc->linebytes + 1));
+
+    temp = enc->prevline;
+    enc->prevline = enc->line;
+    enc->line = temp;
+    enc->y++;
+
+    if(enc->y == enc->h) enc->error = rowEncoderDeflate(enc, 1);
+    else if(enc->data.size - enc->datapos >= ROWENCODER_BLOCKSIZE) enc->error = rowEncoderDeflate(enc, 0);
+  }
+
+  state->error = enc->error;
+  return enc->error;
+}
+
+void lodepng_row_encoder_delete(LodePNGRowEncoder* enc)
+{
+  unsigned type;
+  if(!enc) return;
+  ucvector_cleanup(&enc->data);
+  ucvector_cleanup(&enc->zlibdata);
+  ucvector_cleanup(&enc->chunks);
+  for(type = 0; type < 5; type++) ucvector_cleanup(&enc->attempt[type]);
+  hash_cleanup(&enc->hash);
+  myfree(enc->line);
+  myfree(enc->prevline);
+  myfree(enc);
+}
+
 unsigned lodepng_encode_memory(unsigned char** out, size_t* outsize, const unsigned char* image,
                                unsigned w, unsigned h, LodePNGColorType colortype, unsigned bitdepth)
 {
@@ -140,7 +140,19 @@ typedef struct LodePNGCompressSettings /*deflate = compress*/
   /*LZ77 related settings*/
   unsigned btype; /*the block type for LZ (0, 1, 2 or 3, see zlib standard). Should be 2 for proper compression.*/
   unsigned use_lz77; /*whether or not to use LZ77. Should be 1 for proper compression.*/
-  unsigned windowsize; /*the maximum is 32768, higher gives more compression but is slower. Typical value: 2048.*/
+  unsigned windowsize; /*must be a power of two, the maximum is 32768, higher gives more compression but is slower. Typical value: 2048.
+                         A window size of 1 only encodes runs of the same byte, which is very fast.*/
+  unsigned minmatch; /*minimum lz77 length. 3 is normally best, 6 can be better for some PNGs. Default: 3*/
+  unsigned nicematch; /*stop searching if >= this length found. Set to 258 for best compression. Default: 258*/
+  unsigned lazymatching; /*use lazy matching: better compression but a bit slower. Default: 1*/
+  unsigned maxchain; /*maximum number of earlier positions tried per match, 0 for no limit. Default: 128*/
+  unsigned optimal; /*if not 0, choose the LZ77 matches of dynamic blocks by optimal parsing, refining the costs of the
+                      symbols this many times, and search the smallest encoding of the Huffman trees. Very slow, for
+                      data that is compressed once and read often. Default: 0*/
+  unsigned tryrle; /*also encode every dynamic block with runs of the same byte only (as with a window size of 1),
+                     and keep the smaller of both. Costs up to a third more time. Default: 0*/
+  unsigned numthreads; /*if LODEPNG_COMPILE_THREADS is defined, deflate (and filter PNG images) in this many
+                         bands on their own threads. The output is a little larger. Default: 1*/
   unsigned custom_encoder; /*use custom encoder if LODEPNG_CUSTOM_ZLIB_DECODER and LODEPNG_COMPILE_ZLIB are enabled*/
 } LodePNGCompressSettings;
 
@@ -269,6 +281,11 @@ typedef struct LodePNGDecoderSettings
 
   unsigned ignore_crc; /*ignore CRC checksums*/
   unsigned color_convert; /*whether to convert the PNG to the color type you want. Default: yes*/
+  /*
+  if 1 to 6, the row decoder only decodes this many Adam7 passes of interlaced images,
+  see lodepng_row_decoder_new. Default: 0, interlaced images are not row decoded
+  */
+  unsigned adam7_passes;
 } LodePNGDecoderSettings;
 
 void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings);
@@ -288,6 +305,12 @@ typedef enum LodePNGFilterStrategy
   optimal color mode for the PNG image for best compression. Default: 0 (false).
   */
   LFS_BRUTE_FORCE,
+  /*
+  Choose the filter of each scanline by deflating it after the scanlines filtered before it, and keep
+  the result only if it deflates smaller than all scanlines with the same filter, the minimal sum and
+  the brute force filters. Slower still, for images that are encoded once.
+  */
+  LFS_EXHAUSTIVE,
   LFS_PREDEFINED /*use predefined_filters buffer: you specify the filter type for each scanline*/
 } LodePNGFilterStrategy;
 
@@ -366,6 +389,43 @@ information is placed in the info_png field of the LodePNGState.
 unsigned lodepng_inspect(unsigned* w, unsigned* h,
                          LodePNGState* state,
                          const unsigned char* in, size_t insize);
+
+/*
+Reads up to size bytes into buffer and returns the number of bytes read, 0 at the
+end of the input or on errors.
+*/
+typedef size_t (*LodePNGReadFunc)(unsigned char* buffer, size_t size, void* user);
+
+/*
+Decoder that returns a PNG image a few rows at a time. The file is read through a
+callback as far as needed, so only a scanline or two and the deflate window are
+in memory, not the whole file or image. Interlaced images are not supported
+(error 92), use lodepng_decode for those. The built-in inflater is always used.
+
+If state->decoder.adam7_passes is 1 to 6, interlaced images give a preview instead:
+only the first passes are inflated, and the rows are those of every 8th (1 or 2
+passes), 4th (3 or 4) or 2nd (5 or 6) pixel of every 8th, 4th or 2nd row of the
+image, so w and h are that fraction of the image size, rounded up. The rest of
+the file is not read, so its checksums are not checked.
+*/
+typedef struct LodePNGRowDecoder LodePNGRowDecoder;
+
+/*
+Reads the chunks up to the image data. The state is used like in lodepng_decode
+and must stay alive until the decoder is deleted. On success *decoder must be
+freed with lodepng_row_decoder_delete, on error it is 0.
+*/
+unsigned lodepng_row_decoder_new(LodePNGRowDecoder** decoder, unsigned* w, unsigned* h,
+                                 LodePNGState* state, LodePNGReadFunc read, void* user);
+
+/*
+Decodes the next numrows rows into out, in the color type of state->info_raw. Each
+row takes lodepng_get_raw_size(w, 1, &state->info_raw) bytes. Reading past the last
+row is error 93. After the last row, the checksums at the end of the data are checked.
+*/
+unsigned lodepng_row_decoder_read(LodePNGRowDecoder* decoder, unsigned char* out, unsigned numrows);
+
+void lodepng_row_decoder_delete(LodePNGRowDecoder* decoder);
 #endif /*LODEPNG_COMPILE_DECODER*/
 
 
@@ -374,6 +434,81 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h,
 unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         const unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state);
+
+/*
+Buffers and LZ77 hash tables that lodepng_encode_buffers keeps from one image to
+the next. This saves most of the allocations when many small images are encoded.
+*/
+typedef struct LodePNGEncoderBuffers LodePNGEncoderBuffers;
+
+/*On success *buffers must be freed with lodepng_encoder_buffers_delete.*/
+unsigned lodepng_encoder_buffers_new(LodePNGEncoderBuffers** buffers);
+
+/*
+Encodes like lodepng_encode, but in the buffers. *out points into the buffers and must
+not be freed, it stays valid until they are used again or deleted. A custom_encoder,
+and the filter strategies that compress trial data, still allocate for every image.
+*/
+unsigned lodepng_encode_buffers(unsigned char** out, size_t* outsize, LodePNGEncoderBuffers* buffers,
+                                const unsigned char* image, unsigned w, unsigned h,
+                                LodePNGState* state);
+
+void lodepng_encoder_buffers_delete(LodePNGEncoderBuffers* buffers);
+
+/*
+Chooses the color mode lodepng_encode would use for the image with the given
+auto_convert setting and stores it in mode_out, which must be initialized with
+the color mode requested by the user. Used to pick the color mode for
+lodepng_row_encoder_new when the whole image is available.
+*/
+unsigned lodepng_auto_choose_color(LodePNGColorMode* mode_out,
+                                   const unsigned char* image, unsigned w, unsigned h,
+                                   const LodePNGColorMode* mode_in, LodePNGAutoConvert auto_convert);
+
+/*
+Writes size bytes from buffer and returns the number of bytes written, which is
+less than size on errors.
+*/
+typedef size_t (*LodePNGWriteFunc)(const unsigned char* buffer, size_t size, void* user);
+
+/*
+Encoder that takes a PNG image a few rows at a time. The compressed data is
+written through a callback in IDAT chunks of at most 64 KiB as soon as they are
+complete, so only a few hundred KiB of filtered and compressed data are kept in
+memory, not the whole image or file. The PNG is written in the color mode of
+state->info_png as is, auto_convert is not applied. Interlaced images are not
+supported (error 92), use lodepng_encode for those. The built-in deflater is
+always used, on a single thread.
+*/
+typedef struct LodePNGRowEncoder LodePNGRowEncoder;
+
+/*
+Checks the settings and writes the chunks up to the image data. The state is used
+like in lodepng_encode and must stay alive until the encoder is deleted. On success
+*encoder must be freed with lodepng_row_encoder_delete, on error it is 0. If the
+callback writes less than it was given, the error is 94.
+*/
+unsigned lodepng_row_encoder_new(LodePNGRowEncoder** encoder, unsigned w, unsigned h,
+                                 LodePNGState* state, LodePNGWriteFunc write, void* user);
+
+/*
+Encodes the next numrows rows from in, in the color type of state->info_raw. Each
+row takes lodepng_get_raw_size(w, 1, &state->info_raw) bytes. Writing past the last
+row is error 95. After the last row, the rest of the image data and the IEND chunk
+are written.
+*/
+unsigned lodepng_row_encoder_write(LodePNGRowEncoder* encoder, const unsigned char* in, unsigned numrows);
+
+/*
+Starts a new image with an encoder that was used before, like lodepng_row_encoder_new
+but keeping its buffers and LZ77 hash tables. This saves most of the allocations when
+many small images are encoded. The previous image does not have to be complete. On
+error, the encoder must still be deleted.
+*/
+unsigned lodepng_row_encoder_restart(LodePNGRowEncoder* encoder, unsigned w, unsigned h,
+                                     LodePNGState* state, LodePNGWriteFunc write, void* user);
+
+void lodepng_row_encoder_delete(LodePNGRowEncoder* encoder);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 /*
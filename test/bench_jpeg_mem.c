@@ -0,0 +1,86 @@
+#include "image_jpeg.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include "jpeglib.h"
+#include "jmemsys.h"
+
+
+/****************************************************************************
+ *                                                                          *
+ * Decodes a JPEG image over and over again and reports how many objects    *
+ * the jpeglib memory manager requested per image and how many of them      *
+ * actually ended up as system allocations with the arena memory manager.   *
+ * With the malloc based memory manager (jmemnobs.c), every single request  *
+ * is a system allocation, so the requests column is its malloc count.      *
+ *                                                                          *
+ ****************************************************************************/
+
+
+
+#define ITERATIONS 200
+
+static void run( const char* name, jpeg_decoder_t* dec )
+{
+    long req0, sys0, req1, sys1;
+    image_io_t io;
+    image_t img;
+    clock_t start;
+    double secs;
+    FILE* f;
+    int i;
+
+    image_init( &img );
+    image_io_init_stdio( &io );
+
+    f = fopen( "samples/lenna.jpg", "rb" );
+
+    if( !f )
+        return;
+
+    jpeg_mem_stats( &req0, &sys0 );
+    start = clock( );
+
+    for( i=0; i<ITERATIONS; ++i )
+    {
+        /* the loader reads from the current position of the file */
+        io.seek( f, 0, SEEK_SET );
+
+        if( image_load_custom_with( &img, f, &io, EIF_JPG, dec )!=ELR_SUCESS )
+        {
+            printf( "%-18s failed to load samples/lenna.jpg\n", name );
+            break;
+        }
+    }
+
+    secs = (double)(clock( ) - start) / CLOCKS_PER_SEC;
+    jpeg_mem_stats( &req1, &sys1 );
+
+    if( i==ITERATIONS )
+    {
+        printf( "%-18s %8.2f %12.2f %10.3f\n", name,
+                (double)(req1 - req0) / ITERATIONS,
+                (double)(sys1 - sys0) / ITERATIONS,
+                1000.0 * secs / ITERATIONS );
+    }
+
+    fclose( f );
+    image_deinit( &img );
+}
+
+int main( void )
+{
+    jpeg_decoder_t* dec;
+
+    printf( "%-18s %8s %12s %10s\n", "", "requests",
+            "arena allocs", "ms/image" );
+
+    run( "load_jpg", NULL );
+
+    dec = image_jpeg_decoder_create( );
+    run( "jpeg_decoder_t", dec );
+    image_jpeg_decoder_destroy( dec );
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "image.h"
+
+#include <stdio.h>
+#include <time.h>
+
+
+/****************************************************************************
+ *                                                                          *
+ * Encodes images as PNG with every EIH_PNG_EXPORT_EFFORT level and        *
+ * reports the encoding speed in MB of raw pixel data per second, and the   *
+ * size of the PNG file relative to the raw pixel data. The image files can *
+ * be passed on the command line. Otherwise two photos are used: the        *
+ * filtered rows of samples/lenna.png compress no better with LZ77 than     *
+ * with runs only, while samples/lenna.jpg, decoded, gains from longer      *
+ * match searches.                                                          *
+ *                                                                          *
+ ****************************************************************************/
+
+
+
+#define MIN_SECONDS 0.5
+
+static size_t count_write( const void* ptr, size_t size, size_t blocks,
+                           void* handle )
+{
+    (void)ptr;
+    *((size_t*)handle) += size * blocks;
+    return blocks;
+}
+
+static const char* photos[] = { "samples/lenna.png", "samples/lenna.jpg" };
+
+static int bench( const char* path )
+{
+    size_t raw, length;
+    image_io_t io;
+    image_t img;
+    clock_t start;
+    double secs;
+    int effort, i;
+
+    image_init( &img );
+    image_io_init_stdio( &io );
+    io.write = count_write;
+
+    if( image_load( &img, path, EIF_AUTODETECT ) != ELR_SUCESS )
+    {
+        image_deinit( &img );
+        return 0;
+    }
+
+    raw = (size_t)img.width * img.height *
+          (img.type==ECT_RGBA8 ? 4 : (img.type==ECT_RGB8 ? 3 : 1));
+
+    printf( "%s\n%-8s %10s %10s %8s\n", path, "effort", "bytes", "MB/s",
+            "ratio" );
+
+    for( effort=0; effort<=10; ++effort )
+    {
+        image_set_hint( &img, EIH_PNG_EXPORT_EFFORT, effort );
+
+        start = clock( );
+        i = 0;
+
+        do
+        {
+            length = 0;
+            image_save_custom( &img, &length, &io, EIF_PNG );
+            secs = (double)(clock( ) - start) / CLOCKS_PER_SEC;
+            ++i;
+        }
+        while( secs < MIN_SECONDS );
+
+        printf( "%-8d %10lu %10.2f %8.3f\n", effort, (unsigned long)length,
+                (double)raw * i / (secs * 1000000.0),
+                (double)length / (double)raw );
+    }
+
+    image_deinit( &img );
+    return 1;
+}
+
+int main( int argc, char** argv )
+{
+    int i;
+
+    /* lenna.jpg needs the JPEG loader */
+    for( i=0; argc<2 && i<(int)(sizeof(photos)/sizeof(photos[0])); ++i )
+    {
+        if( !bench( photos[i] ) )
+            printf( "%s could not be loaded\n", photos[i] );
+    }
+
+    for( i=1; i<argc; ++i )
+    {
+        if( !bench( argv[i] ) )
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+/****************************************************************************
+ *                                                                          *
+ * Encodes an image as PNG on 1, 2, 4, 8 and 16 threads and reports the     *
+ * wall clock time, the speedup over a single thread and the size of the    *
+ * PNG file. These all encode the whole image in memory; the row by row     *
+ * encoder used with 0 threads is a different path and is reported on its   *
+ * own, without a speedup. The image file can be passed on the command      *
+ * line, together with the EIH_PNG_EXPORT_EFFORT to use. samples/lenna.png  *
+ * is used otherwise. Only bands of at least 128 KiB are compressed on      *
+ * their own thread, so the image should be large to show the scaling.      *
+ *                                                                          *
+ ****************************************************************************/
+
+
+
+#define MIN_SECONDS 1.0
+
+static size_t count_write( const void* ptr, size_t size, size_t blocks,
+                           void* handle )
+{
+    (void)ptr;
+    *((size_t*)handle) += size * blocks;
+    return blocks;
+}
+
+static double now( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+int main( int argc, char** argv )
+{
+    const char* path = argc>1 ? argv[1] : "samples/lenna.png";
+    double start, secs, single = 0.0;
+    size_t length;
+    image_io_t io;
+    image_t img;
+    int threads, i;
+
+    image_init( &img );
+    image_io_init_stdio( &io );
+    io.write = count_write;
+
+    if( image_load( &img, path, EIF_AUTODETECT ) != ELR_SUCESS )
+        return 1;
+
+    if( argc>2 )
+        image_set_hint( &img, EIH_PNG_EXPORT_EFFORT, atoi( argv[2] ) );
+
+    printf( "%-8s %10s %10s %8s\n", "threads", "ms/image", "speedup",
+            "bytes" );
+
+    for( threads=0; threads<=16; threads=threads ? threads*2 : 1 )
+    {
+        image_set_hint( &img, EIH_PNG_EXPORT_THREADS, threads );
+
+        start = now( );
+        i = 0;
+
+        do
+        {
+            length = 0;
+            image_save_custom( &img, &length, &io, EIF_PNG );
+            secs = now( ) - start;
+            ++i;
+        }
+        while( secs < MIN_SECONDS );
+
+        secs /= i;
+
+        if( threads==0 )
+        {
+            printf( "%-8s %10.2f %10s %8lu\n", "rows", 1000.0 * secs, "-",
+                    (unsigned long)length );
+            continue;
+        }
+
+        if( threads==1 )
+            single = secs;
+
+        printf( "%-8d %10.2f %10.2f %8lu\n", threads, 1000.0 * secs,
+                single / secs, (unsigned long)length );
+    }
+
+    image_deinit( &img );
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include "image_png.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/****************************************************************************
+ *                                                                          *
+ * Cuts an image into tiles of 64x64 pixels and encodes each of them as     *
+ * PNG, once with a new encoder for every tile and once with a reusable     *
+ * png_encoder_t, and reports the number of tiles encoded per second and    *
+ * the total size of the PNG files. The image file can be passed on the     *
+ * command line, together with the EIH_PNG_EXPORT_EFFORT to use and an      *
+ * EIH_PNG_EXPORT_THREADS, which compresses the tiles in memory if it is 1  *
+ * or more. samples/lenna.png is used otherwise.                            *
+ *                                                                          *
+ ****************************************************************************/
+
+
+
+#define MIN_SECONDS 1.0
+#define TILE_SIZE 64
+
+static size_t count_write( const void* ptr, size_t size, size_t blocks,
+                           void* handle )
+{
+    (void)ptr;
+    *((size_t*)handle) += size * blocks;
+    return blocks;
+}
+
+/* encode all tiles, returns the total size of the PNG files */
+static size_t encode_tiles( const image_t* img, image_t* tile,
+                            const image_io_t* io, png_encoder_t* enc )
+{
+    size_t x, y, row, bpp, length = 0;
+    unsigned char* dst;
+
+    bpp = img->type==ECT_RGBA8 ? 4 : (img->type==ECT_RGB8 ? 3 : 1);
+
+    for( y=0; y+TILE_SIZE<=img->height; y+=TILE_SIZE )
+    {
+        for( x=0; x+TILE_SIZE<=img->width; x+=TILE_SIZE )
+        {
+            dst = tile->image_buffer;
+
+            for( row=0; row<TILE_SIZE; ++row, dst+=TILE_SIZE*bpp )
+            {
+                memcpy( dst, (unsigned char*)img->image_buffer +
+                             ((y + row) * img->width + x) * bpp,
+                        TILE_SIZE*bpp );
+            }
+
+            image_save_custom_with( tile, &length, io, EIF_PNG, enc );
+        }
+    }
+
+    return length;
+}
+
+int main( int argc, char** argv )
+{
+    const char* path = argc>1 ? argv[1] : "samples/lenna.png";
+    png_encoder_t* enc;
+    size_t length, tiles;
+    double secs;
+    image_io_t io;
+    image_t img, tile;
+    clock_t start;
+    int pass, i;
+
+    image_init( &img );
+    image_init( &tile );
+    image_io_init_stdio( &io );
+    io.write = count_write;
+
+    if( image_load( &img, path, EIF_AUTODETECT ) != ELR_SUCESS )
+        return 1;
+
+    image_allocate_buffer( &tile, TILE_SIZE, TILE_SIZE, img.type );
+
+    if( argc>2 )
+        image_set_hint( &tile, EIH_PNG_EXPORT_EFFORT, atoi( argv[2] ) );
+
+    if( argc>3 )
+        image_set_hint( &tile, EIH_PNG_EXPORT_THREADS, atoi( argv[3] ) );
+
+    tiles = (img.width / TILE_SIZE) * (img.height / TILE_SIZE);
+    enc = image_png_encoder_create( );
+
+    printf( "%-8s %10s %10s\n", "encoder", "tiles/s", "bytes" );
+
+    for( pass=0; pass<2; ++pass )
+    {
+        start = clock( );
+        i = 0;
+
+        do
+        {
+            length = encode_tiles( &img, &tile, &io, pass ? enc : NULL );
+            secs = (double)(clock( ) - start) / CLOCKS_PER_SEC;
+            ++i;
+        }
+        while( secs < MIN_SECONDS );
+
+        printf( "%-8s %10.0f %10lu\n", pass ? "reused" : "new",
+                (double)tiles * i / secs, (unsigned long)length );
+    }
+
+    image_png_encoder_destroy( enc );
+    image_deinit( &tile );
+    image_deinit( &img );
+    return 0;
+}
@@ -1,4 +1,6 @@
-#include "image.h"
+#include "image_png.h"
+
+#include <stdio.h>
 
 #ifdef _WIN32
     #include <direct.h>
@@ -49,9 +51,12 @@ int isMandelbrot( float X, float Y, float* iter )
 
 int main( void )
 {
+    png_writer_t* writer;
+    image_io_t io;
     image_t image;
     unsigned char* b;
-    size_t x, y;
+    size_t x, y, count;
+    FILE* f;
 
 #ifdef _WIN32
     mkdir( "rgb8"  );
@@ -64,6 +69,7 @@ int main( void )
 #endif
 
     image_init( &image );
+    image_io_init_stdio( &io );
 
     /*********************** generate RGB test images ***********************/
     image_allocate_buffer( &image, 800, 600, ECT_RGB8 );
@@ -96,6 +102,10 @@ int main( void )
     image_save( &image, "rgb8/test.png", EIF_AUTODETECT );
     image_save( &image, "rgb8/test.pbm", EIF_AUTODETECT );
 
+    /* reduce the image to 16 colors, it is exported as a 4 bit palette PNG */
+    if( image_quantize( &image, 16, EDM_NONE ) )
+        image_save( &image, "rgb8/test.16colors.png", EIF_AUTODETECT );
+
     /********************** generate RGBA test images ***********************/
     image_allocate_buffer( &image, 800, 600, ECT_RGBA8 );
 
@@ -128,6 +138,63 @@ int main( void )
     image_save( &image, "rgba8/test.png", EIF_AUTODETECT );
     image_save( &image, "rgba8/test.pbm", EIF_AUTODETECT );
 
+    /* encode the image 16 rows at a time, writing the file as it goes */
+    f = fopen( "rgba8/test.rows.png", "wb" );
+    writer = f ? image_png_writer_create( &image, f, &io ) : NULL;
+
+    for( y=0; writer && y<600; y+=16 )
+    {
+        count = y+16<=600 ? 16 : 600-y;
+        b = (unsigned char*)image.image_buffer + y*800*4;
+
+        if( image_png_writer_write( writer, b, count )!=count )
+            break;
+    }
+
+    image_png_writer_destroy( writer );
+
+    if( f )
+        fclose( f );
+
+    /* reduce the image to 4 colors, it is exported as a 2 bit palette PNG */
+    b = image.image_buffer;
+
+    for( y=0; y<600*800; ++y, b+=4 )
+    {
+        if( b[0]!=255 )
+        {
+            b[3] = b[2]<32 ? 0 : 255;
+            b[2] = b[2]<32 ? 0 : (b[2]<128 ? 128 : 255);
+        }
+        else
+        {
+            b[3] = 255;
+        }
+    }
+
+    image_save( &image, "rgba8/test.4colors.png", EIF_AUTODETECT );
+
+    /* the transparent pixels take one of the colors, which leaves too few
+       for the quantizer at 8 */
+    if( !image_quantize( &image, 8, EDM_FLOYD_STEINBERG ) &&
+        image_quantize( &image, 9, EDM_FLOYD_STEINBERG ) )
+    {
+        image_save( &image, "rgba8/test.9colors.png", EIF_AUTODETECT );
+    }
+
+    /* with the alpha ramp back, the colors are split between the alpha
+       levels, it is exported as a palette PNG with translucent entries */
+    b = image.image_buffer;
+
+    for( y=0; y<600; ++y )
+    {
+        for( x=0; x<800; ++x, b+=4 )
+            b[3] = 255.0f * (1.0f - ((float)x) / 800.0f);
+    }
+
+    if( image_quantize( &image, 64, EDM_FLOYD_STEINBERG ) )
+        image_save( &image, "rgba8/test.alpha.png", EIF_AUTODETECT );
+
     /******************** generate grayscale test images ********************/
     image_allocate_buffer( &image, 800, 600, ECT_GRAYSCALE8 );
 
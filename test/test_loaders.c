@@ -1,12 +1,23 @@
-#include "image.h"
+#include "image_jpeg.h"
+#include "image_png.h"
 
+#include <stdio.h>
 
 
 int main( )
 {
+    jpeg_coefficients_t coefs;
+    jpeg_decoder_t* dec;
+    image_io_t io;
     image_t img;
+    jpeg_crop_t crop;
+    png_reader_t* reader;
+    unsigned char* rows;
+    size_t row_size, count;
+    FILE *f, *out;
 
     image_init( &img );
+    image_io_init_stdio( &io );
 
     image_load( &img, "samples/feep.pbm", EIF_AUTODETECT );
     image_save( &img, "feep.pbm.png", EIF_AUTODETECT );
@@ -26,9 +37,64 @@ int main( )
     image_load( &img, "samples/lenna.jpg", EIF_AUTODETECT );
     image_save( &img, "lenna.jpg.png", EIF_AUTODETECT );
 
+    /* limit the memory used, forces libjpeg to use a temporary file */
+    image_set_hint( &img, EIH_JPEG_MAX_MEMORY, 64 );
+    image_load( &img, "samples/lennaProgressive.jpg", EIF_AUTODETECT );
+    image_save( &img, "lennaProgressive.jpg.png", EIF_AUTODETECT );
+    image_set_hint( &img, EIH_JPEG_MAX_MEMORY, 0 );
+
+    /* preview from the first two scans of a progressive JPEG */
+    image_set_hint( &img, EIH_JPEG_PREVIEW_SCANS, 2 );
+    image_load( &img, "samples/lennaProgressive.jpg", EIF_AUTODETECT );
+    image_save( &img, "lennaProgressive.preview.png", EIF_AUTODETECT );
+    image_set_hint( &img, EIH_JPEG_PREVIEW_SCANS, 0 );
+
     image_load( &img, "samples/lenna.png", EIF_AUTODETECT );
     image_save( &img, "lenna.png.png", EIF_AUTODETECT );
 
+    /* skip the chunk CRC checks for a trusted file */
+    image_set_hint( &img, EIH_PNG_IGNORE_CRC, 1 );
+    image_load( &img, "samples/lenna.png", EIF_AUTODETECT );
+    image_save( &img, "lenna.png.nocrc.png", EIF_AUTODETECT );
+    image_set_hint( &img, EIH_PNG_IGNORE_CRC, 0 );
+
+    image_load( &img, "samples/lennaInterlaced.png", EIF_AUTODETECT );
+    image_save( &img, "lennaInterlaced.png.png", EIF_AUTODETECT );
+
+    /* 1/4 scale preview from the first three passes of an interlaced PNG */
+    image_set_hint( &img, EIH_PNG_PREVIEW_PASSES, 3 );
+    image_load( &img, "samples/lennaInterlaced.png", EIF_AUTODETECT );
+    image_save( &img, "lennaInterlaced.preview.png", EIF_AUTODETECT );
+    image_set_hint( &img, EIH_PNG_PREVIEW_PASSES, 0 );
+
+    /* grayscale PNGs are loaded as ECT_GRAYSCALE8, unless asked otherwise */
+    image_load( &img, "feep_gray.pbm.png", EIF_AUTODETECT );
+    image_save( &img, "feep_gray.png.png", EIF_AUTODETECT );
+
+    image_set_hint( &img, EIH_PNG_COLOR_TYPE, ECT_RGBA8 );
+    image_load( &img, "feep_gray.pbm.png", EIF_AUTODETECT );
+    image_save( &img, "feep_gray.rgba.png", EIF_AUTODETECT );
+    image_set_hint( &img, EIH_PNG_COLOR_TYPE, ECT_NONE );
+
+    /* decode a PNG image 16 rows at a time */
+    f = fopen( "samples/lenna.png", "rb" );
+    reader = image_png_reader_create( &img, f, &io );
+
+    if( reader && image_allocate_buffer( &img, img.width, img.height, img.type ) )
+    {
+        row_size = img.width * (img.type==ECT_RGBA8 ? 4 :
+                                (img.type==ECT_RGB8 ? 3 : 1));
+        rows = img.image_buffer;
+
+        while( (count = image_png_reader_read( reader, rows, 16 )) > 0 )
+            rows += count * row_size;
+
+        image_save( &img, "lenna.png.rows.png", EIF_AUTODETECT );
+    }
+
+    image_png_reader_destroy( reader );
+    fclose( f );
+
     image_load( &img, "samples/lenna32.bmp", EIF_AUTODETECT );
     image_save( &img, "lenna32.bmp.png", EIF_AUTODETECT );
 
@@ -44,6 +110,81 @@ int main( )
     image_load( &img, "samples/grayscaleRLE.tga", EIF_AUTODETECT );
     image_save( &img, "grayscaleRLE.tga.png", EIF_AUTODETECT );
 
+    /* load a few images using a reusable decoder context */
+    dec = image_jpeg_decoder_create( );
+
+    f = fopen( "samples/lenna.jpg", "rb" );
+    image_load_custom_with( &img, f, &io, EIF_JPG, dec );
+    fclose( f );
+
+    f = fopen( "samples/lenna.png", "rb" );
+    image_load_custom_with( &img, f, &io, EIF_JPG, dec );
+    fclose( f );
+
+    f = fopen( "samples/lenna.jpg", "rb" );
+    image_load_custom_with( &img, f, &io, EIF_JPG, dec );
+    image_save( &img, "lenna.jpg.reuse.png", EIF_AUTODETECT );
+    fclose( f );
+
+    image_jpeg_decoder_destroy( dec );
+
+    /* losslessly re-encode a JPEG image from its DCT coefficients */
+    image_jpeg_coefficients_init( &coefs );
+
+    f = fopen( "samples/lennaProgressive.jpg", "rb" );
+    image_jpeg_load_coefficients( &coefs, f, &io );
+    fclose( f );
+
+    f = fopen( "lennaProgressive.coef.jpg", "wb" );
+    image_jpeg_save_coefficients( &coefs, f, &io );
+    fclose( f );
+
+    image_jpeg_coefficients_deinit( &coefs );
+
+    image_load( &img, "lennaProgressive.coef.jpg", EIF_AUTODETECT );
+    image_save( &img, "lennaProgressive.coef.jpg.png", EIF_AUTODETECT );
+
+    /* lossless rotation and cropping */
+    f   = fopen( "samples/lenna.jpg", "rb" );
+    out = fopen( "lenna.rot90.jpg", "wb" );
+    image_jpeg_transform( f, &io, out, &io, EJT_ROT_90, NULL );
+    fclose( out );
+    fclose( f );
+
+    image_load( &img, "lenna.rot90.jpg", EIF_AUTODETECT );
+    image_save( &img, "lenna.rot90.jpg.png", EIF_AUTODETECT );
+
+    crop.x      = 200;
+    crop.y      = 200;
+    crop.width  = 128;
+    crop.height = 128;
+
+    f   = fopen( "samples/lenna.jpg", "rb" );
+    out = fopen( "lenna.crop.jpg", "wb" );
+    image_jpeg_transform( f, &io, out, &io, EJT_FLIP_H, &crop );
+    fclose( out );
+    fclose( f );
+
+    image_load( &img, "lenna.crop.jpg", EIF_AUTODETECT );
+    image_save( &img, "lenna.crop.jpg.png", EIF_AUTODETECT );
+
+    /* embedded EXIF thumbnail */
+    f = fopen( "samples/lennaExif.jpg", "rb" );
+    image_load_embedded_thumbnail( &img, f, &io );
+    fclose( f );
+
+    image_save( &img, "lennaExif.thumb.png", EIF_AUTODETECT );
+
+    /* lossless re-optimization */
+    f   = fopen( "samples/lenna.jpg", "rb" );
+    out = fopen( "lenna.opt.jpg", "wb" );
+    image_jpeg_optimize( f, &io, out, &io, EJO_PROGRESSIVE|EJO_COPY_MARKERS );
+    fclose( out );
+    fclose( f );
+
+    image_load( &img, "lenna.opt.jpg", EIF_AUTODETECT );
+    image_save( &img, "lenna.opt.jpg.png", EIF_AUTODETECT );
+
     image_deinit( &img );
 
     return 0;